@@ -0,0 +1,148 @@
+#include "../common/kex.h"
+#include <chrono>
+#include <iostream>
+#include <openssl/evp.h>
+
+/*
+ * Benchmark of the key exchange of the authentication, for each method and
+ * encoding of the half keys: handshakes per second that a single core can
+ * carry out, counting the work of the server alone (decode the client's half
+ * key, generate a keypair, encode it, derive the secret) and of both parties,
+ * then the bytes of both half keys and the CPU time spent encoding and
+ * decoding them, per handshake. The signatures do not depend on the method,
+ * and are left out.
+ */
+
+using namespace std;
+using namespace std::chrono;
+
+#define ROUNDS 200
+
+// Time spent encoding and decoding half keys, over all rounds
+static nanoseconds coding_time(0);
+
+static void check(bool ok, const char *what) {
+    if (!ok) {
+        cerr << "Could not " << what << endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* A client half key, generated and encoded once per round */
+struct ClientHello {
+    EVP_PKEY *keypair;
+    unsigned char *half_key;
+    size_t half_key_len;
+};
+
+/* Encodes [keypair], timing it */
+static tuple<unsigned char *, size_t>
+encode(kex_method method, kex_encoding encoding, EVP_PKEY *keypair) {
+    auto start = steady_clock::now();
+    auto encode_res = kex_encode(method, encoding, keypair);
+    coding_time += steady_clock::now() - start;
+    check(!encode_res.is_error, "encode a half key");
+    return encode_res.result;
+}
+
+/* Decodes a half key, timing it */
+static EVP_PKEY *decode(kex_method method, kex_encoding encoding,
+                        unsigned char *half_key, size_t half_key_len) {
+    auto start = steady_clock::now();
+    auto decode_res = kex_decode(method, encoding, half_key, half_key_len);
+    coding_time += steady_clock::now() - start;
+    check(!decode_res.is_error, "decode a half key");
+    return decode_res.result;
+}
+
+static ClientHello client_start(kex_method method, kex_encoding encoding) {
+    auto keypair_res = kex_gen_keypair(method);
+    check(!keypair_res.is_error, "generate the client keypair");
+    auto [half_key, half_key_len] =
+        encode(method, encoding, keypair_res.result);
+    return {keypair_res.result, half_key, half_key_len};
+}
+
+/* What the server does for each handshake, returning its half key */
+static tuple<unsigned char *, size_t>
+server_side(kex_method method, kex_encoding encoding, ClientHello &hello) {
+    EVP_PKEY *peer =
+        decode(method, encoding, hello.half_key, hello.half_key_len);
+    auto keypair_res = kex_gen_keypair(method);
+    check(!keypair_res.is_error, "generate the server keypair");
+    auto half_key = encode(method, encoding, keypair_res.result);
+    auto secret_res = kex_derive(keypair_res.result, peer);
+    check(!secret_res.is_error, "derive the server secret");
+
+    delete[] get<0>(secret_res.result);
+    EVP_PKEY_free(peer);
+    EVP_PKEY_free(keypair_res.result);
+    return half_key;
+}
+
+/* The rest of the client's side, once the server has answered */
+static void client_finish(kex_method method, kex_encoding encoding,
+                          ClientHello &hello, unsigned char *half_key,
+                          size_t half_key_len) {
+    EVP_PKEY *peer = decode(method, encoding, half_key, half_key_len);
+    auto secret_res = kex_derive(hello.keypair, peer);
+    check(!secret_res.is_error, "derive the client secret");
+
+    delete[] get<0>(secret_res.result);
+    EVP_PKEY_free(peer);
+}
+
+/* Results of a run, per handshake when not per second */
+struct Result {
+    double server_rate;
+    double total_rate;
+    size_t bytes;
+    double coding_us;
+};
+
+static Result run(kex_method method, kex_encoding encoding) {
+    nanoseconds server_time(0), client_time(0);
+    size_t bytes = 0;
+    coding_time = nanoseconds(0);
+
+    for (int i = 0; i < ROUNDS; i++) {
+        auto start = steady_clock::now();
+        ClientHello hello = client_start(method, encoding);
+        auto sent = steady_clock::now();
+        auto [half_key, half_key_len] = server_side(method, encoding, hello);
+        auto answered = steady_clock::now();
+        client_finish(method, encoding, hello, half_key, half_key_len);
+        auto done = steady_clock::now();
+
+        server_time += answered - sent;
+        client_time += (sent - start) + (done - answered);
+        bytes += hello.half_key_len + half_key_len;
+
+        delete[] half_key;
+        delete[] hello.half_key;
+        EVP_PKEY_free(hello.keypair);
+    }
+
+    double server_s = duration<double>(server_time).count();
+    double total_s = server_s + duration<double>(client_time).count();
+    double coding_us = duration<double, micro>(coding_time).count() / ROUNDS;
+    return {ROUNDS / server_s, ROUNDS / total_s, bytes / ROUNDS, coding_us};
+}
+
+int main() {
+    cout << "Key exchange handshakes per second (" << ROUNDS
+         << " rounds, one core), bytes of the half keys and microseconds "
+            "spent encoding and decoding them per handshake"
+         << endl;
+    for (kex_method method : {KexFfdh2048, KexX25519}) {
+        for (kex_encoding encoding : {KexEncodingPem, KexEncodingRaw}) {
+            auto result = run(method, encoding);
+            cout << "  " << kex_method_name(method)
+                 << (encoding == KexEncodingPem ? " pem" : " raw")
+                 << ":\tserver " << result.server_rate << "\tboth parties "
+                 << result.total_rate << "\t" << result.bytes << " B\t"
+                 << result.coding_us << " us" << endl;
+        }
+    }
+    return 0;
+}
@@ -1,7 +1,8 @@
+#include "../../common/aead.h"
 
 #ifndef delete_h
 #define delete_h
 
-void delete_file(int sock, unsigned char *key);
+void delete_file(Aead *aead);
 
 #endif
\ No newline at end of file
@@ -2,8 +2,15 @@
 #include "../../common/seq.h"
 #include "../../common/types.h"
 #include "../../common/utils.h"
-#include <openssl/evp.h>
+#include "../client.h"
+#include <atomic>
+#include <ctype.h>
+#include <fcntl.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
 
 #if __has_include(<filesystem>)
 #include <filesystem>
@@ -17,298 +24,901 @@ error "Missing the <filesystem> header."
 
 using namespace std;
 
-void download(int sock, unsigned char *key) {
-
-    cout << "What do you want to download? ";
-    unsigned char filename[FNAME_MAX_LEN] = {0};
-    if (fgets(reinterpret_cast<char *>(filename), FNAME_MAX_LEN, stdin) ==
-        nullptr) {
-        handle_errors();
-    }
-    filename[strcspn(reinterpret_cast<char *>(filename), "\n")] = '\0';
+// A download is received into a partial file next to its destination, which
+// only takes its name once complete. The state of what the partial file holds
+// is kept next to it, and saved at the end of every block of the resume hash
+// and whenever the download is interrupted.
+#define PARTIAL_SUFFIX ".partial"
+#define STATE_SUFFIX ".state"
+
+// When the connection drops, the download is resumed on a new one, opened
+// after RECONNECT_DELAY seconds, up to RECONNECT_ATTEMPTS times in all
+#define RECONNECT_ATTEMPTS 5
+#define RECONNECT_DELAY 2
+
+// A parallel download is split into segments of at most SEGMENT_SIZE bytes,
+// each one fetched with a request of its own by whichever connection is free
+// first, on up to MAX_CONNECTIONS of them
+#define SEGMENT_SIZE (64 << 20)
+#define MAX_CONNECTIONS 16
+
+/* A parallel download, shared by the connections carrying it out */
+struct ParallelDownload {
+    unsigned char filename[FNAME_MAX_LEN];
+
+    // Output file, already as long as the file
+    int fd;
+    uint64_t size;
+
+    uint64_t segment_size;
+    uint64_t n_segments;
+
+    // Next segment to fetch, and whether one of them could not be
+    atomic<uint64_t> next;
+    atomic<bool> failed;
+};
+
+/* How an attempt at downloading a file ended */
+enum fetch_result {
+    // Saved, or given up on for good
+    Fetched,
+
+    // The server turned down resuming it, it has to start over
+    StartOver,
+
+    // The connection dropped, what was received is kept to be resumed
+    ConnectionLost
+};
+
+/*
+ * What the partial file of an interrupted download holds. The chaining values
+ * of the blocks of the resume hash follow it in the saved state.
+ */
+struct DownloadState {
+    // File on the server it is the start of
+    unsigned char filename[FNAME_MAX_LEN];
+
+    // Bytes received, only up to the end of the last block once saved
+    uint64_t offset;
+};
+
+static string partial_path(const char *output_file) {
+    return string(output_file) + PARTIAL_SUFFIX;
+}
 
-    cout << "Where do you want to save the file? ";
-    char output_file[FNAME_MAX_LEN] = {0};
-    if (fgets(output_file, FNAME_MAX_LEN, stdin) == nullptr) {
-        handle_errors();
-    }
-    output_file[strcspn(output_file, "\n")] = '\0';
+static string state_path(const char *output_file) {
+    return string(output_file) + PARTIAL_SUFFIX + STATE_SUFFIX;
+}
 
-    // Sanity check: never overwrite a file
-    if (fs::status(fs::path(output_file)).type() != fs::file_type::not_found) {
-        cout << "Error - Output file must not exist" << endl;
+/*
+ * Saves [state] up to the end of the last block [hash] was fed, once what
+ * [fp] holds is flushed: the server only knows the hash of whole blocks.
+ * Failing to do so only means starting over next time.
+ */
+static void save_state(const char *output_file, const DownloadState &state,
+                       FILE *fp, ResumeHash *hash) {
+    DownloadState saved = state;
+    saved.offset = hash->len - hash->len % RESUME_BLOCK;
+    if (fflush(fp) != 0)
         return;
-    }
 
-    // Make sure that the file can be written before
-    FILE *output_file_fp;
-    if ((output_file_fp = fopen(output_file, "w")) == nullptr) {
-        cout << "Error - Could not open output file for writing" << endl;
+    FILE *state_fp;
+    if ((state_fp = fopen(state_path(output_file).c_str(), "w")) == nullptr)
         return;
+    size_t chains_len = saved.offset / RESUME_BLOCK * RESUME_DIGEST_LEN;
+    bool ok = fwrite(&saved, sizeof(saved), 1, state_fp) == 1 &&
+              fwrite(hash->chains.data(), 1, chains_len, state_fp) ==
+                  chains_len;
+    if (fclose(state_fp) != 0 || !ok) {
+        remove(state_path(output_file).c_str());
     }
+}
 
-    // Generate iv for message
-    auto iv_res = gen_iv();
-    if (iv_res.is_error) {
-        handle_errors(iv_res.error);
-    }
-    auto iv = iv_res.result;
-
-    // Send download request
-    auto send_packet_header_res =
-        send_header(sock, DownloadReq, seq_num, iv, get_iv_len());
-    if (send_packet_header_res.is_error) {
-        delete[] iv;
-        handle_errors(send_packet_header_res.error);
+/*
+ * Opens the partial file of [output_file], to go on with the download of
+ * [filename] where its state says it stopped. The state is only saved once
+ * the bytes it covers are flushed, so [hash] is set back from its chaining
+ * values, without reading them again. Returns nullptr if there is nothing to
+ * resume.
+ */
+static FILE *resume_partial(const char *output_file, unsigned char *filename,
+                            DownloadState &state, ResumeHash *hash) {
+    FILE *state_fp;
+    if ((state_fp = fopen(state_path(output_file).c_str(), "r")) == nullptr)
+        return nullptr;
+    vector<unsigned char> chains;
+    bool ok = fread(&state, sizeof(state), 1, state_fp) == 1 &&
+              state.offset <= FSIZE_MAX && state.offset % RESUME_BLOCK == 0;
+    if (ok) {
+        chains.resize(state.offset / RESUME_BLOCK * RESUME_DIGEST_LEN);
+        ok = fread(chains.data(), 1, chains.size(), state_fp) ==
+             chains.size();
     }
-
-    // Initialize encryption context
-    EVP_CIPHER_CTX *ctx;
-    int len = 0;
-    int ct_len;
-    if ((ctx = EVP_CIPHER_CTX_new()) == nullptr) {
-        delete[] iv;
-        handle_errors("Could not encrypt message (alloc)");
+    fclose(state_fp);
+    if (!ok || memcmp(state.filename, filename, FNAME_MAX_LEN) != 0 ||
+        state.offset == 0) {
+        return nullptr;
     }
 
-    if (EVP_EncryptInit(ctx, get_symmetric_cipher(), key, iv) != 1) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+    FILE *fp;
+    if ((fp = fopen(partial_path(output_file).c_str(), "r+")) == nullptr)
+        return nullptr;
+
+    // Anything past the state may not have been written whole
+    struct stat st;
+    if (fstat(fileno(fp), &st) != 0 || (uint64_t)st.st_size < state.offset ||
+        ftruncate(fileno(fp), state.offset) != 0 ||
+        fseek(fp, state.offset, SEEK_SET) != 0 ||
+        !resume_hash_start(hash, state.offset, chains.data())) {
+        fclose(fp);
+        return nullptr;
     }
+    return fp;
+}
 
-    // Authenticated data
-    int err = 0;
-    unsigned char header = mtype_to_uc(DownloadReq);
-    err |=
-        EVP_EncryptUpdate(ctx, nullptr, &len, &header, sizeof(unsigned char));
-    err |=
-        EVP_EncryptUpdate(ctx, nullptr, &len, seqnum_to_uc(), sizeof(seqnum));
-    if (err != 1) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
+/* Removes the partial file of [output_file], and its state */
+static void remove_partial(const char *output_file) {
+    remove(partial_path(output_file).c_str());
+    remove(state_path(output_file).c_str());
+}
 
-    // Encryption of the filename
-    unsigned char *ct = new unsigned char[FNAME_MAX_LEN + get_block_size()];
-    if (EVP_EncryptUpdate(ctx, ct, &len, filename, FNAME_MAX_LEN) != 1) {
-        delete[] iv;
-        delete[] ct;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+/*
+ * Keeps what was received so far when the download is interrupted, to be
+ * resumed later, and frees what is left of it
+ */
+static void suspend(const char *output_file, DownloadState &state, FILE *fp,
+                    ResumeHash *hash) {
+    if (state.offset >= RESUME_BLOCK) {
+        save_state(output_file, state, fp, hash);
+        fclose(fp);
+    } else {
+        fclose(fp);
+        remove_partial(output_file);
     }
-    ct_len = len;
+    free_resume_hash(hash);
+}
 
-    if (EVP_EncryptFinal(ctx, ct + ct_len, &len) != 1) {
-        delete[] iv;
-        delete[] ct;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+/* Sends a DownloadReq made of [request], of len [request_len] */
+static void send_request(Aead *aead, unsigned char *request, int request_len) {
+    // Send download request
+    auto send_packet_header_res = send_header(writer, DownloadReq, send_seq);
+    if (send_packet_header_res.is_error) {
+        handle_errors(send_packet_header_res.error);
     }
-    ct_len += len;
 
+    // Encryption of the request
+    int ct_len = request_len;
+    unsigned char *ct = new unsigned char[ct_len];
     unsigned char *tag = new unsigned char[TAG_LEN];
-    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, TAG_LEN, tag) != 1) {
-        delete[] iv;
+    auto seal_res = aead_seal(aead, DownloadReq, send_seq, request,
+                              request_len, ct, tag);
+    if (seal_res.is_error) {
         delete[] ct;
         delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+        handle_errors(seal_res.error);
     }
-    delete[] iv;
-    EVP_CIPHER_CTX_reset(ctx);
 
     // Send ciphertext
-    auto ct_send_res = send_field(sock, (flen)ct_len, ct);
+    auto ct_send_res = send_field(writer, (flen)ct_len, ct);
     if (ct_send_res.is_error) {
         delete[] ct;
         delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
         handle_errors(ct_send_res.error);
     }
     delete[] ct;
 
-    auto tag_send_res = send_tag(sock, tag);
+    auto tag_send_res = send_tag(writer, tag);
     if (tag_send_res.is_error) {
         delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
         handle_errors(tag_send_res.error);
     }
     delete[] tag;
 
-    inc_seqnum();
+    inc_seqnum(send_seq);
+}
+
+/*
+ * Receives the next message of a download into [pt], which has room for a
+ * chunk, moving on to the next key on the way if the server does. Returns its
+ * type and the length of its plaintext.
+ */
+static Maybe<tuple<mtypes, int>> receive_message(Aead *aead,
+                                                 unsigned char *pt) {
+    Maybe<tuple<mtypes, int>> res;
+
+    // The server moves on to the next key in the middle of long downloads
+    auto server_response_header_res = receive_mtype(reader, aead, recv_seq);
+    if (server_response_header_res.is_error) {
+        res.set_error(server_response_header_res.error);
+        return res;
+    }
+    auto server_response_header = server_response_header_res.result;
+
+    // Read sequence number
+    auto server_header_res = read_header(reader);
+    if (server_header_res.is_error) {
+        res.set_error(server_header_res.error);
+        return res;
+    }
+    auto seq = server_header_res.result;
+
+    // Check correctness of the sequence number
+    if (seq != recv_seq) {
+        res.set_error("Incorrect sequence number");
+        return res;
+    }
+
+    // Read ciphertext
+    auto ct_res = read_field(reader);
+    if (ct_res.is_error) {
+        res.set_error(ct_res.error);
+        return res;
+    }
+    auto [ct_len, ct] = ct_res.result;
+
+    if ((unsigned int)ct_len > chunk_size + get_block_size()) {
+        res.set_error("Ciphertext longer than expected");
+        return res;
+    }
+
+    // Read tag
+    auto tag_res = read_tag(reader);
+    if (tag_res.is_error) {
+        res.set_error(tag_res.error);
+        return res;
+    }
+    auto tag = tag_res.result;
+
+    int pt_len = ct_len;
+    auto open_res =
+        aead_open(aead, server_response_header, seq, ct, ct_len, tag, pt);
+    if (open_res.is_error) {
+        res.set_error(open_res.error);
+        return res;
+    }
+
+    inc_seqnum(recv_seq);
+
+    res.set_result({server_response_header, pt_len});
+    return res;
+}
+
+/*
+ * Downloads [filename] into [output_file], going on from where a previous
+ * download to the same file stopped if [resume] is set
+ */
+static fetch_result fetch(Aead *aead, unsigned char *filename,
+                  const char *output_file, bool resume) {
+    ResumeHash *hash;
+    if ((hash = new_resume_hash()) == nullptr) {
+        handle_errors("Could not allocate hashing context");
+    }
+
+    // Go on from where a previous download to the same file stopped, if it
+    // did. Otherwise make sure that the file can be written before.
+    DownloadState state;
+    FILE *output_file_fp =
+        resume ? resume_partial(output_file, filename, state, hash) : nullptr;
+    if (output_file_fp != nullptr) {
+        cout << "Resuming after " << state.offset << " bytes" << endl;
+    } else {
+        memcpy(state.filename, filename, FNAME_MAX_LEN);
+        state.offset = 0;
+        remove(state_path(output_file).c_str());
+        resume_hash_start(hash, 0, nullptr);
+        if ((output_file_fp =
+                 fopen(partial_path(output_file).c_str(), "w")) == nullptr) {
+            free_resume_hash(hash);
+            cout << "Error - Could not open output file for writing" << endl;
+            return Fetched;
+        }
+    }
+    uint64_t resumed_from = state.offset;
+
+    unsigned char request[FNAME_MAX_LEN + RESUME_POINT_LEN];
+    memcpy(request, filename, FNAME_MAX_LEN);
+    memcpy(request + FNAME_MAX_LEN, &state.offset, sizeof(state.offset));
+    if (!resume_hash_digest(hash,
+                            request + FNAME_MAX_LEN + sizeof(state.offset))) {
+        fclose(output_file_fp);
+        free_resume_hash(hash);
+        handle_errors("Could not hash the partial file");
+    }
+    try {
+        send_request(aead, request,
+                     state.offset > 0 ? sizeof(request) : FNAME_MAX_LEN);
+    } catch (char const *ex) {
+        suspend(output_file, state, output_file_fp, hash);
+        return ConnectionLost;
+    }
 
     //------------------Server's response------------------
 
-    unsigned char *pt = new unsigned char[CHUNK_SIZE + get_block_size()];
+    unsigned char *pt = new unsigned char[chunk_size + get_block_size()];
 
     for (;;) {
-        auto server_response_header_res = get_mtype(sock);
-        if (server_response_header_res.is_error) {
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(output_file_fp);
+        auto message_res = receive_message(aead, pt);
+        if (message_res.is_error) {
+            suspend(output_file, state, output_file_fp, hash);
             delete[] pt;
-            handle_errors(server_response_header_res.error);
+            return ConnectionLost;
         }
-        auto server_response_header = server_response_header_res.result;
+        auto [server_response_header, pt_len] = message_res.result;
 
-        // Read IV and sequence number
-        auto server_header_res = read_header(sock);
-        if (server_header_res.is_error) {
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(output_file_fp);
-            delete[] pt;
-            handle_errors(server_header_res.error);
-        }
-        auto [seq, in_iv] = server_header_res.result;
-        iv = in_iv;
+        // Finally, handle the message
+        switch (server_response_header) {
+        case DownloadChunk:
+        case DownloadEnd:
+            if (fwrite(pt, sizeof(*pt), pt_len, output_file_fp) !=
+                    (unsigned int)pt_len ||
+                !resume_hash_update(hash, pt, pt_len)) {
+                suspend(output_file, state, output_file_fp, hash);
+                delete[] pt;
+                handle_errors("Error when writing downloaded chunk to file");
+            }
+            state.offset += pt_len;
 
-        // Check correctness of the sequence number
-        if (seq != seq_num) {
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(output_file_fp);
+            // Keep track of what was received, in case the connection drops
+            if (state.offset / RESUME_BLOCK !=
+                (state.offset - pt_len) / RESUME_BLOCK) {
+                save_state(output_file, state, output_file_fp, hash);
+            }
+            break;
+        case Error:
+        default:
+            // There was an error, either prior to the download or during it
+            // Handle it by:
+            //   - printing the error to the user
+            //   - freeing memory
+            //   - keeping what was received, to be resumed later, unless the
+            //     error is about the request to resume
+            cout << pt << endl;
             delete[] pt;
-            delete[] iv;
-            handle_errors("Incorrect sequence number");
-        }
 
-        // Read ciphertext
-        auto ct_res = read_field(sock);
-        if (ct_res.is_error) {
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(output_file_fp);
-            delete[] pt;
-            delete[] iv;
-            handle_errors(ct_res.error);
-        }
-        auto ct_tuple = ct_res.result;
-        ct_len = get<0>(ct_tuple);
-        ct = get<1>(ct_tuple);
+            // The partial file is not the start of the file anymore
+            if (resumed_from > 0 && state.offset == resumed_from) {
+                fclose(output_file_fp);
+                free_resume_hash(hash);
+                remove_partial(output_file);
+                return StartOver;
+            }
 
-        if (ct_len > CHUNK_SIZE + get_block_size()) {
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(output_file_fp);
-            delete[] pt;
-            delete[] iv;
-            delete[] ct;
-            handle_errors("Ciphertext longer than expected");
+            suspend(output_file, state, output_file_fp, hash);
+            return Fetched;
         }
 
-        // Read tag
-        auto tag_res = read_tag(sock);
-        if (tag_res.is_error) {
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(output_file_fp);
-            delete[] pt;
-            delete[] ct;
-            delete[] iv;
-            handle_errors(tag_res.error);
+        if (server_response_header == DownloadEnd) {
+            break;
         }
-        tag = tag_res.result;
+    }
 
-        // Initialize decryption
-        if (EVP_DecryptInit(ctx, get_symmetric_cipher(), key, iv) != 1) {
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(output_file_fp);
-            delete[] pt;
-            delete[] tag;
-            delete[] ct;
-            delete[] iv;
-            handle_errors();
+    fclose(output_file_fp);
+    free_resume_hash(hash);
+    delete[] pt;
+
+    // Complete, the file can take its name
+    if (rename(partial_path(output_file).c_str(), output_file) != 0) {
+        handle_errors("Error when saving downloaded file");
+    }
+    remove(state_path(output_file).c_str());
+
+    cout << "File saved locally as '" << output_file << "' correctly!" << endl;
+    return Fetched;
+}
+
+/*
+ * Asks the user which file to download into [filename], and where to save it
+ * into [output_file]. Returns false if it cannot be saved there.
+ */
+static bool ask_files(unsigned char *filename, char *output_file) {
+    cout << "What do you want to download? ";
+    if (fgets(reinterpret_cast<char *>(filename), FNAME_MAX_LEN, stdin) ==
+        nullptr) {
+        handle_errors();
+    }
+    filename[strcspn(reinterpret_cast<char *>(filename), "\n")] = '\0';
+
+    cout << "Where do you want to save the file? ";
+    if (fgets(output_file, FNAME_MAX_LEN, stdin) == nullptr) {
+        handle_errors();
+    }
+    output_file[strcspn(output_file, "\n")] = '\0';
+
+    // Sanity check: never overwrite a file
+    if (fs::status(fs::path(output_file)).type() != fs::file_type::not_found) {
+        cout << "Error - Output file must not exist" << endl;
+        return false;
+    }
+    return true;
+}
+
+void download(Aead *aead) {
+    unsigned char filename[FNAME_MAX_LEN] = {0};
+    char output_file[FNAME_MAX_LEN] = {0};
+    if (!ask_files(filename, output_file))
+        return;
+
+    // Each new connection resumes from what the previous one received
+    bool resume = true;
+    for (int attempts = 0;;) {
+        fetch_result result = fetch(aead, filename, output_file, resume);
+        if (result == StartOver) {
+            cout << "Downloading the file again" << endl;
+            resume = false;
+            continue;
         }
-        delete[] iv;
+        if (result == Fetched)
+            return;
 
-        header = mtype_to_uc(server_response_header);
+        // The download goes on over a new connection, as long as one can be
+        // opened
+        do {
+            if (attempts++ == RECONNECT_ATTEMPTS) {
+                cout << "Connection lost, download the file again to resume"
+                     << endl;
+                handle_errors("Could not reconnect to the server");
+            }
+            cout << "Connection lost, reconnecting..." << endl;
+            sleep(RECONNECT_DELAY);
+        } while (!reopen_session());
 
-        // Authenticated data
-        err = 0;
-        err |= EVP_DecryptUpdate(ctx, nullptr, &len, &header, sizeof(mtype));
-        err |= EVP_DecryptUpdate(ctx, nullptr, &len, seqnum_to_uc(),
-                                 sizeof(seqnum));
+        aead = ::aead;
+        resume = true;
+    }
+}
 
-        if (err != 1) {
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(output_file_fp);
-            delete[] pt;
-            delete[] tag;
-            delete[] ct;
-            handle_errors();
+/*
+ * Parses [text] into [ranges]: ranges separated by commas, each one either
+ * `first-last`, both included, or `-count` for the last bytes of the file.
+ * Returns how many there are, or 0 if [text] is not valid.
+ */
+static int parse_ranges(const char *text, ByteRange *ranges) {
+    int count = 0;
+    for (const char *p = text;; p++) {
+        if (count == MAX_RANGES)
+            return 0;
+
+        char *end;
+        if (p[0] == '-' && isdigit(p[1])) {
+            uint64_t len = strtoull(p + 1, &end, 10);
+            if (len == 0)
+                return 0;
+            ranges[count++] = {RANGE_FROM_END, len};
+        } else if (isdigit(p[0])) {
+            uint64_t first = strtoull(p, &end, 10);
+            if (end[0] != '-' || !isdigit(end[1]))
+                return 0;
+            uint64_t last = strtoull(end + 1, &end, 10);
+            if (last < first || last == UINT64_MAX)
+                return 0;
+            ranges[count++] = {first, last - first + 1};
+        } else {
+            return 0;
         }
 
-        int pt_len;
-        if (EVP_DecryptUpdate(ctx, pt, &len, ct, ct_len) != 1) {
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(output_file_fp);
-            delete[] pt;
-            delete[] tag;
-            delete[] ct;
-            handle_errors();
+        p = end;
+        if (*p == '\0')
+            return count;
+        if (*p != ',')
+            return 0;
+    }
+}
+
+/*
+ * Checks the DownloadAns [answer], of len [answer_len], to a request for
+ * [n_ranges] ranges, and tells the user what they amount to. Returns how many
+ * bytes follow it.
+ */
+static Maybe<uint64_t> read_answer(unsigned char *answer, int answer_len,
+                                   int n_ranges) {
+    Maybe<uint64_t> res;
+
+    uint64_t size;
+    if (answer_len != (int)(sizeof(size) + 1 + n_ranges * sizeof(ByteRange)) ||
+        answer[sizeof(size)] != n_ranges) {
+        res.set_error("Malformed download answer");
+        return res;
+    }
+    memcpy(&size, answer, sizeof(size));
+    ByteRange ranges[MAX_RANGES];
+    memcpy(ranges, answer + sizeof(size) + 1, n_ranges * sizeof(ByteRange));
+
+    cout << "The file is " << size << " bytes long, receiving:" << endl;
+    uint64_t total = 0;
+    for (int i = 0; i < n_ranges; i++) {
+        if (ranges[i].len == 0) {
+            cout << "    nothing" << endl;
+        } else {
+            cout << "    bytes " << ranges[i].offset << "-"
+                 << ranges[i].offset + ranges[i].len - 1 << endl;
         }
-        pt_len = len;
+        total += ranges[i].len;
+    }
+
+    res.set_result(total);
+    return res;
+}
+
+void download_ranges(Aead *aead) {
+    unsigned char filename[FNAME_MAX_LEN] = {0};
+    char output_file[FNAME_MAX_LEN] = {0};
+    if (!ask_files(filename, output_file))
+        return;
 
-        // GCM tag check
-        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, TAG_LEN, tag);
+    cout << "Which bytes? (first-last, or -count for the last ones, separated "
+            "by commas) ";
+    char text[256] = {0};
+    if (fgets(text, sizeof(text), stdin) == nullptr) {
+        handle_errors();
+    }
+    text[strcspn(text, "\n")] = '\0';
+
+    ByteRange ranges[MAX_RANGES];
+    int n_ranges = parse_ranges(text, ranges);
+    if (n_ranges == 0) {
+        cout << "Error - Invalid byte ranges" << endl;
+        return;
+    }
+
+    // Make sure that the file can be written before
+    FILE *output_file_fp;
+    if ((output_file_fp = fopen(output_file, "w")) == nullptr) {
+        cout << "Error - Could not open output file for writing" << endl;
+        return;
+    }
 
-        if (EVP_DecryptFinal(ctx, pt + len, &len) != 1) {
-            EVP_CIPHER_CTX_free(ctx);
+    unsigned char request[FNAME_MAX_LEN + 1 + sizeof(ranges)];
+    memcpy(request, filename, FNAME_MAX_LEN);
+    request[FNAME_MAX_LEN] = n_ranges;
+    memcpy(request + FNAME_MAX_LEN + 1, ranges, n_ranges * sizeof(ByteRange));
+    send_request(aead, request,
+                 FNAME_MAX_LEN + 1 + n_ranges * sizeof(ByteRange));
+
+    //------------------Server's response------------------
+
+    // The bytes of the ranges, one after the other, follow the answer
+    unsigned char *pt = new unsigned char[chunk_size + get_block_size()];
+    uint64_t expected = 0, received = 0;
+    for (bool answered = false;;) {
+        auto message_res = receive_message(aead, pt);
+        if (message_res.is_error) {
             fclose(output_file_fp);
+            remove(output_file);
             delete[] pt;
-            delete[] tag;
-            delete[] ct;
-            handle_errors();
+            handle_errors(message_res.error);
         }
-        pt_len += len;
+        auto [server_response_header, pt_len] = message_res.result;
 
-        delete[] ct;
-        delete[] tag;
-
-        // Reset the context and increment the sequence number
-        EVP_CIPHER_CTX_reset(ctx);
-        inc_seqnum();
+        if (!answered && server_response_header == DownloadAns) {
+            auto answer_res = read_answer(pt, pt_len, n_ranges);
+            if (answer_res.is_error) {
+                fclose(output_file_fp);
+                remove(output_file);
+                delete[] pt;
+                handle_errors(answer_res.error);
+            }
+            expected = answer_res.result;
+            answered = true;
+            continue;
+        }
 
-        // Finally, handle the message
-        switch (server_response_header) {
-        case DownloadChunk:
-        case DownloadEnd:
+        if (answered && (server_response_header == DownloadChunk ||
+                         server_response_header == DownloadEnd)) {
             if (fwrite(pt, sizeof(*pt), pt_len, output_file_fp) !=
                 (unsigned int)pt_len) {
-                EVP_CIPHER_CTX_free(ctx);
                 fclose(output_file_fp);
+                remove(output_file);
                 delete[] pt;
                 handle_errors("Error when writing downloaded chunk to file");
             }
-            break;
-        case Error:
-        default:
-            // There was an error, either prior to the download or during it
-            // Handle it by:
-            //   - printing the error to the user
-            //   - freeing memory
-            //   - removing the (partial) downloaded file
+            received += pt_len;
+            if (server_response_header == DownloadEnd)
+                break;
+            continue;
+        }
 
-            cout << pt << endl;
+        // There was an error, either prior to the download or during it
+        cout << pt << endl;
+        fclose(output_file_fp);
+        remove(output_file);
+        delete[] pt;
+        return;
+    }
 
-            fclose(output_file_fp);
-            EVP_CIPHER_CTX_free(ctx);
-            delete[] pt;
+    fclose(output_file_fp);
+    delete[] pt;
+
+    if (received != expected) {
+        remove(output_file);
+        handle_errors("Ranges shorter than announced");
+    }
+
+    cout << "Bytes saved locally as '" << output_file << "' correctly!"
+         << endl;
+}
 
-            fs::path outfile_path = fs::path(output_file);
-            if (fs::exists(outfile_path)) {
-                fs::remove(outfile_path);
+/*
+ * Receives the bytes of the segment [range] of [job], asked for on the session
+ * of the calling thread, and writes them in place
+ */
+static Maybe<bool> receive_segment(ParallelDownload *job, ByteRange range,
+                                   unsigned char *pt) {
+    Maybe<bool> res;
+
+    uint64_t offset = range.offset;
+    for (bool answered = false;;) {
+        auto message_res = receive_message(aead, pt);
+        if (message_res.is_error) {
+            res.set_error(message_res.error);
+            return res;
+        }
+        auto [server_response_header, pt_len] = message_res.result;
+
+        // The file must still be as long as when the download started
+        if (!answered && server_response_header == DownloadAns) {
+            uint64_t size;
+            ByteRange sent;
+            if (pt_len != (int)(sizeof(size) + 1 + sizeof(sent)) ||
+                pt[sizeof(size)] != 1) {
+                res.set_error("Malformed download answer");
+                return res;
+            }
+            memcpy(&size, pt, sizeof(size));
+            memcpy(&sent, pt + sizeof(size) + 1, sizeof(sent));
+            if (size != job->size || sent.offset != range.offset ||
+                sent.len != range.len) {
+                res.set_error("File changed during the download");
+                return res;
             }
+            answered = true;
+            continue;
+        }
 
-            return;
+        if (answered && (server_response_header == DownloadChunk ||
+                         server_response_header == DownloadEnd)) {
+            if (offset + pt_len > range.offset + range.len ||
+                pwrite(job->fd, pt, pt_len, offset) != pt_len) {
+                res.set_error("Error when writing downloaded chunk to file");
+                return res;
+            }
+            offset += pt_len;
+            if (server_response_header == DownloadChunk)
+                continue;
+
+            if (offset != range.offset + range.len) {
+                res.set_error("Segment shorter than requested");
+                return res;
+            }
+            res.set_result(true);
+            return res;
         }
 
-        if (server_response_header == DownloadEnd) {
+        // There was an error, either prior to the download or during it
+        cout << pt << endl;
+        res.set_error("Segment turned down by the server");
+        return res;
+    }
+}
+
+/*
+ * Fetches the segments of [job] that no connection took yet, one after the
+ * other, on the session of the calling thread, until there is none left or
+ * one of them could not be fetched
+ */
+static void fetch_segments(ParallelDownload *job) {
+    unsigned char *pt = new unsigned char[chunk_size + get_block_size()];
+
+    while (!job->failed) {
+        uint64_t index = job->next++;
+        if (index >= job->n_segments)
             break;
+
+        ByteRange range;
+        range.offset = index * job->segment_size;
+        range.len = min(job->segment_size, job->size - range.offset);
+
+        // Long sessions move on to the next key in between two segments
+        if (aead_needs_update(aead, send_seq)) {
+            send_key_update(writer, aead, send_seq);
+        }
+
+        unsigned char request[FNAME_MAX_LEN + 1 + sizeof(range)];
+        memcpy(request, job->filename, FNAME_MAX_LEN);
+        request[FNAME_MAX_LEN] = 1;
+        memcpy(request + FNAME_MAX_LEN + 1, &range, sizeof(range));
+        send_request(aead, request, sizeof(request));
+
+        auto segment_res = receive_segment(job, range, pt);
+        if (segment_res.is_error) {
+            job->failed = true;
+            delete[] pt;
+            handle_errors(segment_res.error);
         }
     }
 
-    EVP_CIPHER_CTX_free(ctx);
-    fclose(output_file_fp);
     delete[] pt;
+}
+
+/*
+ * Runs a connection of [job] besides the first one. If it cannot be opened,
+ * the other connections fetch its share of the segments.
+ */
+static void run_connection(ParallelDownload *job) {
+    if (!open_session())
+        return;
+
+    try {
+        fetch_segments(job);
+    } catch (char const *ex) {
+        job->failed = true;
+    }
+    close_session();
+}
+
+/*
+ * Asks the server how long [filename] is, for none of its bytes: the last
+ * zero of them. Returns false if the server turned the request down.
+ */
+static bool file_size(Aead *aead, unsigned char *filename, uint64_t &size) {
+    unsigned char request[FNAME_MAX_LEN + 1 + sizeof(ByteRange)];
+    ByteRange none = {RANGE_FROM_END, 0};
+    memcpy(request, filename, FNAME_MAX_LEN);
+    request[FNAME_MAX_LEN] = 1;
+    memcpy(request + FNAME_MAX_LEN + 1, &none, sizeof(none));
+    send_request(aead, request, sizeof(request));
+
+    // The answer, then a DownloadEnd with nothing in it
+    unsigned char *pt = new unsigned char[chunk_size + get_block_size()];
+    for (bool answered = false;;) {
+        auto message_res = receive_message(aead, pt);
+        if (message_res.is_error) {
+            delete[] pt;
+            handle_errors(message_res.error);
+        }
+        auto [server_response_header, pt_len] = message_res.result;
+
+        if (!answered && server_response_header == DownloadAns &&
+            pt_len == (int)(sizeof(size) + 1 + sizeof(none))) {
+            memcpy(&size, pt, sizeof(size));
+            answered = true;
+        } else if (answered && server_response_header == DownloadEnd &&
+                   pt_len == 0) {
+            delete[] pt;
+            return true;
+        } else if (server_response_header == Error) {
+            cout << pt << endl;
+            delete[] pt;
+            return false;
+        } else {
+            delete[] pt;
+            handle_errors("Unexpected message from server");
+        }
+    }
+}
 
+/*
+ * Checks that the [size] bytes of the file downloaded into [path] are the
+ * ones of [filename] on the server, by asking it to resume the download after
+ * all of them: it only does if they hash the same
+ */
+static bool same_file(Aead *aead, unsigned char *filename, const string &path,
+                      uint64_t size) {
+    FILE *fp;
+    ResumeHash *hash;
+    if ((fp = fopen(path.c_str(), "r")) == nullptr)
+        return false;
+    if ((hash = new_resume_hash()) == nullptr) {
+        fclose(fp);
+        return false;
+    }
+
+    unsigned char request[FNAME_MAX_LEN + RESUME_POINT_LEN];
+    memcpy(request, filename, FNAME_MAX_LEN);
+    memcpy(request + FNAME_MAX_LEN, &size, sizeof(size));
+    bool hashed =
+        resume_hash_file(fp, size, hash) &&
+        resume_hash_digest(hash, request + FNAME_MAX_LEN + sizeof(size));
+    free_resume_hash(hash);
+    fclose(fp);
+    if (!hashed)
+        return false;
+
+    send_request(aead, request, sizeof(request));
+
+    unsigned char *pt = new unsigned char[chunk_size + get_block_size()];
+    auto message_res = receive_message(aead, pt);
+    if (message_res.is_error) {
+        delete[] pt;
+        handle_errors(message_res.error);
+    }
+    auto [server_response_header, pt_len] = message_res.result;
+    if (server_response_header == Error) {
+        cout << pt << endl;
+    }
+    delete[] pt;
+    return server_response_header == DownloadEnd && pt_len == 0;
+}
+
+void download_parallel(Aead *aead) {
+    ParallelDownload job;
+    memset(job.filename, 0, FNAME_MAX_LEN);
+    char output_file[FNAME_MAX_LEN] = {0};
+    if (!ask_files(job.filename, output_file))
+        return;
+
+    cout << "Over how many connections? (1-" << MAX_CONNECTIONS << ") ";
+    char text[16] = {0};
+    if (fgets(text, sizeof(text), stdin) == nullptr) {
+        handle_errors();
+    }
+    int n_connections = atoi(text);
+    if (n_connections < 1 || n_connections > MAX_CONNECTIONS) {
+        cout << "Error - Invalid number of connections" << endl;
+        return;
+    }
+
+    if (!file_size(aead, job.filename, job.size))
+        return;
+
+    // The segments are written in place, into a file already as long as the
+    // one downloaded, which only takes its name once complete
+    string path = partial_path(output_file);
+    remove_partial(output_file);
+    if ((job.fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)) <
+        0) {
+        cout << "Error - Could not open output file for writing" << endl;
+        return;
+    }
+    if (job.size > 0 && posix_fallocate(job.fd, 0, job.size) != 0) {
+        close(job.fd);
+        remove(path.c_str());
+        cout << "Error - Not enough space for the file" << endl;
+        return;
+    }
+
+    // Enough segments for every connection to get some, in whole chunks
+    job.segment_size = (job.size + n_connections - 1) / n_connections;
+    job.segment_size = min<uint64_t>(job.segment_size, SEGMENT_SIZE);
+    job.segment_size =
+        max<uint64_t>((job.segment_size + chunk_size - 1) / chunk_size, 1) *
+        chunk_size;
+    job.n_segments = (job.size + job.segment_size - 1) / job.segment_size;
+    job.next = 0;
+    job.failed = false;
+    n_connections =
+        min<uint64_t>(n_connections, max<uint64_t>(job.n_segments, 1));
+
+    // This session fetches segments as well, alongside the other ones
+    vector<thread> connections;
+    for (int i = 1; i < n_connections; i++) {
+        connections.emplace_back(run_connection, &job);
+    }
+    const char *error = nullptr;
+    try {
+        fetch_segments(&job);
+    } catch (char const *ex) {
+        error = ex;
+        job.failed = true;
+    }
+    for (auto &connection : connections) {
+        connection.join();
+    }
+
+    if (close(job.fd) != 0) {
+        job.failed = true;
+    }
+    if (error != nullptr) {
+        remove(path.c_str());
+        handle_errors(error);
+    }
+    if (job.failed || !same_file(aead, job.filename, path, job.size)) {
+        remove(path.c_str());
+        cout << "Error - The file could not be downloaded" << endl;
+        return;
+    }
+
+    if (rename(path.c_str(), output_file) != 0) {
+        handle_errors("Error when saving downloaded file");
+    }
     cout << "File saved locally as '" << output_file << "' correctly!" << endl;
 }
@@ -1,6 +1,21 @@
+#include "../../common/aead.h"
+
 #ifndef download_h
 #define download_h
 
-void download(int sock, unsigned char *key);
+void download(Aead *aead);
+
+/*
+ * Downloads some ranges of bytes of a file only, as the user asks for them,
+ * saved one after the other
+ */
+void download_ranges(Aead *aead);
+
+/*
+ * Downloads a file over several sessions at once, as many as the user asks
+ * for, each one fetching segments of it. The file is checked against the one
+ * on the server once complete.
+ */
+void download_parallel(Aead *aead);
 
 #endif
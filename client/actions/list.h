@@ -1,7 +1,8 @@
+#include "../../common/aead.h"
 
 #ifndef list_h
 #define list_h
 
-void list_files(int sock, unsigned char *key);
+void list_files(Aead *aead);
 
 #endif
\ No newline at end of file
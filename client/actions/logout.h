@@ -1,7 +1,8 @@
+#include "../../common/aead.h"
 
 #ifndef logout_h
 #define logout_h
 
-void logout(int sock, unsigned char *key);
+void logout(Aead *aead);
 
 #endif
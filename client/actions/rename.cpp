@@ -2,12 +2,12 @@
 #include "../../common/seq.h"
 #include "../../common/types.h"
 #include "../../common/utils.h"
-#include <openssl/evp.h>
+#include "../client.h"
 #include <stdio.h>
 #include <string.h>
 #include <sys/socket.h>
 
-void rename(int sock, unsigned char *key) {
+void rename(Aead *aead) {
 
     // all the filenames must have same size
     unsigned char f_old[FNAME_MAX_LEN] = {0};
@@ -29,138 +29,69 @@ void rename(int sock, unsigned char *key) {
     }
     f_new[strcspn(reinterpret_cast<char *>(f_new), "\n")] = '\0';
 
-    // Generate iv for message
-    auto iv_res = gen_iv();
-    if (iv_res.is_error) {
-        handle_errors(iv_res.error);
-    }
-    auto iv = iv_res.result;
-
     // Send rename request
-    auto send_packet_header_res =
-        send_header(sock, RenameReq, seq_num, iv, get_iv_len());
+    auto send_packet_header_res = send_header(writer, RenameReq, send_seq);
     if (send_packet_header_res.is_error) {
-        delete[] iv;
         handle_errors(send_packet_header_res.error);
     }
 
-    // Initialize encryption context
-    EVP_CIPHER_CTX *ctx;
-    int len = 0;
-    int ct_len;
-    if ((ctx = EVP_CIPHER_CTX_new()) == nullptr) {
-        delete[] iv;
-        handle_errors("Could not encrypt message (alloc)");
-    }
-
-    if (EVP_EncryptInit(ctx, get_symmetric_cipher(), key, iv) != 1) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-
-    int err = 0;
-    unsigned char header = mtype_to_uc(RenameReq);
-    err |=
-        EVP_EncryptUpdate(ctx, nullptr, &len, &header, sizeof(unsigned char));
-    err |=
-        EVP_EncryptUpdate(ctx, nullptr, &len, seqnum_to_uc(), sizeof(seqnum));
-    if (err != 1) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-
-    // Actual encryption
-    // First encrypt 128 bytes for f_old
-    unsigned char *ct = new unsigned char[FNAME_MAX_LEN * 2 + get_block_size()];
-    if (EVP_EncryptUpdate(ctx, ct, &len, f_old, FNAME_MAX_LEN) != 1) {
-        delete[] iv;
-        delete[] ct;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-    ct_len = len;
-
-    // Then encrypt 128 bytes for f_new
-    if (EVP_EncryptUpdate(ctx, ct + ct_len, &len, f_new, FNAME_MAX_LEN) != 1) {
-        delete[] iv;
-        delete[] ct;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-    ct_len += len;
-
-    // Finalize encryption
-    if (EVP_EncryptFinal(ctx, ct + ct_len, &len) != 1) {
-        delete[] iv;
-        delete[] ct;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-    ct_len += len;
+    // Actual encryption: 128 bytes for f_old, then 128 bytes for f_new
+    unsigned char filenames[FNAME_MAX_LEN * 2];
+    memcpy(filenames, f_old, FNAME_MAX_LEN);
+    memcpy(filenames + FNAME_MAX_LEN, f_new, FNAME_MAX_LEN);
 
+    int ct_len = sizeof(filenames);
+    unsigned char *ct = new unsigned char[ct_len];
     unsigned char *tag = new unsigned char[TAG_LEN];
-    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, TAG_LEN, tag) != 1) {
-        delete[] iv;
+    auto seal_res = aead_seal(aead, RenameReq, send_seq, filenames,
+                              sizeof(filenames), ct, tag);
+    if (seal_res.is_error) {
         delete[] ct;
         delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+        handle_errors(seal_res.error);
     }
-    delete[] iv;
-    EVP_CIPHER_CTX_reset(ctx);
 
     // Send ciphertext
-    auto ct_send_res = send_field(sock, (flen)ct_len, ct);
+    auto ct_send_res = send_field(writer, (flen)ct_len, ct);
     if (ct_send_res.is_error) {
-        EVP_CIPHER_CTX_free(ctx);
         delete[] ct;
         delete[] tag;
         handle_errors(ct_send_res.error);
     }
     delete[] ct;
 
-    auto tag_send_res = send_tag(sock, tag);
+    auto tag_send_res = send_tag(writer, tag);
     if (tag_send_res.is_error) {
-        EVP_CIPHER_CTX_free(ctx);
         delete[] tag;
         handle_errors(tag_send_res.error);
     }
     delete[] tag;
 
-    inc_seqnum();
+    inc_seqnum(send_seq);
 
     //------------------Wait server response------------------
 
-    auto mtype_res = get_mtype(sock);
+    auto mtype_res = receive_mtype(reader, aead, recv_seq);
     if (mtype_res.is_error ||
         (mtype_res.result != RenameAns && mtype_res.result != Error)) {
-        EVP_CIPHER_CTX_free(ctx);
         handle_errors("Incorrect message type");
     }
 
-    // read iv and sequence number
-    auto server_header_res = read_header(sock);
+    // read sequence number
+    auto server_header_res = read_header(reader);
     if (server_header_res.is_error) {
-        EVP_CIPHER_CTX_free(ctx);
         handle_errors();
     }
-    auto [seq, in_iv] = server_header_res.result;
-    iv = in_iv;
+    auto seq = server_header_res.result;
 
     // Check correctness of the sequence number
-    if (seq != seq_num) {
-        EVP_CIPHER_CTX_free(ctx);
-        delete[] iv;
+    if (seq != recv_seq) {
         handle_errors("Incorrect sequence number");
     }
 
     // read ciphertext
-    auto ct_res = read_field(sock);
+    auto ct_res = read_field(reader);
     if (ct_res.is_error) {
-        EVP_CIPHER_CTX_free(ctx);
-        delete[] iv;
         handle_errors();
     }
     auto ct_tuple = ct_res.result;
@@ -168,66 +99,23 @@ void rename(int sock, unsigned char *key) {
     ct = get<1>(ct_tuple);
 
     // read tag
-    auto tag_res = read_tag(sock);
+    auto tag_res = read_tag(reader);
     if (tag_res.is_error) {
-        EVP_CIPHER_CTX_free(ctx);
-        delete[] ct;
-        delete[] iv;
         handle_errors();
     }
     tag = tag_res.result;
 
-    if (EVP_DecryptInit(ctx, get_symmetric_cipher(), key, iv) != 1) {
-        delete[] iv;
-        delete[] ct;
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-    delete[] iv;
-
-    header = mtype_to_uc(mtype_res.result);
-
-    /* Specify authenticated data */
-    err = 0;
-    err |= EVP_DecryptUpdate(ctx, nullptr, &len, &header, sizeof(mtype));
-    err |=
-        EVP_DecryptUpdate(ctx, nullptr, &len, seqnum_to_uc(), sizeof(seqnum));
-
-    if (err != 1) {
-        delete[] ct;
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-
     // Allocate plaintext of the length == ciphertext length
     auto *pt = new unsigned char[ct_len];
-    if (EVP_DecryptUpdate(ctx, pt, &len, ct, ct_len) != 1) {
-        delete[] ct;
-        delete[] tag;
+    auto open_res =
+        aead_open(aead, mtype_res.result, seq, ct, ct_len, tag, pt);
+    if (open_res.is_error) {
         delete[] pt;
-        EVP_CIPHER_CTX_free(ctx);
-    }
-
-    // GCM tag check
-    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, TAG_LEN, tag);
-
-    // Encrypt Final. Finalize the encryption and adds the padding
-    if (EVP_DecryptFinal(ctx, pt + len, &len) != 1) {
-        delete[] ct;
-        delete[] tag;
-        delete[] pt;
-        EVP_CIPHER_CTX_free(ctx);
+        handle_errors(open_res.error);
     }
 
     cout << endl << pt << endl;
-
-    // free context
-    EVP_CIPHER_CTX_free(ctx);
     delete[] pt;
-    delete[] ct;
-    delete[] tag;
 
-    inc_seqnum();
+    inc_seqnum(recv_seq);
 }
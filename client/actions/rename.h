@@ -1,7 +1,8 @@
+#include "../../common/aead.h"
 
 #ifndef rename_h
 #define rename_h
 
-void rename(int sock, unsigned char *key);
+void rename(Aead *aead);
 
 #endif
\ No newline at end of file
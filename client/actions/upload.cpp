@@ -2,8 +2,10 @@
 #include "../../common/seq.h"
 #include "../../common/types.h"
 #include "../../common/utils.h"
-#include <openssl/evp.h>
+#include "../client.h"
+#include <openssl/crypto.h>
 #include <string.h>
+#include <tuple>
 
 #if __has_include(<filesystem>)
 #include <filesystem>
@@ -17,254 +19,220 @@ error "Missing the <filesystem> header."
 
 using namespace std;
 
-void upload(int sock, unsigned char *key) {
-    cout << "What do you want to upload? ";
-    unsigned char filename[FNAME_MAX_LEN] = {0};
-    if (fgets(reinterpret_cast<char *>(filename), FNAME_MAX_LEN, stdin) ==
-        nullptr) {
-        handle_errors();
-    }
-    filename[strcspn(reinterpret_cast<char *>(filename), "\n")] = '\0';
-
-    // Make sure that the file can be read before
-    FILE *input_file_fp;
-    if ((input_file_fp = fopen(reinterpret_cast<char *>(filename), "r")) ==
-        nullptr) {
-        cout << "Error - Could not open input file for reading" << endl;
-        return;
-    }
-    fs::path input_path = reinterpret_cast<char *>(filename);
-    if (fs::file_size(input_path) > FSIZE_MAX) {
-        cout << "Error - File too big for upload (max 4Gb)" << endl;
-        return;
-    }
-
-    // Generate iv for message
-    auto iv_res = gen_iv();
-    if (iv_res.is_error) {
-        fclose(input_file_fp);
-        handle_errors(iv_res.error);
-    }
-    auto iv = iv_res.result;
+/*
+ * Sends the UploadReq of [filename], asking to resume a previous upload of it
+ * if [resume]
+ */
+static void send_request(Aead *aead, unsigned char *filename, bool resume,
+                         FILE *input_file_fp) {
+    unsigned char request[FNAME_MAX_LEN + 1];
+    memcpy(request, filename, FNAME_MAX_LEN);
+    request[FNAME_MAX_LEN] = resume ? 1 : 0;
 
     // Send upload request
-    auto send_packet_header_res =
-        send_header(sock, UploadReq, seq_num, iv, get_iv_len());
+    auto send_packet_header_res = send_header(writer, UploadReq, send_seq);
     if (send_packet_header_res.is_error) {
-        delete[] iv;
         fclose(input_file_fp);
         handle_errors(send_packet_header_res.error);
     }
 
-    // Initialize encryption context
-    EVP_CIPHER_CTX *ctx;
-    int len = 0;
-    int ct_len;
-    if ((ctx = EVP_CIPHER_CTX_new()) == nullptr) {
-        delete[] iv;
-        fclose(input_file_fp);
-        handle_errors("Could not encrypt message (alloc)");
-    }
-
-    if (EVP_EncryptInit(ctx, get_symmetric_cipher(), key, iv) != 1) {
-        delete[] iv;
-        fclose(input_file_fp);
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-
-    // Authenticated data
-    int err = 0;
-    unsigned char header = mtype_to_uc(UploadReq);
-    err |=
-        EVP_EncryptUpdate(ctx, nullptr, &len, &header, sizeof(unsigned char));
-    err |=
-        EVP_EncryptUpdate(ctx, nullptr, &len, seqnum_to_uc(), sizeof(seqnum));
-    if (err != 1) {
-        delete[] iv;
-        fclose(input_file_fp);
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-
-    // Encryption of the filename
-    unsigned char *ct = new unsigned char[FNAME_MAX_LEN + get_block_size()];
-    if (EVP_EncryptUpdate(ctx, ct, &len, filename, FNAME_MAX_LEN) != 1) {
-        delete[] iv;
-        fclose(input_file_fp);
-        delete[] ct;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-    ct_len = len;
-
-    if (EVP_EncryptFinal(ctx, ct + ct_len, &len) != 1) {
-        delete[] iv;
-        fclose(input_file_fp);
-        delete[] ct;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-    ct_len += len;
-
+    // Encryption of the request
+    int ct_len = sizeof(request);
+    unsigned char *ct = new unsigned char[ct_len];
     unsigned char *tag = new unsigned char[TAG_LEN];
-    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, TAG_LEN, tag) != 1) {
-        delete[] iv;
+    auto seal_res = aead_seal(aead, UploadReq, send_seq, request,
+                              sizeof(request), ct, tag);
+    if (seal_res.is_error) {
         fclose(input_file_fp);
         delete[] ct;
         delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+        handle_errors(seal_res.error);
     }
-    delete[] iv;
-    EVP_CIPHER_CTX_reset(ctx);
 
     // Send ciphertext
-    auto ct_send_res = send_field(sock, (flen)ct_len, ct);
+    auto ct_send_res = send_field(writer, (flen)ct_len, ct);
     if (ct_send_res.is_error) {
         delete[] ct;
         fclose(input_file_fp);
         delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
         handle_errors(ct_send_res.error);
     }
     delete[] ct;
 
-    auto tag_send_res = send_tag(sock, tag);
+    auto tag_send_res = send_tag(writer, tag);
     if (tag_send_res.is_error) {
         delete[] tag;
         fclose(input_file_fp);
-        EVP_CIPHER_CTX_free(ctx);
         handle_errors(tag_send_res.error);
     }
     delete[] tag;
 
-    inc_seqnum();
-
-    //------------------Wait server response------------------
+    inc_seqnum(send_seq);
+}
 
-    auto mtype_res = get_mtype(sock);
+/*
+ * Reads the server's answer to an UploadReq, UploadAns or Error, and returns
+ * its type and plaintext. The caller is responsible for freeing the latter.
+ */
+static tuple<mtypes, unsigned char *, flen> read_answer(Aead *aead,
+                                                       FILE *input_file_fp) {
+    auto mtype_res = receive_mtype(reader, aead, recv_seq);
 
     if (mtype_res.is_error ||
         (mtype_res.result != UploadAns && mtype_res.result != Error)) {
-        EVP_CIPHER_CTX_free(ctx);
         handle_errors("Incorrect message type");
     }
 
-    // read iv and sequence number
-    auto server_header_res = read_header(sock);
+    // read sequence number
+    auto server_header_res = read_header(reader);
     if (server_header_res.is_error) {
-        EVP_CIPHER_CTX_free(ctx);
         handle_errors();
     }
-    auto [seq, in_iv] = server_header_res.result;
-    iv = in_iv;
+    auto seq = server_header_res.result;
 
     // Check correctness of the sequence number
-    if (seq != seq_num) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
+    if (seq != recv_seq) {
         fclose(input_file_fp);
         handle_errors("Incorrect sequence number");
     }
 
     // read ciphertext
-    auto ct_res = read_field(sock);
+    auto ct_res = read_field(reader);
     if (ct_res.is_error) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
         fclose(input_file_fp);
         handle_errors();
     }
-    auto ct_tuple = ct_res.result;
-    ct_len = get<0>(ct_tuple);
-    ct = get<1>(ct_tuple);
+    auto [ct_len, ct] = ct_res.result;
 
     // read tag
-    auto tag_res = read_tag(sock);
+    auto tag_res = read_tag(reader);
     if (tag_res.is_error) {
-        delete[] ct;
         fclose(input_file_fp);
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
         handle_errors();
     }
-    tag = tag_res.result;
+    auto tag = tag_res.result;
 
-    if (EVP_DecryptInit(ctx, get_symmetric_cipher(), key, iv) != 1) {
-        delete[] iv;
+    // Allocate plaintext of the length == ciphertext length
+    auto *pt = new unsigned char[ct_len];
+    auto open_res =
+        aead_open(aead, mtype_res.result, seq, ct, ct_len, tag, pt);
+    if (open_res.is_error) {
         fclose(input_file_fp);
-        delete[] ct;
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+        delete[] pt;
+        handle_errors(open_res.error);
     }
-    delete[] iv;
-
-    header = mtype_to_uc(mtype_res.result);
 
-    /* Specify authenticated data */
-    err = 0;
-    err |= EVP_DecryptUpdate(ctx, nullptr, &len, &header, sizeof(mtype));
-    err |=
-        EVP_DecryptUpdate(ctx, nullptr, &len, seqnum_to_uc(), sizeof(seqnum));
+    inc_seqnum(recv_seq);
 
-    if (err != 1) {
-        delete[] ct;
+    // The message must be a string
+    if (ct_len == 0 || pt[ct_len - 1] != '\0') {
         fclose(input_file_fp);
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+        delete[] pt;
+        handle_errors("Malformed answer from the server");
     }
 
-    // Allocate plaintext of the length == ciphertext length
-    auto *pt = new unsigned char[ct_len];
-    if (EVP_DecryptUpdate(ctx, pt, &len, ct, ct_len) != 1) {
-        delete[] ct;
-        fclose(input_file_fp);
-        delete[] tag;
-        delete[] pt;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+    return {mtype_res.result, pt, ct_len};
+}
+
+/*
+ * Checks that [input_file_fp] starts with the bytes the server already holds,
+ * as told by the answer [pt] of len [pt_len] to a request to resume, and
+ * moves past them. Otherwise the file is rewound and false is returned.
+ */
+static bool resume_from(FILE *input_file_fp, unsigned char *pt, flen pt_len) {
+    if (pt_len < RESUME_POINT_LEN) {
+        return false;
     }
+    uint64_t offset;
+    memcpy(&offset, pt, sizeof(offset));
 
-    // GCM tag check
-    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, TAG_LEN, tag);
+    ResumeHash *hash;
+    if ((hash = new_resume_hash()) == nullptr) {
+        return false;
+    }
 
-    if (EVP_DecryptFinal(ctx, pt + len, &len) != 1) {
-        delete[] ct;
-        fclose(input_file_fp);
-        delete[] tag;
-        delete[] pt;
-        EVP_CIPHER_CTX_free(ctx);
+    // Hash the start of the file the way the server hashed what it received
+    unsigned char digest[RESUME_DIGEST_LEN];
+    bool same = resume_hash_file(input_file_fp, offset, hash) &&
+                resume_hash_digest(hash, digest) &&
+                CRYPTO_memcmp(digest, pt + sizeof(offset),
+                              RESUME_DIGEST_LEN) == 0;
+    free_resume_hash(hash);
+
+    if (!same) {
+        rewind(input_file_fp);
+        return false;
+    }
+    if (offset > 0) {
+        cout << "Resuming after " << offset << " bytes" << endl;
+    }
+    return true;
+}
+
+void upload(Aead *aead) {
+    cout << "What do you want to upload? ";
+    unsigned char filename[FNAME_MAX_LEN] = {0};
+    if (fgets(reinterpret_cast<char *>(filename), FNAME_MAX_LEN, stdin) ==
+        nullptr) {
         handle_errors();
     }
+    filename[strcspn(reinterpret_cast<char *>(filename), "\n")] = '\0';
 
-    delete[] ct;
-    delete[] tag;
+    // Make sure that the file can be read before
+    FILE *input_file_fp;
+    if ((input_file_fp = fopen(reinterpret_cast<char *>(filename), "r")) ==
+        nullptr) {
+        cout << "Error - Could not open input file for reading" << endl;
+        return;
+    }
+    fs::path input_path = reinterpret_cast<char *>(filename);
+    if (fs::file_size(input_path) > FSIZE_MAX) {
+        cout << "Error - File too big for upload (max 4Gb)" << endl;
+        return;
+    }
 
-    EVP_CIPHER_CTX_reset(ctx);
+    // Pick up where a previous upload of the file stopped, if it did
+    send_request(aead, filename, true, input_file_fp);
 
-    inc_seqnum();
+    //------------------Wait server response------------------
 
-    cout << endl << pt << endl;
+    auto [answer_type, pt, pt_len] = read_answer(aead, input_file_fp);
+    const char *message = reinterpret_cast<char *>(pt);
+    if (answer_type == UploadAns) {
+        if (resume_from(input_file_fp, pt, pt_len)) {
+            message += RESUME_POINT_LEN;
+        } else {
+            delete[] pt;
+
+            // What the server holds is not the start of this file: it drops
+            // it, and the upload starts over
+            send_error_response(writer, aead, send_seq,
+                                "Error - Partial upload does not match");
+            send_request(aead, filename, false, input_file_fp);
+            tie(answer_type, pt, pt_len) = read_answer(aead, input_file_fp);
+            message = reinterpret_cast<char *>(pt);
+        }
+    }
+
+    cout << endl << message << endl;
     delete[] pt;
 
-    if (mtype_res.result == Error) {
-        EVP_CIPHER_CTX_free(ctx);
+    if (answer_type == Error) {
+        fclose(input_file_fp);
         return;
     }
 
-    // Send the file a chunk at a time
-    unsigned char buffer[CHUNK_SIZE] = {0};
-    ct = new unsigned char[sizeof(buffer) + get_block_size()];
-    tag = new unsigned char[TAG_LEN];
+    // Send the file a chunk at a time, each one encrypted in place
+    unsigned char *buffer = new unsigned char[chunk_size];
+    unsigned char *ct = buffer;
+    unsigned char *tag = new unsigned char[TAG_LEN];
+    int ct_len;
     mtypes msg_type = UploadChunk;
 
     for (;;) {
         size_t read_len;
-        if ((read_len = fread(buffer, sizeof(*buffer), sizeof(buffer),
-                              input_file_fp)) != sizeof(buffer)) {
+        if ((read_len = fread(buffer, sizeof(*buffer), chunk_size,
+                              input_file_fp)) != chunk_size) {
             // When we read less than expected we could either have an error, or
             // we could have reached eof
             if (feof(input_file_fp) != 0) {
@@ -275,117 +243,63 @@ void upload(int sock, unsigned char *key) {
                 delete[] ct;
                 delete[] tag;
                 fclose(input_file_fp);
-                EVP_CIPHER_CTX_free(ctx);
-                send_error_response(sock, key, "Error - Could not read file");
+                send_error_response(writer, aead, send_seq,
+                                    "Error - Could not read file");
                 return;
             } else {
                 delete[] ct;
                 delete[] tag;
                 fclose(input_file_fp);
-                EVP_CIPHER_CTX_free(ctx);
-                send_error_response(sock, key, "Error - Cosmic rays uh?");
+                send_error_response(writer, aead, send_seq,
+                                    "Error - Cosmic rays uh?");
                 return;
             }
         }
-        // Generate iv for message
-        iv_res = gen_iv();
-        if (iv_res.is_error) {
-            delete[] ct;
-            delete[] tag;
-            fclose(input_file_fp);
-            EVP_CIPHER_CTX_free(ctx);
-            handle_errors(iv_res.error);
+        // Past the messages allowed under the current key, the next one is
+        // announced ahead of the chunk
+        if (aead_needs_update(aead, send_seq)) {
+            send_key_update(writer, aead, send_seq);
         }
-        iv = iv_res.result;
 
         // Send chunk header
-        send_packet_header_res =
-            send_header(sock, msg_type, seq_num, iv, get_iv_len());
+        auto send_packet_header_res = send_header(writer, msg_type, send_seq);
         if (send_packet_header_res.is_error) {
-            delete[] iv;
             delete[] ct;
             delete[] tag;
             fclose(input_file_fp);
-            EVP_CIPHER_CTX_free(ctx);
             handle_errors(send_packet_header_res.error);
         }
 
-        if (EVP_EncryptInit(ctx, get_symmetric_cipher(), key, iv) != 1) {
-            delete[] iv;
-            delete[] ct;
-            delete[] tag;
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(input_file_fp);
-            handle_errors();
-        }
-        delete[] iv;
-
-        // Authenticated data
-        err = 0;
-        header = mtype_to_uc(msg_type);
-        err |= EVP_EncryptUpdate(ctx, nullptr, &len, &header,
-                                 sizeof(unsigned char));
-        err |= EVP_EncryptUpdate(ctx, nullptr, &len, seqnum_to_uc(),
-                                 sizeof(seqnum));
-        if (err != 1) {
-            delete[] ct;
-            delete[] tag;
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(input_file_fp);
-            handle_errors();
-        }
-
         // Encrypt the chunk
-        if (EVP_EncryptUpdate(ctx, ct, &len, buffer, read_len) != 1) {
-            delete[] ct;
-            delete[] tag;
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(input_file_fp);
-            handle_errors();
-        }
-        ct_len = len;
-
-        // Finalize encryption
-        if (EVP_EncryptFinal(ctx, ct + ct_len, &len) != 1) {
-            delete[] ct;
-            delete[] tag;
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(input_file_fp);
-            handle_errors();
-        }
-        ct_len += len;
-
-        if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, TAG_LEN, tag) !=
-            1) {
+        ct_len = read_len;
+        auto seal_res =
+            aead_seal(aead, msg_type, send_seq, buffer, read_len, ct, tag);
+        if (seal_res.is_error) {
             delete[] ct;
             delete[] tag;
-            EVP_CIPHER_CTX_free(ctx);
             fclose(input_file_fp);
-            handle_errors();
+            handle_errors(seal_res.error);
         }
 
-        // Send ciphertext
-        ct_send_res = send_field(sock, (flen)ct_len, ct);
+        // Send ciphertext, left in place until the message is out
+        auto ct_send_res = send_field_ref(writer, (flen)ct_len, ct);
         if (ct_send_res.is_error) {
             delete[] ct;
             delete[] tag;
-            EVP_CIPHER_CTX_free(ctx);
             fclose(input_file_fp);
             handle_errors(ct_send_res.error);
         }
 
-        tag_send_res = send_tag(sock, tag);
+        auto tag_send_res = send_tag(writer, tag);
         if (tag_send_res.is_error) {
             delete[] tag;
             delete[] ct;
-            EVP_CIPHER_CTX_free(ctx);
             fclose(input_file_fp);
             handle_errors(tag_send_res.error);
         }
 
-        // At the end, reset the context and increase the sequence number
-        EVP_CIPHER_CTX_reset(ctx);
-        inc_seqnum();
+        // At the end, increase the sequence number
+        inc_seqnum(send_seq);
 
         // We have reached EOF, thus the upload has ended
         // Note that we already sent the full file to the client, correctly
@@ -401,103 +315,49 @@ void upload(int sock, unsigned char *key) {
 
     //-------------Wait server response--------------
 
-    mtype_res = get_mtype(sock);
+    auto mtype_res = receive_mtype(reader, aead, recv_seq);
 
     if (mtype_res.is_error || mtype_res.result != UploadRes) {
-        EVP_CIPHER_CTX_free(ctx);
         handle_errors("Incorrect message type");
     }
 
-    // read iv and sequence number
-    server_header_res = read_header(sock);
+    // read sequence number
+    auto server_header_res = read_header(reader);
     if (server_header_res.is_error) {
-        EVP_CIPHER_CTX_free(ctx);
         handle_errors();
     }
-    seq = get<0>(server_header_res.result);
-    in_iv = get<1>(server_header_res.result);
-    iv = in_iv;
+    auto seq = server_header_res.result;
 
     // Check correctness of the sequence number
-    if (seq != seq_num) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
+    if (seq != recv_seq) {
         handle_errors("Incorrect sequence number");
     }
 
     // read ciphertext
-    ct_res = read_field(sock);
+    auto ct_res = read_field(reader);
     if (ct_res.is_error) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
         handle_errors();
     }
-    ct_tuple = ct_res.result;
+    auto ct_tuple = ct_res.result;
     ct_len = get<0>(ct_tuple);
     ct = get<1>(ct_tuple);
 
     // read tag
-    tag_res = read_tag(sock);
+    auto tag_res = read_tag(reader);
     if (tag_res.is_error) {
-        delete[] ct;
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
         handle_errors();
     }
     tag = tag_res.result;
 
-    if (EVP_DecryptInit(ctx, get_symmetric_cipher(), key, iv) != 1) {
-        delete[] iv;
-        delete[] ct;
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-    delete[] iv;
-
-    header = mtype_to_uc(mtype_res.result);
-
-    /* Specify authenticated data */
-    err = 0;
-    err |= EVP_DecryptUpdate(ctx, nullptr, &len, &header, sizeof(mtype));
-    err |=
-        EVP_DecryptUpdate(ctx, nullptr, &len, seqnum_to_uc(), sizeof(seqnum));
-
-    if (err != 1) {
-        delete[] ct;
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-
     // Allocate plaintext of the length == ciphertext length
     pt = new unsigned char[ct_len];
-    if (EVP_DecryptUpdate(ctx, pt, &len, ct, ct_len) != 1) {
-        delete[] ct;
-        delete[] tag;
-        delete[] pt;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-
-    // GCM tag check
-    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, TAG_LEN, tag);
-
-    if (EVP_DecryptFinal(ctx, pt + len, &len) != 1) {
-        delete[] ct;
-        delete[] tag;
+    auto open_res = aead_open(aead, UploadRes, seq, ct, ct_len, tag, pt);
+    if (open_res.is_error) {
         delete[] pt;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+        handle_errors(open_res.error);
     }
 
-    delete[] ct;
-    delete[] tag;
-
-    // free context
-    EVP_CIPHER_CTX_free(ctx);
-
-    inc_seqnum();
+    inc_seqnum(recv_seq);
 
     cout << endl << pt << endl;
     delete[] pt;
@@ -1,6 +1,8 @@
+#include "../../common/aead.h"
+
 #ifndef upload_h
 #define upload_h
 
-void upload(int sock, unsigned char *key);
+void upload(Aead *aead);
 
 #endif
\ No newline at end of file
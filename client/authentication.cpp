@@ -1,95 +1,58 @@
 #include "authentication.h"
-#include "../common/dhparams.h"
 #include "../common/errors.h"
+#include "../common/kex.h"
+#include "../common/seq.h"
 #include "../common/types.h"
 #include "../common/utils.h"
+#include "client.h"
+#include "trust.h"
+#include <fcntl.h>
+#include <fstream>
 #include <iostream>
+#include <mutex>
 #include <new>
 #include <openssl/aes.h>
 #include <openssl/bio.h>
 #include <openssl/evp.h>
 #include <openssl/pem.h>
+#include <openssl/rand.h>
 #include <string.h>
 #include <string>
 #include <tuple>
+#include <unistd.h>
 
 using namespace std;
 
-Maybe<EVP_PKEY *> verify_certificate_and_get_key(X509 *cert) {
+/*
+ * Reads the server's certificate, as PEM, through [bio], verifies it unless it
+ * was already, and returns its public key. The caller is responsible for
+ * freeing the key.
+ */
+static Maybe<EVP_PKEY *> certificate_key(BIO *bio, unsigned char *pem,
+                                         flen pem_len) {
     Maybe<EVP_PKEY *> res;
 
-    // Allocate store
-    X509_STORE *store;
-    if ((store = X509_STORE_new()) == nullptr) {
-        res.set_error("Could not allocate X509 store");
-        return res;
-    }
-
-    // Load root certificate
-    FILE *root_cert_fp;
-    if ((root_cert_fp = fopen("certificates/rootCA.crt", "r")) == nullptr) {
-        X509_STORE_free(store);
-        res.set_error("Could not open root certificate");
-        return res;
-    }
-
-    X509 *root_cert;
-    if ((root_cert = PEM_read_X509(root_cert_fp, nullptr, nullptr, nullptr)) ==
-        nullptr) {
-        X509_STORE_free(store);
-        fclose(root_cert_fp);
-        res.set_error("Could not deserialize PEM root certificate");
-        return res;
-    }
-    fclose(root_cert_fp);
-
-    // Add the root certificate as a trusted certificate to the store
-    if (X509_STORE_add_cert(store, root_cert) != 1) {
-        X509_STORE_free(store);
-        X509_free(root_cert);
-        res.set_error("Could not add root certificate to the store");
-        return res;
-    }
-
-    // Verify the received certificate
-    X509_STORE_CTX *ctx;
-    if ((ctx = X509_STORE_CTX_new()) == nullptr) {
-        X509_STORE_free(store);
-        X509_free(root_cert);
-        res.set_error("Could not allocate verification context");
+    // Write it to the BIO as PEM
+    if (BIO_write(bio, pem, pem_len) != (int)pem_len) {
+        res.set_error("Could not write to memory bio");
         return res;
     }
 
-    int err = 0;
-    err |= X509_STORE_CTX_init(ctx, store, cert, nullptr);
-    err |= X509_verify_cert(ctx);
-    if (err != 1) {
-        X509_STORE_free(store);
-        X509_free(root_cert);
-        X509_STORE_CTX_free(ctx);
-        res.set_error("Certificate could not be verified correctly");
+    // and extract it as a X509 struct
+    X509 *certificate = PEM_read_bio_X509(bio, nullptr, 0, nullptr);
+    BIO_reset(bio);
+    if (certificate == nullptr) {
+        res.set_error("Could not read from memory bio");
         return res;
     }
 
-    X509_STORE_CTX_free(ctx);
-    X509_free(root_cert);
-    X509_STORE_free(store);
-
-    // Extract public key from validated certificate
-    EVP_PKEY *pubkey;
-    if ((pubkey = X509_get_pubkey(cert)) == nullptr) {
-        res.set_error("Could not retrieve pubkey from certificate");
-    } else {
-        res.set_result(pubkey);
-    }
-    return res;
+    auto pubkey_res = trust_certificate(certificate);
+    X509_free(certificate);
+    return pubkey_res;
 }
 
-unsigned char *authenticate(int socket, int key_len) {
-    cout << "Username: ";
-    string username;
-    getline(cin, username);
-
+unsigned char *authenticate(const string &username, int key_len,
+                            kex_method method) {
     // Check that the length of the name doesn't exceed the maximum length of a
     // packet field
     if (username.length() + 1 > FLEN_MAX) {
@@ -101,24 +64,38 @@ unsigned char *authenticate(int socket, int key_len) {
     // ---------------------------------------------------------------------- //
 
     // Authentication start
-    auto send_auth_start_header_res = send_header(socket, AuthStart);
+    auto send_auth_start_header_res = send_header(writer, AuthStart);
     if (send_auth_start_header_res.is_error) {
         handle_errors("Incorrect header during authentication (AuthStart)");
     }
 
     // Send the username
     auto send_username_res =
-        send_field(socket, username.length() + 1,
+        send_field(writer, username.length() + 1,
                    reinterpret_cast<unsigned char *>(
                        const_cast<char *>(username.c_str())));
     if (send_username_res.is_error) {
         handle_errors(send_username_res.error);
     }
 
-    // Send the client's half key
-    auto keypair = gen_keypair();
+    // Send the key exchange method and the encoding of the half keys, and
+    // the client's half key for them. The raw encoding is the most compact.
+    kex_encoding encoding = KexEncodingRaw;
+    unsigned char kex_params[] = {(unsigned char)method,
+                                  (unsigned char)encoding};
+    auto send_method_res = send_field(writer, sizeof(kex_params), kex_params);
+    if (send_method_res.is_error) {
+        handle_errors(send_method_res.error);
+    }
+
+    auto keypair_res = kex_gen_keypair(method);
+    if (keypair_res.is_error) {
+        handle_errors(keypair_res.error);
+    }
+    auto keypair = keypair_res.result;
 
 #ifdef DEBUG
+    cout << "Key exchange: " << kex_method_name(method) << endl;
     cout << "Client half key:" << endl;
     PEM_write_PUBKEY(stdout, keypair);
     cout << endl;
@@ -131,46 +108,71 @@ unsigned char *authenticate(int socket, int key_len) {
         handle_errors("Could not create memory bio");
     }
 
-    // Write the half key as PEM into it
-    if (PEM_write_bio_PUBKEY(tmp_bio, keypair) != 1) {
-        EVP_PKEY_free(keypair);
-        BIO_free(tmp_bio);
-        handle_errors("Could not write to memory bio");
-    }
-
-    // Get the length and a pointer to the bio's memory data
-    long client_half_key_len;
-    unsigned char *client_half_key_ptr;
-    if ((client_half_key_len =
-             BIO_get_mem_data(tmp_bio, &client_half_key_ptr)) <= 0) {
+    // Encode the half key, and keep it for later usage (signature
+    // computation/verification)
+    auto client_half_key_res = kex_encode(method, encoding, keypair);
+    if (client_half_key_res.is_error) {
         EVP_PKEY_free(keypair);
         BIO_free(tmp_bio);
-        handle_errors("Could not get access to internal memory of memory bio");
+        handle_errors(client_half_key_res.error);
     }
+    auto [client_half_key_encoded, client_half_key_len] =
+        client_half_key_res.result;
 
     // Check if the size of the public key is less than the maximum size of a
     // packet field
     if (client_half_key_len > FLEN_MAX) {
         EVP_PKEY_free(keypair);
         BIO_free(tmp_bio);
+        delete[] client_half_key_encoded;
         handle_errors(
             "Client's half key is bigger than the maximum field's length");
     }
 
-    // Copy the half key for later usage (signature computation/verification)
-    unsigned char *client_half_key_pem = new unsigned char[client_half_key_len];
-    memcpy(client_half_key_pem, client_half_key_ptr, client_half_key_len);
-
     // Finally send the half key
     auto send_client_half_key_result =
-        send_field(socket, (flen)client_half_key_len, client_half_key_ptr);
+        send_field(writer, (flen)client_half_key_len, client_half_key_encoded);
 
     if (send_client_half_key_result.is_error) {
         EVP_PKEY_free(keypair);
         BIO_free(tmp_bio);
-        delete[] client_half_key_pem;
+        delete[] client_half_key_encoded;
         handle_errors(send_client_half_key_result.error);
     }
+
+    // Send the largest chunk size we can handle, the server picks the one
+    // that both of us can
+    unsigned int client_chunk_size = MAX_CHUNK_SIZE;
+    auto send_chunk_size_res =
+        send_field(writer, sizeof(client_chunk_size),
+                   reinterpret_cast<unsigned char *>(&client_chunk_size));
+    if (send_chunk_size_res.is_error) {
+        EVP_PKEY_free(keypair);
+        BIO_free(tmp_bio);
+        delete[] client_half_key_encoded;
+        handle_errors(send_chunk_size_res.error);
+    }
+
+    // Tell the server which certificate of its we hold, if any, for it to
+    // spare sending it again
+    unsigned char held_fingerprint[FINGERPRINT_LEN];
+    bool holds_certificate = held_certificate(held_fingerprint);
+    auto send_fingerprint_res = send_field(
+        writer, holds_certificate ? FINGERPRINT_LEN : 0, held_fingerprint);
+    if (send_fingerprint_res.is_error) {
+        EVP_PKEY_free(keypair);
+        BIO_free(tmp_bio);
+        delete[] client_half_key_encoded;
+        handle_errors(send_fingerprint_res.error);
+    }
+
+    auto end_auth_start_res = writer_end_message(writer);
+    if (end_auth_start_res.is_error) {
+        EVP_PKEY_free(keypair);
+        BIO_free(tmp_bio);
+        delete[] client_half_key_encoded;
+        handle_errors(end_auth_start_res.error);
+    }
     BIO_reset(tmp_bio);
 
     // ---------------------------------------------------------------------- //
@@ -178,21 +180,21 @@ unsigned char *authenticate(int socket, int key_len) {
     // ---------------------------------------------------------------------- //
 
     // Receive the packet header
-    auto server_header_result = get_mtype(socket);
+    auto server_header_result = get_mtype(reader);
     if (server_header_result.is_error ||
         server_header_result.result != AuthServerAns) {
         EVP_PKEY_free(keypair);
         BIO_free(tmp_bio);
-        delete[] client_half_key_pem;
+        delete[] client_half_key_encoded;
         handle_errors("Incorrect message type");
     }
 
     // Get server name
-    auto server_name_result = read_field(socket);
+    auto server_name_result = read_field(reader);
     if (server_name_result.is_error) {
         EVP_PKEY_free(keypair);
         BIO_free(tmp_bio);
-        delete[] client_half_key_pem;
+        delete[] client_half_key_encoded;
         handle_errors(server_name_result.error);
     }
     auto [server_name_len, server_name] = server_name_result.result;
@@ -203,45 +205,32 @@ unsigned char *authenticate(int socket, int key_len) {
                 server_name_len) != 0) {
         EVP_PKEY_free(keypair);
         BIO_free(tmp_bio);
-        delete[] client_half_key_pem;
-        delete[] server_name;
+        delete[] client_half_key_encoded;
         handle_errors("Server's name is incorrect");
     }
 
-    // Receive server's pubkey in PEM format
-    auto server_half_key_result = read_field(socket);
+    // Receive server's half key
+    auto server_half_key_result = read_field(reader);
     if (server_half_key_result.is_error) {
         EVP_PKEY_free(keypair);
         BIO_free(tmp_bio);
-        delete[] client_half_key_pem;
-        delete[] server_name;
+        delete[] client_half_key_encoded;
         handle_errors(server_half_key_result.error);
     }
-    auto [server_half_key_len, server_half_key_pem] =
+    auto [server_half_key_len, server_half_key_encoded] =
         server_half_key_result.result;
 
-    // Write it to memory bio
-    if (BIO_write(tmp_bio, server_half_key_pem, server_half_key_len) !=
-        server_half_key_len) {
+    // ... and extract it as the server half key, of the same method as ours
+    auto server_half_key_res =
+        kex_decode(method, encoding, server_half_key_encoded,
+                   server_half_key_len);
+    if (server_half_key_res.is_error) {
         EVP_PKEY_free(keypair);
         BIO_free(tmp_bio);
-        delete[] client_half_key_pem;
-        delete[] server_name;
-        delete[] server_half_key_pem;
-        handle_errors("Could not write to memory bio");
+        delete[] client_half_key_encoded;
+        handle_errors(server_half_key_res.error);
     }
-
-    // ... and extract it as the client half key
-    auto server_half_key = PEM_read_bio_PUBKEY(tmp_bio, nullptr, 0, nullptr);
-    if (server_half_key == nullptr) {
-        EVP_PKEY_free(keypair);
-        BIO_free(tmp_bio);
-        delete[] client_half_key_pem;
-        delete[] server_name;
-        delete[] server_half_key_pem;
-        handle_errors("Could not read from memory bio");
-    }
-    BIO_reset(tmp_bio);
+    auto server_half_key = server_half_key_res.result;
 
 #ifdef DEBUG
     cout << "Server half key:" << endl;
@@ -250,13 +239,11 @@ unsigned char *authenticate(int socket, int key_len) {
 #endif
 
     // Receive server's certificate and verify it
-    auto server_certificate_res = read_field(socket);
+    auto server_certificate_res = read_field(reader);
     if (server_certificate_res.is_error) {
         EVP_PKEY_free(keypair);
         BIO_free(tmp_bio);
-        delete[] client_half_key_pem;
-        delete[] server_name;
-        delete[] server_half_key_pem;
+        delete[] client_half_key_encoded;
         EVP_PKEY_free(server_half_key);
         handle_errors(server_certificate_res.error);
     }
@@ -264,77 +251,71 @@ unsigned char *authenticate(int socket, int key_len) {
     auto [server_certificate_len, server_certificate_pem] =
         server_certificate_res.result;
 
-    // Write it to the BIO as PEM
-    if (BIO_write(tmp_bio, server_certificate_pem, server_certificate_len) !=
-        server_certificate_len) {
+    // Unless the server only confirmed that its certificate is still the one
+    // we hold, verify the one it sent, and extract its public key
+    bool certificate_confirmed =
+        holds_certificate && server_certificate_len == FINGERPRINT_LEN &&
+        memcmp(server_certificate_pem, held_fingerprint, FINGERPRINT_LEN) == 0;
+    auto server_pubkey_res =
+        certificate_confirmed
+            ? trusted_key(held_fingerprint)
+            : certificate_key(tmp_bio, server_certificate_pem,
+                              server_certificate_len);
+    if (server_pubkey_res.is_error) {
         EVP_PKEY_free(keypair);
         BIO_free(tmp_bio);
-        delete[] client_half_key_pem;
-        delete[] server_name;
-        delete[] server_half_key_pem;
+        delete[] client_half_key_encoded;
         EVP_PKEY_free(server_half_key);
-        delete[] server_certificate_pem;
-        handle_errors("Could not write to memory bio");
+        handle_errors(server_pubkey_res.error);
     }
+    auto server_pubkey = server_pubkey_res.result;
 
-    // and extract it as a X509 struct
-    X509 *server_certificate;
-    if ((server_certificate =
-             PEM_read_bio_X509(tmp_bio, nullptr, 0, nullptr)) == nullptr) {
+    // Receive server's digital signature and verify it
+    auto server_signature_res = read_field(reader);
+    if (server_signature_res.is_error) {
         EVP_PKEY_free(keypair);
         BIO_free(tmp_bio);
-        delete[] client_half_key_pem;
-        delete[] server_name;
-        delete[] server_half_key_pem;
+        delete[] client_half_key_encoded;
         EVP_PKEY_free(server_half_key);
-        delete[] server_certificate_pem;
-        handle_errors("Could not read from memory bio");
+        EVP_PKEY_free(server_pubkey);
+        handle_errors(server_signature_res.error);
     }
-    delete[] server_certificate_pem;
-    BIO_reset(tmp_bio);
 
-    // Verify and extract the public key of the server from the received
-    // certificate
-    auto server_pubkey_res = verify_certificate_and_get_key(server_certificate);
-    if (server_pubkey_res.is_error) {
+    auto [server_signature_len, server_signature] = server_signature_res.result;
+
+    // Receive the chunk size the server agreed on, covered by the signature
+    auto chunk_size_res = read_field(reader);
+    if (chunk_size_res.is_error) {
         EVP_PKEY_free(keypair);
         BIO_free(tmp_bio);
-        delete[] client_half_key_pem;
-        delete[] server_name;
-        delete[] server_half_key_pem;
+        delete[] client_half_key_encoded;
         EVP_PKEY_free(server_half_key);
-        X509_free(server_certificate);
-        handle_errors(server_pubkey_res.error);
+        EVP_PKEY_free(server_pubkey);
+        handle_errors(chunk_size_res.error);
     }
+    auto [chunk_size_len, chunk_size_view] = chunk_size_res.result;
 
-    X509_free(server_certificate);
-    auto server_pubkey = server_pubkey_res.result;
-
-    // Receive server's digital signature and verify it
-    auto server_signature_res = read_field(socket);
-    if (server_signature_res.is_error) {
+    unsigned int server_chunk_size = 0;
+    if (chunk_size_len == sizeof(server_chunk_size)) {
+        memcpy(&server_chunk_size, chunk_size_view, chunk_size_len);
+    }
+    if (server_chunk_size < CHUNK_SIZE ||
+        server_chunk_size > client_chunk_size) {
         EVP_PKEY_free(keypair);
         BIO_free(tmp_bio);
-        delete[] client_half_key_pem;
-        delete[] server_name;
-        delete[] server_half_key_pem;
+        delete[] client_half_key_encoded;
         EVP_PKEY_free(server_half_key);
         EVP_PKEY_free(server_pubkey);
-        handle_errors(server_signature_res.error);
+        handle_errors("Invalid chunk size");
     }
 
-    auto [server_signature_len, server_signature] = server_signature_res.result;
-
     // Create and initialize the verification context
     EVP_MD_CTX *signature_ctx;
     if ((signature_ctx = EVP_MD_CTX_new()) == nullptr) {
         EVP_PKEY_free(keypair);
         BIO_free(tmp_bio);
-        delete[] client_half_key_pem;
-        delete[] server_name;
-        delete[] server_half_key_pem;
+        delete[] client_half_key_encoded;
         EVP_PKEY_free(server_half_key);
-        delete[] server_signature;
         EVP_PKEY_free(server_pubkey);
         handle_errors("Signature verification failed (alloc)");
     }
@@ -342,21 +323,23 @@ unsigned char *authenticate(int socket, int key_len) {
     EVP_VerifyInit(signature_ctx, get_hash_type());
 
     int err = 0;
-    err |= EVP_VerifyUpdate(signature_ctx, client_half_key_pem,
+    err |= EVP_VerifyUpdate(signature_ctx, kex_params, sizeof(kex_params));
+    err |= EVP_VerifyUpdate(signature_ctx, client_half_key_encoded,
                             client_half_key_len);
-    err |= EVP_VerifyUpdate(signature_ctx, server_half_key_pem,
+    err |= EVP_VerifyUpdate(signature_ctx, server_half_key_encoded,
                             server_half_key_len);
     err |= EVP_VerifyUpdate(signature_ctx, username.c_str(),
                             username.length() + 1);
+    err |= EVP_VerifyUpdate(signature_ctx, &client_chunk_size,
+                            sizeof(client_chunk_size));
+    err |= EVP_VerifyUpdate(signature_ctx, &server_chunk_size,
+                            sizeof(server_chunk_size));
 
     if (err != 1) {
         EVP_PKEY_free(keypair);
         BIO_free(tmp_bio);
-        delete[] client_half_key_pem;
-        delete[] server_name;
-        delete[] server_half_key_pem;
+        delete[] client_half_key_encoded;
         EVP_PKEY_free(server_half_key);
-        delete[] server_signature;
         EVP_MD_CTX_free(signature_ctx);
         EVP_PKEY_free(server_pubkey);
         handle_errors("Signature verification failed (update)");
@@ -367,11 +350,8 @@ unsigned char *authenticate(int socket, int key_len) {
                         server_pubkey) != 1) {
         EVP_PKEY_free(keypair);
         BIO_free(tmp_bio);
-        delete[] client_half_key_pem;
-        delete[] server_name;
-        delete[] server_half_key_pem;
+        delete[] client_half_key_encoded;
         EVP_PKEY_free(server_half_key);
-        delete[] server_signature;
         EVP_MD_CTX_free(signature_ctx);
         EVP_PKEY_free(server_pubkey);
         handle_errors("Signature verification failed (final)");
@@ -379,53 +359,25 @@ unsigned char *authenticate(int socket, int key_len) {
 
     EVP_PKEY_free(server_pubkey);
     EVP_MD_CTX_reset(signature_ctx);
-    delete[] server_signature;
 
     // Computes shared secret
-    EVP_PKEY_CTX *shared_secret_ctx;
-    if ((shared_secret_ctx = EVP_PKEY_CTX_new(keypair, nullptr)) == nullptr) {
-        EVP_PKEY_free(keypair);
-        BIO_free(tmp_bio);
-        delete[] client_half_key_pem;
-        delete[] server_name;
-        delete[] server_half_key_pem;
-        EVP_PKEY_free(server_half_key);
-        handle_errors("Shared secret creation failed (alloc)");
-    }
-
-    err = 0;
-    err |= EVP_PKEY_derive_init(shared_secret_ctx);
-    err |= EVP_PKEY_derive_set_peer(shared_secret_ctx, server_half_key);
-
-    // Get the length of the shared secret
-    size_t shared_secret_len;
-    err |= EVP_PKEY_derive(shared_secret_ctx, NULL, &shared_secret_len);
-
-    // Compute the shared secret
-    unsigned char *shared_secret = new unsigned char[shared_secret_len];
-    err |=
-        EVP_PKEY_derive(shared_secret_ctx, shared_secret, &shared_secret_len);
-
-    if (err != 1) {
+    auto shared_secret_res = kex_derive(keypair, server_half_key);
+    EVP_PKEY_free(server_half_key);
+    if (shared_secret_res.is_error) {
         EVP_PKEY_free(keypair);
         BIO_free(tmp_bio);
-        delete[] client_half_key_pem;
-        delete[] server_name;
-        delete[] server_half_key_pem;
-        EVP_PKEY_CTX_free(shared_secret_ctx);
-        handle_errors("Shared secret creation failed");
+        delete[] client_half_key_encoded;
+        EVP_MD_CTX_free(signature_ctx);
+        handle_errors(shared_secret_res.error);
     }
-    EVP_PKEY_free(server_half_key);
-    EVP_PKEY_CTX_free(shared_secret_ctx);
+    auto [shared_secret, shared_secret_len] = shared_secret_res.result;
 
     // Finally, derive the symmetric key from the shared secret
     auto key_res = kdf(shared_secret, shared_secret_len, key_len);
     if (key_res.is_error) {
         EVP_PKEY_free(keypair);
         BIO_free(tmp_bio);
-        delete[] client_half_key_pem;
-        delete[] server_name;
-        delete[] server_half_key_pem;
+        delete[] client_half_key_encoded;
         handle_errors("Shared secret creation failed");
     }
     auto key = key_res.result;
@@ -434,13 +386,11 @@ unsigned char *authenticate(int socket, int key_len) {
     // ---------------------------------------------------------------------- //
 
     // Send packet header
-    auto send_last_header_res = send_header(socket, AuthClientAns);
+    auto send_last_header_res = send_header(writer, AuthClientAns);
     if (send_last_header_res.is_error) {
         EVP_PKEY_free(keypair);
         BIO_free(tmp_bio);
-        delete[] client_half_key_pem;
-        delete[] server_name;
-        delete[] server_half_key_pem;
+        delete[] client_half_key_encoded;
         handle_errors("Could not send header");
     }
 
@@ -450,17 +400,17 @@ unsigned char *authenticate(int socket, int key_len) {
     EVP_SignInit(signature_ctx, get_hash_type());
 
     err = 0;
-    err |=
-        EVP_SignUpdate(signature_ctx, server_half_key_pem, server_half_key_len);
-    err |=
-        EVP_SignUpdate(signature_ctx, client_half_key_pem, client_half_key_len);
+    err |= EVP_SignUpdate(signature_ctx, server_half_key_encoded,
+                          server_half_key_len);
+    err |= EVP_SignUpdate(signature_ctx, client_half_key_encoded,
+                          client_half_key_len);
     err |= EVP_SignUpdate(signature_ctx, server_name, server_name_len);
+    err |= EVP_SignUpdate(signature_ctx, &server_chunk_size,
+                          sizeof(server_chunk_size));
     if (err != 1) {
         EVP_PKEY_free(keypair);
         BIO_free(tmp_bio);
-        delete[] client_half_key_pem;
-        delete[] server_name;
-        delete[] server_half_key_pem;
+        delete[] client_half_key_encoded;
         EVP_MD_CTX_free(signature_ctx);
         handle_errors("Could not sign correctly (update)");
     }
@@ -472,9 +422,7 @@ unsigned char *authenticate(int socket, int key_len) {
         nullptr) {
         EVP_PKEY_free(keypair);
         BIO_free(tmp_bio);
-        delete[] client_half_key_pem;
-        delete[] server_name;
-        delete[] server_half_key_pem;
+        delete[] client_half_key_encoded;
         EVP_MD_CTX_free(signature_ctx);
         handle_errors("Could not open client's private key");
     }
@@ -485,9 +433,7 @@ unsigned char *authenticate(int socket, int key_len) {
              client_private_key_fp, nullptr, 0, nullptr)) == nullptr) {
         EVP_PKEY_free(keypair);
         BIO_free(tmp_bio);
-        delete[] client_half_key_pem;
-        delete[] server_name;
-        delete[] server_half_key_pem;
+        delete[] client_half_key_encoded;
         EVP_MD_CTX_free(signature_ctx);
         fclose(client_private_key_fp);
         handle_errors("Could not read client's private key");
@@ -504,9 +450,7 @@ unsigned char *authenticate(int socket, int key_len) {
                       client_private_key) != 1) {
         EVP_PKEY_free(keypair);
         BIO_free(tmp_bio);
-        delete[] client_half_key_pem;
-        delete[] server_name;
-        delete[] server_half_key_pem;
+        delete[] client_half_key_encoded;
         delete[] client_signature;
         EVP_PKEY_free(client_private_key);
         EVP_MD_CTX_free(signature_ctx);
@@ -515,9 +459,7 @@ unsigned char *authenticate(int socket, int key_len) {
 
     EVP_PKEY_free(client_private_key);
     EVP_MD_CTX_free(signature_ctx);
-    delete[] server_half_key_pem;
-    delete[] client_half_key_pem;
-    delete[] server_name;
+    delete[] client_half_key_encoded;
 
     // Check if the size of the signature is less than the maximum size of a
     // packet field
@@ -530,17 +472,237 @@ unsigned char *authenticate(int socket, int key_len) {
 
     // Send the signature to the server
     auto send_client_signature_res =
-        send_field(socket, (flen)client_signature_len, client_signature);
+        send_field(writer, (flen)client_signature_len, client_signature);
     if (send_client_signature_res.is_error) {
         EVP_PKEY_free(keypair);
         BIO_free(tmp_bio);
         handle_errors(send_client_signature_res.error);
     }
 
+    auto end_client_ans_res = writer_end_message(writer);
+    if (end_client_ans_res.is_error) {
+        EVP_PKEY_free(keypair);
+        BIO_free(tmp_bio);
+        handle_errors(end_client_ans_res.error);
+    }
+
     // Free up memory that is no longer needed
     delete[] client_signature;
     EVP_PKEY_free(keypair);
     BIO_free(tmp_bio);
 
+    chunk_size = server_chunk_size;
+    return key;
+}
+
+/* Where the ticket of [username] is kept, along with its secret */
+static string ticket_path(const string &username) {
+    return "certificates/" + username + ".ticket";
+}
+
+// The sessions of all threads share the ticket, each one replacing it with
+// the ticket it is given
+static mutex ticket_lock;
+
+unsigned char *resume(const string &username, int key_len) {
+    // The secret, followed by the ticket
+    unique_lock<mutex> guard(ticket_lock);
+    ifstream file(ticket_path(username), ios::binary);
+    if (!file) {
+        return nullptr;
+    }
+    string stored((istreambuf_iterator<char>(file)),
+                  istreambuf_iterator<char>());
+    file.close();
+    guard.unlock();
+    if (stored.size() <= RESUMPTION_SECRET_LEN ||
+        username.length() + 1 > FLEN_MAX) {
+        return nullptr;
+    }
+    auto *secret = reinterpret_cast<unsigned char *>(stored.data());
+    auto *ticket = secret + RESUMPTION_SECRET_LEN;
+    size_t ticket_len = stored.size() - RESUMPTION_SECRET_LEN;
+
+    unsigned char client_nonce[RESUME_NONCE_LEN];
+    if (RAND_bytes(client_nonce, sizeof(client_nonce)) != 1) {
+        explicit_bzero(stored.data(), stored.size());
+        handle_errors("Could not generate nonce");
+    }
+
+    // ---------------------------------------------------------------------- //
+    // --------------- Client's resumption request to Server ---------------- //
+    // ---------------------------------------------------------------------- //
+
+    auto send_header_res = send_header(writer, ResumeStart);
+    if (send_header_res.is_error) {
+        explicit_bzero(stored.data(), stored.size());
+        handle_errors(send_header_res.error);
+    }
+
+    auto send_username_res =
+        send_field(writer, username.length() + 1,
+                   reinterpret_cast<unsigned char *>(
+                       const_cast<char *>(username.c_str())));
+    if (send_username_res.is_error) {
+        explicit_bzero(stored.data(), stored.size());
+        handle_errors(send_username_res.error);
+    }
+
+    auto send_ticket_res = send_field(writer, (flen)ticket_len, ticket);
+    if (send_ticket_res.is_error) {
+        explicit_bzero(stored.data(), stored.size());
+        handle_errors(send_ticket_res.error);
+    }
+
+    auto send_nonce_res =
+        send_field(writer, sizeof(client_nonce), client_nonce);
+    if (send_nonce_res.is_error) {
+        explicit_bzero(stored.data(), stored.size());
+        handle_errors(send_nonce_res.error);
+    }
+
+    unsigned int client_chunk_size = MAX_CHUNK_SIZE;
+    auto send_chunk_size_res =
+        send_field(writer, sizeof(client_chunk_size),
+                   reinterpret_cast<unsigned char *>(&client_chunk_size));
+    if (send_chunk_size_res.is_error) {
+        explicit_bzero(stored.data(), stored.size());
+        handle_errors(send_chunk_size_res.error);
+    }
+
+    auto end_message_res = writer_end_message(writer);
+    if (end_message_res.is_error) {
+        explicit_bzero(stored.data(), stored.size());
+        handle_errors(end_message_res.error);
+    }
+
+    // ---------------------------------------------------------------------- //
+    // ------------------ Server's response to the Client ------------------- //
+    // ---------------------------------------------------------------------- //
+
+    auto mtype_res = get_mtype(reader);
+    if (mtype_res.is_error) {
+        explicit_bzero(stored.data(), stored.size());
+        handle_errors(mtype_res.error);
+    }
+
+    // The ticket is of no use anymore, most likely because it expired
+    if (mtype_res.result == Error) {
+        explicit_bzero(stored.data(), stored.size());
+        remove(ticket_path(username).c_str());
+        return nullptr;
+    }
+    if (mtype_res.result != ResumeAns) {
+        explicit_bzero(stored.data(), stored.size());
+        handle_errors("Incorrect message type");
+    }
+
+    auto server_nonce_res = read_field(reader);
+    if (server_nonce_res.is_error) {
+        explicit_bzero(stored.data(), stored.size());
+        handle_errors(server_nonce_res.error);
+    }
+    auto [server_nonce_len, server_nonce] = server_nonce_res.result;
+
+    auto chunk_size_res = read_field(reader);
+    if (chunk_size_res.is_error) {
+        explicit_bzero(stored.data(), stored.size());
+        handle_errors(chunk_size_res.error);
+    }
+    auto [chunk_size_len, chunk_size_view] = chunk_size_res.result;
+
+    auto confirm_res = read_field(reader);
+    if (confirm_res.is_error) {
+        explicit_bzero(stored.data(), stored.size());
+        handle_errors(confirm_res.error);
+    }
+    auto [confirm_len, confirm] = confirm_res.result;
+
+    unsigned int server_chunk_size = 0;
+    if (chunk_size_len == sizeof(server_chunk_size)) {
+        memcpy(&server_chunk_size, chunk_size_view, chunk_size_len);
+    }
+    if (server_nonce_len != RESUME_NONCE_LEN ||
+        confirm_len != RESUME_CONFIRM_LEN || server_chunk_size < CHUNK_SIZE ||
+        server_chunk_size > client_chunk_size) {
+        explicit_bzero(stored.data(), stored.size());
+        handle_errors("Invalid resumption answer");
+    }
+
+    // The confirmation proves that the server could read the ticket, and
+    // covers its nonce and the chunk size
+    unsigned char expected[RESUME_CONFIRM_LEN];
+    auto key_res =
+        derive_resumed_key(secret, client_nonce, server_nonce, username.c_str(),
+                           server_chunk_size, key_len, expected);
+    explicit_bzero(stored.data(), stored.size());
+    if (key_res.is_error) {
+        handle_errors(key_res.error);
+    }
+    auto key = key_res.result;
+
+    if (CRYPTO_memcmp(expected, confirm, RESUME_CONFIRM_LEN) != 0) {
+        explicit_bzero(key, key_len);
+        delete[] key;
+        handle_errors("Resumption could not be confirmed");
+    }
+
+    chunk_size = server_chunk_size;
     return key;
 }
+
+void receive_ticket(const string &username, unsigned char *secret) {
+    auto mtype_res = get_mtype(reader);
+    if (mtype_res.is_error || mtype_res.result != NewTicket) {
+        explicit_bzero(secret, RESUMPTION_SECRET_LEN);
+        handle_errors("Incorrect message type");
+    }
+
+    auto header_res = read_header(reader);
+    if (header_res.is_error || header_res.result != recv_seq) {
+        explicit_bzero(secret, RESUMPTION_SECRET_LEN);
+        handle_errors("Incorrect sequence number");
+    }
+
+    auto ct_res = read_field(reader);
+    if (ct_res.is_error) {
+        explicit_bzero(secret, RESUMPTION_SECRET_LEN);
+        handle_errors(ct_res.error);
+    }
+    auto [ticket_len, ct] = ct_res.result;
+
+    auto tag_res = read_tag(reader);
+    if (tag_res.is_error) {
+        explicit_bzero(secret, RESUMPTION_SECRET_LEN);
+        handle_errors(tag_res.error);
+    }
+
+    unsigned char *ticket = new unsigned char[ticket_len];
+    auto open_res =
+        aead_open(aead, NewTicket, recv_seq, ct, ticket_len, tag_res.result,
+                  ticket);
+    if (open_res.is_error) {
+        explicit_bzero(secret, RESUMPTION_SECRET_LEN);
+        delete[] ticket;
+        handle_errors(open_res.error);
+    }
+    inc_seqnum(recv_seq);
+
+    // Only the user can read the secret. Failing to keep it just means a full
+    // authentication next time.
+    lock_guard<mutex> guard(ticket_lock);
+    int fd = open(ticket_path(username).c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                  0600);
+    if (fd >= 0) {
+        bool ok = write(fd, secret, RESUMPTION_SECRET_LEN) ==
+                      RESUMPTION_SECRET_LEN &&
+                  write(fd, ticket, ticket_len) == (ssize_t)ticket_len;
+        close(fd);
+        if (!ok) {
+            remove(ticket_path(username).c_str());
+        }
+    }
+
+    explicit_bzero(secret, RESUMPTION_SECRET_LEN);
+    delete[] ticket;
+}
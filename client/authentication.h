@@ -1,14 +1,36 @@
+#include "../common/kex.h"
+#include "../common/resumption.h"
 #include <openssl/bio.h>
 #include <openssl/evp.h>
+#include <string>
+
+using namespace std;
 
 #ifndef authentication_h
 #define authentication_h
 /*
- * Runs the authentication protocol with the entity on the other side of the
- * passed socket.
+ * Runs the authentication protocol as [username] with the entity on the other
+ * side of the connection, agreeing on the key with the key exchange [method].
  *
  * Returns the key shared with the other party of len [key_len], if the run was
- * successful. If the run failed, it aborts the program execution.
+ * successful, and sets the chunk size agreed on with it. If the run failed, it
+ * aborts the program execution.
+ */
+unsigned char *authenticate(const string &username, int key_len,
+                            kex_method method);
+
+/*
+ * Resumes a previous session of [username] with the ticket the server gave
+ * us, if any. Returns the key of the new session, of len [key_len], and sets
+ * the chunk size agreed on; or null if there is no ticket or the server turned
+ * it down, in which case the connection is left for a full authentication.
+ */
+unsigned char *resume(const string &username, int key_len);
+
+/*
+ * Receives the ticket the server sends at the start of every session, and
+ * keeps it along with the resumption [secret] of the session, for the next
+ * connection of [username]
  */
-unsigned char *authenticate(int socket, int key_len);
+void receive_ticket(const string &username, unsigned char *secret);
 #endif
@@ -8,7 +8,9 @@
 #include "actions/rename.h"
 #include "actions/upload.h"
 #include "authentication.h"
+#include "client.h"
 #include <arpa/inet.h>
+#include <chrono>
 #include <iostream>
 #include <openssl/bio.h>
 #include <signal.h>
@@ -23,17 +25,30 @@
 
 using namespace std;
 
-int sock;
-unsigned char *shared_key;
+thread_local int sock;
+thread_local seqnum send_seq = 0;
+thread_local seqnum recv_seq = 0;
+thread_local Aead *aead;
+thread_local unsigned int chunk_size = CHUNK_SIZE;
+thread_local Reader *reader;
+thread_local Writer *writer;
 
-void signal_handler(int signum) {
-    logout(sock, shared_key);
-    explicit_bzero(shared_key, get_symmetric_key_length());
-    delete[] shared_key;
+// Who the user is and how the sessions are opened, for the ones opened along
+// the first
+static string session_username;
+static kex_method session_method;
+static bool session_resumption;
+
+/* Logs out of the server, then exits */
+void quit() {
+    logout(aead);
+    free_aead(aead);
     close(sock);
     exit(EXIT_SUCCESS);
 }
 
+void signal_handler(int signum) { quit(); }
+
 void greet_user() {
     // Thanks to https://fsymbols.com/generators/carty/
     cout << "\
@@ -52,29 +67,175 @@ void print_menu() {
     cout << "    list     - List your files" << endl;
     cout << "    upload   - Upload a new file" << endl;
     cout << "    download - Download a file" << endl;
+    cout << "    part     - Download some bytes of a file" << endl;
+    cout << "    parallel - Download a file over several connections" << endl;
     cout << "    rename   - Rename a file" << endl;
     cout << "    delete   - Delete a file" << endl;
     cout << "    exit     - Terminate current session" << endl;
     cout << "> ";
 }
 
-/* Loop for the user to interact with the server. */
-void interact() {
-    string action;
-    int key_len;
+/*
+ * Authenticates the user on the connection of the calling thread, or resumes
+ * their previous session if allowed, and sets up the encryption contexts.
+ * Returns whether the session was resumed.
+ */
+static bool start_session() {
+    int key_len = get_symmetric_key_length();
+
+    unsigned char *shared_key = nullptr;
+    if (session_resumption) {
+        shared_key = resume(session_username, key_len);
+    }
+    bool resumed = shared_key != nullptr;
+    if (!resumed) {
+        shared_key = authenticate(session_username, key_len, session_method);
+    }
+#ifdef DEBUG
+    cout << "Shared key: ";
+    print_debug(shared_key, key_len);
+    cout << endl;
+#endif
+
+    // The key is only needed to set up the encryption contexts, and the
+    // secret to resume the session next time
+    unsigned char secret[RESUMPTION_SECRET_LEN];
+    auto secret_res = derive_resumption_secret(shared_key, key_len, secret);
+    auto aead_res = new_aead(shared_key, key_len, ClientToServer);
+    explicit_bzero(shared_key, key_len);
+    delete[] shared_key;
+    if (aead_res.is_error) {
+        explicit_bzero(secret, sizeof(secret));
+        handle_errors(aead_res.error);
+    }
+    aead = aead_res.result;
+    if (secret_res.is_error) {
+        handle_errors(secret_res.error);
+    }
+
+    // The server opens the session with a ticket for the next one
+    receive_ticket(session_username, secret);
+    return resumed;
+}
 
-    key_len = get_symmetric_key_length();
+/* Connects to the server, returning the socket or -1 */
+static int connect_to_server() {
+    struct sockaddr_in serv_addr;
+
+    // Create the socket
+    int server_sock;
+    if ((server_sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("Socket creation failed");
+        return -1;
+    }
+
+    // Set socket address and port
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(PORT);
+
+    // Convert IPv4 and IPv6 addresses from text to binary
+    // form
+    if (inet_pton(AF_INET, ADDRESS, &serv_addr.sin_addr) <= 0) {
+        perror("Cannot convert address");
+        close(server_sock);
+        return -1;
+    }
+
+    // Connect to the server
+    if (connect(server_sock, (struct sockaddr *)&serv_addr,
+                sizeof(serv_addr)) < 0) {
+        perror("Cannot connect to server");
+        close(server_sock);
+        return -1;
+    }
+    return server_sock;
+}
+
+/* Frees the session of the calling thread, without logging out of it */
+static void drop_session() {
+    free_aead(aead);
+    free_reader(reader);
+    free_writer(writer);
+    aead = nullptr;
+    reader = nullptr;
+    writer = nullptr;
+    if (sock >= 0) {
+        close(sock);
+    }
+    sock = -1;
+}
+
+/*
+ * Connects the calling thread to the server and opens a session on the
+ * connection. Returns false, leaving the thread without a session, if it could
+ * not.
+ */
+static bool connect_session() {
+    send_seq = 0;
+    recv_seq = 0;
+    if ((sock = connect_to_server()) < 0)
+        return false;
+    reader = new_reader(sock);
+    writer = new_writer(sock);
+
+    try {
+        start_session();
+    } catch (char const *ex) {
+        drop_session();
+        return false;
+    }
+    return true;
+}
+
+bool open_session() {
+    // SIGINT is left to the first thread, which logs out of the first session
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    return connect_session();
+}
+
+bool reopen_session() {
+    drop_session();
+    return connect_session();
+}
+
+void close_session() {
+    // The session may be broken already: it is closed all the same
+    try {
+        logout(aead);
+    } catch (char const *ex) {
+    }
+    drop_session();
+}
+
+/*
+ * Loop for the user to interact with the server, once authenticated with the
+ * key exchange [method], or by resuming the previous session if [resumption]
+ * is allowed. If [timed], the time the handshake took is reported.
+ */
+void interact(kex_method method, bool resumption, bool timed) {
+    string action;
 
     // First of all, the user must run the authentication protocol with the
     // other party (hopefully the server). The exchange also provides a shared
     // ephemeral key to use for further communications.
     try {
-        shared_key = authenticate(sock, key_len);
-#ifdef DEBUG
-        cout << "Shared key: ";
-        print_debug(shared_key, key_len);
-        cout << endl;
-#endif
+        cout << "Username: ";
+        getline(cin, session_username);
+        session_method = method;
+        session_resumption = resumption;
+
+        auto start = chrono::steady_clock::now();
+        bool resumed = start_session();
+        if (timed) {
+            chrono::duration<double, milli> elapsed =
+                chrono::steady_clock::now() - start;
+            cout << "Handshake (" << (resumed ? "resumed" : "full")
+                 << "): " << elapsed.count() << " ms" << endl;
+        }
 
         // Interaction loop. The user can perform a set of actions, until he
         // decides to terminate the session.
@@ -84,18 +245,27 @@ void interact() {
                 cout << "Error reading input!" << endl;
             }
 
+            // Long sessions move on to the next key in between two actions
+            if (aead_needs_update(aead, send_seq)) {
+                send_key_update(writer, aead, send_seq);
+            }
+
             if (action == "list") {
-                list_files(sock, shared_key);
+                list_files(aead);
             } else if (action == "upload") {
-                upload(sock, shared_key);
+                upload(aead);
             } else if (action == "download") {
-                download(sock, shared_key);
+                download(aead);
+            } else if (action == "part") {
+                download_ranges(aead);
+            } else if (action == "parallel") {
+                download_parallel(aead);
             } else if (action == "rename") {
-                rename(sock, shared_key);
+                rename(aead);
             } else if (action == "delete") {
-                delete_file(sock, shared_key);
+                delete_file(aead);
             } else if (action == "exit") {
-                kill(getpid(), SIGUSR1);
+                quit();
             } else {
                 cout << "Invalid action!" << endl;
             }
@@ -111,44 +281,65 @@ void interact() {
     }
 }
 
-int main() {
-    struct sockaddr_in serv_addr;
-
-    // Register signal handler to gracefully close on SIGINT
-    signal(SIGINT, signal_handler);
+void print_usage(char *name) {
+    cerr << "Usage: " << name << " [-k method] [-f] [-t]" << endl;
+    cerr << "    -k  Key exchange method, x25519 or ffdh2048 (default: "
+         << kex_method_name(DEFAULT_KEX_METHOD) << ")" << endl;
+    cerr << "    -f  Always run the full authentication, even with a ticket to "
+            "resume"
+         << endl;
+    cerr << "    -t  Report the time the handshake took" << endl;
+}
 
-    // Register signal handler to gracefully close on SIGUSR1 (before sequence
-    // number wraps)
-    signal(SIGUSR1, signal_handler);
+int main(int argc, char *argv[]) {
+    kex_method method = DEFAULT_KEX_METHOD;
+    bool resumption = true;
+    bool timed = false;
 
-    // Create the socket
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("Socket creation failed");
-        exit(EXIT_FAILURE);
+    int opt;
+    while ((opt = getopt(argc, argv, "k:ft")) != -1) {
+        switch (opt) {
+        case 'k': {
+            auto method_res = kex_method_from_name(optarg);
+            if (method_res.is_error) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            method = method_res.result;
+            break;
+        }
+        case 'f':
+            resumption = false;
+            break;
+        case 't':
+            timed = true;
+            break;
+        default:
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
     }
 
-    // Set socket address and port
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(PORT);
+    // Register signal handler to gracefully close on SIGINT
+    signal(SIGINT, signal_handler);
 
-    // Convert IPv4 and IPv6 addresses from text to binary
-    // form
-    if (inet_pton(AF_INET, "127.0.0.1", &serv_addr.sin_addr) <= 0) {
-        perror("Cannot convert address");
-        exit(EXIT_FAILURE);
-    }
+    // A server going away must not kill the client, which reconnects
+    signal(SIGPIPE, SIG_IGN);
 
     // Connect to the server
-    if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
-        perror("Cannot connect to server");
+    if ((sock = connect_to_server()) < 0) {
         exit(EXIT_FAILURE);
     }
+    reader = new_reader(sock);
+    writer = new_writer(sock);
 
     greet_user();
 
     // Start interacting with the server
-    interact();
+    interact(method, resumption, timed);
 
     // Close socket when we are done
+    free_reader(reader);
+    free_writer(writer);
     close(sock);
 }
@@ -0,0 +1,51 @@
+#include "../common/aead.h"
+#include "../common/reader.h"
+#include "../common/types.h"
+#include "../common/writer.h"
+
+#ifndef client_h
+#define client_h
+
+/*
+ * The state of the connection to the server below belongs to the thread using
+ * it: the first session is the main thread's, and any other thread can open
+ * one of its own, to carry out a part of a transfer.
+ */
+
+/*
+ * Sequence numbers of the next message to the server and from it, each
+ * direction counting on its own
+ */
+extern thread_local seqnum send_seq;
+extern thread_local seqnum recv_seq;
+
+/* Contexts encrypting the messages, keyed with the shared key */
+extern thread_local Aead *aead;
+
+/* Size of the chunks of the transfers, agreed on with the server */
+extern thread_local unsigned int chunk_size;
+
+/* Bytes received from the server and not read yet */
+extern thread_local Reader *reader;
+
+/* Messages for the server not sent yet */
+extern thread_local Writer *writer;
+
+/*
+ * Opens another session with the server for the calling thread, as the same
+ * user and the same way as the first one. Returns false if it could not be
+ * opened.
+ */
+bool open_session();
+
+/*
+ * Replaces the session of the calling thread, whose connection dropped, with
+ * a new one as the same user. Returns false if it could not be opened, leaving
+ * the thread without a session.
+ */
+bool reopen_session();
+
+/* Logs out of the session of the calling thread, and closes it */
+void close_session();
+
+#endif
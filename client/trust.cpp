@@ -0,0 +1,278 @@
+#include "trust.h"
+#include <openssl/pem.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+#define ROOT_CERTIFICATE_PATH "certificates/rootCA.crt"
+#define VERIFIED_CERTIFICATE_PATH "certificates/server.verified.crt"
+
+static TrustCache trust;
+
+TrustCache::~TrustCache() {
+    for (auto &[fingerprint, trusted] : verified) {
+        X509_free(trusted.cert);
+        EVP_PKEY_free(trusted.pubkey);
+    }
+    X509_STORE_free(store);
+}
+
+/* Loads the root certificate into the store, the first time only */
+static Maybe<X509_STORE *> get_store() {
+    Maybe<X509_STORE *> res;
+
+    if (trust.store != nullptr) {
+        res.set_result(trust.store);
+        return res;
+    }
+
+    // Allocate store
+    X509_STORE *store;
+    if ((store = X509_STORE_new()) == nullptr) {
+        res.set_error("Could not allocate X509 store");
+        return res;
+    }
+
+    // Load root certificate
+    FILE *root_cert_fp;
+    if ((root_cert_fp = fopen(ROOT_CERTIFICATE_PATH, "r")) == nullptr) {
+        X509_STORE_free(store);
+        res.set_error("Could not open root certificate");
+        return res;
+    }
+
+    X509 *root_cert;
+    if ((root_cert = PEM_read_X509(root_cert_fp, nullptr, nullptr, nullptr)) ==
+        nullptr) {
+        X509_STORE_free(store);
+        fclose(root_cert_fp);
+        res.set_error("Could not deserialize PEM root certificate");
+        return res;
+    }
+    fclose(root_cert_fp);
+
+    // Add the root certificate as a trusted certificate to the store, which
+    // takes a reference of its own
+    if (X509_STORE_add_cert(store, root_cert) != 1) {
+        X509_STORE_free(store);
+        X509_free(root_cert);
+        res.set_error("Could not add root certificate to the store");
+        return res;
+    }
+    X509_free(root_cert);
+
+    trust.store = store;
+    res.set_result(store);
+    return res;
+}
+
+Maybe<bool> certificate_fingerprint(X509 *cert, unsigned char *fingerprint) {
+    Maybe<bool> res;
+
+    unsigned int len;
+    if (X509_digest(cert, EVP_sha256(), fingerprint, &len) != 1 ||
+        len != FINGERPRINT_LEN) {
+        res.set_error("Could not compute certificate fingerprint");
+        return res;
+    }
+
+    res.set_result(true);
+    return res;
+}
+
+/* Verifies [cert] against the root certificate */
+static Maybe<bool> verify(X509 *cert) {
+    Maybe<bool> res;
+
+    auto store_res = get_store();
+    if (store_res.is_error) {
+        res.set_error(store_res.error);
+        return res;
+    }
+
+    X509_STORE_CTX *ctx;
+    if ((ctx = X509_STORE_CTX_new()) == nullptr) {
+        res.set_error("Could not allocate verification context");
+        return res;
+    }
+
+    if (X509_STORE_CTX_init(ctx, store_res.result, cert, nullptr) != 1 ||
+        X509_verify_cert(ctx) != 1) {
+        X509_STORE_CTX_free(ctx);
+        res.set_error("Certificate could not be verified correctly");
+        return res;
+    }
+    X509_STORE_CTX_free(ctx);
+
+    res.set_result(true);
+    return res;
+}
+
+/* Remembers [cert], already verified, under its [fingerprint] */
+static Maybe<TrustedCertificate> remember(X509 *cert,
+                                          const string &fingerprint) {
+    Maybe<TrustedCertificate> res;
+
+    struct tm not_after;
+    if (ASN1_TIME_to_tm(X509_get0_notAfter(cert), &not_after) != 1) {
+        res.set_error("Could not read certificate expiry");
+        return res;
+    }
+
+    // Extract public key from validated certificate
+    EVP_PKEY *pubkey;
+    if ((pubkey = X509_get_pubkey(cert)) == nullptr) {
+        res.set_error("Could not retrieve pubkey from certificate");
+        return res;
+    }
+
+    X509_up_ref(cert);
+    TrustedCertificate trusted = {cert, pubkey, timegm(&not_after)};
+    trust.verified[fingerprint] = trusted;
+    trust.last = fingerprint;
+
+    res.set_result(trusted);
+    return res;
+}
+
+static void forget(map<string, TrustedCertificate>::iterator it) {
+    X509_free(it->second.cert);
+    EVP_PKEY_free(it->second.pubkey);
+    trust.verified.erase(it);
+}
+
+/*
+ * Remembers the certificate verified by a previous run, unless the root
+ * certificate changed since then. Anyone may have written the file in the
+ * meantime: the certificate is verified again, and ignored if it fails.
+ */
+static void load_verified() {
+    struct stat root_st, verified_st;
+    if (stat(ROOT_CERTIFICATE_PATH, &root_st) < 0 ||
+        stat(VERIFIED_CERTIFICATE_PATH, &verified_st) < 0 ||
+        verified_st.st_mtime < root_st.st_mtime) {
+        return;
+    }
+
+    FILE *fp;
+    if ((fp = fopen(VERIFIED_CERTIFICATE_PATH, "r")) == nullptr)
+        return;
+    X509 *cert = PEM_read_X509(fp, nullptr, nullptr, nullptr);
+    fclose(fp);
+    if (cert == nullptr)
+        return;
+
+    unsigned char fingerprint[FINGERPRINT_LEN];
+    if (!verify(cert).is_error &&
+        !certificate_fingerprint(cert, fingerprint).is_error) {
+        remember(cert, string((char *)fingerprint, FINGERPRINT_LEN));
+    }
+    X509_free(cert);
+}
+
+/* Looks for the certificate kept on disk, the first time only */
+static void load_once() {
+    if (!trust.loaded) {
+        load_verified();
+        trust.loaded = true;
+    }
+}
+
+/* Certificate verified with [fingerprint], unless it expired since then */
+static TrustedCertificate *find_trusted(const string &fingerprint) {
+    auto it = trust.verified.find(fingerprint);
+    if (it == trust.verified.end()) {
+        return nullptr;
+    }
+    if (time(nullptr) >= it->second.expiry) {
+        forget(it);
+        return nullptr;
+    }
+    return &it->second;
+}
+
+/* Keeps [cert] on disk for the next runs. Failing to do so is harmless. */
+static void store_verified(X509 *cert) {
+    string tmp_path = string(VERIFIED_CERTIFICATE_PATH) + ".tmp";
+    FILE *fp;
+    if ((fp = fopen(tmp_path.c_str(), "w")) == nullptr)
+        return;
+
+    bool ok = PEM_write_X509(fp, cert) == 1;
+    if (fclose(fp) != 0 || !ok ||
+        rename(tmp_path.c_str(), VERIFIED_CERTIFICATE_PATH) != 0) {
+        remove(tmp_path.c_str());
+    }
+}
+
+Maybe<EVP_PKEY *> trust_certificate(X509 *cert) {
+    Maybe<EVP_PKEY *> res;
+
+    unsigned char digest[FINGERPRINT_LEN];
+    auto fingerprint_res = certificate_fingerprint(cert, digest);
+    if (fingerprint_res.is_error) {
+        res.set_error(fingerprint_res.error);
+        return res;
+    }
+    string fingerprint((char *)digest, FINGERPRINT_LEN);
+
+    lock_guard<mutex> guard(trust.lock);
+    load_once();
+
+    // Seen before: only its expiry is left to check
+    auto trusted = find_trusted(fingerprint);
+    if (trusted != nullptr) {
+        EVP_PKEY_up_ref(trusted->pubkey);
+        res.set_result(trusted->pubkey);
+        return res;
+    }
+
+    // Verify the received certificate
+    auto verify_res = verify(cert);
+    if (verify_res.is_error) {
+        res.set_error(verify_res.error);
+        return res;
+    }
+
+    auto remember_res = remember(cert, fingerprint);
+    if (remember_res.is_error) {
+        res.set_error(remember_res.error);
+        return res;
+    }
+    store_verified(cert);
+
+    EVP_PKEY_up_ref(remember_res.result.pubkey);
+    res.set_result(remember_res.result.pubkey);
+    return res;
+}
+
+bool held_certificate(unsigned char *fingerprint) {
+    lock_guard<mutex> guard(trust.lock);
+    load_once();
+
+    if (trust.last.empty() || find_trusted(trust.last) == nullptr) {
+        return false;
+    }
+    memcpy(fingerprint, trust.last.data(), FINGERPRINT_LEN);
+    return true;
+}
+
+Maybe<EVP_PKEY *> trusted_key(const unsigned char *fingerprint) {
+    Maybe<EVP_PKEY *> res;
+
+    lock_guard<mutex> guard(trust.lock);
+    load_once();
+
+    auto trusted =
+        find_trusted(string((const char *)fingerprint, FINGERPRINT_LEN));
+    if (trusted == nullptr) {
+        res.set_error("Server's certificate is not trusted");
+        return res;
+    }
+
+    EVP_PKEY_up_ref(trusted->pubkey);
+    res.set_result(trusted->pubkey);
+    return res;
+}
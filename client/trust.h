@@ -0,0 +1,69 @@
+#include "../common/maybe.h"
+#include "../common/types.h"
+#include <map>
+#include <mutex>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+#include <string>
+#include <time.h>
+
+using namespace std;
+
+#ifndef trust_h
+#define trust_h
+
+/* A server certificate that was verified, and until when it is valid */
+struct TrustedCertificate {
+    X509 *cert;
+    EVP_PKEY *pubkey;
+    time_t expiry;
+};
+
+/*
+ * Certificates the client trusts. The root store is loaded once and kept, and
+ * every server certificate verified against it is remembered by fingerprint
+ * until it expires, so that seeing it again costs no chain building.
+ *
+ * The last certificate verified is also kept on disk, for the next runs of
+ * the client. It is only trusted while the root certificate is not replaced.
+ */
+struct TrustCache {
+    mutex lock;
+    X509_STORE *store;
+    map<string, TrustedCertificate> verified;
+
+    // Fingerprint of the certificate verified last, the one the client tells
+    // the server it holds
+    string last;
+
+    // Whether the certificate kept on disk was looked for already
+    bool loaded;
+
+    ~TrustCache();
+};
+
+/*
+ * Verifies the server certificate [cert], or finds it among the ones already
+ * verified, and returns its public key. The caller is responsible for freeing
+ * the key.
+ */
+Maybe<EVP_PKEY *> trust_certificate(X509 *cert);
+
+/*
+ * Writes into [fingerprint] the fingerprint of the server certificate verified
+ * last, if there is one and it has not expired yet. The server can then spare
+ * sending it again.
+ */
+bool held_certificate(unsigned char *fingerprint);
+
+/*
+ * Returns the public key of the certificate with [fingerprint], which must be
+ * among the ones verified and not expired. The caller is responsible for
+ * freeing the key.
+ */
+Maybe<EVP_PKEY *> trusted_key(const unsigned char *fingerprint);
+
+/* Writes the fingerprint of [cert] into [fingerprint] */
+Maybe<bool> certificate_fingerprint(X509 *cert, unsigned char *fingerprint);
+
+#endif
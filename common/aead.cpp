@@ -0,0 +1,235 @@
+#include "aead.h"
+#include "hkdf.h"
+#include "seq.h"
+#include "utils.h"
+#include <string.h>
+#include <utility>
+
+// Keep the keys of each direction, and the next keys, independent from each
+// other and from other values derived from the same key
+static const char client_label[] = "client to server";
+static const char server_label[] = "server to client";
+static const char update_label[] = "key update";
+
+/* Sets the cipher and the key of [ctx] once, leaving the nonce for later */
+static bool key_context(EVP_CIPHER_CTX *ctx, bool encrypt,
+                        unsigned char *key) {
+    return EVP_CipherInit_ex(ctx, get_symmetric_cipher(), nullptr, key,
+                             nullptr, encrypt ? 1 : 0) == 1;
+}
+
+/*
+ * Keys the context of [aead_key] with [key], which it keeps, for the messages
+ * from sequence number [start] on
+ */
+static Maybe<bool> set_key(AeadKey *aead_key, bool encrypt, unsigned char *key,
+                           int key_len, seqnum start) {
+    Maybe<bool> res;
+
+    if (key_len > EVP_MAX_KEY_LENGTH ||
+        !key_context(aead_key->ctx, encrypt, key)) {
+        res.set_error("Could not set up encryption");
+        return res;
+    }
+
+    auto salt_res = derive_nonce_salt(key, key_len, aead_key->nonce_salt);
+    if (salt_res.is_error) {
+        res.set_error(salt_res.error);
+        return res;
+    }
+
+    memcpy(aead_key->key, key, key_len);
+    aead_key->key_len = key_len;
+    aead_key->start = start;
+
+    res.set_result(true);
+    return res;
+}
+
+/*
+ * Keys [aead_key] with the key derived from [key] with [label], of the same
+ * length, for the messages from sequence number [start] on
+ */
+static Maybe<bool> derive_key(AeadKey *aead_key, bool encrypt,
+                              const unsigned char *key, int key_len,
+                              const char *label, seqnum start) {
+    Maybe<bool> res;
+
+    unsigned char derived[EVP_MAX_KEY_LENGTH];
+    if (key_len > EVP_MAX_KEY_LENGTH) {
+        res.set_error("Could not set up encryption");
+        return res;
+    }
+    auto hkdf_res =
+        hkdf(key, key_len, nullptr, 0,
+             reinterpret_cast<const unsigned char *>(label), strlen(label) + 1,
+             derived, key_len);
+    if (hkdf_res.is_error) {
+        res.set_error(hkdf_res.error);
+        return res;
+    }
+
+    res = set_key(aead_key, encrypt, derived, key_len, start);
+    explicit_bzero(derived, sizeof(derived));
+    return res;
+}
+
+Maybe<Aead *> new_aead(unsigned char *key, int key_len, direction sending) {
+    Maybe<Aead *> res;
+
+    Aead *aead = new Aead();
+    aead->sending = sending;
+    aead->seal.ctx = EVP_CIPHER_CTX_new();
+    aead->open.ctx = EVP_CIPHER_CTX_new();
+    if (aead->seal.ctx == nullptr || aead->open.ctx == nullptr) {
+        free_aead(aead);
+        res.set_error("Could not set up encryption (alloc)");
+        return res;
+    }
+
+    // Each party seals with the key of its own direction
+    const char *seal_label = client_label, *open_label = server_label;
+    if (sending == ServerToClient) {
+        swap(seal_label, open_label);
+    }
+
+    auto seal_res =
+        derive_key(&aead->seal, true, key, key_len, seal_label, 0);
+    auto open_res =
+        derive_key(&aead->open, false, key, key_len, open_label, 0);
+    if (seal_res.is_error || open_res.is_error) {
+        free_aead(aead);
+        res.set_error(seal_res.is_error ? seal_res.error : open_res.error);
+        return res;
+    }
+
+    res.set_result(aead);
+    return res;
+}
+
+bool aead_needs_update(Aead *aead, seqnum seq) {
+    return seq - aead->seal.start >= KEY_UPDATE_INTERVAL;
+}
+
+/* Moves [aead_key] on to its next key, from sequence number [seq] + 1 on */
+static Maybe<bool> update_key(AeadKey *aead_key, bool encrypt, seqnum seq) {
+    unsigned char current[EVP_MAX_KEY_LENGTH];
+    int key_len = aead_key->key_len;
+    memcpy(current, aead_key->key, key_len);
+
+    auto res =
+        derive_key(aead_key, encrypt, current, key_len, update_label, seq + 1);
+    explicit_bzero(current, sizeof(current));
+    return res;
+}
+
+Maybe<bool> aead_update_seal(Aead *aead, seqnum seq) {
+    return update_key(&aead->seal, true, seq);
+}
+
+Maybe<bool> aead_update_open(Aead *aead, seqnum seq) {
+    return update_key(&aead->open, false, seq);
+}
+
+/* Frees the context of [aead_key], wiping the key schedule, and the key */
+static void free_key(AeadKey *aead_key) {
+    EVP_CIPHER_CTX_free(aead_key->ctx);
+    explicit_bzero(aead_key->nonce_salt, NONCE_SALT_LEN);
+    explicit_bzero(aead_key->key, sizeof(aead_key->key));
+}
+
+void free_aead(Aead *aead) {
+    if (aead == nullptr)
+        return;
+
+    free_key(&aead->seal);
+    free_key(&aead->open);
+    delete aead;
+}
+
+static direction opposite(direction dir) {
+    return dir == ClientToServer ? ServerToClient : ClientToServer;
+}
+
+/*
+ * Starts a message under [aead_key]: its nonce, then the authenticated data.
+ * Messages from before the current key, or too far past it, are refused.
+ */
+static bool start_message(AeadKey *aead_key, direction dir, mtypes type,
+                          seqnum seq) {
+    if (seq < aead_key->start || seq - aead_key->start >= KEY_MESSAGES_MAX) {
+        return false;
+    }
+
+    unsigned char nonce[NONCE_LEN];
+    make_nonce(aead_key->nonce_salt, dir, seq, nonce);
+
+    // Only the nonce changes, the key schedule is kept
+    EVP_CIPHER_CTX *ctx = aead_key->ctx;
+    if (EVP_CipherInit_ex(ctx, nullptr, nullptr, nullptr, nonce, -1) != 1) {
+        return false;
+    }
+
+    int len;
+    unsigned char header = mtype_to_uc(type);
+    return EVP_CipherUpdate(ctx, nullptr, &len, &header, sizeof(mtype)) ==
+               1 &&
+           EVP_CipherUpdate(ctx, nullptr, &len, seqnum_to_uc(seq),
+                            sizeof(seqnum)) == 1;
+}
+
+Maybe<bool> aead_seal(Aead *aead, mtypes type, seqnum seq,
+                      const unsigned char *pt, int len, unsigned char *ct,
+                      unsigned char *tag) {
+    Maybe<bool> res;
+    EVP_CIPHER_CTX *ctx = aead->seal.ctx;
+
+    if (!start_message(&aead->seal, aead->sending, type, seq)) {
+        res.set_error("Could not encrypt message (init)");
+        return res;
+    }
+
+    int ct_len;
+    if (EVP_EncryptUpdate(ctx, ct, &ct_len, pt, len) != 1 ||
+        EVP_EncryptFinal_ex(ctx, ct + ct_len, &ct_len) != 1) {
+        res.set_error("Could not encrypt message");
+        return res;
+    }
+
+    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, TAG_LEN, tag) != 1) {
+        res.set_error("Could not encrypt message (tag)");
+        return res;
+    }
+
+    res.set_result(true);
+    return res;
+}
+
+Maybe<bool> aead_open(Aead *aead, mtypes type, seqnum seq,
+                      const unsigned char *ct, int len,
+                      const unsigned char *tag, unsigned char *pt) {
+    Maybe<bool> res;
+    EVP_CIPHER_CTX *ctx = aead->open.ctx;
+
+    if (!start_message(&aead->open, opposite(aead->sending), type, seq)) {
+        res.set_error("Could not decrypt message (init)");
+        return res;
+    }
+
+    int pt_len;
+    if (EVP_DecryptUpdate(ctx, pt, &pt_len, ct, len) != 1) {
+        res.set_error("Could not decrypt message");
+        return res;
+    }
+
+    // GCM tag check
+    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, TAG_LEN,
+                            const_cast<unsigned char *>(tag)) != 1 ||
+        EVP_DecryptFinal_ex(ctx, pt + pt_len, &pt_len) != 1) {
+        res.set_error("Message authentication failed");
+        return res;
+    }
+
+    res.set_result(true);
+    return res;
+}
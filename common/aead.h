@@ -0,0 +1,94 @@
+#include "maybe.h"
+#include "nonce.h"
+#include "types.h"
+#include <openssl/evp.h>
+
+#ifndef aead_h
+#define aead_h
+
+// Messages sent under a traffic key, after which the sender moves its direction
+// on to the next key (see KeyUpdate). Far below the usage limits of AES-GCM.
+#ifndef KEY_UPDATE_INTERVAL
+#define KEY_UPDATE_INTERVAL (1ULL << 24)
+#endif
+
+// Messages under a key past which it is refused: a peer that never updates
+// it is cut off
+#define KEY_MESSAGES_MAX (2 * KEY_UPDATE_INTERVAL)
+
+/*
+ * Traffic key of one direction of a session, set up in its own context, and
+ * the nonce salt derived from it
+ */
+struct AeadKey {
+    EVP_CIPHER_CTX *ctx;
+    unsigned char nonce_salt[NONCE_SALT_LEN];
+
+    // Current key, from which the next one is derived, and the sequence
+    // number of the first message under it
+    unsigned char key[EVP_MAX_KEY_LENGTH];
+    int key_len;
+    seqnum start;
+};
+
+/*
+ * Authenticated encryption of the messages of a session. The key schedule and
+ * the GHASH tables are set up once per direction: each message then only
+ * supplies its nonce, derived from its sequence number.
+ *
+ * Each direction has a key, nonces and sequence numbers of its own, and moves
+ * on to its next key on its own, so that messages can flow both ways at once.
+ * The messages sent are only ever sealed, and the ones received opened: each
+ * half can be used by a different thread.
+ *
+ * The message type and the sequence number are authenticated along with the
+ * ciphertext. As with GCM the ciphertext is exactly as long as the plaintext.
+ */
+struct Aead {
+    // Keys of the messages sent and of the ones received
+    AeadKey seal;
+    AeadKey open;
+
+    // Direction of the messages sealed by this party
+    direction sending;
+};
+
+/*
+ * Derives the keys of both directions of a session from its [key], of len
+ * [key_len], with HKDF. The key can be wiped afterwards. The caller is
+ * responsible for freeing the aead with `free_aead`.
+ */
+Maybe<Aead *> new_aead(unsigned char *key, int key_len, direction sending);
+void free_aead(Aead *aead);
+
+/*
+ * Whether the message sent with sequence number [seq] calls for a new key
+ * first
+ */
+bool aead_needs_update(Aead *aead, seqnum seq);
+
+/*
+ * Move the messages sent, or the ones received, on to their next traffic key,
+ * derived from the current one with HKDF, once the KeyUpdate message with
+ * sequence number [seq] has been sealed, or opened. The current key is wiped.
+ */
+Maybe<bool> aead_update_seal(Aead *aead, seqnum seq);
+Maybe<bool> aead_update_open(Aead *aead, seqnum seq);
+
+/*
+ * Encrypts the [len] bytes of [pt] of the message [type] with sequence number
+ * [seq] into [ct], and writes the tag (TAG_LEN bytes) into [tag]
+ */
+Maybe<bool> aead_seal(Aead *aead, mtypes type, seqnum seq,
+                      const unsigned char *pt, int len, unsigned char *ct,
+                      unsigned char *tag);
+
+/*
+ * Decrypts the [len] bytes of [ct] of the message [type] with sequence number
+ * [seq] into [pt]. Fails if the message does not match its [tag].
+ */
+Maybe<bool> aead_open(Aead *aead, mtypes type, seqnum seq,
+                      const unsigned char *ct, int len,
+                      const unsigned char *tag, unsigned char *pt);
+
+#endif
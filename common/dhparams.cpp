@@ -1,8 +1,10 @@
+#include "dhparams.h"
 #include "errors.h"
-#include <openssl/dh.h>
+#include <openssl/core_names.h>
 #include <openssl/evp.h>
+#include <openssl/param_build.h>
 
-DH *get_dh2048(void) {
+EVP_PKEY *dh2048_key(const BIGNUM *pub) {
     static unsigned char dhp_2048[] = {
         0xEE, 0x21, 0x70, 0x3F, 0x8C, 0xD6, 0x26, 0x3E, 0xB3, 0xE5, 0x34, 0x5B,
         0x4F, 0x58, 0xE7, 0x54, 0xE2, 0x8B, 0xC6, 0x2F, 0x9A, 0xA2, 0x2C, 0xB6,
@@ -27,41 +29,44 @@ DH *get_dh2048(void) {
         0x58, 0x1D, 0x3D, 0x8E, 0x41, 0xD6, 0x4A, 0x63, 0xD8, 0xA7, 0xEF, 0x2C,
         0x2C, 0x2D, 0x08, 0xEB};
     static unsigned char dhg_2048[] = {0x02};
-    DH *dh = DH_new();
-    BIGNUM *p, *g;
 
-    if (dh == nullptr)
-        return nullptr;
-    p = BN_bin2bn(dhp_2048, sizeof(dhp_2048), nullptr);
-    g = BN_bin2bn(dhg_2048, sizeof(dhg_2048), nullptr);
-    if (p == nullptr || g == NULL || !DH_set0_pqg(dh, p, NULL, g)) {
-        DH_free(dh);
-        BN_free(p);
-        BN_free(g);
-        return nullptr;
+    BIGNUM *p = BN_bin2bn(dhp_2048, sizeof(dhp_2048), nullptr);
+    BIGNUM *g = BN_bin2bn(dhg_2048, sizeof(dhg_2048), nullptr);
+    OSSL_PARAM_BLD *bld = OSSL_PARAM_BLD_new();
+    OSSL_PARAM *params = nullptr;
+    EVP_PKEY_CTX *ctx = nullptr;
+    EVP_PKEY *key = nullptr;
+
+    if (p != nullptr && g != nullptr && bld != nullptr &&
+        OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_FFC_P, p) == 1 &&
+        OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_FFC_G, g) == 1 &&
+        (pub == nullptr ||
+         OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_PUB_KEY, pub) == 1) &&
+        (params = OSSL_PARAM_BLD_to_param(bld)) != nullptr &&
+        (ctx = EVP_PKEY_CTX_new_from_name(nullptr, "DH", nullptr)) !=
+            nullptr &&
+        EVP_PKEY_fromdata_init(ctx) == 1) {
+        int selection =
+            pub == nullptr ? EVP_PKEY_KEY_PARAMETERS : EVP_PKEY_PUBLIC_KEY;
+        if (EVP_PKEY_fromdata(ctx, &key, selection, params) != 1) {
+            key = nullptr;
+        }
     }
-    return dh;
+
+    EVP_PKEY_CTX_free(ctx);
+    OSSL_PARAM_free(params);
+    OSSL_PARAM_BLD_free(bld);
+    BN_free(p);
+    BN_free(g);
+    return key;
 }
 
 EVP_PKEY *gen_keypair() {
     // generate dh params p and g
-    DH *tmp;
-    if ((tmp = get_dh2048()) == nullptr) {
-        handle_errors();
-    }
-
     EVP_PKEY *dh_params;
-    if ((dh_params = EVP_PKEY_new()) == nullptr) {
-        DH_free(tmp);
-        handle_errors();
-    }
-
-    if (EVP_PKEY_set1_DH(dh_params, tmp) != 1) {
-        DH_free(tmp);
-        EVP_PKEY_free(dh_params);
+    if ((dh_params = dh2048_key(nullptr)) == nullptr) {
         handle_errors();
     }
-    DH_free(tmp);
 
     // generate private and public key
     EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new(dh_params, nullptr);
@@ -1,8 +1,14 @@
-#include <openssl/dh.h>
+#include <openssl/bn.h>
+#include <openssl/evp.h>
 
 #ifndef dhparams_h
 #define dhparams_h
 
-DH *get_dh2048();
+/*
+ * Key of the fixed 2048-bit group: its parameters alone when [pub] is null,
+ * or else the public key [pub]. Null if it cannot be built.
+ */
+EVP_PKEY *dh2048_key(const BIGNUM *pub);
+
 EVP_PKEY *gen_keypair();
 #endif
\ No newline at end of file
@@ -0,0 +1,38 @@
+#include "hkdf.h"
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+
+Maybe<bool> hkdf(const unsigned char *key, size_t key_len,
+                 const unsigned char *salt, size_t salt_len,
+                 const unsigned char *info, size_t info_len, unsigned char *out,
+                 size_t out_len) {
+    Maybe<bool> res;
+
+    EVP_PKEY_CTX *ctx;
+    if ((ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr)) == nullptr) {
+        res.set_error("Could not derive key (alloc)");
+        return res;
+    }
+
+    // OpenSSL rejects an empty salt, which HKDF treats as a zeroed one anyway
+    static const unsigned char no_salt[1] = {0};
+    if (salt_len == 0) {
+        salt = no_salt;
+        salt_len = sizeof(no_salt);
+    }
+
+    if (EVP_PKEY_derive_init(ctx) != 1 ||
+        EVP_PKEY_CTX_set_hkdf_md(ctx, EVP_sha256()) != 1 ||
+        EVP_PKEY_CTX_set1_hkdf_salt(ctx, salt, salt_len) != 1 ||
+        EVP_PKEY_CTX_set1_hkdf_key(ctx, key, key_len) != 1 ||
+        EVP_PKEY_CTX_add1_hkdf_info(ctx, info, info_len) != 1 ||
+        EVP_PKEY_derive(ctx, out, &out_len) != 1) {
+        EVP_PKEY_CTX_free(ctx);
+        res.set_error("Could not derive key");
+        return res;
+    }
+    EVP_PKEY_CTX_free(ctx);
+
+    res.set_result(true);
+    return res;
+}
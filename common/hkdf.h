@@ -0,0 +1,18 @@
+#include "maybe.h"
+#include <stddef.h>
+
+#ifndef hkdf_h
+#define hkdf_h
+
+/*
+ * HKDF with SHA-256 (RFC 5869): derives [out_len] bytes into [out] from the
+ * input keying material [key], with an optional [salt] and the [info] that
+ * binds the output to its purpose, so that values derived from the same key
+ * for different purposes are independent.
+ */
+Maybe<bool> hkdf(const unsigned char *key, size_t key_len,
+                 const unsigned char *salt, size_t salt_len,
+                 const unsigned char *info, size_t info_len, unsigned char *out,
+                 size_t out_len);
+
+#endif
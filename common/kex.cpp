@@ -0,0 +1,278 @@
+#include "kex.h"
+#include "dhparams.h"
+#include <openssl/bio.h>
+#include <openssl/core_names.h>
+#include <openssl/pem.h>
+#include <string.h>
+
+// Length of an X25519 public key
+#define X25519_KEY_LEN 32
+
+/* What differs from one key exchange method to another */
+struct KexOps {
+    const char *name;
+
+    // Type of the keys, as told by EVP_PKEY_base_id
+    int key_type;
+
+    EVP_PKEY *(*gen_keypair)();
+
+    // Indexed by kex_encoding
+    Maybe<tuple<unsigned char *, size_t>> (*encode[KEX_ENCODINGS])(
+        EVP_PKEY *keypair);
+    EVP_PKEY *(*decode[KEX_ENCODINGS])(const unsigned char *data, size_t len);
+};
+
+/* Finite-field DH: the half keys are exchanged as PEM, or raw */
+static EVP_PKEY *ffdh_gen_keypair() { return gen_keypair(); }
+
+static Maybe<tuple<unsigned char *, size_t>> ffdh_encode(EVP_PKEY *keypair) {
+    Maybe<tuple<unsigned char *, size_t>> res;
+
+    BIO *bio;
+    if ((bio = BIO_new(BIO_s_mem())) == nullptr) {
+        res.set_error("Could not allocate memory bio");
+        return res;
+    }
+
+    unsigned char *pem;
+    long len;
+    if (PEM_write_bio_PUBKEY(bio, keypair) != 1 ||
+        (len = BIO_get_mem_data(bio, &pem)) <= 0) {
+        BIO_free(bio);
+        res.set_error("Could not write to memory bio");
+        return res;
+    }
+
+    unsigned char *encoded = new unsigned char[len];
+    memcpy(encoded, pem, len);
+    BIO_free(bio);
+
+    res.set_result({encoded, (size_t)len});
+    return res;
+}
+
+static EVP_PKEY *ffdh_decode(const unsigned char *data, size_t len) {
+    BIO *bio;
+    if ((bio = BIO_new_mem_buf(data, len)) == nullptr)
+        return nullptr;
+
+    EVP_PKEY *key = PEM_read_bio_PUBKEY(bio, nullptr, 0, nullptr);
+    BIO_free(bio);
+    return key;
+}
+
+/* Bare public value, left-padded to the size of the group */
+static Maybe<tuple<unsigned char *, size_t>>
+ffdh_encode_raw(EVP_PKEY *keypair) {
+    Maybe<tuple<unsigned char *, size_t>> res;
+
+    BIGNUM *pub = nullptr;
+    if (EVP_PKEY_get_bn_param(keypair, OSSL_PKEY_PARAM_PUB_KEY, &pub) != 1) {
+        res.set_error("Not a DH keypair");
+        return res;
+    }
+
+    int len = EVP_PKEY_get_size(keypair);
+    unsigned char *encoded = new unsigned char[len];
+    if (BN_bn2binpad(pub, encoded, len) != len) {
+        BN_free(pub);
+        delete[] encoded;
+        res.set_error("Could not encode half key");
+        return res;
+    }
+    BN_free(pub);
+
+    res.set_result({encoded, (size_t)len});
+    return res;
+}
+
+static EVP_PKEY *ffdh_decode_raw(const unsigned char *data, size_t len) {
+    BIGNUM *pub;
+    if ((pub = BN_bin2bn(data, len, nullptr)) == nullptr)
+        return nullptr;
+
+    EVP_PKEY *key = dh2048_key(pub);
+    BN_free(pub);
+    if (key == nullptr)
+        return nullptr;
+
+    // Values such as 1 or p - 1 would give away the shared secret
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_from_pkey(nullptr, key, nullptr);
+    if (len != (size_t)EVP_PKEY_get_size(key) || ctx == nullptr ||
+        EVP_PKEY_public_check(ctx) != 1) {
+        EVP_PKEY_CTX_free(ctx);
+        EVP_PKEY_free(key);
+        return nullptr;
+    }
+    EVP_PKEY_CTX_free(ctx);
+    return key;
+}
+
+/* X25519: the half keys are exchanged raw, whatever the encoding */
+static EVP_PKEY *x25519_gen_keypair() {
+    EVP_PKEY_CTX *ctx;
+    if ((ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_X25519, nullptr)) == nullptr)
+        return nullptr;
+
+    EVP_PKEY *keypair = nullptr;
+    if (EVP_PKEY_keygen_init(ctx) != 1 ||
+        EVP_PKEY_keygen(ctx, &keypair) != 1) {
+        keypair = nullptr;
+    }
+    EVP_PKEY_CTX_free(ctx);
+    return keypair;
+}
+
+static Maybe<tuple<unsigned char *, size_t>> x25519_encode(EVP_PKEY *keypair) {
+    Maybe<tuple<unsigned char *, size_t>> res;
+
+    unsigned char *encoded = new unsigned char[X25519_KEY_LEN];
+    size_t len = X25519_KEY_LEN;
+    if (EVP_PKEY_get_raw_public_key(keypair, encoded, &len) != 1) {
+        delete[] encoded;
+        res.set_error("Could not get raw public key");
+        return res;
+    }
+
+    res.set_result({encoded, len});
+    return res;
+}
+
+static EVP_PKEY *x25519_decode(const unsigned char *data, size_t len) {
+    if (len != X25519_KEY_LEN)
+        return nullptr;
+
+    return EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519, nullptr, data, len);
+}
+
+// Indexed by kex_method
+static const KexOps kex_ops[] = {
+    {"ffdh2048",
+     EVP_PKEY_DH,
+     ffdh_gen_keypair,
+     {ffdh_encode, ffdh_encode_raw},
+     {ffdh_decode, ffdh_decode_raw}},
+    {"x25519",
+     EVP_PKEY_X25519,
+     x25519_gen_keypair,
+     {x25519_encode, x25519_encode},
+     {x25519_decode, x25519_decode}},
+};
+
+static_assert(sizeof(kex_ops) / sizeof(kex_ops[0]) == KEX_METHODS,
+              "Every key exchange method must have its operations");
+
+Maybe<kex_method> kex_method_from_byte(unsigned char byte) {
+    Maybe<kex_method> res;
+
+    if (byte >= KEX_METHODS) {
+        res.set_error("Key exchange method not supported");
+        return res;
+    }
+
+    res.set_result((kex_method)byte);
+    return res;
+}
+
+Maybe<kex_encoding> kex_encoding_from_byte(unsigned char byte) {
+    Maybe<kex_encoding> res;
+
+    if (byte >= KEX_ENCODINGS) {
+        res.set_error("Half key encoding not supported");
+        return res;
+    }
+
+    res.set_result((kex_encoding)byte);
+    return res;
+}
+
+Maybe<kex_method> kex_method_from_name(const char *name) {
+    Maybe<kex_method> res;
+
+    for (unsigned int i = 0; i < KEX_METHODS; i++) {
+        if (strcmp(name, kex_ops[i].name) == 0) {
+            res.set_result((kex_method)i);
+            return res;
+        }
+    }
+
+    res.set_error("Key exchange method not supported");
+    return res;
+}
+
+const char *kex_method_name(kex_method method) {
+    return kex_ops[method].name;
+}
+
+Maybe<EVP_PKEY *> kex_gen_keypair(kex_method method) {
+    Maybe<EVP_PKEY *> res;
+
+    EVP_PKEY *keypair = kex_ops[method].gen_keypair();
+    if (keypair == nullptr) {
+        res.set_error("Could not generate keypair");
+        return res;
+    }
+
+    res.set_result(keypair);
+    return res;
+}
+
+Maybe<tuple<unsigned char *, size_t>>
+kex_encode(kex_method method, kex_encoding encoding, EVP_PKEY *keypair) {
+    return kex_ops[method].encode[encoding](keypair);
+}
+
+Maybe<EVP_PKEY *> kex_decode(kex_method method, kex_encoding encoding,
+                             const unsigned char *data, size_t len) {
+    Maybe<EVP_PKEY *> res;
+
+    EVP_PKEY *key = kex_ops[method].decode[encoding](data, len);
+    if (key == nullptr) {
+        res.set_error("Could not read half key");
+        return res;
+    }
+
+    // A key of another kind would only fail later on, if at all
+    if (EVP_PKEY_base_id(key) != kex_ops[method].key_type) {
+        EVP_PKEY_free(key);
+        res.set_error("Half key of the wrong type");
+        return res;
+    }
+
+    res.set_result(key);
+    return res;
+}
+
+Maybe<tuple<unsigned char *, size_t>> kex_derive(EVP_PKEY *keypair,
+                                                 EVP_PKEY *peer) {
+    Maybe<tuple<unsigned char *, size_t>> res;
+
+    EVP_PKEY_CTX *ctx;
+    if ((ctx = EVP_PKEY_CTX_new(keypair, nullptr)) == nullptr) {
+        res.set_error("Shared secret creation failed (alloc)");
+        return res;
+    }
+
+    // Get the length of the shared secret first
+    size_t len;
+    if (EVP_PKEY_derive_init(ctx) != 1 ||
+        EVP_PKEY_derive_set_peer(ctx, peer) != 1 ||
+        EVP_PKEY_derive(ctx, nullptr, &len) != 1) {
+        EVP_PKEY_CTX_free(ctx);
+        res.set_error("Shared secret creation failed");
+        return res;
+    }
+
+    unsigned char *secret = new unsigned char[len];
+    if (EVP_PKEY_derive(ctx, secret, &len) != 1) {
+        delete[] secret;
+        EVP_PKEY_CTX_free(ctx);
+        res.set_error("Shared secret creation failed");
+        return res;
+    }
+    EVP_PKEY_CTX_free(ctx);
+
+    res.set_result({secret, len});
+    return res;
+}
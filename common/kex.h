@@ -0,0 +1,69 @@
+#include "maybe.h"
+#include <openssl/evp.h>
+#include <stddef.h>
+#include <tuple>
+
+using namespace std;
+
+#ifndef kex_h
+#define kex_h
+
+/*
+ * Methods of the ephemeral key exchange of the authentication, chosen by the
+ * client in AuthStart. Their values are sent on the wire, as a single byte.
+ *
+ * Finite-field DH is the original method. X25519 agrees on a key for a small
+ * fraction of the CPU time, with 32-byte half keys sent as they are.
+ */
+enum kex_method { KexFfdh2048, KexX25519 };
+
+// Number of methods, all of them below this value
+#define KEX_METHODS 2
+
+// Method the client uses unless told otherwise
+#define DEFAULT_KEX_METHOD KexX25519
+
+/*
+ * Encodings of the half keys on the wire, chosen by the client along with the
+ * method. The original one is PEM. The raw one is the bare public value: for
+ * finite-field DH the group is the fixed one of `dh2048_key`, and half keys
+ * of any other group are refused. X25519 half keys are raw in both.
+ *
+ * Clients that predate the raw encoding only send the method, and are answered
+ * in PEM.
+ */
+enum kex_encoding { KexEncodingPem, KexEncodingRaw };
+
+#define KEX_ENCODINGS 2
+
+/* Parses a method, as sent on the wire or as named by `kex_method_name` */
+Maybe<kex_method> kex_method_from_byte(unsigned char byte);
+Maybe<kex_encoding> kex_encoding_from_byte(unsigned char byte);
+Maybe<kex_method> kex_method_from_name(const char *name);
+const char *kex_method_name(kex_method method);
+
+/* Generates an ephemeral keypair for [method] */
+Maybe<EVP_PKEY *> kex_gen_keypair(kex_method method);
+
+/*
+ * Encodes the public half of [keypair] as sent on the wire, with [encoding].
+ * The caller is responsible for freeing it with `delete[]`.
+ */
+Maybe<tuple<unsigned char *, size_t>>
+kex_encode(kex_method method, kex_encoding encoding, EVP_PKEY *keypair);
+
+/*
+ * Parses a half key received from the other party, checking that it is one
+ * of [method]
+ */
+Maybe<EVP_PKEY *> kex_decode(kex_method method, kex_encoding encoding,
+                             const unsigned char *data, size_t len);
+
+/*
+ * Computes the secret shared by our [keypair] and the [peer] half key. The
+ * caller is responsible for freeing it with `delete[]`.
+ */
+Maybe<tuple<unsigned char *, size_t>> kex_derive(EVP_PKEY *keypair,
+                                                 EVP_PKEY *peer);
+
+#endif
@@ -0,0 +1,39 @@
+#include "nonce.h"
+#include "hkdf.h"
+#include <string.h>
+
+// Keeps the salt independent from other values derived from the key
+static const char salt_label[] = "nonce salt";
+
+Maybe<bool> derive_nonce_salt(unsigned char *key, int key_len,
+                              unsigned char *salt) {
+    Maybe<bool> res;
+
+    auto hkdf_res =
+        hkdf(key, key_len, nullptr, 0,
+             reinterpret_cast<const unsigned char *>(salt_label),
+             sizeof(salt_label), salt, NONCE_SALT_LEN);
+    if (hkdf_res.is_error) {
+        res.set_error("Could not derive nonce salt");
+        return res;
+    }
+
+    res.set_result(true);
+    return res;
+}
+
+void make_nonce(const unsigned char *salt, direction dir, seqnum seq,
+                unsigned char *nonce) {
+    memcpy(nonce, salt, NONCE_SALT_LEN);
+
+    // The remaining 8 bytes are a big endian counter, whose top bit is the
+    // direction
+    unsigned long long counter = (unsigned long long)seq;
+    if (dir == ServerToClient) {
+        counter |= 1ULL << 63;
+    }
+    for (int i = NONCE_LEN - 1; i >= NONCE_SALT_LEN; i--) {
+        nonce[i] = (unsigned char)counter;
+        counter >>= 8;
+    }
+}
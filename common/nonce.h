@@ -0,0 +1,31 @@
+#include "maybe.h"
+#include "types.h"
+
+#ifndef nonce_h
+#define nonce_h
+
+// Length of the GCM nonces, and of the salt they start with
+#define NONCE_LEN 12
+#define NONCE_SALT_LEN 4
+
+/* Direction of a message on a connection */
+enum direction { ClientToServer, ServerToClient };
+
+/*
+ * Derives with HKDF the nonce salt of the messages under the traffic key [key]
+ * of len [key_len]. Both parties compute the same salt on their own, and it is
+ * as random and unique to the key as the key itself.
+ */
+Maybe<bool> derive_nonce_salt(unsigned char *key, int key_len,
+                              unsigned char *salt);
+
+/*
+ * Writes into [nonce] the nonce of the message sent in direction [dir] with
+ * sequence number [seq]: the salt, followed by the direction and the sequence
+ * number. As sequence numbers never repeat in a direction, nor does a nonce
+ * under the same key, and the receiver can derive it rather than read it.
+ */
+void make_nonce(const unsigned char *salt, direction dir, seqnum seq,
+                unsigned char *nonce);
+
+#endif
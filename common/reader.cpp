@@ -0,0 +1,119 @@
+#include "reader.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+
+Reader *new_reader(int sock) {
+    Reader *reader = new Reader();
+    reader->sock = sock;
+    reader->buffer = new unsigned char[READER_BUFFER_SIZE];
+    reader->size = READER_BUFFER_SIZE;
+    reader->head = 0;
+    reader->tail = 0;
+    return reader;
+}
+
+static void release_retired(Reader *reader) {
+    for (unsigned char *buffer : reader->retired) {
+        delete[] buffer;
+    }
+    reader->retired.clear();
+}
+
+void free_reader(Reader *reader) {
+    if (reader == nullptr)
+        return;
+
+    release_retired(reader);
+    delete[] reader->buffer;
+    delete reader;
+}
+
+size_t reader_available(Reader *reader) { return reader->tail - reader->head; }
+
+void reader_start_message(Reader *reader) {
+    release_retired(reader);
+
+    // Nothing points into the buffer anymore, the unread bytes can be moved
+    size_t available = reader_available(reader);
+    if (reader->head > 0) {
+        memmove(reader->buffer, reader->buffer + reader->head, available);
+        reader->head = 0;
+        reader->tail = available;
+    }
+}
+
+/*
+ * Makes sure that [needed] unread bytes fit in the buffer after the head. The
+ * unread bytes may be moved to a new buffer, but the old one is kept: views
+ * into the current message may still point into it.
+ */
+static void make_room(Reader *reader, size_t needed) {
+    if (reader->head + needed <= reader->size)
+        return;
+
+    size_t size = reader->size;
+    while (size < needed) {
+        size *= 2;
+    }
+
+    size_t available = reader_available(reader);
+    unsigned char *buffer = new unsigned char[size];
+    memcpy(buffer, reader->buffer + reader->head, available);
+
+    reader->retired.push_back(reader->buffer);
+    reader->buffer = buffer;
+    reader->size = size;
+    reader->head = 0;
+    reader->tail = available;
+}
+
+Maybe<bool> reader_fill(Reader *reader, size_t needed, bool wait) {
+    Maybe<bool> res;
+
+    if (reader_available(reader) >= needed) {
+        res.set_result(true);
+        return res;
+    }
+    make_room(reader, needed);
+
+    do {
+        ssize_t received = recv(reader->sock, reader->buffer + reader->tail,
+                                reader->size - reader->tail,
+                                wait ? 0 : MSG_DONTWAIT);
+        if (received == 0) {
+            res.set_error("Connection closed by peer");
+            return res;
+        }
+        if (received < 0) {
+            if (errno == EINTR)
+                continue;
+            if (!wait && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            res.set_error("Error when receiving data");
+            return res;
+        }
+        reader->tail += received;
+    } while (wait && reader_available(reader) < needed);
+
+    res.set_result(reader_available(reader) >= needed);
+    return res;
+}
+
+Maybe<unsigned char *> reader_take(Reader *reader, size_t len) {
+    Maybe<unsigned char *> res;
+
+    auto fill_res = reader_fill(reader, len, true);
+    if (fill_res.is_error) {
+        res.set_error(fill_res.error);
+        return res;
+    }
+
+    res.set_result(reader->buffer + reader->head);
+    reader->head += len;
+    return res;
+}
+
+unsigned char *reader_peek(Reader *reader, size_t offset) {
+    return reader->buffer + reader->head + offset;
+}
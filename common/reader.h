@@ -0,0 +1,68 @@
+#include "maybe.h"
+#include <stddef.h>
+#include <vector>
+
+using namespace std;
+
+#ifndef reader_h
+#define reader_h
+
+// Initial size of a receive buffer, enough for a few chunk messages
+#define READER_BUFFER_SIZE (1 << 17)
+
+/*
+ * Receive buffer of a connection. Bytes are pulled from the socket as many at
+ * a time as are available, and messages are parsed in place: the fields read
+ * from it are views into the buffer, rather than copies. A view stays valid
+ * until the next message is started (see `reader_start_message`), and must be
+ * copied to be kept any longer.
+ */
+struct Reader {
+    int sock;
+
+    unsigned char *buffer;
+    size_t size;
+
+    // The unread bytes are the ones in [head, tail)
+    size_t head;
+    size_t tail;
+
+    // Buffers outgrown in the middle of a message. They are kept until the
+    // message is over, as views may still point into them.
+    vector<unsigned char *> retired;
+};
+
+/* The caller is responsible for freeing the reader with `free_reader` */
+Reader *new_reader(int sock);
+void free_reader(Reader *reader);
+
+/* Number of bytes received and not read yet */
+size_t reader_available(Reader *reader);
+
+/*
+ * Marks the start of a new message: the views into the previous ones are
+ * released, and the unread bytes moved back to the front of the buffer.
+ */
+void reader_start_message(Reader *reader);
+
+/*
+ * Makes room for [needed] unread bytes and receives as many bytes as are
+ * available with a single recv, unless [needed] bytes are already there.
+ * With [wait] it keeps receiving until there are [needed] unread bytes,
+ * otherwise it never blocks. Fails if the other party closed the connection.
+ */
+Maybe<bool> reader_fill(Reader *reader, size_t needed, bool wait);
+
+/*
+ * Returns a view of the next [len] bytes and consumes them, waiting for them
+ * to be received if needed
+ */
+Maybe<unsigned char *> reader_take(Reader *reader, size_t len);
+
+/*
+ * Returns a view of the unread bytes starting [offset] bytes after the next
+ * one, without consuming anything. The bytes must have been received already.
+ */
+unsigned char *reader_peek(Reader *reader, size_t offset);
+
+#endif
@@ -0,0 +1,56 @@
+#include "resumption.h"
+#include "hkdf.h"
+#include <string.h>
+#include <string>
+
+using namespace std;
+
+// Keep the values derived from the same secret independent from each other
+static const char secret_label[] = "resumption secret";
+static const char resume_label[] = "resumed session";
+
+Maybe<bool> derive_resumption_secret(const unsigned char *key, int key_len,
+                                     unsigned char *secret) {
+    return hkdf(key, key_len, nullptr, 0,
+                reinterpret_cast<const unsigned char *>(secret_label),
+                sizeof(secret_label), secret, RESUMPTION_SECRET_LEN);
+}
+
+Maybe<unsigned char *> derive_resumed_key(const unsigned char *secret,
+                                          const unsigned char *client_nonce,
+                                          const unsigned char *server_nonce,
+                                          const char *username,
+                                          unsigned int chunk_size, int key_len,
+                                          unsigned char *confirm) {
+    Maybe<unsigned char *> res;
+
+    unsigned char salt[2 * RESUME_NONCE_LEN];
+    memcpy(salt, client_nonce, RESUME_NONCE_LEN);
+    memcpy(salt + RESUME_NONCE_LEN, server_nonce, RESUME_NONCE_LEN);
+
+    // label | username | chunk size
+    string info(resume_label, sizeof(resume_label));
+    info.append(username, strlen(username) + 1);
+    info.append(reinterpret_cast<char *>(&chunk_size), sizeof(chunk_size));
+
+    // The key, followed by the confirmation
+    size_t out_len = key_len + RESUME_CONFIRM_LEN;
+    unsigned char *out = new unsigned char[out_len];
+    auto hkdf_res = hkdf(secret, RESUMPTION_SECRET_LEN, salt, sizeof(salt),
+                         reinterpret_cast<const unsigned char *>(info.data()),
+                         info.size(), out, out_len);
+    if (hkdf_res.is_error) {
+        delete[] out;
+        res.set_error(hkdf_res.error);
+        return res;
+    }
+
+    unsigned char *key = new unsigned char[key_len];
+    memcpy(key, out, key_len);
+    memcpy(confirm, out + key_len, RESUME_CONFIRM_LEN);
+    explicit_bzero(out, out_len);
+    delete[] out;
+
+    res.set_result(key);
+    return res;
+}
@@ -0,0 +1,43 @@
+#include "maybe.h"
+#include <stddef.h>
+
+#ifndef resumption_h
+#define resumption_h
+
+/*
+ * Session resumption. After an authentication, the server hands the client a
+ * ticket: the resumption secret of the session and the client's username,
+ * encrypted with a key only the server knows. To reconnect, the client sends
+ * the ticket back with a fresh nonce (ResumeStart), and the server answers
+ * with its own nonce and a confirmation that it could read the ticket
+ * (ResumeAns). Both parties then derive the key of the new session from the
+ * secret and the two nonces, without any signature nor key exchange.
+ *
+ * Every session, resumed or not, gets a new ticket with a secret of its own.
+ */
+
+#define RESUMPTION_SECRET_LEN 32
+#define RESUME_NONCE_LEN 32
+#define RESUME_CONFIRM_LEN 32
+
+/*
+ * Derives the resumption secret of a session from its [key] of len [key_len]
+ * into [secret]. It is independent from the key itself, that is never stored.
+ */
+Maybe<bool> derive_resumption_secret(const unsigned char *key, int key_len,
+                                     unsigned char *secret);
+
+/*
+ * Derives the key of a resumed session, of len [key_len], from the ticket's
+ * [secret] and the nonces of both parties, bound to the [username] and to the
+ * [chunk_size] agreed on. The confirmation sent by the server is written into
+ * [confirm]. The caller is responsible for freeing the key with `delete[]`.
+ */
+Maybe<unsigned char *> derive_resumed_key(const unsigned char *secret,
+                                          const unsigned char *client_nonce,
+                                          const unsigned char *server_nonce,
+                                          const char *username,
+                                          unsigned int chunk_size, int key_len,
+                                          unsigned char *confirm);
+
+#endif
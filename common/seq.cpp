@@ -1,19 +1,12 @@
 #include "seq.h"
+#include "errors.h"
 #include "types.h"
-#include <signal.h>
-#include <unistd.h>
 
-seqnum seq_num = 0;
-
-void check_wraparound() {
-    if (seq_num > (SEQ_MAX_THRESHOLD))
-        kill(getpid(), SIGUSR1);
-}
-
-seqnum inc_seqnum() {
-    seq_num++;
-    check_wraparound();
-    return seq_num;
+seqnum inc_seqnum(seqnum &seq) {
+    if (seq >= SEQNUM_MAX) {
+        handle_errors("Sequence numbers exhausted");
+    }
+    return ++seq;
 }
 
-unsigned char *seqnum_to_uc() { return (unsigned char *)&seq_num; }
+unsigned char *seqnum_to_uc(seqnum &seq) { return (unsigned char *)&seq; }
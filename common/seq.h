@@ -3,10 +3,11 @@
 #ifndef seq_h
 #define seq_h
 
-extern seqnum seq_num;
-
-bool is_wraparound();
-seqnum inc_seqnum();
-unsigned char *seqnum_to_uc();
+/*
+ * Sequence numbers are kept by each party per connection: the functions below
+ * work on the counter [seq] of the connection they are given.
+ */
+seqnum inc_seqnum(seqnum &seq);
+unsigned char *seqnum_to_uc(seqnum &seq);
 
 #endif
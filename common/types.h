@@ -1,3 +1,5 @@
+#include <stdint.h>
+
 #ifndef types_h
 #define types_h
 
@@ -6,21 +8,50 @@ typedef unsigned short ushort;
 typedef unsigned int uint;
 
 typedef char mtype;
-typedef uint seqnum;
-typedef ushort flen;
+typedef uint64_t seqnum;
+typedef uint flen;
 
-#define SEQNUM_MAX ((1UL << 32) - 1)
-#define LOGOUT_THRESHOLD 5
-#define SEQ_MAX_THRESHOLD (SEQNUM_MAX - LOGOUT_THRESHOLD)
+// Sequence numbers never wrap around: the nonces have room for 63 bits of
+// them, which no session can ever use up
+#define SEQNUM_MAX ((1ULL << 63) - 1)
 
-#define FLEN_MAX ((1 << 16) - 1)
+// Fields are at most a chunk long, give or take a cipher block
+#define FLEN_MAX (MAX_CHUNK_SIZE + 4096)
 #define FSIZE_MAX ((1UL << 32) - 1)
 
 #define TAG_LEN 16
+
+// Fingerprint of a certificate, the SHA-256 of its DER encoding
+#define FINGERPRINT_LEN 32
 #define FNAME_MAX_LEN 128
 
-// Size of a download/upload chunk
+// Hash of the part of a file already transferred, chained over blocks of
+// RESUME_BLOCK bytes (see ResumeHash)
+#define RESUME_DIGEST_LEN 32
+#define RESUME_BLOCK (8 << 20)
+
+// Where an interrupted transfer goes on from: the offset, and the hash of the
+// bytes before it. It starts an UploadAns to a request to resume, and ends a
+// DownloadReq that resumes.
+#define RESUME_POINT_LEN (sizeof(uint64_t) + RESUME_DIGEST_LEN)
+
+/*
+ * Bytes of a file, from [offset] on. A DownloadReq can ask for up to
+ * MAX_RANGES of them instead of the whole file, each one sent as it is. An
+ * [offset] of RANGE_FROM_END asks for the last [len] bytes.
+ */
+struct ByteRange {
+    uint64_t offset;
+    uint64_t len;
+};
+
+#define MAX_RANGES 16
+#define RANGE_FROM_END UINT64_MAX
+
+// Size of a download/upload chunk, unless the client and the server agree on
+// a bigger one during the authentication, up to MAX_CHUNK_SIZE
 #define CHUNK_SIZE 32768
+#define MAX_CHUNK_SIZE (1 << 24)
 
 enum mtypes {
     // Authentication
@@ -28,6 +59,14 @@ enum mtypes {
     AuthServerAns,
     AuthClientAns,
 
+    // Resumption
+    ResumeStart,
+    ResumeAns,
+    NewTicket,
+
+    // Next traffic key, for the messages that follow
+    KeyUpdate,
+
     // Upload
     UploadReq,
     UploadAns,
@@ -37,6 +76,7 @@ enum mtypes {
 
     // Download
     DownloadReq,
+    DownloadAns,
     DownloadChunk,
     DownloadEnd,
 
@@ -1,7 +1,9 @@
 #include "utils.h"
 #include "errors.h"
+#include "hkdf.h"
 #include "seq.h"
 #include "types.h"
+#include <algorithm>
 #include <errno.h>
 #include <iostream>
 #include <openssl/evp.h>
@@ -27,6 +29,10 @@ void print_debug(unsigned char *x, int len) {
         printf("%02x", (int)x[i]);
 }
 
+// Keeps the session key independent from other values derived from the
+// shared secret
+static const char session_key_label[] = "session key";
+
 const EVP_CIPHER *get_symmetric_cipher() { return EVP_aes_256_gcm(); }
 int get_iv_len() { return EVP_CIPHER_iv_length(get_symmetric_cipher()); }
 int get_block_size() { return EVP_CIPHER_block_size(get_symmetric_cipher()); }
@@ -46,60 +52,23 @@ Maybe<unsigned char *> kdf(unsigned char *shared_secret, int shared_secret_len,
                            unsigned int key_len) {
     Maybe<unsigned char *> res;
 
-    unsigned char *digest = new unsigned char[get_hash_type_length()];
-    unsigned int digest_len;
-    EVP_MD_CTX *ctx;
-    if ((ctx = EVP_MD_CTX_new()) == nullptr ||
-        EVP_DigestInit(ctx, get_hash_type()) != 1 ||
-        EVP_DigestUpdate(ctx, shared_secret, shared_secret_len) != 1 ||
-        EVP_DigestFinal(ctx, digest, &digest_len) != 1) {
-        delete[] digest;
-        delete[] shared_secret;
-        explicit_bzero(shared_secret, shared_secret_len);
-        EVP_MD_CTX_free(ctx);
-        res.set_error("Could not create hashing context for kdf");
-        return res;
-    }
-
+    unsigned char *key = new unsigned char[key_len];
+    auto hkdf_res =
+        hkdf(shared_secret, shared_secret_len, nullptr, 0,
+             reinterpret_cast<const unsigned char *>(session_key_label),
+             sizeof(session_key_label), key, key_len);
     explicit_bzero(shared_secret, shared_secret_len);
     delete[] shared_secret;
-    EVP_MD_CTX_free(ctx);
-
-    if (digest_len < key_len) {
-        delete[] digest;
-        res.set_error("Cannot derive a key: key length is bigger than the "
-                      "digest's length.");
+    if (hkdf_res.is_error) {
+        delete[] key;
+        res.set_error(hkdf_res.error);
         return res;
     }
 
-    unsigned char *key = new unsigned char[key_len];
-    memcpy(key, digest, key_len);
-    explicit_bzero(digest, digest_len);
-    delete[] digest;
-
     res.set_result(key);
     return res;
 }
 
-Maybe<unsigned char *> gen_iv() {
-    Maybe<unsigned char *> res;
-
-    int iv_len = get_iv_len();
-    if (RAND_poll() != 1) {
-        res.set_error("Could not seed generator");
-        return res;
-    }
-
-    unsigned char *iv = new unsigned char[iv_len];
-    if (RAND_bytes(iv, iv_len) != 1) {
-        delete[] iv;
-        res.set_error("Could not generate IV");
-    } else {
-        res.set_result(iv);
-    }
-    return res;
-}
-
 Maybe<unsigned char *> get_dummy() {
     Maybe<unsigned char *> res;
 
@@ -118,12 +87,18 @@ Maybe<unsigned char *> get_dummy() {
     return res;
 }
 
-Maybe<mtypes> get_mtype(int socket) {
+Maybe<mtypes> get_mtype(Reader *reader) {
     Maybe<mtypes> res;
 
-    if (read(socket, &res.result, sizeof(mtype)) != sizeof(mtype)) {
+    // A new message begins, the views into the previous one are released
+    reader_start_message(reader);
+
+    auto mtype_res = reader_take(reader, sizeof(mtype));
+    if (mtype_res.is_error) {
         res.set_error("Error when reading mtype");
-    };
+        return res;
+    }
+    res.set_result(mtypes(*mtype_res.result));
 
 #ifdef DEBUG
     cout << endl
@@ -133,9 +108,9 @@ Maybe<mtypes> get_mtype(int socket) {
     return res;
 }
 
-Maybe<bool> send_header(int socket, mtypes type) {
-    Maybe<bool> res;
-    if (write(socket, &type, sizeof(mtype)) != sizeof(mtype)) {
+Maybe<bool> send_header(Writer *writer, mtypes type) {
+    auto res = writer_copy(writer, &type, sizeof(mtype));
+    if (res.is_error) {
         res.set_error("Error when writing mtype");
         return res;
     }
@@ -147,14 +122,14 @@ Maybe<bool> send_header(int socket, mtypes type) {
     return res;
 }
 
-Maybe<bool> send_header(int socket, mtypes type, seqnum seq_num, uchar *iv,
-                        int iv_len) {
-    auto res = send_header(socket, type);
+Maybe<bool> send_header(Writer *writer, mtypes type, seqnum seq_num) {
+    auto res = send_header(writer, type);
     if (res.is_error) {
         return res;
     }
 
-    if (write(socket, &seq_num, sizeof(seq_num)) != sizeof(seq_num)) {
+    res = writer_copy(writer, &seq_num, sizeof(seq_num));
+    if (res.is_error) {
         res.set_error("Error when writing sequence number");
         return res;
     }
@@ -163,32 +138,25 @@ Maybe<bool> send_header(int socket, mtypes type, seqnum seq_num, uchar *iv,
     cout << BLUE << "Sequence number: " << seq_num << RESET << endl;
 #endif
 
-    if (write(socket, iv, iv_len) != iv_len) {
-        res.set_error("Error when writing iv");
-        return res;
-    };
-
-#ifdef DEBUG
-    cout << BLUE << "IV: ";
-    print_debug(iv, iv_len);
-    cout << RESET << endl;
-#endif
-
     return res;
 }
-Maybe<bool> send_tag(int socket, unsigned char *tag) {
-    Maybe<bool> res;
-    if (write(socket, tag, TAG_LEN) != TAG_LEN) {
+Maybe<bool> send_tag(Writer *writer, unsigned char *tag) {
+    auto res = writer_copy(writer, tag, TAG_LEN);
+    if (res.is_error) {
         res.set_error("Error when writing tag");
         return res;
     }
 
+    // The tag ends the message
+    res = writer_end_message(writer);
     return res;
 }
 
-Maybe<bool> send_field(int socket, flen len, unsigned char *data) {
-    Maybe<bool> res;
-    if (write(socket, &len, sizeof(flen)) != sizeof(flen)) {
+/* Queues a field, copying its data or borrowing it */
+static Maybe<bool> queue_field(Writer *writer, flen len, unsigned char *data,
+                               bool borrow) {
+    auto res = writer_copy(writer, &len, sizeof(flen));
+    if (res.is_error) {
         res.set_error("Error when writing field length");
         return res;
     }
@@ -196,7 +164,9 @@ Maybe<bool> send_field(int socket, flen len, unsigned char *data) {
 #ifdef DEBUG
     cout << BLUE << "Field length: " << len << RESET << endl;
 #endif
-    if (write(socket, data, len) != len) {
+    res = borrow ? writer_borrow(writer, data, len)
+                 : writer_copy(writer, data, len);
+    if (res.is_error) {
         res.set_error("Error when writing field data");
         return res;
     }
@@ -209,37 +179,39 @@ Maybe<bool> send_field(int socket, flen len, unsigned char *data) {
     return res;
 }
 
-Maybe<tuple<flen, unsigned char *>> read_field(int socket) {
+Maybe<bool> send_field(Writer *writer, flen len, unsigned char *data) {
+    return queue_field(writer, len, data, false);
+}
+
+Maybe<bool> send_field_ref(Writer *writer, flen len, unsigned char *data) {
+    return queue_field(writer, len, data, true);
+}
+
+Maybe<tuple<flen, unsigned char *>> read_field(Reader *reader) {
     Maybe<tuple<flen, unsigned char *>> res;
 
-    ssize_t received_len = 0;
-    ssize_t read_len;
+    auto len_res = reader_take(reader, sizeof(flen));
+    if (len_res.is_error) {
+        res.set_error("Error when reading field length");
+        return res;
+    }
     flen len;
-    while ((unsigned long)received_len < sizeof(flen)) {
-        if ((read_len = read(socket, (uchar *)&len + received_len,
-                             sizeof(flen) - received_len)) <= 0) {
-            res.set_error("Error when reading field length");
-            return res;
-        }
-        received_len += read_len;
+    memcpy(&len, len_res.result, sizeof(flen));
+    if (len > FLEN_MAX) {
+        res.set_error("Field longer than allowed");
+        return res;
     }
 
 #ifdef DEBUG
 
     cout << GREEN << "Field length: " << len << RESET << endl;
 #endif
-    unsigned char *r = new unsigned char[len];
-
-    received_len = 0;
-    while (received_len < len) {
-        if ((read_len = read(socket, r + received_len, len - received_len)) <=
-            0) {
-            delete[] r;
-            res.set_error("Error when reading field");
-            return res;
-        }
-        received_len += read_len;
+    auto data_res = reader_take(reader, len);
+    if (data_res.is_error) {
+        res.set_error("Error when reading field");
+        return res;
     }
+    unsigned char *r = data_res.result;
 
 #ifdef DEBUG
     cout << GREEN << "Content (hex): ";
@@ -253,64 +225,80 @@ Maybe<tuple<flen, unsigned char *>> read_field(int socket) {
 
 unsigned char mtype_to_uc(mtypes m) { return (unsigned char)m; }
 
-Maybe<tuple<seqnum, unsigned char *>> read_header(int socket) {
-    Maybe<tuple<seqnum, unsigned char *>> res;
+Maybe<seqnum> read_header(Reader *reader) {
+    Maybe<seqnum> res;
 
-    ssize_t received_len = 0;
-    ssize_t read_len;
-    seqnum seq;
-    while ((unsigned long)received_len < sizeof(seqnum)) {
-        if ((read_len = read(socket, (uchar *)&seq + received_len,
-                             sizeof(seqnum) - received_len)) <= 0) {
-            res.set_error("Error when reading sequence number");
-            return res;
-        }
-        received_len += read_len;
+    auto seq_res = reader_take(reader, sizeof(seqnum));
+    if (seq_res.is_error) {
+        res.set_error("Error when reading sequence number");
+        return res;
     }
+    seqnum seq;
+    memcpy(&seq, seq_res.result, sizeof(seqnum));
 
 #ifdef DEBUG
     cout << GREEN << "Sequence number: " << seq << RESET << endl;
 #endif
 
-    received_len = 0;
-    unsigned char *iv = new unsigned char[get_iv_len()];
-    while (received_len < get_iv_len()) {
-        if ((read_len = read(socket, iv + received_len,
-                             get_iv_len() - received_len)) <= 0) {
-            delete[] iv;
-            res.set_error("Error when reading iv");
-            return res;
-        }
+    res.set_result(seq);
+    return res;
+}
 
-        received_len += read_len;
-    }
+Maybe<unsigned char *> read_tag(Reader *reader) {
+    Maybe<unsigned char *> res;
 
-#ifdef DEBUG
-    cout << GREEN << "IV: ";
-    print_debug(iv, get_iv_len());
-    cout << RESET << endl;
-#endif
+    auto tag_res = reader_take(reader, TAG_LEN);
+    if (tag_res.is_error) {
+        res.set_error("Error when reading tag");
+        return res;
+    }
 
-    res.set_result({seq, iv});
+    res.set_result(tag_res.result);
     return res;
 }
 
-Maybe<unsigned char *> read_tag(int socket) {
-    Maybe<unsigned char *> res;
+Maybe<bool> is_message_ready(Reader *reader, int fields, bool has_header,
+                             flen max_len) {
+    Maybe<bool> res;
+
+    size_t needed = sizeof(mtype);
+    if (has_header) {
+        needed += sizeof(seqnum);
+    }
 
-    ssize_t received_len = 0;
-    ssize_t read_len;
-    unsigned char *tag = new unsigned char[TAG_LEN];
-    while ((unsigned long)received_len < TAG_LEN) {
-        if ((read_len = read(socket, tag + received_len,
-                             TAG_LEN - received_len)) <= 0) {
-            res.set_error("Error when reading tag");
+    // Walk the length of each field, receiving more only when what is
+    // buffered is not enough
+    for (int i = 0; i < fields; i++) {
+        auto fill_res = reader_fill(reader, needed + sizeof(flen), false);
+        if (fill_res.is_error) {
+            res.set_error(fill_res.error);
+            return res;
+        }
+        if (!fill_res.result) {
             return res;
         }
-        received_len += read_len;
+
+        // Never wait for (and buffer) more than the message can take
+        flen len;
+        memcpy(&len, reader_peek(reader, needed), sizeof(flen));
+        if (len > max_len) {
+            res.set_error("Field longer than allowed");
+            return res;
+        }
+        needed += sizeof(flen) + len;
     }
 
-    res.set_result(tag);
+    if (has_header) {
+        needed += TAG_LEN;
+    }
+
+    auto fill_res = reader_fill(reader, needed, false);
+    if (fill_res.is_error) {
+        res.set_error(fill_res.error);
+        return res;
+    }
+
+    res.set_result(fill_res.result);
     return res;
 }
 
@@ -366,6 +354,14 @@ const char *mtypes_to_string(mtypes m) {
         return "AuthServerAns";
     case AuthClientAns:
         return "AuthClientAns";
+    case ResumeStart:
+        return "ResumeStart";
+    case ResumeAns:
+        return "ResumeAns";
+    case NewTicket:
+        return "NewTicket";
+    case KeyUpdate:
+        return "KeyUpdate";
     case UploadReq:
         return "UploadReq";
     case UploadAns:
@@ -378,6 +374,8 @@ const char *mtypes_to_string(mtypes m) {
         return "UploadRes";
     case DownloadReq:
         return "DownloadReq";
+    case DownloadAns:
+        return "DownloadAns";
     case DownloadChunk:
         return "DownloadChunk";
     case DownloadEnd:
@@ -409,95 +407,200 @@ const char *mtypes_to_string(mtypes m) {
     }
 }
 
-void send_error_response(int sock, unsigned char *key, const char *msg) {
-    // Generate iv for message
-    auto iv_res = gen_iv();
-    if (iv_res.is_error) {
-        handle_errors(iv_res.error);
+/* Starts hashing the next block of [hash], from the last chaining value */
+static bool start_block(ResumeHash *hash) {
+    unsigned char first[RESUME_DIGEST_LEN] = {0};
+    const unsigned char *chain =
+        hash->chains.empty() ? first
+                             : &hash->chains[hash->chains.size() -
+                                             RESUME_DIGEST_LEN];
+    return EVP_DigestInit_ex(hash->block, EVP_sha256(), nullptr) == 1 &&
+           EVP_DigestUpdate(hash->block, chain, RESUME_DIGEST_LEN) == 1;
+}
+
+ResumeHash *new_resume_hash() {
+    ResumeHash *hash = new ResumeHash();
+    if ((hash->block = EVP_MD_CTX_new()) == nullptr || !start_block(hash)) {
+        free_resume_hash(hash);
+        return nullptr;
     }
-    auto iv = iv_res.result;
+    return hash;
+}
+
+void free_resume_hash(ResumeHash *hash) {
+    if (hash == nullptr)
+        return;
 
-    // Send download request
-    auto send_packet_header_res =
-        send_header(sock, Error, seq_num, iv, get_iv_len());
+    EVP_MD_CTX_free(hash->block);
+    delete hash;
+}
+
+bool resume_hash_start(ResumeHash *hash, uint64_t len,
+                       const unsigned char *chains) {
+    hash->len = len;
+    hash->chains.assign(chains,
+                        chains + len / RESUME_BLOCK * RESUME_DIGEST_LEN);
+    return start_block(hash);
+}
+
+bool resume_hash_update(ResumeHash *hash, const unsigned char *data,
+                        size_t len) {
+    while (len > 0) {
+        size_t n =
+            min<uint64_t>(len, RESUME_BLOCK - hash->len % RESUME_BLOCK);
+        if (EVP_DigestUpdate(hash->block, data, n) != 1)
+            return false;
+        hash->len += n;
+        data += n;
+        len -= n;
+
+        // The block is over, the next one chains from it
+        if (hash->len % RESUME_BLOCK == 0) {
+            unsigned char chain[RESUME_DIGEST_LEN];
+            if (EVP_DigestFinal_ex(hash->block, chain, nullptr) != 1)
+                return false;
+            hash->chains.insert(hash->chains.end(), chain,
+                                chain + RESUME_DIGEST_LEN);
+            if (!start_block(hash))
+                return false;
+        }
+    }
+    return true;
+}
+
+bool resume_hash_file(FILE *fp, uint64_t len, ResumeHash *hash) {
+    unsigned char *buffer = new unsigned char[CHUNK_SIZE];
+    uint64_t hashed = 0;
+    while (hashed < len) {
+        size_t n = min((uint64_t)CHUNK_SIZE, len - hashed);
+        if (fread(buffer, 1, n, fp) != n ||
+            !resume_hash_update(hash, buffer, n)) {
+            break;
+        }
+        hashed += n;
+    }
+    delete[] buffer;
+    return hashed == len;
+}
+
+bool resume_hash_digest(ResumeHash *hash, unsigned char *digest) {
+    EVP_MD_CTX *copy = EVP_MD_CTX_new();
+    bool ok = copy != nullptr && EVP_MD_CTX_copy_ex(copy, hash->block) == 1 &&
+              EVP_DigestFinal_ex(copy, digest, nullptr) == 1;
+    EVP_MD_CTX_free(copy);
+    return ok;
+}
+
+void send_error_response(Writer *writer, Aead *aead, seqnum &seq,
+                         const char *msg) {
+    // Send error header
+    auto send_packet_header_res = send_header(writer, Error, seq);
     if (send_packet_header_res.is_error) {
-        delete[] iv;
         handle_errors(send_packet_header_res.error);
     }
 
-    // Initialize encryption context
-    EVP_CIPHER_CTX *ctx;
-    int len = 0;
-    int ct_len;
-    if ((ctx = EVP_CIPHER_CTX_new()) == nullptr) {
-        delete[] iv;
-        handle_errors("Could not encrypt message (alloc)");
-    }
-
-    if (EVP_EncryptInit(ctx, get_symmetric_cipher(), key, iv) != 1) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-    delete[] iv;
-
-    // Authenticated data
-    int err = 0;
-    unsigned char header = mtype_to_uc(Error);
-    err |=
-        EVP_EncryptUpdate(ctx, nullptr, &len, &header, sizeof(unsigned char));
-    err |=
-        EVP_EncryptUpdate(ctx, nullptr, &len, seqnum_to_uc(), sizeof(seqnum));
-    if (err != 1) {
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-
-    // Encryption of the filename
-    unsigned char *ct = new unsigned char[FNAME_MAX_LEN + get_block_size()];
-    if (EVP_EncryptUpdate(
-            ctx, ct, &len,
-            reinterpret_cast<unsigned char *>(const_cast<char *>(msg)),
-            strlen(msg) + 1) != 1) {
+    // Encryption of the message
+    int ct_len = strlen(msg) + 1;
+    unsigned char *ct = new unsigned char[ct_len];
+    unsigned char tag[TAG_LEN];
+    auto seal_res = aead_seal(
+        aead, Error, seq,
+        reinterpret_cast<unsigned char *>(const_cast<char *>(msg)), ct_len,
+        ct, tag);
+    if (seal_res.is_error) {
         delete[] ct;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+        handle_errors(seal_res.error);
     }
-    ct_len = len;
 
-    if (EVP_EncryptFinal(ctx, ct + ct_len, &len) != 1) {
-        delete[] ct;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+    // Send ciphertext
+    auto ct_send_res = send_field(writer, (flen)ct_len, ct);
+    delete[] ct;
+    if (ct_send_res.is_error) {
+        handle_errors(ct_send_res.error);
     }
-    ct_len += len;
 
-    unsigned char *tag = new unsigned char[TAG_LEN];
-    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, TAG_LEN, tag) != 1) {
-        delete[] ct;
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+    auto tag_send_res = send_tag(writer, tag);
+    if (tag_send_res.is_error) {
+        handle_errors(tag_send_res.error);
     }
-    EVP_CIPHER_CTX_free(ctx);
 
-    // Send ciphertext
-    auto ct_send_res = send_field(sock, (flen)ct_len, ct);
+    inc_seqnum(seq);
+}
+
+void send_key_update(Writer *writer, Aead *aead, seqnum &seq) {
+    auto send_header_res = send_header(writer, KeyUpdate, seq);
+    if (send_header_res.is_error) {
+        handle_errors(send_header_res.error);
+    }
+
+    // Nothing to encrypt: the message only has to be authenticated, in its
+    // place in the sequence
+    unsigned char none;
+    unsigned char tag[TAG_LEN];
+    auto seal_res = aead_seal(aead, KeyUpdate, seq, &none, 0, &none, tag);
+    if (seal_res.is_error) {
+        handle_errors(seal_res.error);
+    }
+
+    auto ct_send_res = send_field(writer, 0, &none);
     if (ct_send_res.is_error) {
-        delete[] ct;
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
         handle_errors(ct_send_res.error);
     }
-    delete[] ct;
 
-    auto tag_send_res = send_tag(sock, tag);
+    auto tag_send_res = send_tag(writer, tag);
     if (tag_send_res.is_error) {
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
         handle_errors(tag_send_res.error);
     }
-    delete[] tag;
 
-    inc_seqnum();
+    auto update_res = aead_update_seal(aead, seq);
+    if (update_res.is_error) {
+        handle_errors(update_res.error);
+    }
+    inc_seqnum(seq);
+}
+
+void receive_key_update(Reader *reader, Aead *aead, seqnum &seq) {
+    auto header_res = read_header(reader);
+    if (header_res.is_error) {
+        handle_errors(header_res.error);
+    }
+    if (header_res.result != seq) {
+        handle_errors("Incorrect sequence number");
+    }
+
+    auto ct_res = read_field(reader);
+    if (ct_res.is_error) {
+        handle_errors(ct_res.error);
+    }
+    auto [ct_len, ct] = ct_res.result;
+    if (ct_len != 0) {
+        handle_errors("Invalid key update");
+    }
+
+    auto tag_res = read_tag(reader);
+    if (tag_res.is_error) {
+        handle_errors(tag_res.error);
+    }
+
+    unsigned char none;
+    auto open_res =
+        aead_open(aead, KeyUpdate, seq, ct, 0, tag_res.result, &none);
+    if (open_res.is_error) {
+        handle_errors(open_res.error);
+    }
+
+    auto update_res = aead_update_open(aead, seq);
+    if (update_res.is_error) {
+        handle_errors(update_res.error);
+    }
+    inc_seqnum(seq);
+}
+
+Maybe<mtypes> receive_mtype(Reader *reader, Aead *aead, seqnum &seq) {
+    auto mtype_res = get_mtype(reader);
+    while (!mtype_res.is_error && mtype_res.result == KeyUpdate) {
+        receive_key_update(reader, aead, seq);
+        mtype_res = get_mtype(reader);
+    }
+    return mtype_res;
 }
@@ -1,5 +1,8 @@
+#include "aead.h"
 #include "maybe.h"
+#include "reader.h"
 #include "types.h"
+#include "writer.h"
 #include <iostream>
 #include <openssl/bio.h>
 #include <openssl/evp.h>
@@ -7,6 +10,7 @@
 #include <stdio.h>
 #include <tuple>
 #include <unistd.h>
+#include <vector>
 
 #if __has_include(<filesystem>)
 #include <filesystem>
@@ -41,9 +45,11 @@ int get_signature_max_length(EVP_PKEY *privkey);
 
 /*
  * Key derivation function: given a shared secret, its length, and the required
- * length of the key, gets a key from the shared secret of the specified length.
- * The caller is responsible for the de-allocation of the key memory, and it
- * must be freed using `delete[]`
+ * length of the key, gets a key from the shared secret of the specified length
+ * with HKDF. The keys of each direction are in turn derived from it (see
+ * `new_aead`). The shared secret is wiped and freed. The caller is responsible
+ * for the de-allocation of the key memory, and it must be freed using
+ * `delete[]`
  */
 Maybe<unsigned char *> kdf(unsigned char *shared_secret, int shared_secret_len,
                            unsigned int key_len);
@@ -52,28 +58,55 @@ Maybe<unsigned char *> kdf(unsigned char *shared_secret, int shared_secret_len,
  * The caller is responsible for the de-allocation of the returned pointer, if
  * any
  */
-Maybe<unsigned char *> gen_iv();
+#define DUMMY_LEN 12
+Maybe<unsigned char *> get_dummy();
 
 /*
- * The caller is responsible for the de-allocation of the returned pointer, if
- * any
+ * The functions reading a message work on the receive buffer of the
+ * connection: the fields they return are views into it, which must not be
+ * freed. They are valid until the next message is started with `get_mtype`.
  */
-#define DUMMY_LEN 12
-Maybe<unsigned char *> get_dummy();
+Maybe<mtypes> get_mtype(Reader *reader);
+
+/*
+ * The functions sending a message queue its parts on the writer of the
+ * connection. The message is sent as a whole once it is over: after its tag,
+ * or after `writer_end_message` for the ones without a tag (authentication).
+ */
+Maybe<bool> send_header(Writer *writer, mtypes type);
+
+/*
+ * The IV of an encrypted message is not sent: each party derives it from the
+ * sequence number (see `aead_seal` and `aead_open`).
+ */
+Maybe<bool> send_header(Writer *writer, mtypes type, seqnum seq_num);
+Maybe<bool> send_tag(Writer *writer, unsigned char *tag);
 
-Maybe<mtypes> get_mtype(int socket);
+Maybe<bool> send_field(Writer *writer, flen len, unsigned char *data);
 
-Maybe<bool> send_header(int socket, mtypes type);
-Maybe<bool> send_header(int socket, mtypes type, seqnum seq_num, uchar *iv,
-                        int iv_len);
-Maybe<bool> send_tag(int socket, unsigned char *tag);
+/*
+ * Like `send_field`, without copying [data]: it must stay valid until the end
+ * of the message. Meant for big fields, such as the ciphertext of a chunk.
+ */
+Maybe<bool> send_field_ref(Writer *writer, flen len, unsigned char *data);
 
-Maybe<bool> send_field(int socket, flen len, unsigned char *data);
-Maybe<tuple<flen, unsigned char *>> read_field(int socket);
+Maybe<tuple<flen, unsigned char *>> read_field(Reader *reader);
 
 unsigned char mtype_to_uc(mtypes m);
-Maybe<tuple<seqnum, unsigned char *>> read_header(int socket);
-Maybe<unsigned char *> read_tag(int socket);
+Maybe<seqnum> read_header(Reader *reader);
+Maybe<unsigned char *> read_tag(Reader *reader);
+
+/*
+ * Checks, without consuming anything, whether a whole message has been
+ * received: the mtype, the sequence number (if [has_header]), [fields]
+ * length-prefixed fields and the tag (if [has_header]). Whatever is
+ * available on the socket is pulled into the buffer, without blocking. When
+ * it returns true the functions above can read the message without any
+ * syscall. Fails if the other party closed the connection, or if a field is
+ * longer than [max_len].
+ */
+Maybe<bool> is_message_ready(Reader *reader, int fields, bool has_header,
+                             flen max_len);
 
 unsigned char *string_to_uchar(const string &my_string);
 
@@ -88,6 +121,70 @@ bool is_path_valid(char *username, fs::path user_path);
 
 const char *mtypes_to_string(mtypes m);
 
-void send_error_response(int sock, unsigned char *key, const char *msg);
+/*
+ * Hash of the start of a file, for a transfer of it to be resumed. The file
+ * is hashed a block of RESUME_BLOCK bytes at a time, each block along with the
+ * chaining value of the ones before it: the SHA-256 of both, starting from 0s.
+ * The start of the file hashes to the SHA-256 of the last chaining value and
+ * of the bytes after it. Going on from the end of a block takes nothing but
+ * the chaining values, instead of hashing the file again, and they are all it
+ * takes to check a start of the file made of whole blocks.
+ */
+struct ResumeHash {
+    // Hash of the last chaining value and of the bytes of the current block
+    EVP_MD_CTX *block;
+
+    // Bytes hashed, and the chaining value at the end of each of their blocks
+    uint64_t len;
+    vector<unsigned char> chains;
+};
+
+ResumeHash *new_resume_hash();
+
+void free_resume_hash(ResumeHash *hash);
+
+/*
+ * Sets [hash] to the end of the first [len] bytes of a file, a whole number
+ * of blocks whose chaining values are [chains]. With a [len] of 0, it starts
+ * over.
+ */
+bool resume_hash_start(ResumeHash *hash, uint64_t len,
+                       const unsigned char *chains);
+
+/* Feeds [hash] the next [len] bytes of the file, from [data] */
+bool resume_hash_update(ResumeHash *hash, const unsigned char *data,
+                        size_t len);
+
+/*
+ * Feeds [hash] the next [len] bytes of [fp]. Returns false if the file is
+ * shorter, or cannot be read.
+ */
+bool resume_hash_file(FILE *fp, uint64_t len, ResumeHash *hash);
+
+/* Writes into [digest] the hash of the bytes [hash] was fed so far */
+bool resume_hash_digest(ResumeHash *hash, unsigned char *digest);
+
+void send_error_response(Writer *writer, Aead *aead, seqnum &seq,
+                         const char *msg);
+
+/*
+ * Sends a KeyUpdate with sequence number [seq], sealed with the current key,
+ * and moves on to the next key for the messages sent after it
+ */
+void send_key_update(Writer *writer, Aead *aead, seqnum &seq);
+
+/*
+ * Reads the rest of a KeyUpdate, whose message type has already been read,
+ * and moves on to the next key for the messages received after it. [seq] is
+ * the sequence number of the messages received.
+ */
+void receive_key_update(Reader *reader, Aead *aead, seqnum &seq);
+
+/*
+ * Reads the type of the next message, moving on to the next key for each
+ * KeyUpdate received before it. [seq] is the sequence number of the messages
+ * received.
+ */
+Maybe<mtypes> receive_mtype(Reader *reader, Aead *aead, seqnum &seq);
 
 #endif
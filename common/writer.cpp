@@ -0,0 +1,188 @@
+#include "writer.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+Writer *new_writer(int sock) {
+    Writer *writer = new Writer();
+    writer->sock = sock;
+    writer->buffered = 0;
+    writer->iov_count = 0;
+    writer->borrowing = false;
+    writer->corked = false;
+    writer->backlog_sent = 0;
+    return writer;
+}
+
+void free_writer(Writer *writer) { delete writer; }
+
+void writer_discard(Writer *writer) {
+    writer->buffered = 0;
+    writer->iov_count = 0;
+    writer->borrowing = false;
+}
+
+bool writer_pending(Writer *writer) { return !writer->backlog.empty(); }
+
+/* Copies the [iov_count] parts of [iov] at the end of the backlog */
+static void hold_back(Writer *writer, struct iovec *iov, int iov_count) {
+    for (int i = 0; i < iov_count; i++) {
+        auto *base = static_cast<unsigned char *>(iov[i].iov_base);
+        writer->backlog.insert(writer->backlog.end(), base,
+                               base + iov[i].iov_len);
+    }
+}
+
+/* Sends as much of the backlog as the socket takes */
+static Maybe<bool> send_backlog(Writer *writer) {
+    Maybe<bool> res;
+
+    while (writer->backlog_sent < writer->backlog.size()) {
+        ssize_t written =
+            write(writer->sock, writer->backlog.data() + writer->backlog_sent,
+                  writer->backlog.size() - writer->backlog_sent);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (written <= 0) {
+            writer->backlog.clear();
+            writer->backlog_sent = 0;
+            res.set_error("Error when writing message");
+            return res;
+        }
+        writer->backlog_sent += written;
+    }
+
+    // The memory is kept for the next time the socket is full
+    if (writer->backlog_sent == writer->backlog.size()) {
+        writer->backlog.clear();
+        writer->backlog_sent = 0;
+    }
+
+    res.set_result(writer->backlog.empty());
+    return res;
+}
+
+Maybe<bool> writer_flush(Writer *writer) {
+    Maybe<bool> res;
+
+    // Whatever is queued goes out after the bytes held back already
+    if (writer_pending(writer)) {
+        hold_back(writer, writer->iov, writer->iov_count);
+        writer_discard(writer);
+        return send_backlog(writer);
+    }
+
+    struct iovec *iov = writer->iov;
+    int iov_count = writer->iov_count;
+    while (iov_count > 0) {
+        ssize_t written = writev(writer->sock, iov, iov_count);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (written <= 0) {
+            writer_discard(writer);
+            res.set_error("Error when writing message");
+            return res;
+        }
+
+        // Skip whatever was sent, the socket may have taken only part of it
+        size_t left = written;
+        while (iov_count > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            iov++;
+            iov_count--;
+        }
+        if (iov_count > 0) {
+            iov->iov_base = static_cast<char *>(iov->iov_base) + left;
+            iov->iov_len -= left;
+        }
+    }
+
+    // The socket is full: the rest waits in the backlog, as the parts
+    // borrowed may be reused as soon as this returns
+    hold_back(writer, iov, iov_count);
+    writer_discard(writer);
+    res.set_result(!writer_pending(writer));
+    return res;
+}
+
+/* Appends an entry to the iovec, making room for it if needed */
+static Maybe<bool> queue(Writer *writer, void *base, size_t len) {
+    Maybe<bool> res;
+
+    // Extend the last entry if the part follows it in memory, as consecutive
+    // copies do
+    if (writer->iov_count > 0) {
+        struct iovec *last = &writer->iov[writer->iov_count - 1];
+        if (static_cast<char *>(last->iov_base) + last->iov_len == base) {
+            last->iov_len += len;
+            res.set_result(true);
+            return res;
+        }
+    }
+
+    if (writer->iov_count == WRITER_MAX_IOVECS) {
+        auto flush_res = writer_flush(writer);
+        if (flush_res.is_error) {
+            return flush_res;
+        }
+    }
+
+    writer->iov[writer->iov_count].iov_base = base;
+    writer->iov[writer->iov_count].iov_len = len;
+    writer->iov_count++;
+
+    res.set_result(true);
+    return res;
+}
+
+Maybe<bool> writer_copy(Writer *writer, const void *data, size_t len) {
+    if (len > WRITER_BUFFER_SIZE) {
+        // Too big to be copied, but it may be gone once this returns
+        auto borrow_res = writer_borrow(writer, data, len);
+        if (borrow_res.is_error) {
+            return borrow_res;
+        }
+        return writer_flush(writer);
+    }
+
+    // The copy must not be sent (and overwritten) by `queue` making room
+    if (writer->buffered + len > WRITER_BUFFER_SIZE ||
+        writer->iov_count == WRITER_MAX_IOVECS) {
+        auto flush_res = writer_flush(writer);
+        if (flush_res.is_error) {
+            return flush_res;
+        }
+    }
+
+    unsigned char *copy = writer->buffer + writer->buffered;
+    memcpy(copy, data, len);
+    writer->buffered += len;
+    return queue(writer, copy, len);
+}
+
+Maybe<bool> writer_borrow(Writer *writer, const void *data, size_t len) {
+    writer->borrowing = true;
+    return queue(writer, const_cast<void *>(data), len);
+}
+
+Maybe<bool> writer_end_message(Writer *writer) {
+    Maybe<bool> res;
+
+    if (!writer->corked || writer->borrowing) {
+        return writer_flush(writer);
+    }
+
+    res.set_result(true);
+    return res;
+}
+
+void writer_cork(Writer *writer) { writer->corked = true; }
+
+Maybe<bool> writer_uncork(Writer *writer) {
+    writer->corked = false;
+    return writer_flush(writer);
+}
@@ -0,0 +1,97 @@
+#include "maybe.h"
+#include <stddef.h>
+#include <sys/uio.h>
+#include <vector>
+
+using namespace std;
+
+#ifndef writer_h
+#define writer_h
+
+// Room for the small parts of the queued messages, copied by the writer
+#define WRITER_BUFFER_SIZE 16384
+
+// Parts of the queued messages, at most, sent with a single writev
+#define WRITER_MAX_IOVECS 64
+
+/*
+ * Send side of a connection. The parts of a message (header, fields and tag)
+ * are queued as an iovec, and each message is sent with a single writev
+ * instead of a write per part.
+ *
+ * Small parts are copied in the writer's own buffer, so that consecutive ones
+ * end up in a single iovec entry. Big ones (e.g. the ciphertext of a chunk)
+ * can be borrowed instead: they are referenced by the iovec and must stay
+ * valid until their message is over.
+ *
+ * While the writer is corked, complete messages are held back and coalesced
+ * with the following ones, up to `writer_uncork`. A message borrowing memory
+ * from the caller is always sent when it is over.
+ *
+ * On a non-blocking socket, what the socket does not take right away is
+ * copied into the writer's backlog, so that the caller can reuse what it lent
+ * all the same. The backlog goes out first at the next flushes, and the
+ * caller is expected to queue nothing more until it is over (see
+ * `writer_pending`), waiting for the socket to be writable instead.
+ */
+struct Writer {
+    int sock;
+
+    unsigned char buffer[WRITER_BUFFER_SIZE];
+    size_t buffered;
+
+    struct iovec iov[WRITER_MAX_IOVECS];
+    int iov_count;
+
+    // Whether some queued parts point to memory of the caller
+    bool borrowing;
+
+    bool corked;
+
+    // Bytes the socket did not take yet, and how many of them it took since
+    vector<unsigned char> backlog;
+    size_t backlog_sent;
+};
+
+/* The caller is responsible for freeing the writer with `free_writer` */
+Writer *new_writer(int sock);
+void free_writer(Writer *writer);
+
+/*
+ * Queues a copy of [len] bytes of [data]. Parts bigger than the writer's
+ * buffer are sent at once, along with whatever was queued before them.
+ */
+Maybe<bool> writer_copy(Writer *writer, const void *data, size_t len);
+
+/*
+ * Queues [len] bytes of [data] without copying them. They must stay valid
+ * until the end of the message.
+ */
+Maybe<bool> writer_borrow(Writer *writer, const void *data, size_t len);
+
+/*
+ * Marks the end of a message, sending everything queued unless the writer is
+ * corked
+ */
+Maybe<bool> writer_end_message(Writer *writer);
+
+/* Holds complete messages back until `writer_uncork` */
+void writer_cork(Writer *writer);
+
+/* Sends the messages held back, and stops holding them */
+Maybe<bool> writer_uncork(Writer *writer);
+
+/*
+ * Sends everything queued, as much of it as the socket takes: on a blocking
+ * socket, all of it. The rest is kept in the backlog. Returns whether
+ * everything went out, and fails if the connection is broken.
+ */
+Maybe<bool> writer_flush(Writer *writer);
+
+/* Whether some bytes are still waiting for the socket to take them */
+bool writer_pending(Writer *writer);
+
+/* Drops everything queued, e.g. a message left halfway by an error */
+void writer_discard(Writer *writer);
+
+#endif
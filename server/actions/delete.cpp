@@ -2,7 +2,9 @@
 #include "../../common/seq.h"
 #include "../../common/types.h"
 #include "../../common/utils.h"
-#include <openssl/evp.h>
+#include "../session.h"
+#include "delete.h"
+#include "upload.h"
 #include <string.h>
 
 #if __has_include(<filesystem>)
@@ -29,8 +31,9 @@ Maybe<fs::path> sanitize_path(char *username, unsigned char *f) {
         return res;
     }
 
-    // Check if file exists
-    if (!fs::exists(f_path)) {
+    // Check if file exists. Partial uploads are not files of the user, they
+    // are left to the uploads.
+    if (is_partial_upload(f_path) || !fs::exists(f_path)) {
         res.set_error("Error - File doesn't exist");
         return res;
     }
@@ -44,6 +47,7 @@ string actual_delete(fs::path f_path) {
     int retval = fs::remove(f_path, ec);
     if (!ec) { // Success
         if (retval) {
+            remove_journal(f_path);
             return "Deletion performed correctly";
         } else {
             return "File does not exist, but it should";
@@ -54,100 +58,42 @@ string actual_delete(fs::path f_path) {
     return "Deletion canceled - something went wrong";
 }
 
-void delete_file(int sock, unsigned char *key, char *username) {
+bool delete_file(Session *session) {
+    char *username = session->username;
 
-    auto server_header_res = read_header(sock);
+    auto server_header_res = read_header(session->reader);
     if (server_header_res.is_error) {
         handle_errors();
     }
-    auto [seq, iv] = server_header_res.result;
+    auto seq = server_header_res.result;
 
-    if (seq != seq_num) {
-        delete[] iv;
+    if (seq != session->recv_seq) {
         handle_errors("Incorrect sequence number");
     }
 
     // read ciphertext
-    auto ct_res = read_field(sock);
+    auto ct_res = read_field(session->reader);
     if (ct_res.is_error) {
-        delete[] iv;
         handle_errors();
     }
     auto [ct_len, ct] = ct_res.result;
 
     // read tag
-    auto tag_res = read_tag(sock);
+    auto tag_res = read_tag(session->reader);
     if (tag_res.is_error) {
-        delete[] ct;
-        delete[] iv;
         handle_errors();
     }
     auto tag = tag_res.result;
 
-    // Initialize decryption
-    EVP_CIPHER_CTX *ctx;
-    if ((ctx = EVP_CIPHER_CTX_new()) == nullptr) {
-        delete[] iv;
-        delete[] ct;
-        delete[] tag;
-        handle_errors("Could not decrypt message (alloc)");
-    }
-    int len;
-
-    if (EVP_DecryptInit(ctx, get_symmetric_cipher(), key, iv) != 1) {
-        delete[] iv;
-        delete[] ct;
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-
-    delete[] iv;
-
-    unsigned char header = mtype_to_uc(DeleteReq);
-
-    /* Specify authenticated data */
-    int err = 0;
-    err |= EVP_DecryptUpdate(ctx, nullptr, &len, &header, sizeof(mtype));
-    err |=
-        EVP_DecryptUpdate(ctx, nullptr, &len, seqnum_to_uc(), sizeof(seqnum));
-
-    if (err != 1) {
-        delete[] ct;
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-
     auto *pt = new unsigned char[ct_len];
-    int pt_len;
-    // Decrypt Update
-    if (EVP_DecryptUpdate(ctx, pt, &len, ct, ct_len) != 1) {
-        delete[] ct;
-        delete[] tag;
-        delete[] pt;
-        EVP_CIPHER_CTX_free(ctx);
-    }
-
-    // GCM tag check
-    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, TAG_LEN, tag);
-
-    // Decrypt Final. Finalize the encryption and adds the padding
-    if (EVP_DecryptFinal(ctx, pt + len, &len) != 1) {
-        delete[] ct;
-        delete[] tag;
+    auto open_res =
+        aead_open(session->aead, DeleteReq, seq, ct, ct_len, tag, pt);
+    if (open_res.is_error) {
         delete[] pt;
-        EVP_CIPHER_CTX_free(ctx);
+        handle_errors(open_res.error);
     }
 
-    // free variables
-    delete[] ct;
-    delete[] tag;
-
-    // free context
-    EVP_CIPHER_CTX_reset(ctx);
-
-    inc_seqnum();
+    inc_seqnum(session->recv_seq);
 
 #ifdef DEBUG
     cout << endl << "f to delete: " << pt << endl;
@@ -159,285 +105,121 @@ void delete_file(int sock, unsigned char *key, char *username) {
     // Sanitize path
     auto sanitize_res = sanitize_path(username, filename);
     if (sanitize_res.is_error) {
-        EVP_CIPHER_CTX_free(ctx);
-        send_error_response(sock, key, sanitize_res.error);
+        send_error_response(session->writer, session->aead, session->send_seq,
+                            sanitize_res.error);
         delete[] filename;
-        return;
+        return false;
     }
+    delete[] filename;
 
     //-----------------Respond to client---------------------
 
-    // Generate iv for message
-    auto iv_res = gen_iv();
-    if (iv_res.is_error) {
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors(iv_res.error);
-    }
-    iv = iv_res.result;
-
     auto send_packet_header_res =
-        send_header(sock, DeleteConfirm, seq_num, iv, get_iv_len());
+        send_header(session->writer, DeleteConfirm, session->send_seq);
     if (send_packet_header_res.is_error) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
         handle_errors(send_packet_header_res.error);
     }
 
-    // Initialize encryption context
-    len = 0;
-    ct_len = 0;
-
-    if (EVP_EncryptInit(ctx, get_symmetric_cipher(), key, iv) != 1) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-
-    // Authenticate data
-    err = 0;
-    header = mtype_to_uc(DeleteConfirm);
-    err |= EVP_EncryptUpdate(ctx, nullptr, &len, &header, sizeof(mtype));
-    err |=
-        EVP_EncryptUpdate(ctx, nullptr, &len, seqnum_to_uc(), sizeof(seqnum));
-    if (err != 1) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-
     unsigned char response[] = "Are you sure? (y/n)";
-    ct = new unsigned char[sizeof(response) + get_block_size()];
-    if (EVP_EncryptUpdate(ctx, ct, &len, response, sizeof(response)) != 1) {
-        delete[] iv;
-        delete[] ct;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-    ct_len = len;
-
-    if (EVP_EncryptFinal(ctx, ct + len, &len) != 1) {
-        delete[] iv;
-        delete[] ct;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-    ct_len += len;
-
+    ct_len = sizeof(response);
+    ct = new unsigned char[ct_len];
     tag = new unsigned char[TAG_LEN];
-    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, TAG_LEN, tag) != 1) {
-        delete[] iv;
+    auto seal_res = aead_seal(session->aead, DeleteConfirm, session->send_seq,
+                              response, sizeof(response), ct, tag);
+    if (seal_res.is_error) {
         delete[] ct;
         delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+        handle_errors(seal_res.error);
     }
-    delete[] iv;
-    EVP_CIPHER_CTX_reset(ctx);
 
-    auto ct_send_res = send_field(sock, (flen)ct_len, ct);
+    auto ct_send_res = send_field(session->writer, (flen)ct_len, ct);
     if (ct_send_res.is_error) {
         delete[] ct;
         delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
         handle_errors(ct_send_res.error);
     }
     delete[] ct;
 
-    auto tag_send_res = send_tag(sock, tag);
+    auto tag_send_res = send_tag(session->writer, tag);
     if (tag_send_res.is_error) {
         delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
         handle_errors(tag_send_res.error);
     }
     delete[] tag;
 
-    inc_seqnum();
+    inc_seqnum(session->send_seq);
 
-    //---------------Wait client confirmation---------------------
-
-    auto mtype_res = get_mtype(sock);
-    if (mtype_res.is_error || mtype_res.result != DeleteRes) {
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors("Incorrect message type");
-    }
+    // The file is deleted once the user confirms it
+    session->path = sanitize_res.result;
+    return true;
+}
 
-    server_header_res = read_header(sock);
+void delete_confirm(Session *session) {
+    auto server_header_res = read_header(session->reader);
     if (server_header_res.is_error) {
-        EVP_CIPHER_CTX_free(ctx);
         handle_errors();
     }
-    seq = get<0>(server_header_res.result);
-    iv = get<1>(server_header_res.result);
+    auto seq = server_header_res.result;
 
-    if (seq != seq_num) {
-        EVP_CIPHER_CTX_free(ctx);
-        delete[] iv;
+    if (seq != session->recv_seq) {
         handle_errors("Incorrect sequence number");
     }
 
     // read ciphertext
-    ct_res = read_field(sock);
+    auto ct_res = read_field(session->reader);
     if (ct_res.is_error) {
-        EVP_CIPHER_CTX_free(ctx);
-        delete[] iv;
         handle_errors();
     }
-    ct_len = get<0>(ct_res.result);
-    ct = get<1>(ct_res.result);
-    pt = new unsigned char[ct_len];
-
+    auto [ct_len, ct] = ct_res.result;
     // read tag
-    tag_res = read_tag(sock);
+    auto tag_res = read_tag(session->reader);
     if (tag_res.is_error) {
-        EVP_CIPHER_CTX_free(ctx);
-        delete[] ct;
-        delete[] pt;
-        delete[] iv;
-        handle_errors();
-    }
-    tag = tag_res.result;
-
-    if (EVP_DecryptInit(ctx, get_symmetric_cipher(), key, iv) != 1) {
-        delete[] iv;
-        delete[] ct;
-        delete[] tag;
-        delete[] pt;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-
-    delete[] iv;
-
-    header = mtype_to_uc(DeleteRes);
-
-    /* Specify authenticated data */
-    err = 0;
-    err |= EVP_DecryptUpdate(ctx, nullptr, &len, &header, sizeof(mtype));
-    err |=
-        EVP_DecryptUpdate(ctx, nullptr, &len, seqnum_to_uc(), sizeof(seqnum));
-
-    if (err != 1) {
-        delete[] ct;
-        delete[] tag;
-        delete[] pt;
-        EVP_CIPHER_CTX_free(ctx);
         handle_errors();
     }
+    auto tag = tag_res.result;
 
-    // Decrypt Update
-    if (EVP_DecryptUpdate(ctx, pt, &len, ct, ct_len) != 1) {
-        delete[] ct;
-        delete[] tag;
+    auto *pt = new unsigned char[ct_len];
+    auto open_res =
+        aead_open(session->aead, DeleteRes, seq, ct, ct_len, tag, pt);
+    if (open_res.is_error) {
         delete[] pt;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+        handle_errors(open_res.error);
     }
 
-    // GCM tag check
-    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, TAG_LEN, tag);
-
-    // Decrypt Final. Finalize the encryption and adds the padding
-    if (EVP_DecryptFinal(ctx, pt + len, &len) != 1) {
-        delete[] ct;
-        delete[] tag;
-        delete[] pt;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-
-    // free variables
-    delete[] ct;
-    delete[] tag;
-
-    // free context
-    EVP_CIPHER_CTX_reset(ctx);
-
-    inc_seqnum();
+    inc_seqnum(session->recv_seq);
 
     // Perform actual deletion
     string delete_response;
     if (strncmp(reinterpret_cast<char *>(pt), "y", 1) == 0) {
-        delete_response = actual_delete(sanitize_res.result);
+        delete_response = actual_delete(session->path);
     } else {
         delete_response = "Deletion aborted - user did not confirm";
     }
     delete[] pt;
-    delete[] filename;
 
     //-----------------Respond to client---------------------
 
-    // Generate iv for message
-    iv_res = gen_iv();
-    if (iv_res.is_error) {
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors(iv_res.error);
-    }
-    iv = iv_res.result;
-
-    send_packet_header_res =
-        send_header(sock, DeleteAns, seq_num, iv, get_iv_len());
+    auto send_packet_header_res =
+        send_header(session->writer, DeleteAns, session->send_seq);
     if (send_packet_header_res.is_error) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
         handle_errors(send_packet_header_res.error);
     }
 
-    // Initialize encryption context
-    len = 0;
-    ct_len = 0;
-
-    if (EVP_EncryptInit(ctx, get_symmetric_cipher(), key, iv) != 1) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-
-    // Authenticate data
-    err = 0;
-    header = mtype_to_uc(DeleteAns);
-    err |=
-        EVP_EncryptUpdate(ctx, nullptr, &len, &header, sizeof(unsigned char));
-    err |=
-        EVP_EncryptUpdate(ctx, nullptr, &len, seqnum_to_uc(), sizeof(seqnum));
-    if (err != 1) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-
-    pt_len = delete_response.length() + 1;
+    int pt_len = delete_response.length() + 1;
     pt = string_to_uchar(delete_response);
-    ct = new unsigned char[pt_len];
-    if (EVP_EncryptUpdate(ctx, ct, &len, pt, pt_len) != 1) {
-        delete[] iv;
-        delete[] pt;
-        delete[] ct;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-    ct_len = len;
-    delete[] pt;
-
-    if (EVP_EncryptFinal(ctx, ct + len, &len) != 1) {
-        delete[] iv;
-        delete[] ct;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-    ct_len += len;
-
+    ct_len = pt_len;
+    ct = new unsigned char[ct_len];
     tag = new unsigned char[TAG_LEN];
-    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, TAG_LEN, tag) != 1) {
-        delete[] iv;
+    auto seal_res = aead_seal(session->aead, DeleteAns, session->send_seq, pt,
+                              pt_len, ct, tag);
+    delete[] pt;
+    if (seal_res.is_error) {
         delete[] ct;
         delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+        handle_errors(seal_res.error);
     }
-    delete[] iv;
-    EVP_CIPHER_CTX_free(ctx);
 
-    ct_send_res = send_field(sock, (flen)ct_len, ct);
+    auto ct_send_res = send_field(session->writer, (flen)ct_len, ct);
     if (ct_send_res.is_error) {
         delete[] ct;
         delete[] tag;
@@ -445,12 +227,12 @@ void delete_file(int sock, unsigned char *key, char *username) {
     }
     delete[] ct;
 
-    tag_send_res = send_tag(sock, tag);
+    auto tag_send_res = send_tag(session->writer, tag);
     if (tag_send_res.is_error) {
         delete[] tag;
         handle_errors(tag_send_res.error);
     }
     delete[] tag;
 
-    inc_seqnum();
+    inc_seqnum(session->send_seq);
 }
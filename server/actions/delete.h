@@ -1,8 +1,18 @@
+#include "../../common/maybe.h"
+#include "../session.h"
+
 #ifndef delete_h
 #define delete_h
 
-void delete_file(int sock, unsigned char *key, char *username);
+/*
+ * Handles a DeleteReq. Returns true if the user has been asked to confirm the
+ * deletion, in which case the path of the file is left in the session.
+ */
+bool delete_file(Session *session);
+
+/* Handles the user's confirmation (DeleteRes) and performs the deletion */
+void delete_confirm(Session *session);
 
-int sanitize_path(char *username, unsigned char *f);
+Maybe<fs::path> sanitize_path(char *username, unsigned char *f);
 
-#endif
\ No newline at end of file
+#endif
@@ -2,8 +2,16 @@
 #include "../../common/seq.h"
 #include "../../common/types.h"
 #include "../../common/utils.h"
-#include <openssl/evp.h>
+#include "../session.h"
+#include "../spsc.h"
+#include "download.h"
+#include "upload.h"
+#include <algorithm>
+#include <errno.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
 
 #if __has_include(<filesystem>)
 #include <filesystem>
@@ -17,6 +25,70 @@ error "Missing the <filesystem> header."
 
 using namespace std;
 
+// Operations and registered buffers of a download on io_uring
+enum download_ops { ReadOp, SendOp };
+enum download_buffers { FileBuffer, FrameBuffer };
+
+// Messages in flight in the pipeline of a download on blocking I/O, at most,
+// and how many bytes of chunks they can take together. Big chunks make for
+// fewer frames, but never less than two.
+#define PIPELINE_FRAMES 8
+#define PIPELINE_MEMORY (1 << 22)
+
+// Header, sequence number and ciphertext length of a message
+#define FRAME_HEADER_LEN (sizeof(mtype) + sizeof(seqnum) + sizeof(flen))
+
+// A whole KeyUpdate message, whose ciphertext is empty
+#define KEY_UPDATE_LEN (FRAME_HEADER_LEN + TAG_LEN)
+
+/* A chunk message, built in place as it goes through the pipeline */
+struct PipelineFrame {
+    // Room for a KeyUpdate, the header, a chunk and the tag
+    unsigned char *data;
+
+    // Bytes of the chunk, then of the whole frame once sealed
+    int read_len;
+    unsigned int len;
+
+    // Whether the chunk is preceded by a KeyUpdate, in which case the frame
+    // starts with it. Otherwise it starts at the header of the chunk.
+    bool key_update;
+    unsigned int start;
+
+    // Last message of the download, and whether it could not be sealed
+    bool last;
+    bool failed;
+
+    // Set if the file could not be read: the message is an Error instead
+    const char *error;
+};
+
+/*
+ * Download on blocking I/O: a thread reads the file ahead and another one
+ * encrypts the chunks, while the session sends them. The frames are recycled
+ * through three rings, each with a single producer and a single consumer:
+ *
+ *   free_frames -> reader -> read_frames -> sealer -> sealed_frames -> sender
+ *        ^                                                               |
+ *        +---------------------------------------------------------------+
+ *
+ * The frames only ever move forward, so the messages are sent in the order
+ * of their sequence numbers.
+ */
+struct DownloadPipeline {
+    PipelineFrame frames[PIPELINE_FRAMES];
+    int n_frames;
+    unsigned int chunk_size;
+
+    SpscRing *free_frames;
+    SpscRing *read_frames;
+    SpscRing *sealed_frames;
+
+    thread reader;
+    thread sealer;
+    atomic<bool> stopping;
+};
+
 Maybe<FILE *> validate_request(char *username, char *filename) {
     Maybe<FILE *> res;
 
@@ -26,7 +98,8 @@ Maybe<FILE *> validate_request(char *username, char *filename) {
         return res;
     }
 
-    if (!fs::exists(filename_path)) {
+    // Partial uploads are not files of the user
+    if (is_partial_upload(filename_path) || !fs::exists(filename_path)) {
         res.set_error("Error - File not found");
         return res;
     }
@@ -39,253 +112,615 @@ Maybe<FILE *> validate_request(char *username, char *filename) {
     return res;
 }
 
-void download(int sock, unsigned char *key, char *username) {
+/*
+ * Clamps [ranges], as asked for by the client, to a file of [size] bytes:
+ * what lies past its end is left out
+ */
+static void clamp_ranges(ByteRange *ranges, int count, uint64_t size) {
+    for (int i = 0; i < count; i++) {
+        if (ranges[i].offset == RANGE_FROM_END) {
+            ranges[i].len = min(ranges[i].len, size);
+            ranges[i].offset = size - ranges[i].len;
+        } else {
+            ranges[i].offset = min(ranges[i].offset, size);
+            ranges[i].len = min(ranges[i].len, size - ranges[i].offset);
+        }
+    }
+}
+
+/*
+ * Returns how many bytes the next chunk of the download is read from [cursor],
+ * and at which offset. A chunk never spans two ranges.
+ */
+static tuple<unsigned int, uint64_t> next_read(RangeCursor *cursor,
+                                               unsigned int chunk_size) {
+    while (cursor->current < cursor->count - 1 &&
+           cursor->ranges[cursor->current].len == 0) {
+        cursor->current++;
+    }
+    ByteRange &range = cursor->ranges[cursor->current];
+    return {(unsigned int)min<uint64_t>(range.len, chunk_size), range.offset};
+}
+
+/* Moves [cursor] past the [len] bytes read. Returns whether any are left. */
+static bool advance(RangeCursor *cursor, unsigned int len) {
+    cursor->ranges[cursor->current].offset += len;
+    cursor->ranges[cursor->current].len -= len;
+    for (int i = cursor->current; i < cursor->count; i++) {
+        if (cursor->ranges[i].len > 0)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Reader stage: fills the free frames with the chunks of the file [fd], in
+ * order, as [cursor] lays them out
+ */
+static void read_stage(DownloadPipeline *pipeline, int fd, RangeCursor cursor) {
+    while (!pipeline->stopping) {
+        auto *frame = static_cast<PipelineFrame *>(
+            spsc_pop_wait(pipeline->free_frames));
+        if (frame == nullptr)
+            return;
+
+        auto [len, offset] = next_read(&cursor, pipeline->chunk_size);
+        frame->read_len = pread(
+            fd, frame->data + KEY_UPDATE_LEN + FRAME_HEADER_LEN, len, offset);
+        frame->error = nullptr;
+
+        // The file could not be read, or got shorter since the download
+        // started
+        if (frame->read_len != (int)len) {
+            frame->error = frame->read_len < 0 ? "Error - Could not read file"
+                                               : "Error - File was truncated";
+            frame->last = true;
+        } else {
+            frame->last = !advance(&cursor, len);
+        }
+
+        // The frame belongs to the next stage once pushed
+        bool last = frame->last;
+        spsc_push(pipeline->read_frames, frame);
+        if (last)
+            return;
+    }
+}
+
+/*
+ * Lays out the KeyUpdate with sequence number [seq] in [msg], as
+ * `send_key_update` does, and moves [aead] on to the next key
+ */
+static bool seal_key_update(Aead *aead, seqnum seq, unsigned char *msg) {
+    msg[0] = mtype_to_uc(KeyUpdate);
+    memcpy(msg + sizeof(mtype), &seq, sizeof(seqnum));
+    flen field_len = 0;
+    memcpy(msg + sizeof(mtype) + sizeof(seqnum), &field_len, sizeof(flen));
+
+    unsigned char *tag = msg + FRAME_HEADER_LEN;
+    return !aead_seal(aead, KeyUpdate, seq, tag, 0, tag, tag).is_error &&
+           !aead_update_seal(aead, seq).is_error;
+}
+
+/*
+ * Crypto stage: turns each chunk into a whole message, encrypted in place,
+ * numbering them from [seq]. The aead belongs to this stage until the last
+ * message is sealed, so it is the one to update the key when it is due.
+ */
+static void seal_stage(DownloadPipeline *pipeline, Aead *aead, seqnum seq) {
+    while (!pipeline->stopping) {
+        auto *frame = static_cast<PipelineFrame *>(
+            spsc_pop_wait(pipeline->read_frames));
+        if (frame == nullptr)
+            return;
+
+        frame->key_update = aead_needs_update(aead, seq);
+        frame->start = frame->key_update ? 0 : KEY_UPDATE_LEN;
+        frame->failed = false;
+        if (frame->key_update) {
+            frame->failed = !seal_key_update(aead, seq, frame->data);
+            seq++;
+        }
+
+        // Nothing left to read after the last chunk
+        mtypes msg_type = frame->last ? DownloadEnd : DownloadChunk;
+        unsigned char *msg = frame->data + KEY_UPDATE_LEN;
+        unsigned char *pt = msg + FRAME_HEADER_LEN;
+        int pt_len = frame->read_len;
+        if (frame->error != nullptr) {
+            msg_type = Error;
+            pt_len = strlen(frame->error) + 1;
+            memcpy(pt, frame->error, pt_len);
+        }
+
+        msg[0] = mtype_to_uc(msg_type);
+        memcpy(msg + sizeof(mtype), &seq, sizeof(seqnum));
+        flen field_len = pt_len;
+        memcpy(msg + sizeof(mtype) + sizeof(seqnum), &field_len,
+               sizeof(flen));
+
+        // The tag goes right after the ciphertext
+        if (!frame->failed) {
+            auto seal_res =
+                aead_seal(aead, msg_type, seq, pt, pt_len, pt, pt + pt_len);
+            frame->failed = seal_res.is_error;
+        }
+        frame->len =
+            KEY_UPDATE_LEN - frame->start + FRAME_HEADER_LEN + pt_len + TAG_LEN;
+
+        bool done = frame->last || frame->failed;
+        spsc_push(pipeline->sealed_frames, frame);
+        if (done)
+            return;
+        seq++;
+    }
+}
+
+static void start_pipeline(Session *session) {
+    DownloadPipeline *pipeline = new DownloadPipeline();
+    pipeline->free_frames = new_spsc(PIPELINE_FRAMES);
+    pipeline->read_frames = new_spsc(PIPELINE_FRAMES);
+    pipeline->sealed_frames = new_spsc(PIPELINE_FRAMES);
+    pipeline->stopping = false;
+    pipeline->chunk_size = session->chunk_size;
+    pipeline->n_frames = PIPELINE_MEMORY / pipeline->chunk_size;
+    pipeline->n_frames = min(max(pipeline->n_frames, 2), PIPELINE_FRAMES);
+    size_t frame_size =
+        KEY_UPDATE_LEN + FRAME_HEADER_LEN + pipeline->chunk_size + TAG_LEN;
+    for (int i = 0; i < pipeline->n_frames; i++) {
+        pipeline->frames[i].data = new unsigned char[frame_size];
+        spsc_push(pipeline->free_frames, &pipeline->frames[i]);
+    }
+
+    pipeline->reader =
+        thread(read_stage, pipeline, fileno(session->fp), session->ranges);
+    pipeline->sealer =
+        thread(seal_stage, pipeline, session->aead, session->send_seq);
+    session->pipeline = pipeline;
+}
+
+/* Stops both threads of [pipeline], once they are done with their frame */
+static void halt_pipeline(DownloadPipeline *pipeline) {
+    pipeline->stopping = true;
+    spsc_close(pipeline->free_frames);
+    spsc_close(pipeline->read_frames);
+    if (pipeline->reader.joinable())
+        pipeline->reader.join();
+    if (pipeline->sealer.joinable())
+        pipeline->sealer.join();
+}
+
+void stop_download(Session *session) {
+    DownloadPipeline *pipeline = session->pipeline;
+    if (pipeline == nullptr)
+        return;
+
+    halt_pipeline(pipeline);
+
+    free_spsc(pipeline->free_frames);
+    free_spsc(pipeline->read_frames);
+    free_spsc(pipeline->sealed_frames);
+    for (int i = 0; i < pipeline->n_frames; i++) {
+        delete[] pipeline->frames[i].data;
+    }
+    delete pipeline;
+    session->pipeline = nullptr;
+}
+
+/*
+ * Answers a DownloadReq for [ranges] of a file of [size] bytes, once clamped
+ * to it: the bytes that follow are theirs, in order
+ */
+static void send_download_ans(Session *session, uint64_t size,
+                              ByteRange *ranges, int n_ranges) {
+    unsigned char answer[sizeof(size) + 1 + MAX_RANGES * sizeof(ByteRange)];
+    memcpy(answer, &size, sizeof(size));
+    answer[sizeof(size)] = n_ranges;
+    memcpy(answer + sizeof(size) + 1, ranges, n_ranges * sizeof(ByteRange));
+    int answer_len = sizeof(size) + 1 + n_ranges * sizeof(ByteRange);
+
+    auto send_packet_header_res =
+        send_header(session->writer, DownloadAns, session->send_seq);
+    if (send_packet_header_res.is_error) {
+        handle_errors(send_packet_header_res.error);
+    }
+
+    // Encryption of the answer
+    int ct_len = answer_len;
+    unsigned char ct[sizeof(answer)];
+    unsigned char tag[TAG_LEN];
+    auto seal_res = aead_seal(session->aead, DownloadAns, session->send_seq,
+                              answer, answer_len, ct, tag);
+    if (seal_res.is_error) {
+        handle_errors(seal_res.error);
+    }
+
+    auto ct_send_res = send_field(session->writer, (flen)ct_len, ct);
+    if (ct_send_res.is_error) {
+        handle_errors(ct_send_res.error);
+    }
+
+    auto tag_send_res = send_tag(session->writer, tag);
+    if (tag_send_res.is_error) {
+        handle_errors(tag_send_res.error);
+    }
+
+    inc_seqnum(session->send_seq);
+}
+
+bool download(Session *session) {
+    char *username = session->username;
 
     // -----------receive client download request-----------
-    auto server_header_res = read_header(sock);
+    auto server_header_res = read_header(session->reader);
     if (server_header_res.is_error) {
         handle_errors();
     }
-    auto [seq, iv] = server_header_res.result;
+    auto seq = server_header_res.result;
 
-    if (seq != seq_num) {
-        delete[] iv;
+    if (seq != session->recv_seq) {
         handle_errors("Incorrect sequence number");
     }
 
     // Read ciphertext
-    auto ct_res = read_field(sock);
+    auto ct_res = read_field(session->reader);
     if (ct_res.is_error) {
-        delete[] iv;
         handle_errors();
     }
     auto [ct_len, ct] = ct_res.result;
 
     // Read tag
-    auto tag_res = read_tag(sock);
+    auto tag_res = read_tag(session->reader);
     if (tag_res.is_error) {
-        delete[] ct;
-        delete[] iv;
         handle_errors();
     }
     auto tag = tag_res.result;
 
-    // Initialize decryption
-    EVP_CIPHER_CTX *ctx;
-    if ((ctx = EVP_CIPHER_CTX_new()) == nullptr) {
-        delete[] iv;
-        delete[] ct;
-        delete[] tag;
-        handle_errors("Could not decrypt message (alloc)");
-    }
-    int len;
-
-    if (EVP_DecryptInit(ctx, get_symmetric_cipher(), key, iv) != 1) {
-        delete[] iv;
-        delete[] ct;
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+    auto *pt = new unsigned char[ct_len];
+    auto open_res =
+        aead_open(session->aead, DownloadReq, seq, ct, ct_len, tag, pt);
+    if (open_res.is_error) {
+        delete[] pt;
+        handle_errors(open_res.error);
     }
 
-    delete[] iv;
+    inc_seqnum(session->recv_seq);
 
-    unsigned char header = mtype_to_uc(DownloadReq);
+    // -----------validate client's request and answer-----------
+    // The file name, followed either by where to resume the download from if
+    // the client already holds the start of the file, or by the ranges of it
+    // to send
+    uint64_t offset = 0;
+    unsigned char digest[RESUME_DIGEST_LEN];
+    bool resume = ct_len == FNAME_MAX_LEN + RESUME_POINT_LEN;
+    ByteRange ranges[MAX_RANGES];
+    int n_ranges = 0;
+    if (resume) {
+        memcpy(&offset, pt + FNAME_MAX_LEN, sizeof(offset));
+        memcpy(digest, pt + FNAME_MAX_LEN + sizeof(offset), RESUME_DIGEST_LEN);
+    } else if (ct_len > FNAME_MAX_LEN) {
+        n_ranges = pt[FNAME_MAX_LEN];
+        if (n_ranges == 0 || n_ranges > MAX_RANGES ||
+            ct_len != FNAME_MAX_LEN + 1 + n_ranges * sizeof(ByteRange)) {
+            delete[] pt;
+            handle_errors("Malformed download request");
+        }
+        memcpy(ranges, pt + FNAME_MAX_LEN + 1, n_ranges * sizeof(ByteRange));
+    }
+
+    fs::path path =
+        get_user_storage_path(username) / reinterpret_cast<char *>(pt);
+    auto validation_res =
+        validate_request(username, reinterpret_cast<char *>(pt));
+    delete[] pt;
+    if (validation_res.is_error) {
+        send_error_response(session->writer, session->aead, session->send_seq,
+                            validation_res.error);
+        return false;
+    }
+    FILE *fp = validation_res.result;
+
+    struct stat st;
+    if (fstat(fileno(fp), &st) < 0) {
+        fclose(fp);
+        send_error_response(session->writer, session->aead, session->send_seq,
+                            "Error - File is not readable");
+        return false;
+    }
 
-    // Authenticated data
-    int err = 0;
-    err |= EVP_DecryptUpdate(ctx, nullptr, &len, &header, sizeof(mtype));
-    err |=
-        EVP_DecryptUpdate(ctx, nullptr, &len, seqnum_to_uc(), sizeof(seqnum));
+    // The client starts over if its partial file is not the start of this
+    // one anymore, as far as the journal of its upload can tell: the file is
+    // not hashed again
+    if (resume && !same_upload_start(path, st, offset, digest)) {
+        fclose(fp);
+        send_error_response(session->writer, session->aead, session->send_seq,
+                            "Error - Partial download does not match the file");
+        return false;
+    }
 
-    if (err != 1) {
-        delete[] ct;
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+    // The whole file is a single range, and the client is told what the
+    // ranges it asked for amount to
+    RangeCursor &cursor = session->ranges;
+    cursor.current = 0;
+    if (n_ranges > 0) {
+        clamp_ranges(ranges, n_ranges, st.st_size);
+        memcpy(cursor.ranges, ranges, n_ranges * sizeof(ByteRange));
+        cursor.count = n_ranges;
+        send_download_ans(session, st.st_size, ranges, n_ranges);
+    } else {
+        cursor.ranges[0] = {offset, st.st_size - offset};
+        cursor.count = 1;
     }
 
-    auto *pt = new unsigned char[ct_len];
-    if (EVP_DecryptUpdate(ctx, pt, &len, ct, ct_len) != 1) {
-        delete[] ct;
-        delete[] tag;
-        delete[] pt;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+    // The file is sent a chunk at a time, each time the socket is writable
+    session->fp = fp;
+
+    // With io_uring, the first chunk is read ahead right away
+    Uring *ring = get_session_ring(session);
+    if (ring != nullptr) {
+        auto [len, at] = next_read(&cursor, session->chunk_size);
+        auto read_res = uring_read_fixed(ring, ReadOp, fileno(session->fp),
+                                         FileBuffer, len, at, 0);
+        if (read_res.is_error) {
+            handle_errors(read_res.error);
+        }
+
+        auto submit_res = uring_submit(ring, 0);
+        if (submit_res.is_error) {
+            handle_errors(submit_res.error);
+        }
+    } else {
+        start_pipeline(session);
     }
 
-    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, TAG_LEN, tag);
+    return true;
+}
 
-    if (EVP_DecryptFinal(ctx, pt + len, &len) != 1) {
-        delete[] ct;
-        delete[] tag;
-        delete[] pt;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+/*
+ * download_chunk on the io_uring backend. The chunk has already been read
+ * into a registered buffer, and the whole message is built in the other one.
+ * Sending it and reading the next chunk are then submitted together, linked
+ * so that the read is cancelled if the send fails: a single syscall per chunk.
+ * What the socket does not take is left to the writer, to be sent once the
+ * socket is writable again.
+ */
+static bool download_chunk_uring(Session *session) {
+    int sock = session->sock;
+    Uring *ring = session->ring;
+    int file_fd = fileno(session->fp);
+
+    auto read_res = uring_result(ring, ReadOp);
+    if (read_res.is_error) {
+        handle_errors(read_res.error);
+    }
+    int read_len = read_res.result;
+    auto [len, offset] = next_read(&session->ranges, session->chunk_size);
+
+    // The previous message was sent in more than one go, and the read was
+    // cancelled in the meantime: issue it again
+    if (read_len == -ECANCELED) {
+        auto retry_res = uring_read_fixed(ring, ReadOp, file_fd, FileBuffer,
+                                          len, offset, 0);
+        if (retry_res.is_error) {
+            handle_errors(retry_res.error);
+        }
+
+        read_res = uring_result(ring, ReadOp);
+        if (read_res.is_error) {
+            handle_errors(read_res.error);
+        }
+        read_len = read_res.result;
     }
 
-    delete[] ct;
-    delete[] tag;
+    // The file could not be read, or got shorter since the download started
+    if (read_len != (int)len) {
+        fclose(session->fp);
+        session->fp = nullptr;
+        send_error_response(session->writer, session->aead, session->send_seq,
+                            read_len < 0 ? "Error - Could not read file"
+                                         : "Error - File was truncated");
+        return true;
+    }
 
-    EVP_CIPHER_CTX_reset(ctx);
+    // Nothing left to read after the last chunk
+    bool last = !advance(&session->ranges, read_len);
+    mtypes msg_type = last ? DownloadEnd : DownloadChunk;
 
-    inc_seqnum();
+    // Past the messages allowed under the current key, the next one is
+    // announced ahead of the chunk
+    if (aead_needs_update(session->aead, session->send_seq)) {
+        send_key_update(session->writer, session->aead, session->send_seq);
+    }
 
-    // -----------validate client's request and answer-----------
-    auto validation_res =
-        validate_request(username, reinterpret_cast<char *>(pt));
-    delete[] pt;
-    if (validation_res.is_error) {
-        EVP_CIPHER_CTX_free(ctx);
-        send_error_response(sock, key, validation_res.error);
-        return;
+    // Lay out the message: header, ciphertext length, ciphertext and tag
+    auto *buffer =
+        static_cast<unsigned char *>(ring->buffers[FileBuffer].iov_base);
+    auto *frame =
+        static_cast<unsigned char *>(ring->buffers[FrameBuffer].iov_base);
+    unsigned char *ct_len_field = frame + sizeof(mtype) + sizeof(seqnum);
+    unsigned char *ct = ct_len_field + sizeof(flen);
+
+    frame[0] = mtype_to_uc(msg_type);
+    memcpy(frame + sizeof(mtype), &session->send_seq, sizeof(seqnum));
+
+    // Encrypt the chunk straight into the message, followed by its tag
+    int ct_len = read_len;
+    auto seal_res = aead_seal(session->aead, msg_type, session->send_seq,
+                              buffer, read_len, ct, ct + ct_len);
+    if (seal_res.is_error) {
+        handle_errors(seal_res.error);
     }
 
-    FILE *file_fp = validation_res.result;
-
-    // Send the file a chunk at a time
-    unsigned char buffer[CHUNK_SIZE] = {0};
-    ct = new unsigned char[sizeof(buffer) + get_block_size()];
-    tag = new unsigned char[TAG_LEN];
-    mtypes msg_type = DownloadChunk;
-
-    for (;;) {
-        size_t read_len;
-        if ((read_len = fread(buffer, sizeof(*buffer), sizeof(buffer),
-                              file_fp)) != sizeof(buffer)) {
-
-            // When we read less than expected we could either have an error, or
-            // we could have reached eof
-            if (feof(file_fp) != 0) {
-                // Change message type, as this is the last chunk of data
-                msg_type = DownloadEnd;
-            } else if (ferror(file_fp) != 0) {
-                delete[] ct;
-                delete[] tag;
-                fclose(file_fp);
-                EVP_CIPHER_CTX_free(ctx);
-                send_error_response(sock, key, "Error - Could not read file");
-                return;
-            } else {
-                delete[] ct;
-                delete[] tag;
-                fclose(file_fp);
-                EVP_CIPHER_CTX_free(ctx);
-                send_error_response(sock, key, "Error - Cosmic rays uh?");
-                return;
-            }
-        }
+    flen field_len = ct_len;
+    memcpy(ct_len_field, &field_len, sizeof(flen));
+    unsigned int frame_len = (ct - frame) + ct_len + TAG_LEN;
 
-        // Generate iv for message
-        auto iv_res = gen_iv();
-        if (iv_res.is_error) {
-            delete[] ct;
-            delete[] tag;
-            fclose(file_fp);
-            EVP_CIPHER_CTX_free(ctx);
-            handle_errors(iv_res.error);
+    // The messages queued on the writer go out before this one
+    auto flush_res = writer_flush(session->writer);
+    if (flush_res.is_error) {
+        handle_errors(flush_res.error);
+    }
+
+    // They did not all fit in the socket: the message waits behind them
+    bool held_back = !flush_res.result;
+    if (held_back) {
+        auto copy_res = writer_copy(session->writer, frame, frame_len);
+        if (copy_res.is_error) {
+            handle_errors(copy_res.error);
         }
-        iv = iv_res.result;
-
-        // Send chunk header
-        auto send_packet_header_res =
-            send_header(sock, msg_type, seq_num, iv, get_iv_len());
-        if (send_packet_header_res.is_error) {
-            delete[] iv;
-            delete[] ct;
-            delete[] tag;
-            fclose(file_fp);
-            EVP_CIPHER_CTX_free(ctx);
-            handle_errors(send_packet_header_res.error);
+    } else {
+        // Send the message and, unless it is the last one, read the next
+        // chunk
+        auto send_res =
+            uring_write_fixed(ring, SendOp, sock, FrameBuffer, frame_len, 0,
+                              last ? 0 : IOSQE_IO_LINK);
+        if (send_res.is_error) {
+            handle_errors(send_res.error);
         }
+    }
 
-        if (EVP_EncryptInit(ctx, get_symmetric_cipher(), key, iv) != 1) {
-            delete[] iv;
-            delete[] ct;
-            delete[] tag;
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(file_fp);
-            handle_errors();
+    if (!last) {
+        auto [next_len, next_offset] =
+            next_read(&session->ranges, session->chunk_size);
+        auto next_res = uring_read_fixed(ring, ReadOp, file_fd, FileBuffer,
+                                         next_len, next_offset, 0);
+        if (next_res.is_error) {
+            handle_errors(next_res.error);
         }
-        delete[] iv;
-
-        // Authenticated data
-        err = 0;
-        header = mtype_to_uc(msg_type);
-        err |= EVP_EncryptUpdate(ctx, nullptr, &len, &header,
-                                 sizeof(unsigned char));
-        err |= EVP_EncryptUpdate(ctx, nullptr, &len, seqnum_to_uc(),
-                                 sizeof(seqnum));
-        if (err != 1) {
-            delete[] ct;
-            delete[] tag;
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(file_fp);
-            handle_errors();
+    }
+
+    // The next read is left running when the message was held back
+    unsigned wait_nr = held_back ? 0 : (last ? 1 : 2);
+    auto submit_res = uring_submit(ring, wait_nr);
+    if (submit_res.is_error) {
+        handle_errors(submit_res.error);
+    }
+
+    if (!held_back) {
+        auto sent_res = uring_result(ring, SendOp);
+        if (sent_res.is_error) {
+            handle_errors(sent_res.error);
         }
 
-        // Encrypt the chunk
-        if (EVP_EncryptUpdate(ctx, ct, &len, buffer, read_len) != 1) {
-            delete[] ct;
-            delete[] tag;
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(file_fp);
-            handle_errors();
+        // The socket is full, as non-blocking sockets are never waited on
+        int sent = sent_res.result == -EAGAIN ? 0 : sent_res.result;
+        if (sent < 0) {
+            handle_errors("Error when writing chunk");
         }
-        ct_len = len;
-
-        // Finalize encryption
-        if (EVP_EncryptFinal(ctx, ct + ct_len, &len) != 1) {
-            delete[] ct;
-            delete[] tag;
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(file_fp);
-            handle_errors();
+
+        // A short send: the writer keeps the rest for later
+        if ((unsigned int)sent < frame_len) {
+            auto copy_res =
+                writer_copy(session->writer, frame + sent, frame_len - sent);
+            if (copy_res.is_error) {
+                handle_errors(copy_res.error);
+            }
         }
-        ct_len += len;
-
-        if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, TAG_LEN, tag) !=
-            1) {
-            delete[] ct;
-            delete[] tag;
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(file_fp);
-            handle_errors();
+    }
+
+    // At the end, increase the sequence number
+    inc_seqnum(session->send_seq);
+
+    if (last) {
+        fclose(session->fp);
+        session->fp = nullptr;
+        return true;
+    }
+
+    return false;
+}
+
+/*
+ * Sends the [n_frames] sealed frames of [batch] with a single writev, then
+ * hands them back to the reader. Returns whether the last one ends the
+ * download.
+ */
+static bool send_frames(Session *session, PipelineFrame **batch,
+                        int n_frames) {
+    for (int i = 0; i < n_frames; i++) {
+        if (batch[i]->failed) {
+            handle_errors("Could not encrypt chunk");
         }
 
-        // Send ciphertext
-        auto ct_send_res = send_field(sock, (flen)ct_len, ct);
-        if (ct_send_res.is_error) {
-            delete[] ct;
-            delete[] tag;
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(file_fp);
-            handle_errors(ct_send_res.error);
+        auto queue_res = writer_borrow(
+            session->writer, batch[i]->data + batch[i]->start, batch[i]->len);
+        if (queue_res.is_error) {
+            handle_errors(queue_res.error);
         }
+    }
+
+    auto flush_res = writer_flush(session->writer);
+    if (flush_res.is_error) {
+        handle_errors(flush_res.error);
+    }
 
-        auto tag_send_res = send_tag(sock, tag);
-        if (tag_send_res.is_error) {
-            delete[] tag;
-            delete[] ct;
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(file_fp);
-            handle_errors(tag_send_res.error);
+    // The frames can be reused as soon as they are out
+    bool last = false;
+    for (int i = 0; i < n_frames; i++) {
+        if (batch[i]->key_update) {
+            inc_seqnum(session->send_seq);
         }
+        inc_seqnum(session->send_seq);
+        last = batch[i]->last;
+        spsc_push(session->pipeline->free_frames, batch[i]);
+    }
+    return last;
+}
+
+void finish_download(Session *session) {
+    DownloadPipeline *pipeline = session->pipeline;
+    if (pipeline == nullptr)
+        return;
 
-        // At the end, reset the context and increase the sequence number
-        EVP_CIPHER_CTX_reset(ctx);
-        inc_seqnum();
+    // The sealer may have moved the key on already: whatever it sealed is
+    // sent, for the sequence number and the key of the session to catch up
+    halt_pipeline(pipeline);
+
+    PipelineFrame *batch[PIPELINE_FRAMES];
+    int n_frames = 0;
+    void *item;
+    while ((item = spsc_pop(pipeline->sealed_frames)) != nullptr) {
+        batch[n_frames++] = static_cast<PipelineFrame *>(item);
+    }
+    send_frames(session, batch, n_frames);
+
+    stop_download(session);
+}
 
-        // We have reached EOF, thus the download has ended
-        // Note that we already sent the full file to the client, correctly
-        // ending with a DownloadEnd message
-        if (feof(file_fp) != 0) {
+bool download_chunk(Session *session) {
+    if (session->ring != nullptr) {
+        return download_chunk_uring(session);
+    }
+
+    DownloadPipeline *pipeline = session->pipeline;
+
+    // Wait for the next message, then take along every other one that is
+    // already sealed, so that all of them go out with a single writev
+    PipelineFrame *batch[PIPELINE_FRAMES];
+    int n_frames = 0;
+    void *item = spsc_pop_wait(pipeline->sealed_frames);
+    while (item != nullptr) {
+        auto *frame = static_cast<PipelineFrame *>(item);
+        batch[n_frames++] = frame;
+        if (frame->last || frame->failed)
             break;
-        }
+        item = spsc_pop(pipeline->sealed_frames);
+    }
+    if (n_frames == 0) {
+        handle_errors("Download pipeline stopped");
+    }
+
+    bool last = send_frames(session, batch, n_frames);
+
+    // We have reached EOF, thus the download has ended
+    // Note that we already sent the full file to the client, correctly
+    // ending with a DownloadEnd message (or an Error one)
+    if (last) {
+        stop_download(session);
+        fclose(session->fp);
+        session->fp = nullptr;
+        return true;
     }
 
-    delete[] tag;
-    delete[] ct;
-    EVP_CIPHER_CTX_free(ctx);
-    fclose(file_fp);
+    return false;
 }
@@ -1,6 +1,43 @@
+#include "../session.h"
+
 #ifndef download_h
 #define download_h
 
-void download(int sock, unsigned char *key, char *username);
+/*
+ * Handles a DownloadReq. Returns true if the download was accepted, in which
+ * case the requested file is left open in the session, to be sent.
+ *
+ * A request can resume an interrupted download: the file name is then
+ * followed by the offset to go on from and the hash of the bytes before it,
+ * which the client holds (see RESUME_POINT_LEN). The offset is either the end
+ * of a block of the resume hash or the end of the file. If the file does not
+ * start with them anymore, or if it was not uploaded whole to the server, so
+ * that it cannot be told, the request is turned down with an Error.
+ *
+ * A request can also ask for some ranges of the file only: the file name is
+ * then followed by their number, on a byte, and the ranges themselves. They
+ * are answered with a DownloadAns holding the size of the file, the number of
+ * ranges and the ranges once clamped to the file, whose bytes follow.
+ */
+bool download(Session *session);
+
+/*
+ * Sends the next chunk of the file being downloaded, along with the following
+ * ones if they are ready. Returns true once the download is over, after the
+ * file has been closed.
+ */
+bool download_chunk(Session *session);
+
+/*
+ * Stops the threads preparing the chunks of the download in progress, if
+ * any. The file is left open.
+ */
+void stop_download(Session *session);
+
+/*
+ * Stops them as well, but sends the messages they sealed already first, so
+ * that the session can seal messages of its own afterwards
+ */
+void finish_download(Session *session);
 
 #endif
@@ -1,3 +1,4 @@
+#include "../session.h"
 #include <tuple>
 using namespace std;
 
@@ -6,6 +7,6 @@ using namespace std;
 
 tuple<unsigned char *, unsigned int> get_file_list(char *username);
 
-void list_files(int sock, unsigned char *key, char *username);
+void list_files(Session *session);
 
 #endif
\ No newline at end of file
@@ -1,6 +1,8 @@
+#include "../session.h"
+
 #ifndef logout_h
 #define logout_h
 
-void logout(int sock, unsigned char *key);
+void logout(Session *session);
 
 #endif
@@ -2,7 +2,8 @@
 #include "../../common/seq.h"
 #include "../../common/types.h"
 #include "../../common/utils.h"
-#include <openssl/evp.h>
+#include "rename.h"
+#include "upload.h"
 #include <string.h>
 
 #if __has_include(<filesystem>)
@@ -38,11 +39,16 @@ Maybe<bool> handle_renaming(char *username, unsigned char *f_old,
         return res;
     }
 
-    // check if file exists
-    if (!fs::exists(f_old_path)) {
+    // check if file exists. Partial uploads are not files of the user, and
+    // no file can take their names.
+    if (is_partial_upload(f_old_path) || !fs::exists(f_old_path)) {
         res.set_error("Error - File does not exist");
         return res;
     }
+    if (is_partial_upload(f_new_path)) {
+        res.set_error("Error - Illegal file name");
+        return res;
+    }
 
     // check that new filename does not exist
     if (fs::exists(f_new_path)) {
@@ -50,110 +56,52 @@ Maybe<bool> handle_renaming(char *username, unsigned char *f_old,
         return res;
     }
 
-    // renaming
+    // renaming, along with the journal of its upload
     fs::rename(f_old_path, f_new_path);
+    rename_journal(f_old_path, f_new_path);
 
     return res;
 }
 
-void rename(int sock, unsigned char *key, char *username) {
+void rename(Session *session) {
+    char *username = session->username;
 
     // -----------receive client list request-----------
 
-    auto server_header_res = read_header(sock);
+    auto server_header_res = read_header(session->reader);
     if (server_header_res.is_error) {
         handle_errors();
     }
-    auto [seq, iv] = server_header_res.result;
+    auto seq = server_header_res.result;
 
-    if (seq != seq_num) {
-        delete[] iv;
+    if (seq != session->recv_seq) {
         handle_errors("Incorrect sequence number");
     }
 
     // read ciphertext
-    auto ct_res = read_field(sock);
+    auto ct_res = read_field(session->reader);
     if (ct_res.is_error) {
-        delete[] iv;
         handle_errors();
     }
     auto [ct_len, ct] = ct_res.result;
 
     // read tag
-    auto tag_res = read_tag(sock);
+    auto tag_res = read_tag(session->reader);
     if (tag_res.is_error) {
-        delete[] ct;
-        delete[] iv;
         handle_errors();
     }
     auto tag = tag_res.result;
 
-    // Initialize decryption
-    EVP_CIPHER_CTX *ctx;
-    if ((ctx = EVP_CIPHER_CTX_new()) == nullptr) {
-        delete[] iv;
-        delete[] ct;
-        delete[] tag;
-        handle_errors("Could not decrypt message (alloc)");
-    }
-    int len;
-
-    if (EVP_DecryptInit(ctx, get_symmetric_cipher(), key, iv) != 1) {
-        delete[] iv;
-        delete[] ct;
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-
-    delete[] iv;
-
-    unsigned char header = mtype_to_uc(RenameReq);
-
-    /* Specify authenticated data */
-    int err = 0;
-    err |= EVP_DecryptUpdate(ctx, nullptr, &len, &header, sizeof(mtype));
-    err |=
-        EVP_DecryptUpdate(ctx, nullptr, &len, seqnum_to_uc(), sizeof(seqnum));
-
-    if (err != 1) {
-        delete[] ct;
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-
+    // Decrypt the old and the new filename
     auto *pt = new unsigned char[ct_len];
-    int pt_len;
-    // Encrypt Update: one call is enough because our mesage is very short.
-    if (EVP_DecryptUpdate(ctx, pt, &len, ct, ct_len) != 1) {
-        delete[] ct;
-        delete[] tag;
-        delete[] pt;
-        EVP_CIPHER_CTX_free(ctx);
-    }
-    pt_len = len;
-
-    // GCM tag check
-    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, TAG_LEN, tag);
-
-    // Encrypt Final. Finalize the encryption and adds the padding
-    if (EVP_DecryptFinal(ctx, pt + len, &len) != 1) {
-        delete[] ct;
-        delete[] tag;
+    auto open_res =
+        aead_open(session->aead, RenameReq, seq, ct, ct_len, tag, pt);
+    if (open_res.is_error) {
         delete[] pt;
-        EVP_CIPHER_CTX_free(ctx);
+        handle_errors(open_res.error);
     }
-    pt_len += len;
-
-    // free variables
-    delete[] ct;
-    delete[] tag;
-
-    // free context
-    EVP_CIPHER_CTX_reset(ctx);
 
-    inc_seqnum();
+    inc_seqnum(session->recv_seq);
 
 #ifdef DEBUG
     cout << endl << "f_old || f_new: " << pt << endl;
@@ -163,8 +111,8 @@ void rename(int sock, unsigned char *key, char *username) {
     auto rename_res = handle_renaming(username, pt, pt + FNAME_MAX_LEN);
     if (rename_res.is_error) {
         delete[] pt;
-        EVP_CIPHER_CTX_free(ctx);
-        send_error_response(sock, key, rename_res.error);
+        send_error_response(session->writer, session->aead, session->send_seq,
+                            rename_res.error);
         return;
     }
 
@@ -172,75 +120,25 @@ void rename(int sock, unsigned char *key, char *username) {
 
     //-----------------Respond to client---------------------
 
-    // Generate iv for message
-    auto iv_res = gen_iv();
-    if (iv_res.is_error) {
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors(iv_res.error);
-    }
-    iv = iv_res.result;
-
     auto send_packet_header_res =
-        send_header(sock, RenameAns, seq_num, iv, get_iv_len());
+        send_header(session->writer, RenameAns, session->send_seq);
     if (send_packet_header_res.is_error) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
         handle_errors(send_packet_header_res.error);
     }
 
-    // Initialize encryption context
-    len = 0;
-    ct_len = 0;
-
-    if (EVP_EncryptInit(ctx, get_symmetric_cipher(), key, iv) != 1) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-
-    // Authenticate data
-    err = 0;
-    header = mtype_to_uc(RenameAns);
-    err |=
-        EVP_EncryptUpdate(ctx, nullptr, &len, &header, sizeof(unsigned char));
-    err |=
-        EVP_EncryptUpdate(ctx, nullptr, &len, seqnum_to_uc(), sizeof(seqnum));
-    if (err != 1) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-
     unsigned char response[] = "File renamed correctly";
-    ct = new unsigned char[pt_len];
-    if (EVP_EncryptUpdate(ctx, ct, &len, response, sizeof(response)) != 1) {
-        delete[] iv;
-        delete[] ct;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-    ct_len = len;
-
-    if (EVP_EncryptFinal(ctx, ct + len, &len) != 1) {
-        delete[] iv;
-        delete[] ct;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-    ct_len += len;
-
+    ct_len = sizeof(response);
+    ct = new unsigned char[ct_len];
     tag = new unsigned char[TAG_LEN];
-    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, TAG_LEN, tag) != 1) {
-        delete[] iv;
+    auto seal_res = aead_seal(session->aead, RenameAns, session->send_seq,
+                              response, sizeof(response), ct, tag);
+    if (seal_res.is_error) {
         delete[] ct;
         delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+        handle_errors(seal_res.error);
     }
-    delete[] iv;
-    EVP_CIPHER_CTX_free(ctx);
 
-    auto ct_send_res = send_field(sock, (flen)ct_len, ct);
+    auto ct_send_res = send_field(session->writer, (flen)ct_len, ct);
     if (ct_send_res.is_error) {
         delete[] ct;
         delete[] tag;
@@ -248,12 +146,12 @@ void rename(int sock, unsigned char *key, char *username) {
     }
     delete[] ct;
 
-    auto tag_send_res = send_tag(sock, tag);
+    auto tag_send_res = send_tag(session->writer, tag);
     if (tag_send_res.is_error) {
         delete[] tag;
         handle_errors(tag_send_res.error);
     }
     delete[] tag;
 
-    inc_seqnum();
+    inc_seqnum(session->send_seq);
 }
@@ -1,10 +1,11 @@
 #include "../../common/maybe.h"
+#include "../session.h"
 #include <string>
 
 #ifndef rename_h
 #define rename_h
 
-void rename(int sock, unsigned char *key, char *username);
+void rename(Session *session);
 
 // TODO: better type?
 int handle_renaming(unsigned char *msg, int msg_len, char *username);
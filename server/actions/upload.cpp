@@ -2,9 +2,20 @@
 #include "../../common/seq.h"
 #include "../../common/types.h"
 #include "../../common/utils.h"
-#include "download.h"
-#include <openssl/evp.h>
+#include "../session.h"
+#include "../spsc.h"
+#include "upload.h"
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <openssl/crypto.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
 
 #if __has_include(<filesystem>)
 #include <filesystem>
@@ -18,6 +29,89 @@ error "Missing the <filesystem> header."
 
 using namespace std;
 
+// Bytes coalesced in a single write, unless a chunk alone is bigger, and
+// buffers of them in the upload pipeline: no more than that is held in memory
+// for an upload
+#define WRITE_BEHIND_SIZE (8 * CHUNK_SIZE)
+#define WRITE_BEHIND_BUFFERS 4
+
+// An upload is received into a partial file next to where it goes. A journal
+// of what it holds is kept next to it, rewritten at the end of every block of
+// the resume hash once it is on the disk and whenever the upload is
+// interrupted, so that it can be resumed even after a crash. Both are kept for
+// this long (in seconds) since they were last written. Once the upload is
+// complete, its journal stays next to the file for good.
+#define PARTIAL_SUFFIX ".partial"
+#define JOURNAL_SUFFIX ".journal"
+#define PARTIAL_TTL (24 * 60 * 60)
+
+// Operations writing the two registered buffers of an upload on io_uring, apart
+// from those of downloads on the same ring
+#define WRITE_OP(buffer) (2 + (buffer))
+
+// Operation syncing the written chunks before the journal is rewritten
+#define SYNC_OP 4
+
+/*
+ * What the partial file of an interrupted upload holds: the bytes written, up
+ * to the end of a block of the resume hash. The chaining values of the blocks
+ * follow it in the journal, for the hash to go on from them without reading
+ * the bytes again. The journal of a complete upload has the size of the file
+ * and the hash of all of it as well, for its downloads to be resumed.
+ */
+struct UploadJournal {
+    uint64_t offset;
+    unsigned char digest[RESUME_DIGEST_LEN];
+};
+
+/* Plaintext of consecutive chunks, written to the file all at once */
+struct WriteBuffer {
+    unsigned char *data;
+    size_t size;
+    size_t len;
+
+    // Where the data goes in the file
+    off_t offset;
+
+    // Whether the journal is rewritten once the data is on the disk
+    bool checkpoint;
+    UploadJournal journal;
+    vector<unsigned char> chains;
+};
+
+/*
+ * Upload on blocking I/O: the session decrypts the chunks straight into a
+ * buffer, which is handed to a thread writing it behind once it is full. The
+ * buffers go back and forth through two rings:
+ *
+ *   session -> filled_buffers -> writer -> free_buffers -> session
+ *
+ * The session waits for a free buffer when the disk cannot keep up, instead
+ * of queueing more data.
+ */
+struct UploadPipeline {
+    WriteBuffer buffers[WRITE_BEHIND_BUFFERS];
+
+    SpscRing *free_buffers;
+    SpscRing *filled_buffers;
+
+    // Buffer being filled by the session, if any
+    WriteBuffer *current;
+
+    thread writer;
+    int fd;
+
+    // File being uploaded, whose journal the writer rewrites
+    fs::path path;
+
+    // Set by the writer when the file could not be written: the rest of the
+    // data is dropped, and the session aborts the upload
+    atomic<bool> failed;
+
+    // Set when the upload is aborted, so that the data is dropped
+    atomic<bool> stopping;
+};
+
 Maybe<fs::path> validate_path(char *username, char *f) {
     Maybe<fs::path> res;
     fs::path f_path = f;
@@ -29,6 +123,12 @@ Maybe<fs::path> validate_path(char *username, char *f) {
         return res;
     }
 
+    // The names of the partial files are taken
+    if (is_partial_upload(dest_path)) {
+        res.set_error("Error - Illegal file name");
+        return res;
+    }
+
     // check if file already exists
     if (fs::exists(dest_path)) {
         res.set_error("Error - File already exist");
@@ -39,176 +139,588 @@ Maybe<fs::path> validate_path(char *username, char *f) {
     return res;
 }
 
-void upload(int sock, unsigned char *key, char *username) {
+static fs::path partial_path(const fs::path &path) {
+    return path.native() + PARTIAL_SUFFIX;
+}
 
-    // -----------receive client upload request-----------
-    auto server_header_res = read_header(sock);
-    if (server_header_res.is_error) {
-        handle_errors();
+static fs::path journal_path(const fs::path &path) {
+    return path.native() + JOURNAL_SUFFIX;
+}
+
+static bool ends_with(const string &name, const string &suffix) {
+    return name.size() >= suffix.size() &&
+           name.compare(name.size() - suffix.size(), suffix.size(), suffix) ==
+               0;
+}
+
+bool is_partial_upload(const fs::path &path) {
+    string name = path.filename();
+    return ends_with(name, PARTIAL_SUFFIX) || ends_with(name, JOURNAL_SUFFIX);
+}
+
+/*
+ * Removes the partial files of [username] not written for too long, unless
+ * their upload is still in progress in another session, which holds the lock
+ * on them. The journals of complete uploads stay as long as their files.
+ */
+static void remove_stale_partials(char *username) {
+    time_t now = time(nullptr);
+    error_code ec;
+    for (const auto &entry :
+         fs::directory_iterator(get_user_storage_path(username), ec)) {
+        const string &name = entry.path().native();
+        struct stat st;
+        if (!is_partial_upload(entry.path()) ||
+            (ends_with(name, JOURNAL_SUFFIX) &&
+             fs::exists(name.substr(0, name.size() - strlen(JOURNAL_SUFFIX)),
+                        ec)) ||
+            stat(name.c_str(), &st) != 0 || now - st.st_mtime < PARTIAL_TTL) {
+            continue;
+        }
+
+        int fd = open(entry.path().c_str(), O_RDONLY);
+        if (fd < 0)
+            continue;
+        if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+            fs::remove(entry.path(), ec);
+        }
+        close(fd);
     }
-    auto [seq, iv] = server_header_res.result;
+}
 
-    if (seq != seq_num) {
-        delete[] iv;
-        handle_errors("Incorrect sequence number");
+/* Removes the partial file of the upload of [path], and its journal */
+static void remove_partial(const fs::path &path) {
+    remove(partial_path(path).c_str());
+    remove(journal_path(path).c_str());
+}
+
+/*
+ * Keeps the journal of the upload of [path]. It is written aside and renamed,
+ * so that a crash never leaves half of it in place of the previous one. The
+ * name aside is the journal of a partial file, which no upload can have.
+ */
+static bool save_journal(const fs::path &path, const UploadJournal &journal,
+                         const vector<unsigned char> &chains) {
+    fs::path next_path = journal_path(partial_path(path));
+    FILE *fp;
+    if ((fp = fopen(next_path.c_str(), "w")) == nullptr)
+        return false;
+
+    size_t chains_len = journal.offset / RESUME_BLOCK * RESUME_DIGEST_LEN;
+    bool ok = fwrite(&journal, sizeof(journal), 1, fp) == 1 &&
+              fwrite(chains.data(), 1, chains_len, fp) == chains_len;
+    if (fclose(fp) != 0 || !ok ||
+        rename(next_path.c_str(), journal_path(path).c_str()) != 0) {
+        remove(next_path.c_str());
+        return false;
     }
+    return true;
+}
 
-    // Read ciphertext
-    auto ct_res = read_field(sock);
-    if (ct_res.is_error) {
-        delete[] iv;
-        handle_errors();
+static bool load_journal(const fs::path &path, UploadJournal &journal,
+                         vector<unsigned char> &chains) {
+    FILE *fp;
+    if ((fp = fopen(journal_path(path).c_str(), "r")) == nullptr)
+        return false;
+
+    bool ok = fread(&journal, sizeof(journal), 1, fp) == 1 &&
+              journal.offset <= FSIZE_MAX;
+    if (ok) {
+        chains.resize(journal.offset / RESUME_BLOCK * RESUME_DIGEST_LEN);
+        ok = fread(chains.data(), 1, chains.size(), fp) == chains.size();
     }
-    auto [ct_len, ct] = ct_res.result;
+    fclose(fp);
+    return ok;
+}
 
-    // Read tag
-    auto tag_res = read_tag(sock);
-    if (tag_res.is_error) {
-        delete[] ct;
-        delete[] iv;
-        handle_errors();
+/*
+ * Keeps the journal of the upload of [path], complete: [hash] was fed all of
+ * the file
+ */
+static bool save_final_journal(const fs::path &path, ResumeHash *hash) {
+    UploadJournal journal;
+    journal.offset = hash->len;
+    return resume_hash_digest(hash, journal.digest) &&
+           save_journal(path, journal, hash->chains);
+}
+
+bool same_upload_start(const fs::path &path, const struct stat &st,
+                       uint64_t offset, const unsigned char *digest) {
+    // The journal is written once the file is, a file written since is not
+    // the one it is about anymore
+    struct stat journal_st;
+    if (stat(journal_path(path).c_str(), &journal_st) != 0 ||
+        st.st_mtim.tv_sec > journal_st.st_mtim.tv_sec ||
+        (st.st_mtim.tv_sec == journal_st.st_mtim.tv_sec &&
+         st.st_mtim.tv_nsec > journal_st.st_mtim.tv_nsec)) {
+        return false;
     }
-    auto tag = tag_res.result;
 
-    // Initialize decryption
-    EVP_CIPHER_CTX *ctx;
-    if ((ctx = EVP_CIPHER_CTX_new()) == nullptr) {
-        delete[] iv;
-        delete[] ct;
-        delete[] tag;
-        handle_errors("Could not decrypt message (alloc)");
+    UploadJournal journal;
+    vector<unsigned char> chains;
+    if (!load_journal(path, journal, chains) ||
+        journal.offset != (uint64_t)st.st_size || offset > journal.offset) {
+        return false;
+    }
+    uint64_t size = journal.offset;
+
+    // Only the whole file and whole blocks at its start have a known hash
+    unsigned char start_digest[RESUME_DIGEST_LEN];
+    if (offset == size) {
+        memcpy(start_digest, journal.digest, RESUME_DIGEST_LEN);
+    } else if (offset % RESUME_BLOCK == 0) {
+        ResumeHash *hash;
+        if ((hash = new_resume_hash()) == nullptr)
+            return false;
+        bool hashed = resume_hash_start(hash, offset, chains.data()) &&
+                      resume_hash_digest(hash, start_digest);
+        free_resume_hash(hash);
+        if (!hashed)
+            return false;
+    } else {
+        return false;
     }
-    int len;
+    return CRYPTO_memcmp(start_digest, digest, RESUME_DIGEST_LEN) == 0;
+}
 
-    if (EVP_DecryptInit(ctx, get_symmetric_cipher(), key, iv) != 1) {
-        delete[] iv;
-        delete[] ct;
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+void rename_journal(const fs::path &path, const fs::path &new_path) {
+    rename(journal_path(path).c_str(), journal_path(new_path).c_str());
+}
+
+void remove_journal(const fs::path &path) {
+    remove(journal_path(path).c_str());
+}
+
+/*
+ * Opens the partial file of the upload of [path], creating it if needed, and
+ * locks it: no other session, in this process or another worker, touches the
+ * upload until the file is closed. The lock must be taken on the file that
+ * still has the name, not one renamed or removed by the session that held it
+ * before.
+ */
+static Maybe<FILE *> lock_partial(const fs::path &path) {
+    Maybe<FILE *> res;
+
+    fs::path partial = partial_path(path);
+    int fd = open(partial.c_str(), O_RDWR | O_CREAT, 0666);
+    if (fd < 0) {
+        res.set_error("Error - Could not create file");
+        return res;
     }
 
-    delete[] iv;
+    struct stat locked, named;
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0 || fstat(fd, &locked) != 0 ||
+        stat(partial.c_str(), &named) != 0 || locked.st_dev != named.st_dev ||
+        locked.st_ino != named.st_ino) {
+        close(fd);
+        res.set_error("Error - File is being uploaded");
+        return res;
+    }
 
-    unsigned char header = mtype_to_uc(UploadReq);
+    FILE *fp;
+    if ((fp = fdopen(fd, "r+")) == nullptr) {
+        close(fd);
+        res.set_error("Error - Could not create file");
+        return res;
+    }
 
-    // Authenticated data
-    int err = 0;
-    err |= EVP_DecryptUpdate(ctx, nullptr, &len, &header, sizeof(mtype));
-    err |=
-        EVP_DecryptUpdate(ctx, nullptr, &len, seqnum_to_uc(), sizeof(seqnum));
+    res.set_result(fp);
+    return res;
+}
 
-    if (err != 1) {
-        delete[] ct;
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+/* Starts the upload of session->path from scratch, in its partial file */
+static bool start_partial(Session *session) {
+    remove(journal_path(session->path).c_str());
+    if (ftruncate(fileno(session->fp), 0) != 0 ||
+        !resume_hash_start(session->upload_hash, 0, nullptr)) {
+        return false;
     }
 
-    auto *pt = new unsigned char[ct_len];
-    if (EVP_DecryptUpdate(ctx, pt, &len, ct, ct_len) != 1) {
-        delete[] ct;
-        delete[] tag;
-        delete[] pt;
-        EVP_CIPHER_CTX_free(ctx);
+    session->offset = 0;
+    return true;
+}
+
+/*
+ * Picks up the interrupted upload of session->path where its journal says it
+ * stopped. The journal is only written once the bytes it covers are on the
+ * disk, so the running hash is set back from its chaining value, without
+ * reading them again. Returns false if there is nothing to resume.
+ */
+static bool resume_partial(Session *session) {
+    UploadJournal journal;
+    vector<unsigned char> chains;
+    if (!load_journal(session->path, journal, chains) ||
+        journal.offset % RESUME_BLOCK != 0) {
+        return false;
     }
 
-    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, TAG_LEN, tag);
+    // Anything past the journal may not have made it to the disk whole
+    int fd = fileno(session->fp);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < journal.offset ||
+        ftruncate(fd, journal.offset) != 0 ||
+        !resume_hash_start(session->upload_hash, journal.offset,
+                           chains.data())) {
+        return false;
+    }
 
-    if (EVP_DecryptFinal(ctx, pt + len, &len) != 1) {
-        delete[] ct;
-        delete[] tag;
-        delete[] pt;
-        EVP_CIPHER_CTX_free(ctx);
+    // The journal stays accurate: the bytes it covers are not written again
+    session->offset = journal.offset;
+    return true;
+}
+
+/* Writes the whole [buffer] at its offset in the file [fd] */
+static bool write_buffer(int fd, WriteBuffer *buffer) {
+    size_t written = 0;
+    while (written < buffer->len) {
+        ssize_t res = pwrite(fd, buffer->data + written, buffer->len - written,
+                             buffer->offset + written);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            return false;
+        written += res;
     }
+    return true;
+}
 
-    delete[] ct;
-    delete[] tag;
+/* Writer stage: writes the filled buffers, in order, until the ring closes */
+static void write_stage(UploadPipeline *pipeline) {
+    void *item;
+    while ((item = spsc_pop_wait(pipeline->filled_buffers)) != nullptr) {
+        auto *buffer = static_cast<WriteBuffer *>(item);
+        if (!pipeline->failed && !pipeline->stopping &&
+            !write_buffer(pipeline->fd, buffer)) {
+            pipeline->failed = true;
+        }
 
-    EVP_CIPHER_CTX_reset(ctx);
+        // The buffers before this one are written already. Failing to sync
+        // them only leaves the previous journal.
+        if (buffer->checkpoint && !pipeline->failed && !pipeline->stopping &&
+            fdatasync(pipeline->fd) == 0) {
+            save_journal(pipeline->path, buffer->journal, buffer->chains);
+        }
 
-    inc_seqnum();
+        // Recycled even after a failure, so that the session never waits for
+        // a buffer in vain
+        buffer->len = 0;
+        buffer->checkpoint = false;
+        spsc_push(pipeline->free_buffers, buffer);
+    }
+}
 
-    // -----------validate client's request and answer-----------
-    auto validation_res = validate_path(username, reinterpret_cast<char *>(pt));
+static void start_write_behind(Session *session) {
+    UploadPipeline *pipeline = new UploadPipeline();
+    pipeline->free_buffers = new_spsc(WRITE_BEHIND_BUFFERS);
+    pipeline->filled_buffers = new_spsc(WRITE_BEHIND_BUFFERS);
+    pipeline->current = nullptr;
+    pipeline->fd = fileno(session->fp);
+    pipeline->path = session->path;
+    pipeline->failed = false;
+    pipeline->stopping = false;
+
+    // Room for at least a whole chunk, as it is decrypted
+    size_t size = max((size_t)WRITE_BEHIND_SIZE,
+                      (size_t)(session->chunk_size + get_block_size()));
+    for (int i = 0; i < WRITE_BEHIND_BUFFERS; i++) {
+        pipeline->buffers[i].data = new unsigned char[size];
+        pipeline->buffers[i].size = size;
+        pipeline->buffers[i].len = 0;
+        pipeline->buffers[i].checkpoint = false;
+        spsc_push(pipeline->free_buffers, &pipeline->buffers[i]);
+    }
 
-    delete[] pt;
+    pipeline->writer = thread(write_stage, pipeline);
+    session->write_behind = pipeline;
+}
 
-    if (validation_res.is_error) {
-        EVP_CIPHER_CTX_free(ctx);
-        send_error_response(sock, key, validation_res.error);
+/* Hands the buffer being filled, if any, to the writer */
+static void hand_buffer(UploadPipeline *pipeline) {
+    if (pipeline->current == nullptr)
         return;
+
+    // There are as many slots as buffers, the ring cannot be full
+    spsc_push(pipeline->filled_buffers, pipeline->current);
+    pipeline->current = nullptr;
+}
+
+/*
+ * Returns where to decrypt a chunk of at most [len] bytes, received at
+ * [offset] in the file. Waits for the writer to free a buffer if the current
+ * one is full.
+ */
+static unsigned char *reserve_chunk(UploadPipeline *pipeline, size_t len,
+                                    off_t offset) {
+    WriteBuffer *buffer = pipeline->current;
+    if (buffer != nullptr && buffer->len + len > buffer->size) {
+        hand_buffer(pipeline);
+        buffer = nullptr;
     }
 
-    // Generate iv for message
-    auto iv_res = gen_iv();
-    if (iv_res.is_error) {
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors(iv_res.error);
+    if (buffer == nullptr) {
+        buffer = static_cast<WriteBuffer *>(
+            spsc_pop_wait(pipeline->free_buffers));
+        buffer->offset = offset;
+        pipeline->current = buffer;
     }
-    iv = iv_res.result;
 
-    auto send_packet_header_res =
-        send_header(sock, UploadAns, seq_num, iv, get_iv_len());
-    if (send_packet_header_res.is_error) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors(send_packet_header_res.error);
+    return buffer->data + buffer->len;
+}
+
+/*
+ * Waits for everything handed to the writer to be on file, and stops it.
+ * Returns false if some of it could not be written.
+ */
+static bool finish_write_behind(Session *session) {
+    UploadPipeline *pipeline = session->write_behind;
+    hand_buffer(pipeline);
+
+    // The writer drains the ring before seeing it closed
+    spsc_close(pipeline->filled_buffers);
+    pipeline->writer.join();
+    bool written = !pipeline->failed;
+
+    free_spsc(pipeline->free_buffers);
+    free_spsc(pipeline->filled_buffers);
+    for (int i = 0; i < WRITE_BEHIND_BUFFERS; i++) {
+        delete[] pipeline->buffers[i].data;
     }
+    delete pipeline;
+    session->write_behind = nullptr;
+    return written;
+}
 
-    // Initialize encryption context
-    len = 0;
-    ct_len = 0;
+/*
+ * Starts rewriting the journal at the end of the last block of the resume
+ * hash, once what was received so far is on the disk. The upload goes on
+ * meanwhile: on blocking I/O the writer syncs the file after writing the
+ * current buffer, on io_uring the sync is queued behind the writes in flight.
+ * A checkpoint is skipped if the previous one is still syncing.
+ */
+static void start_checkpoint(Session *session) {
+    ResumeHash *hash = session->upload_hash;
+    UploadJournal journal = {};
+    journal.offset = hash->len - hash->len % RESUME_BLOCK;
+
+    // The writer gets the chaining values as they are now, the session
+    // keeps adding to them
+    UploadPipeline *pipeline = session->write_behind;
+    if (pipeline != nullptr) {
+        pipeline->current->checkpoint = true;
+        pipeline->current->journal = journal;
+        pipeline->current->chains = hash->chains;
+        hand_buffer(pipeline);
+        return;
+    }
 
-    if (EVP_EncryptInit(ctx, get_symmetric_cipher(), key, iv) != 1) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+    Uring *ring = session->ring;
+    if (session->checkpoint != 0 ||
+        uring_datasync(ring, SYNC_OP, fileno(session->fp), IOSQE_IO_DRAIN)
+            .is_error) {
+        return;
+    }
+
+    auto submit_res = uring_submit(ring, 0);
+    if (submit_res.is_error) {
+        handle_errors(submit_res.error);
+    }
+    session->checkpoint = journal.offset;
+}
+
+/*
+ * Rewrites the journal once the sync of the checkpoint on io_uring is over, if
+ * there is one. Unless [wait], leaves it for later if it is still in flight.
+ */
+static void finish_checkpoint(Session *session, bool wait) {
+    Uring *ring = session->ring;
+    if (session->checkpoint == 0 || (!wait && ring->pending[SYNC_OP]))
+        return;
+
+    auto sync_res = uring_result(ring, SYNC_OP);
+    if (!sync_res.is_error && sync_res.result == 0) {
+        UploadJournal journal = {};
+        journal.offset = session->checkpoint;
+        save_journal(session->path, journal, session->upload_hash->chains);
+    }
+    session->checkpoint = 0;
+}
+
+void stop_upload(Session *session) {
+    if (session->write_behind == nullptr)
+        return;
+
+    session->write_behind->stopping = true;
+    finish_write_behind(session);
+}
+
+void suspend_upload(Session *session) {
+    Uring *ring = session->ring;
+
+    // The journal must not claim more than the file holds: whatever is still
+    // being written is waited for
+    bool written = true;
+    if (ring != nullptr) {
+        for (unsigned buffer = 0; buffer < 2; buffer++) {
+            unsigned len = ring->lengths[WRITE_OP(buffer)];
+            auto write_res = uring_result(ring, WRITE_OP(buffer));
+            written = written && !write_res.is_error &&
+                      write_res.result >= 0 &&
+                      (unsigned int)write_res.result == len;
+        }
+        finish_checkpoint(session, true);
+    } else if (session->write_behind != nullptr) {
+        written = finish_write_behind(session);
     }
 
-    // Authenticate data
-    err = 0;
-    header = mtype_to_uc(UploadAns);
-    err |=
-        EVP_EncryptUpdate(ctx, nullptr, &len, &header, sizeof(unsigned char));
-    err |=
-        EVP_EncryptUpdate(ctx, nullptr, &len, seqnum_to_uc(), sizeof(seqnum));
-    if (err != 1) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
+    // The upload is resumed from the end of the last whole block, the bytes
+    // after it are received again
+    ResumeHash *hash = session->upload_hash;
+    UploadJournal journal = {};
+    journal.offset = hash->len - hash->len % RESUME_BLOCK;
+    written = written && fdatasync(fileno(session->fp)) == 0;
+
+    // Nothing worth resuming otherwise. The file is only unlocked once its
+    // journal is settled.
+    if (!written || journal.offset == 0 ||
+        !save_journal(session->path, journal, hash->chains)) {
+        remove_partial(session->path);
+    }
+    fclose(session->fp);
+    session->fp = nullptr;
+}
+
+bool upload(Session *session) {
+    char *username = session->username;
+
+    // -----------receive client upload request-----------
+    auto server_header_res = read_header(session->reader);
+    if (server_header_res.is_error) {
         handle_errors();
     }
+    auto seq = server_header_res.result;
 
-    unsigned char response[] = "The file can be uploaded";
-    ct = new unsigned char[sizeof(response)];
-    if (EVP_EncryptUpdate(ctx, ct, &len, response, sizeof(response)) != 1) {
-        delete[] iv;
-        delete[] ct;
-        EVP_CIPHER_CTX_free(ctx);
+    if (seq != session->recv_seq) {
+        handle_errors("Incorrect sequence number");
+    }
+
+    // Read ciphertext
+    auto ct_res = read_field(session->reader);
+    if (ct_res.is_error) {
         handle_errors();
     }
-    ct_len = len;
+    auto [ct_len, ct] = ct_res.result;
 
-    if (EVP_EncryptFinal(ctx, ct + len, &len) != 1) {
-        delete[] iv;
-        delete[] ct;
-        EVP_CIPHER_CTX_free(ctx);
+    // Read tag
+    auto tag_res = read_tag(session->reader);
+    if (tag_res.is_error) {
         handle_errors();
     }
-    ct_len += len;
+    auto tag = tag_res.result;
+
+    auto *pt = new unsigned char[ct_len];
+    auto open_res =
+        aead_open(session->aead, UploadReq, seq, ct, ct_len, tag, pt);
+    if (open_res.is_error) {
+        delete[] pt;
+        handle_errors(open_res.error);
+    }
+
+    inc_seqnum(session->recv_seq);
 
+    // -----------validate client's request and answer-----------
+    // The file name, possibly followed by whether to resume a previous upload
+    bool resume = ct_len > FNAME_MAX_LEN && pt[FNAME_MAX_LEN] != 0;
+    auto validation_res = validate_path(username, reinterpret_cast<char *>(pt));
+
+    delete[] pt;
+
+    if (validation_res.is_error) {
+        send_error_response(session->writer, session->aead, session->send_seq,
+                            validation_res.error);
+        return false;
+    }
+
+    if (session->upload_hash == nullptr &&
+        (session->upload_hash = new_resume_hash()) == nullptr) {
+        handle_errors("Could not allocate hashing context");
+    }
+
+    // Make sure that the file can be written before accepting the upload.
+    // From now on the session owns it, and keeps it if the upload is
+    // interrupted.
+    remove_stale_partials(username);
+    session->path = validation_res.result;
+    auto lock_res = lock_partial(session->path);
+    if (lock_res.is_error) {
+        send_error_response(session->writer, session->aead, session->send_seq,
+                            lock_res.error);
+        return false;
+    }
+    session->fp = lock_res.result;
+
+    // Another session may have completed the same upload in the meantime,
+    // the journal is the one of its file now
+    if (fs::exists(session->path)) {
+        remove(partial_path(session->path).c_str());
+        fclose(session->fp);
+        session->fp = nullptr;
+        send_error_response(session->writer, session->aead, session->send_seq,
+                            "Error - File already exist");
+        return false;
+    }
+
+    bool resumed = resume && resume_partial(session);
+    if (!resumed && !start_partial(session)) {
+        remove_partial(session->path);
+        fclose(session->fp);
+        session->fp = nullptr;
+        send_error_response(session->writer, session->aead, session->send_seq,
+                            "Error - Could not create file");
+        return false;
+    }
+    session->buffer = 0;
+
+    // Without io_uring, the chunks are written behind by another thread
+    if (get_session_ring(session) == nullptr) {
+        start_write_behind(session);
+    }
+
+    auto send_packet_header_res =
+        send_header(session->writer, UploadAns, session->send_seq);
+    if (send_packet_header_res.is_error) {
+        handle_errors(send_packet_header_res.error);
+    }
+
+    // A request to resume learns where the upload goes on from
+    const char *message =
+        resumed ? "The upload is resumed" : "The file can be uploaded";
+    size_t message_len = strlen(message) + 1;
+    uint64_t offset = session->offset;
+    unsigned char digest[RESUME_DIGEST_LEN];
+    if (resume && !resume_hash_digest(session->upload_hash, digest)) {
+        handle_errors("Could not hash the uploaded file");
+    }
+
+    ct_len = (resume ? RESUME_POINT_LEN : 0) + message_len;
+    unsigned char *response = new unsigned char[ct_len];
+    if (resume) {
+        memcpy(response, &offset, sizeof(offset));
+        memcpy(response + sizeof(offset), digest, RESUME_DIGEST_LEN);
+    }
+    memcpy(response + ct_len - message_len, message, message_len);
+
+    ct = new unsigned char[ct_len];
     tag = new unsigned char[TAG_LEN];
-    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, TAG_LEN, tag) != 1) {
-        delete[] iv;
+    auto seal_res = aead_seal(session->aead, UploadAns, session->send_seq,
+                              response, ct_len, ct, tag);
+    delete[] response;
+    if (seal_res.is_error) {
         delete[] ct;
         delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+        handle_errors(seal_res.error);
     }
-    delete[] iv;
-    EVP_CIPHER_CTX_reset(ctx);
 
-    auto ct_send_res = send_field(sock, (flen)ct_len, ct);
+    auto ct_send_res = send_field(session->writer, (flen)ct_len, ct);
     if (ct_send_res.is_error) {
         delete[] ct;
         delete[] tag;
@@ -216,196 +728,190 @@ void upload(int sock, unsigned char *key, char *username) {
     }
     delete[] ct;
 
-    auto tag_send_res = send_tag(sock, tag);
+    auto tag_send_res = send_tag(session->writer, tag);
     if (tag_send_res.is_error) {
         delete[] tag;
         handle_errors(tag_send_res.error);
     }
     delete[] tag;
 
-    inc_seqnum();
-
-    //------------------Client's response------------------
-
-    pt = new unsigned char[CHUNK_SIZE + get_block_size()];
-    fs::path output_file_path = validation_res.result;
-    FILE *output_file_fp = fopen(output_file_path.native().c_str(), "w");
-    unsigned long received_size = 0;
-    for (;;) {
-        auto server_response_header_res = get_mtype(sock);
-        if (server_response_header_res.is_error) {
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(output_file_fp);
-            delete[] pt;
-            handle_errors(server_response_header_res.error);
-        }
-        auto server_response_header = server_response_header_res.result;
-
-        // Read IV and sequence number
-        server_header_res = read_header(sock);
-        if (server_header_res.is_error) {
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(output_file_fp);
-            delete[] pt;
-            handle_errors(server_header_res.error);
-        }
-        auto [in_seq, in_iv] = server_header_res.result;
-        seq = in_seq;
-        iv = in_iv;
-
-        // Check correctness of the sequence number
-        if (seq != seq_num) {
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(output_file_fp);
-            delete[] pt;
-            delete[] iv;
-            handle_errors("Incorrect sequence number");
-        }
+    inc_seqnum(session->send_seq);
 
-        // Read ciphertext
-        ct_res = read_field(sock);
-        if (ct_res.is_error) {
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(output_file_fp);
-            delete[] pt;
-            delete[] iv;
-            handle_errors(ct_res.error);
-        }
-        auto ct_tuple = ct_res.result;
-        ct_len = get<0>(ct_tuple);
-        ct = get<1>(ct_tuple);
+    return true;
+}
 
-        if (ct_len > CHUNK_SIZE + get_block_size()) {
-            handle_errors("Ciphertext longer than expected");
-        }
+/*
+ * Waits for the write of the chunk in the registered [buffer] to be over, so
+ * that the buffer can be reused
+ */
+static void wait_chunk_write(Uring *ring, unsigned buffer) {
+    unsigned len = ring->lengths[WRITE_OP(buffer)];
+    auto write_res = uring_result(ring, WRITE_OP(buffer));
+    if (write_res.is_error) {
+        handle_errors(write_res.error);
+    }
+    if (write_res.result < 0 || (unsigned int)write_res.result != len) {
+        handle_errors("Error when writing uploaded chunk to file");
+    }
+}
 
-        // Read tag
-        tag_res = read_tag(sock);
-        if (tag_res.is_error) {
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(output_file_fp);
-            delete[] pt;
-            delete[] ct;
-            delete[] iv;
-            handle_errors(tag_res.error);
-        }
-        tag = tag_res.result;
-
-        // Initialize decryption
-        if (EVP_DecryptInit(ctx, get_symmetric_cipher(), key, iv) != 1) {
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(output_file_fp);
-            delete[] pt;
-            delete[] tag;
-            delete[] ct;
-            delete[] iv;
-            handle_errors();
-        }
-        delete[] iv;
-
-        header = mtype_to_uc(server_response_header);
-
-        // Authenticated data
-        err = 0;
-        err |= EVP_DecryptUpdate(ctx, nullptr, &len, &header, sizeof(mtype));
-        err |= EVP_DecryptUpdate(ctx, nullptr, &len, seqnum_to_uc(),
-                                 sizeof(seqnum));
-
-        if (err != 1) {
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(output_file_fp);
-            delete[] pt;
-            delete[] tag;
-            delete[] ct;
-            handle_errors();
-        }
+bool upload_chunk(Session *session, mtypes type) {
+    FILE *output_file_fp = session->fp;
+    fs::path output_file_path = session->path;
+    Uring *ring = session->ring;
+    UploadPipeline *pipeline = session->write_behind;
+
+    // With io_uring, the chunk is decrypted straight into a registered buffer
+    // while the previous one is still being written from the other
+    if (ring != nullptr) {
+        wait_chunk_write(ring, session->buffer);
+        finish_checkpoint(session, false);
+    }
 
-        int pt_len;
-        if (EVP_DecryptUpdate(ctx, pt, &len, ct, ct_len) != 1) {
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(output_file_fp);
-            delete[] pt;
-            delete[] tag;
-            delete[] ct;
-            handle_errors();
-        }
-        pt_len = len;
-
-        // GCM tag check
-        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, TAG_LEN, tag);
-
-        if (EVP_DecryptFinal(ctx, pt + len, &len) != 1) {
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(output_file_fp);
-            delete[] pt;
-            delete[] tag;
-            delete[] ct;
-            handle_errors();
-        }
-        pt_len += len;
+    // Read sequence number
+    auto server_header_res = read_header(session->reader);
+    if (server_header_res.is_error) {
+        handle_errors(server_header_res.error);
+    }
+    auto seq = server_header_res.result;
 
-        delete[] ct;
-        delete[] tag;
+    // Check correctness of the sequence number
+    if (seq != session->recv_seq) {
+        handle_errors("Incorrect sequence number");
+    }
 
-        // Reset the context and increment the sequence number
-        EVP_CIPHER_CTX_reset(ctx);
-        inc_seqnum();
-
-        received_size += pt_len;
-        if (received_size > FSIZE_MAX) {
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(output_file_fp);
-            delete[] pt;
-            if (fs::exists(output_file_path)) {
-                fs::remove(output_file_path);
+    // Read ciphertext
+    auto ct_res = read_field(session->reader);
+    if (ct_res.is_error) {
+        handle_errors(ct_res.error);
+    }
+    auto [ct_len, ct] = ct_res.result;
+
+    if (ct_len > session->chunk_size + get_block_size()) {
+        handle_errors("Ciphertext longer than expected");
+    }
+
+    // Read tag
+    auto tag_res = read_tag(session->reader);
+    if (tag_res.is_error) {
+        handle_errors(tag_res.error);
+    }
+    auto tag = tag_res.result;
+
+    // The chunk is decrypted where it is going to be written from
+    unsigned char *pt;
+    if (ring != nullptr) {
+        pt = static_cast<unsigned char *>(
+            ring->buffers[session->buffer].iov_base);
+    } else {
+        pt = reserve_chunk(pipeline, ct_len, session->offset);
+    }
+    int pt_len = ct_len;
+    auto open_res = aead_open(session->aead, type, seq, ct, ct_len, tag, pt);
+    if (open_res.is_error) {
+        handle_errors(open_res.error);
+    }
+
+    inc_seqnum(session->recv_seq);
+
+    unsigned long received_size = session->offset + pt_len;
+    if (received_size > FSIZE_MAX) {
+        handle_errors("Error - File too big");
+    }
+
+    // Finally, handle the message
+    switch (type) {
+    case UploadChunk:
+    case UploadEnd:
+        if (ring != nullptr) {
+            // Not waited for: the next chunk goes to the other buffer
+            auto write_res = uring_write_fixed(
+                ring, WRITE_OP(session->buffer), fileno(output_file_fp),
+                session->buffer, pt_len, session->offset, 0);
+            if (write_res.is_error) {
+                handle_errors(write_res.error);
             }
-            handle_errors("Error - File too big");
-        }
 
-        // Finally, handle the message
-        switch (server_response_header) {
-        case UploadChunk:
-        case UploadEnd:
-            if (fwrite(pt, sizeof(*pt), pt_len, output_file_fp) !=
-                (unsigned int)pt_len) {
-                EVP_CIPHER_CTX_free(ctx);
-                fclose(output_file_fp);
-                delete[] pt;
-                if (fs::exists(output_file_path)) {
-                    fs::remove(output_file_path);
-                }
-                handle_errors("Error when writing uploaded chunk to file");
+            auto submit_res = uring_submit(ring, 0);
+            if (submit_res.is_error) {
+                handle_errors(submit_res.error);
             }
-            break;
-        case Error:
-        default:
-            // There was an error, either prior to the upload or during it
-            // Handle it by:
-            //   - printing the error to the user
-            //   - freeing memory
-            //   - removing the (partial) uploaded file
-
-            cout << pt << endl;
-
-            fclose(output_file_fp);
-            EVP_CIPHER_CTX_free(ctx);
-            delete[] pt;
-
-            if (fs::exists(output_file_path)) {
-                fs::remove(output_file_path);
+            session->buffer ^= 1;
+        } else {
+            // Keep the chunk in the buffer, unless the writer already gave up
+            if (pipeline->failed) {
+                handle_errors("Error when writing uploaded chunk to file");
             }
+            pipeline->current->len += pt_len;
+        }
 
-            return;
+        // The hash follows the bytes written, for the upload to be resumed
+        // if it is interrupted
+        if (!resume_hash_update(session->upload_hash, pt, pt_len)) {
+            handle_errors("Could not hash the uploaded file");
         }
+        session->offset += pt_len;
 
-        if (server_response_header == UploadEnd) {
-            break;
+        // A crash loses no more than the bytes since the last checkpoint
+        if (type == UploadChunk &&
+            session->offset / RESUME_BLOCK !=
+                (session->offset - pt_len) / RESUME_BLOCK) {
+            start_checkpoint(session);
+        }
+        break;
+    case Error:
+    default:
+        // There was an error, either prior to the upload or during it
+        // Handle it by:
+        //   - printing the error to the user
+        //   - freeing memory
+        //   - removing the partial file: the client gave up on it
+
+        cout << pt << endl;
+
+        // Let the writes still in flight end before getting rid of the file
+        if (ring != nullptr) {
+            uring_result(ring, WRITE_OP(0));
+            uring_result(ring, WRITE_OP(1));
+            finish_checkpoint(session, true);
         }
+        stop_upload(session);
+
+        remove_partial(output_file_path);
+        fclose(output_file_fp);
+        session->fp = nullptr;
+
+        return true;
+    }
+
+    if (type != UploadEnd) {
+        return false;
     }
 
-    EVP_CIPHER_CTX_reset(ctx);
+    if (ring != nullptr) {
+        wait_chunk_write(ring, 0);
+        wait_chunk_write(ring, 1);
+        finish_checkpoint(session, true);
+    } else if (!finish_write_behind(session)) {
+        handle_errors("Error when writing uploaded chunk to file");
+    }
+
+    // Complete, the file can take its name. Its journal stays, for its
+    // downloads to be resumed, unless it cannot be completed. The file is
+    // only unlocked once it is not the partial file anymore.
+    if (!save_final_journal(output_file_path, session->upload_hash)) {
+        remove_journal(output_file_path);
+    }
+    error_code ec;
+    fs::rename(partial_path(output_file_path), output_file_path, ec);
+    if (ec) {
+        remove_partial(output_file_path);
+    }
     fclose(output_file_fp);
-    delete[] pt;
+    session->fp = nullptr;
+    if (ec) {
+        handle_errors("Error when saving uploaded file");
+    }
 
 #ifdef DEBUG
     cout << "File saved locally as '" << output_file_path << "' correctly!"
@@ -414,73 +920,27 @@ void upload(int sock, unsigned char *key, char *username) {
 
     //---------------Send response----------------
 
-    // Generate iv for message
-    iv_res = gen_iv();
-    if (iv_res.is_error) {
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors(iv_res.error);
-    }
-    iv = iv_res.result;
     // Send upload request
-    send_packet_header_res =
-        send_header(sock, UploadRes, seq_num, iv, get_iv_len());
+    auto send_packet_header_res =
+        send_header(session->writer, UploadRes, session->send_seq);
     if (send_packet_header_res.is_error) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
         handle_errors(send_packet_header_res.error);
     }
 
-    if (EVP_EncryptInit(ctx, get_symmetric_cipher(), key, iv) != 1) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-
-    // Authenticated data
-    err = 0;
-    header = mtype_to_uc(UploadRes);
-    err |=
-        EVP_EncryptUpdate(ctx, nullptr, &len, &header, sizeof(unsigned char));
-    err |=
-        EVP_EncryptUpdate(ctx, nullptr, &len, seqnum_to_uc(), sizeof(seqnum));
-    if (err != 1) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-
-    // Encryption of the filename
     unsigned char response2[] = "File uploaded correctly";
-    ct = new unsigned char[sizeof(response2) + get_block_size()];
-    if (EVP_EncryptUpdate(ctx, ct, &len, response2, sizeof(response2)) != 1) {
-        delete[] iv;
-        delete[] ct;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-    ct_len = len;
-
-    if (EVP_EncryptFinal(ctx, ct + ct_len, &len) != 1) {
-        delete[] iv;
-        delete[] ct;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-    ct_len += len;
-
+    ct_len = sizeof(response2);
+    ct = new unsigned char[ct_len];
     tag = new unsigned char[TAG_LEN];
-    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, TAG_LEN, tag) != 1) {
-        delete[] iv;
+    auto seal_res = aead_seal(session->aead, UploadRes, session->send_seq,
+                              response2, sizeof(response2), ct, tag);
+    if (seal_res.is_error) {
         delete[] ct;
         delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+        handle_errors(seal_res.error);
     }
-    delete[] iv;
-    EVP_CIPHER_CTX_free(ctx);
 
     // Send ciphertext
-    ct_send_res = send_field(sock, (flen)ct_len, ct);
+    auto ct_send_res = send_field(session->writer, (flen)ct_len, ct);
     if (ct_send_res.is_error) {
         delete[] ct;
         delete[] tag;
@@ -488,12 +948,14 @@ void upload(int sock, unsigned char *key, char *username) {
     }
     delete[] ct;
 
-    tag_send_res = send_tag(sock, tag);
+    auto tag_send_res = send_tag(session->writer, tag);
     if (tag_send_res.is_error) {
         delete[] tag;
         handle_errors(tag_send_res.error);
     }
     delete[] tag;
 
-    inc_seqnum();
+    inc_seqnum(session->send_seq);
+
+    return true;
 }
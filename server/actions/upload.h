@@ -1,7 +1,63 @@
+#include "../../common/types.h"
+#include "../session.h"
+#include <sys/stat.h>
 
 #ifndef upload_h
 #define upload_h
 
-void upload(int sock, unsigned char *key, char *username);
+/*
+ * Handles an UploadReq. Returns true if the upload was accepted, in which case
+ * the output file is left open in the session, waiting for the chunks.
+ *
+ * The file is received as a partial file, next to where it goes, and only
+ * takes its name once complete. A request can ask to resume the upload of the
+ * same file, interrupted before: it is then answered with the offset the
+ * upload goes on from, the end of the last block of the resume hash received
+ * whole, and the hash of the bytes before it, for the client to check that
+ * they are the start of its file (see RESUME_POINT_LEN). The
+ * session holds a lock on the partial file until it is closed: a request for
+ * an upload still in progress in another session is turned down. The journal
+ * of the upload stays next to the file once complete (see same_upload_start).
+ */
+bool upload(Session *session);
+
+/*
+ * Handles one of the messages carrying the uploaded file (UploadChunk,
+ * UploadEnd, or Error if the client gave up). Returns true once the upload is
+ * over, after the output file has been closed.
+ */
+bool upload_chunk(Session *session, mtypes type);
+
+/*
+ * Stops the thread writing the upload in progress, if any, dropping what it
+ * was left to write. The file is left open.
+ */
+void stop_upload(Session *session);
+
+/*
+ * Interrupts the upload in progress, once everything received is written. The
+ * partial file is closed and kept along with its journal, so that the client
+ * can resume the upload later.
+ */
+void suspend_upload(Session *session);
+
+/* Whether [path] is the partial file of an upload, or its journal */
+bool is_partial_upload(const fs::path &path);
+
+/*
+ * Whether the first [offset] bytes of the file [path], whose status is [st],
+ * hash to [digest], as told by the journal its upload left next to it. Only
+ * the whole file and whole blocks of the resume hash at its start can be
+ * checked, and only if the file was uploaded whole to the server and not
+ * written since.
+ */
+bool same_upload_start(const fs::path &path, const struct stat &st,
+                       uint64_t offset, const unsigned char *digest);
+
+/* Renames the journal of the uploaded file [path] along with it */
+void rename_journal(const fs::path &path, const fs::path &new_path);
+
+/* Removes the journal of the uploaded file [path], once it is deleted */
+void remove_journal(const fs::path &path);
 
 #endif
@@ -1,14 +1,17 @@
 #include "authentication.h"
-#include "../common/dhparams.h"
 #include "../common/errors.h"
+#include "../common/kex.h"
+#include "../common/resumption.h"
 #include "../common/utils.h"
+#include "tickets.h"
+#include <algorithm>
 #include <iostream>
-#include <map>
 #include <new>
 #include <openssl/aes.h>
 #include <openssl/bio.h>
 #include <openssl/evp.h>
 #include <openssl/pem.h>
+#include <openssl/rand.h>
 #include <stdio.h>
 #include <string.h>
 #include <tuple>
@@ -25,149 +28,158 @@ error "Missing the <filesystem> header."
 
 using namespace std;
 
-void free_user_keys(map<string, EVP_PKEY *> keys) {
-    for (auto it = keys.begin(); it != keys.end(); it++) {
-        EVP_PKEY_free(it->second);
-    }
-    keys.clear();
-}
-
-// Possible users of the server
-string users[2] = {"alice", "bob"};
 unsigned char server_name[] = "server";
 
-/* Reads all the public keys of the registered users */
-static map<string, EVP_PKEY *> setup_keys() {
-    auto user_map = map<string, EVP_PKEY *>();
-    FILE *public_key_fp;
-    EVP_PKEY *pubkey;
-
-    for (string user : users) {
-
-        // Get the user public key path
-        auto user_key_path =
-            (fs::canonical(".") / "certificates" / (user + ".pub")).string();
+unsigned int max_chunk_size = 1 << 20;
 
-        // Open the public key file
-        if ((public_key_fp = fopen(user_key_path.c_str(), "r")) == nullptr) {
-            user_map.clear();
-            handle_errors();
-        }
+KeyPool *key_pool = nullptr;
 
-        // ... and read it as a public key
-        if ((pubkey = PEM_read_PUBKEY(public_key_fp, nullptr, 0, nullptr)) ==
-            nullptr) {
-            fclose(public_key_fp);
-            free_user_keys(user_map);
-            handle_errors();
-        }
-
-        fclose(public_key_fp);
-
-        // ... and save it into the list of users
-        user_map.insert({user, pubkey});
-
-#ifdef DEBUG
-        cout << "Loaded public key for " << user << endl
-             << "Path: " << user_key_path << endl
-             << endl;
-#endif
-    }
+void free_auth_state(AuthState *state) {
+    if (state == nullptr)
+        return;
 
-    return user_map;
+    delete[] state->username;
+    delete[] state->client_half_key_encoded;
+    delete[] state->server_half_key_encoded;
+    EVP_PKEY_free(state->client_pubkey);
+    EVP_PKEY_free(state->client_half_key);
+    EVP_PKEY_free(state->keypair);
+    delete state;
 }
 
 /*
- * Runs the key agreement protocol with the client.
- * Returns a tuple containing the username of the client and the agreed key.
- * The caller of this function has to free the memory allocated for the key when
- * done with it.
+ * Handles the client's opening message (AuthStart), whose message type has
+ * already been read, and answers with AuthServerAns.
+ * Returns the state of the handshake, to be completed by auth_finish once the
+ * client's answer arrives.
  */
-tuple<char *, unsigned char *> authenticate(int socket, int key_len) {
-    // Setup simple associations of usernames and public keys
-    auto user_keys = setup_keys();
+AuthState *auth_start(Reader *reader, Writer *writer) {
+    // Keys of the users and of the server, held until the answer is sent even
+    // if they are reloaded in the meantime
+    auto keystore = current_keystore();
+
+    AuthState *state = new AuthState();
 
     // ---------------------------------------------------------------------- //
     // ----------------- Client's opening message to Server ----------------- //
     // ---------------------------------------------------------------------- //
 
-    // Receive first client message
-    auto client_header_result = get_mtype(socket);
-
-    // Check the correctness of the message type
-    if (client_header_result.is_error ||
-        client_header_result.result != AuthStart) {
-        free_user_keys(user_keys);
-        handle_errors("Incorrect message type");
-    }
-
     // Read the username of the client
-    auto username_result = read_field(socket);
+    auto username_result = read_field(reader);
     if (username_result.is_error) {
-        free_user_keys(user_keys);
+        free_auth_state(state);
         handle_errors(username_result.error);
     }
-    auto [username_len, username] = username_result.result;
+    auto [username_len, username_view] = username_result.result;
+    if (username_len == 0 || username_len > USERNAME_MAX) {
+        free_auth_state(state);
+        handle_errors("Invalid username");
+    }
+
+    // The state outlives the message, thus it keeps copies of its fields
+    auto *username = new unsigned char[username_len];
+    memcpy(username, username_view, username_len);
     username[username_len - 1] = '\0';
+    state->username = username;
+    state->username_len = username_len;
 
 #ifdef DEBUG
     cout << endl << "Username length: " << username_len << endl;
     cout << "Username: " << username << endl << endl;
 #endif
 
-    // Check that it is registered on the server
-    auto finder = user_keys.find(reinterpret_cast<char *>(username));
-    EVP_PKEY *client_pubkey = nullptr;
-    if (finder != user_keys.end()) {
-        client_pubkey = finder->second;
-    } else {
-        free_user_keys(user_keys);
-        delete[] username;
-        handle_errors("User not registered!");
-    }
-
-    // Load the client's half key
-    BIO *tmp_bio;
-    if ((tmp_bio = BIO_new(BIO_s_mem())) == nullptr) {
-        free_user_keys(user_keys);
-        delete[] username;
-        handle_errors("Could not allocate memory bio");
-    }
-
-    // Read client half key in PEM format
-    auto half_key_result = read_field(socket);
+    // Check that it is registered on the server, and keep its public key for
+    // the verification of its signature
+    auto pubkey_res = registry_lookup(keystore->users,
+                                      reinterpret_cast<char *>(username));
+    if (pubkey_res.is_error) {
+        free_auth_state(state);
+        handle_errors(pubkey_res.error);
+    }
+    state->client_pubkey = pubkey_res.result;
+
+    // Read the key exchange method chosen by the client, followed by the
+    // encoding of the half keys, unless the client predates the raw one
+    auto method_result = read_field(reader);
+    if (method_result.is_error) {
+        free_auth_state(state);
+        handle_errors(method_result.error);
+    }
+    auto [method_len, method_view] = method_result.result;
+    if (method_len != 1 && method_len != 2) {
+        free_auth_state(state);
+        handle_errors("Invalid key exchange method");
+    }
+    auto kex_res = kex_method_from_byte(method_view[0]);
+    if (kex_res.is_error) {
+        free_auth_state(state);
+        handle_errors(kex_res.error);
+    }
+    state->method = kex_res.result;
+
+    auto encoding_res = kex_encoding_from_byte(
+        method_len == 2 ? method_view[1] : (unsigned char)KexEncodingPem);
+    if (encoding_res.is_error) {
+        free_auth_state(state);
+        handle_errors(encoding_res.error);
+    }
+    state->encoding = encoding_res.result;
+
+    // Read the client's half key, encoded as the method goes
+    auto half_key_result = read_field(reader);
     if (half_key_result.is_error) {
-        free_user_keys(user_keys);
-        delete[] username;
-        BIO_free(tmp_bio);
+        free_auth_state(state);
         handle_errors(half_key_result.error);
     }
-    auto [client_half_key_len, client_half_key_pem] = half_key_result.result;
-
-    // Write it to memory bio
-    if (BIO_write(tmp_bio, client_half_key_pem, client_half_key_len) !=
-        client_half_key_len) {
-        free_user_keys(user_keys);
-        delete[] username;
-        delete[] client_half_key_pem;
-        BIO_free(tmp_bio);
-        handle_errors("Could not write to memory bio");
-    }
+    auto [client_half_key_len, client_half_key_view] = half_key_result.result;
+    auto *client_half_key_encoded = new unsigned char[client_half_key_len];
+    memcpy(client_half_key_encoded, client_half_key_view, client_half_key_len);
+    state->client_half_key_encoded = client_half_key_encoded;
+    state->client_half_key_len = client_half_key_len;
 
     // ... and extract it as the client half key
-    auto client_half_key = PEM_read_bio_PUBKEY(tmp_bio, nullptr, 0, nullptr);
-    if (client_half_key == nullptr) {
-        free_user_keys(user_keys);
-        delete[] username;
-        delete[] client_half_key_pem;
-        BIO_free(tmp_bio);
-        handle_errors("Could not read from memory bio");
-    }
-    BIO_reset(tmp_bio);
+    auto client_half_key_res =
+        kex_decode(state->method, state->encoding, client_half_key_encoded,
+                   client_half_key_len);
+    if (client_half_key_res.is_error) {
+        free_auth_state(state);
+        handle_errors(client_half_key_res.error);
+    }
+    state->client_half_key = client_half_key_res.result;
+
+    // Read the largest chunk size the client can handle, and agree on the
+    // largest one that both of us can
+    auto chunk_size_result = read_field(reader);
+    if (chunk_size_result.is_error) {
+        free_auth_state(state);
+        handle_errors(chunk_size_result.error);
+    }
+    auto [chunk_size_len, chunk_size_view] = chunk_size_result.result;
+    if (chunk_size_len != sizeof(state->client_chunk_size)) {
+        free_auth_state(state);
+        handle_errors("Invalid chunk size");
+    }
+    memcpy(&state->client_chunk_size, chunk_size_view, chunk_size_len);
+    state->chunk_size = min(state->client_chunk_size, max_chunk_size);
+    state->chunk_size = max(state->chunk_size, (unsigned int)CHUNK_SIZE);
+
+    // Read the fingerprint of the server certificate the client holds, if it
+    // holds one, in which case there is no need to send it again
+    auto fingerprint_result = read_field(reader);
+    if (fingerprint_result.is_error) {
+        free_auth_state(state);
+        handle_errors(fingerprint_result.error);
+    }
+    auto [fingerprint_len, fingerprint_view] = fingerprint_result.result;
+    bool certificate_held =
+        fingerprint_len == FINGERPRINT_LEN &&
+        memcmp(fingerprint_view, keystore->certificate_fingerprint,
+               FINGERPRINT_LEN) == 0;
 
 #ifdef DEBUG
+    cout << "Key exchange: " << kex_method_name(state->method) << endl;
     cout << "Client half key:" << endl;
-    PEM_write_PUBKEY(stdout, client_half_key);
+    PEM_write_PUBKEY(stdout, state->client_half_key);
     cout << endl;
 #endif
 
@@ -176,325 +188,187 @@ tuple<char *, unsigned char *> authenticate(int socket, int key_len) {
     // ---------------------------------------------------------------------- //
 
     // Send header
-    auto send_header_result = send_header(socket, AuthServerAns);
+    auto send_header_result = send_header(writer, AuthServerAns);
     if (send_header_result.is_error) {
-        free_user_keys(user_keys);
-        delete[] username;
-        delete[] client_half_key_pem;
-        EVP_PKEY_free(client_half_key);
+        free_auth_state(state);
         handle_errors(send_header_result.error);
     }
 
     // Send server name ("server")
     auto send_server_name_res =
-        send_field(socket, sizeof(server_name), server_name);
+        send_field(writer, sizeof(server_name), server_name);
     if (send_server_name_res.is_error) {
-        free_user_keys(user_keys);
-        delete[] username;
-        delete[] client_half_key_pem;
-        EVP_PKEY_free(client_half_key);
+        free_auth_state(state);
         handle_errors(send_server_name_res.error);
     }
 
     // Send server's half key
 
-    // Generate the keypair for the server and write it the public key to the
-    // memory bio to extract it as PEM
-    auto keypair = gen_keypair();
-    if (PEM_write_bio_PUBKEY(tmp_bio, keypair) != 1) {
-        free_user_keys(user_keys);
-        delete[] username;
-        delete[] client_half_key_pem;
-        BIO_free(tmp_bio);
-        EVP_PKEY_free(client_half_key);
-        handle_errors("Could not write to memory bio");
-    };
-
-    // Get the length and a pointer to the bio's memory data
-    long server_half_key_len;
-    unsigned char *server_half_key_ptr;
-    if ((server_half_key_len =
-             BIO_get_mem_data(tmp_bio, &server_half_key_ptr)) <= 0) {
-        free_user_keys(user_keys);
-        delete[] username;
-        delete[] client_half_key_pem;
-        BIO_free(tmp_bio);
-        EVP_PKEY_free(client_half_key);
-        EVP_PKEY_free(keypair);
-        handle_errors("Could not read from memory bio");
+    // Take a keypair for the server, with the method of the client, out of
+    // the ones generated beforehand
+    auto keypair_res = key_pool_take(key_pool, state->method);
+    if (keypair_res.is_error) {
+        free_auth_state(state);
+        handle_errors(keypair_res.error);
     }
+    state->keypair = keypair_res.result;
+
+    // The half key is kept for later usage (signature computation and
+    // verification)
+    auto server_half_key_res =
+        kex_encode(state->method, state->encoding, state->keypair);
+    if (server_half_key_res.is_error) {
+        free_auth_state(state);
+        handle_errors(server_half_key_res.error);
+    }
+    auto [server_half_key_encoded, server_half_key_len] =
+        server_half_key_res.result;
+    state->server_half_key_encoded = server_half_key_encoded;
+    state->server_half_key_len = server_half_key_len;
 
 #ifdef DEBUG
     cout << "Server half key:" << endl;
-    PEM_write_PUBKEY(stdout, client_half_key);
+    PEM_write_PUBKEY(stdout, state->keypair);
     cout << endl;
 #endif
 
     // Check if the size of the public key is less than the maximum size of a
     // packet field
     if (server_half_key_len > FLEN_MAX) {
-        free_user_keys(user_keys);
-        delete[] username;
-        delete[] client_half_key_pem;
-        BIO_free(tmp_bio);
-        EVP_PKEY_free(client_half_key);
-        EVP_PKEY_free(keypair);
+        free_auth_state(state);
         handle_errors("Server's half key length is bigger than the maximum "
                       "field's length");
     }
 
-    // Copy the half key for later usage (signature computation/verification)
-    unsigned char *server_half_key_pem = new unsigned char[server_half_key_len];
-    memcpy(server_half_key_pem, server_half_key_ptr, server_half_key_len);
-
     // Actually send the half key
     auto send_server_half_key_result =
-        send_field(socket, (flen)server_half_key_len, server_half_key_ptr);
+        send_field(writer, (flen)server_half_key_len, server_half_key_encoded);
 
     // and check the result
     if (send_server_half_key_result.is_error) {
-        free_user_keys(user_keys);
-        delete[] username;
-        delete[] client_half_key_pem;
-        delete[] server_half_key_pem;
-        BIO_free(tmp_bio);
-        EVP_PKEY_free(client_half_key);
-        EVP_PKEY_free(keypair);
+        free_auth_state(state);
         handle_errors(send_server_half_key_result.error);
     }
-    BIO_reset(tmp_bio);
-
-    // Send server's certificate
-
-    // Open the certificate file
-    FILE *server_certificate_fp;
-    if ((server_certificate_fp = fopen("certificates/server.crt", "r")) ==
-        nullptr) {
-        free_user_keys(user_keys);
-        delete[] username;
-        delete[] client_half_key_pem;
-        delete[] server_half_key_pem;
-        BIO_free(tmp_bio);
-        EVP_PKEY_free(client_half_key);
-        EVP_PKEY_free(keypair);
-        handle_errors("Could not open server's certificate file");
-    }
-
-    // Read the certificate into an X509 struct
-    X509 *server_certificate;
-    if ((server_certificate = PEM_read_X509(server_certificate_fp, nullptr, 0,
-                                            nullptr)) == nullptr) {
-        free_user_keys(user_keys);
-        delete[] username;
-        delete[] client_half_key_pem;
-        delete[] server_half_key_pem;
-        BIO_free(tmp_bio);
-        EVP_PKEY_free(client_half_key);
-        fclose(server_certificate_fp);
-        EVP_PKEY_free(keypair);
-        handle_errors("Could not read X509 certificate from file");
-    }
-
-    fclose(server_certificate_fp);
 
-    // Save the X509 certificate as PEM and writes it to the memory bio
-    if (PEM_write_bio_X509(tmp_bio, server_certificate) != 1) {
-        free_user_keys(user_keys);
-        delete[] username;
-        delete[] client_half_key_pem;
-        delete[] server_half_key_pem;
-        BIO_free(tmp_bio);
-        EVP_PKEY_free(client_half_key);
-        EVP_PKEY_free(keypair);
-        X509_free(server_certificate);
-        handle_errors("Could not write to memory bio");
-    }
-
-    X509_free(server_certificate);
-
-    // Get the length and a pointer to the bio's memory data
-    long server_certificate_len;
-    unsigned char *server_certificate_ptr;
-    if ((server_certificate_len =
-             BIO_get_mem_data(tmp_bio, &server_certificate_ptr)) <= 0) {
-        free_user_keys(user_keys);
-        delete[] username;
-        delete[] client_half_key_pem;
-        delete[] server_half_key_pem;
-        BIO_free(tmp_bio);
-        EVP_PKEY_free(client_half_key);
-        EVP_PKEY_free(keypair);
-        handle_errors("Could not read from memory bio");
-    }
-
-    // Check if the size of the certificate is less than the maximum size of a
-    // packet field
-    if (server_certificate_len > FLEN_MAX) {
-        free_user_keys(user_keys);
-        delete[] username;
-        delete[] client_half_key_pem;
-        delete[] server_half_key_pem;
-        BIO_free(tmp_bio);
-        EVP_PKEY_free(client_half_key);
-        EVP_PKEY_free(keypair);
-        handle_errors("Server's certificate length is bigger than the maximum "
-                      "field's length");
-    }
-
-    // Actually send the certificate
-    auto send_server_certificate_result = send_field(
-        socket, (flen)server_certificate_len, server_certificate_ptr);
-
-    // and check the result
+    // Send server's certificate, or only confirm the one the client holds by
+    // echoing its fingerprint. The client still checks our signature with
+    // the key in it, so a stale certificate cannot be passed off as ours.
+    auto send_server_certificate_result =
+        certificate_held
+            ? send_field(writer, FINGERPRINT_LEN,
+                         const_cast<unsigned char *>(
+                             keystore->certificate_fingerprint))
+            : send_field(writer, (flen)keystore->certificate_len,
+                         keystore->certificate);
     if (send_server_certificate_result.is_error) {
-        free_user_keys(user_keys);
-        delete[] username;
-        delete[] client_half_key_pem;
-        delete[] server_half_key_pem;
-        BIO_free(tmp_bio);
-        EVP_PKEY_free(client_half_key);
-        EVP_PKEY_free(keypair);
+        free_auth_state(state);
         handle_errors(send_server_certificate_result.error);
     }
-    BIO_free(tmp_bio);
 
-    // Sign {g^x, g^y, C} with server's private key and send it
+    // Sign {method, encoding, g^x, g^y, C, chunk sizes} with server's
+    // private key and send it. The encoding is left out for the clients that
+    // do not send it.
 
     // Init the signing context
     EVP_MD_CTX *server_signature_ctx;
     if ((server_signature_ctx = EVP_MD_CTX_new()) == nullptr) {
-        free_user_keys(user_keys);
-        delete[] username;
-        delete[] client_half_key_pem;
-        EVP_PKEY_free(client_half_key);
-        EVP_PKEY_free(keypair);
+        free_auth_state(state);
         handle_errors("Could not allocate signing context");
     }
     EVP_SignInit(server_signature_ctx, get_hash_type());
 
     // Update the context with the data that has to be signed
+    unsigned char method = state->method;
+    unsigned char encoding = state->encoding;
     int err = 0;
-    err |= EVP_SignUpdate(server_signature_ctx, client_half_key_pem,
+    err |= EVP_SignUpdate(server_signature_ctx, &method, sizeof(method));
+    if (state->encoding != KexEncodingPem) {
+        err |= EVP_SignUpdate(server_signature_ctx, &encoding,
+                              sizeof(encoding));
+    }
+    err |= EVP_SignUpdate(server_signature_ctx, client_half_key_encoded,
                           client_half_key_len);
-    err |= EVP_SignUpdate(server_signature_ctx, server_half_key_pem,
+    err |= EVP_SignUpdate(server_signature_ctx, server_half_key_encoded,
                           server_half_key_len);
     err |= EVP_SignUpdate(server_signature_ctx, username, username_len);
+    err |= EVP_SignUpdate(server_signature_ctx, &state->client_chunk_size,
+                          sizeof(state->client_chunk_size));
+    err |= EVP_SignUpdate(server_signature_ctx, &state->chunk_size,
+                          sizeof(state->chunk_size));
 
     if (err != 1) {
-        free_user_keys(user_keys);
-        delete[] username;
-        delete[] client_half_key_pem;
-        delete[] server_half_key_pem;
-        EVP_PKEY_free(client_half_key);
+        free_auth_state(state);
         EVP_MD_CTX_free(server_signature_ctx);
-        EVP_PKEY_free(keypair);
         handle_errors("Could not sign correctly (update)");
     }
 
-    // Open the server's private key file
-    FILE *server_private_key_fp;
-    if ((server_private_key_fp = fopen("certificates/server.key", "r")) ==
-        nullptr) {
-        free_user_keys(user_keys);
-        delete[] username;
-        delete[] client_half_key_pem;
-        delete[] server_half_key_pem;
-        EVP_PKEY_free(client_half_key);
-        EVP_MD_CTX_free(server_signature_ctx);
-        EVP_PKEY_free(keypair);
-        handle_errors("Could not open server's private key");
-    }
-
-    // And read the key from it
-    EVP_PKEY *server_private_key;
-    if ((server_private_key = PEM_read_PrivateKey(
-             server_private_key_fp, nullptr, 0, nullptr)) == nullptr) {
-        free_user_keys(user_keys);
-        delete[] username;
-        delete[] client_half_key_pem;
-        delete[] server_half_key_pem;
-        EVP_PKEY_free(client_half_key);
-        EVP_MD_CTX_free(server_signature_ctx);
-        fclose(server_private_key_fp);
-        EVP_PKEY_free(keypair);
-        handle_errors("Could not read server's private key");
-    }
-    fclose(server_private_key_fp);
-
+    EVP_PKEY *server_private_key = keystore->private_key;
     unsigned char *server_signature =
         new unsigned char[get_signature_max_length(server_private_key)];
     unsigned int server_signature_len;
 
     if (EVP_SignFinal(server_signature_ctx, server_signature,
                       &server_signature_len, server_private_key) != 1) {
-        free_user_keys(user_keys);
-        delete[] username;
-        delete[] client_half_key_pem;
-        delete[] server_half_key_pem;
+        free_auth_state(state);
         delete[] server_signature;
-        EVP_PKEY_free(client_half_key);
         EVP_MD_CTX_free(server_signature_ctx);
-        EVP_PKEY_free(keypair);
-        EVP_PKEY_free(server_private_key);
         handle_errors("Could not sign correctly (final)");
     }
 
-    EVP_PKEY_free(server_private_key);
     EVP_MD_CTX_free(server_signature_ctx);
 
     if (server_signature_len > FLEN_MAX) {
-        free_user_keys(user_keys);
-        delete[] username;
-        delete[] client_half_key_pem;
-        delete[] server_half_key_pem;
+        free_auth_state(state);
         delete[] server_signature;
-        EVP_PKEY_free(client_half_key);
-        EVP_PKEY_free(keypair);
         handle_errors(
             "Server signature is bigger than the max packet field length");
     }
 
     auto send_server_signature_result =
-        send_field(socket, (flen)server_signature_len, server_signature);
+        send_field(writer, (flen)server_signature_len, server_signature);
     if (send_server_signature_result.is_error) {
-        free_user_keys(user_keys);
-        delete[] username;
-        delete[] client_half_key_pem;
-        delete[] server_half_key_pem;
+        free_auth_state(state);
         delete[] server_signature;
-        EVP_PKEY_free(client_half_key);
-        EVP_PKEY_free(keypair);
         handle_errors(send_server_signature_result.error);
     }
 
     delete[] server_signature;
 
+    // Send the chunk size agreed on
+    auto send_chunk_size_result =
+        send_field(writer, sizeof(state->chunk_size),
+                   reinterpret_cast<unsigned char *>(&state->chunk_size));
+    if (send_chunk_size_result.is_error) {
+        free_auth_state(state);
+        handle_errors(send_chunk_size_result.error);
+    }
+
+    auto end_message_result = writer_end_message(writer);
+    if (end_message_result.is_error) {
+        free_auth_state(state);
+        handle_errors(end_message_result.error);
+    }
+
+    return state;
+}
+
+/*
+ * Handles the client's answer (AuthClientAns), whose message type has already
+ * been read, and completes the key agreement started by auth_start.
+ * Returns a tuple containing the username of the client and the agreed key.
+ * The caller of this function has to free the memory allocated for the key when
+ * done with it. The handshake state is freed in any case.
+ */
+tuple<char *, unsigned char *> auth_finish(Reader *reader, AuthState *state,
+                                           int key_len) {
     // ---------------------------------------------------------------------- //
     // -------------------- Client's response to Server --------------------- //
     // ---------------------------------------------------------------------- //
 
-    // Receive client header
-    auto client_header_res = get_mtype(socket);
-    if (client_header_res.is_error ||
-        client_header_res.result != AuthClientAns) {
-        free_user_keys(user_keys);
-        delete[] username;
-        delete[] client_half_key_pem;
-        delete[] server_half_key_pem;
-        EVP_PKEY_free(client_half_key);
-        EVP_PKEY_free(keypair);
-        handle_errors(client_header_res.error);
-    }
-
     // Receive client signature and check it
-    auto client_signature_res = read_field(socket);
+    auto client_signature_res = read_field(reader);
     if (client_signature_res.is_error) {
-        free_user_keys(user_keys);
-        delete[] username;
-        delete[] client_half_key_pem;
-        delete[] server_half_key_pem;
-        EVP_PKEY_free(client_half_key);
-        EVP_PKEY_free(keypair);
+        free_auth_state(state);
         handle_errors(client_signature_res.error);
     }
 
@@ -503,94 +377,59 @@ tuple<char *, unsigned char *> authenticate(int socket, int key_len) {
     // Create and initialize the verification context
     EVP_MD_CTX *client_signature_ctx;
     if ((client_signature_ctx = EVP_MD_CTX_new()) == nullptr) {
-        free_user_keys(user_keys);
-        delete[] username;
-        delete[] client_signature;
-        delete[] client_half_key_pem;
-        delete[] server_half_key_pem;
-        EVP_PKEY_free(client_half_key);
-        EVP_PKEY_free(keypair);
+        free_auth_state(state);
         handle_errors("Signature verification failed (alloc)");
     }
 
     EVP_VerifyInit(client_signature_ctx, get_hash_type());
 
-    err = 0;
-    err |= EVP_VerifyUpdate(client_signature_ctx, server_half_key_pem,
-                            server_half_key_len);
-    err |= EVP_VerifyUpdate(client_signature_ctx, client_half_key_pem,
-                            client_half_key_len);
+    int err = 0;
+    err |= EVP_VerifyUpdate(client_signature_ctx,
+                            state->server_half_key_encoded,
+                            state->server_half_key_len);
+    err |= EVP_VerifyUpdate(client_signature_ctx,
+                            state->client_half_key_encoded,
+                            state->client_half_key_len);
     err |= EVP_VerifyUpdate(client_signature_ctx, server_name,
                             sizeof(server_name));
+    err |= EVP_VerifyUpdate(client_signature_ctx, &state->chunk_size,
+                            sizeof(state->chunk_size));
 
     if (err != 1) {
-        free_user_keys(user_keys);
-        delete[] username;
-        delete[] client_signature;
-        delete[] client_half_key_pem;
-        delete[] server_half_key_pem;
-        EVP_PKEY_free(client_half_key);
+        free_auth_state(state);
         EVP_MD_CTX_free(client_signature_ctx);
-        EVP_PKEY_free(keypair);
         handle_errors("Signature verification failed (update)");
     }
 
     // Verify that the signature is correct
     if (EVP_VerifyFinal(client_signature_ctx, client_signature,
-                        client_signature_len, client_pubkey) != 1) {
-        free_user_keys(user_keys);
-        delete[] username;
-        delete[] client_signature;
-        EVP_PKEY_free(client_half_key);
+                        client_signature_len, state->client_pubkey) != 1) {
+        free_auth_state(state);
         EVP_MD_CTX_free(client_signature_ctx);
-        EVP_PKEY_free(keypair);
         handle_errors("Signature verification failed (final)");
     }
 
-    delete[] client_half_key_pem;
-    delete[] server_half_key_pem;
     EVP_MD_CTX_free(client_signature_ctx);
-    delete[] client_signature;
 
     // Computes shared secret
-    EVP_PKEY_CTX *shared_secret_ctx;
-    if ((shared_secret_ctx = EVP_PKEY_CTX_new(keypair, nullptr)) == nullptr) {
-        free_user_keys(user_keys);
-        delete[] username;
-        EVP_PKEY_free(client_half_key);
-        handle_errors("Shared secret creation failed (alloc)");
-    }
-
-    err = 0;
-    err |= EVP_PKEY_derive_init(shared_secret_ctx);
-    err |= EVP_PKEY_derive_set_peer(shared_secret_ctx, client_half_key);
+    auto shared_secret_res =
+        kex_derive(state->keypair, state->client_half_key);
 
-    // Get the length of the shared secret
-    size_t shared_secret_len;
-    err |= EVP_PKEY_derive(shared_secret_ctx, NULL, &shared_secret_len);
+    // The username is handed over to the caller, the rest of the state is not
+    // needed anymore either way
+    auto username = state->username;
+    state->username = nullptr;
+    free_auth_state(state);
 
-    // Compute the shared secret
-    unsigned char *shared_secret = new unsigned char[shared_secret_len];
-    err |=
-        EVP_PKEY_derive(shared_secret_ctx, shared_secret, &shared_secret_len);
-
-    if (err != 1) {
-        free_user_keys(user_keys);
+    if (shared_secret_res.is_error) {
         delete[] username;
-        EVP_PKEY_free(client_half_key);
-        EVP_PKEY_CTX_free(shared_secret_ctx);
-        handle_errors("Shared secret creation failed");
+        handle_errors(shared_secret_res.error);
     }
-
-    free_user_keys(user_keys);
-    EVP_PKEY_free(keypair);
-    EVP_PKEY_free(client_half_key);
-    EVP_PKEY_CTX_free(shared_secret_ctx);
+    auto [shared_secret, shared_secret_len] = shared_secret_res.result;
 
     // Finally, derive the symmetric key from the shared secret
     auto key_res = kdf(shared_secret, shared_secret_len, key_len);
     if (key_res.is_error) {
-        free_user_keys(user_keys);
         delete[] username;
         handle_errors("Shared secret creation failed");
     }
@@ -599,3 +438,146 @@ tuple<char *, unsigned char *> authenticate(int socket, int key_len) {
 
     return {reinterpret_cast<char *>(username), key};
 }
+
+/* Turns a resumption down, for the client to fall back to a full run */
+static void reject_resumption(Writer *writer, const char *reason) {
+#ifdef DEBUG
+    cout << "Resumption turned down: " << reason << endl;
+#else
+    (void)reason;
+#endif
+
+    auto send_header_res = send_header(writer, Error);
+    if (send_header_res.is_error) {
+        handle_errors(send_header_res.error);
+    }
+    auto end_message_res = writer_end_message(writer);
+    if (end_message_res.is_error) {
+        handle_errors(end_message_res.error);
+    }
+}
+
+tuple<char *, unsigned char *, unsigned int, int64_t>
+auth_resume(Reader *reader, Writer *writer, int key_len) {
+    // Username, ticket, nonce and largest chunk size of the client
+    auto username_res = read_field(reader);
+    if (username_res.is_error) {
+        handle_errors(username_res.error);
+    }
+    auto [username_len, username] = username_res.result;
+
+    auto ticket_res = read_field(reader);
+    if (ticket_res.is_error) {
+        handle_errors(ticket_res.error);
+    }
+    auto [ticket_len, ticket] = ticket_res.result;
+
+    auto client_nonce_res = read_field(reader);
+    if (client_nonce_res.is_error) {
+        handle_errors(client_nonce_res.error);
+    }
+    auto [client_nonce_len, client_nonce] = client_nonce_res.result;
+    if (client_nonce_len != RESUME_NONCE_LEN) {
+        handle_errors("Invalid nonce");
+    }
+
+    auto chunk_size_res = read_field(reader);
+    if (chunk_size_res.is_error) {
+        handle_errors(chunk_size_res.error);
+    }
+    auto [chunk_size_len, chunk_size_view] = chunk_size_res.result;
+    unsigned int client_chunk_size;
+    if (chunk_size_len != sizeof(client_chunk_size)) {
+        handle_errors("Invalid chunk size");
+    }
+    memcpy(&client_chunk_size, chunk_size_view, chunk_size_len);
+
+    // The ticket must be ours, still valid and issued to the same user, who
+    // must still be registered
+    auto open_res = open_ticket(ticket, ticket_len);
+    if (open_res.is_error) {
+        reject_resumption(writer, open_res.error);
+        return {nullptr, nullptr, 0, 0};
+    }
+    Ticket contents = open_res.result;
+    if (username_len == 0 || username[username_len - 1] != '\0' ||
+        contents.username != reinterpret_cast<char *>(username)) {
+        explicit_bzero(contents.secret, sizeof(contents.secret));
+        reject_resumption(writer, "Ticket of another user");
+        return {nullptr, nullptr, 0, 0};
+    }
+    auto pubkey_res = registry_lookup(current_keystore()->users,
+                                      contents.username.c_str());
+    if (pubkey_res.is_error) {
+        explicit_bzero(contents.secret, sizeof(contents.secret));
+        reject_resumption(writer, pubkey_res.error);
+        return {nullptr, nullptr, 0, 0};
+    }
+    EVP_PKEY_free(pubkey_res.result);
+
+    unsigned int chunk_size = min(client_chunk_size, max_chunk_size);
+    if (chunk_size < CHUNK_SIZE) {
+        explicit_bzero(contents.secret, sizeof(contents.secret));
+        handle_errors("Invalid chunk size");
+    }
+
+    unsigned char server_nonce[RESUME_NONCE_LEN];
+    if (RAND_bytes(server_nonce, sizeof(server_nonce)) != 1) {
+        explicit_bzero(contents.secret, sizeof(contents.secret));
+        handle_errors("Could not generate nonce");
+    }
+
+    unsigned char confirm[RESUME_CONFIRM_LEN];
+    auto key_res = derive_resumed_key(
+        contents.secret, client_nonce, server_nonce, contents.username.c_str(),
+        chunk_size, key_len, confirm);
+    explicit_bzero(contents.secret, sizeof(contents.secret));
+    if (key_res.is_error) {
+        handle_errors(key_res.error);
+    }
+    auto key = key_res.result;
+
+    // Answer with our nonce, the chunk size, and the proof that we could read
+    // the ticket
+    auto send_header_res = send_header(writer, ResumeAns);
+    if (send_header_res.is_error) {
+        explicit_bzero(key, key_len);
+        delete[] key;
+        handle_errors(send_header_res.error);
+    }
+
+    auto send_nonce_res =
+        send_field(writer, sizeof(server_nonce), server_nonce);
+    if (send_nonce_res.is_error) {
+        explicit_bzero(key, key_len);
+        delete[] key;
+        handle_errors(send_nonce_res.error);
+    }
+
+    auto send_chunk_size_res =
+        send_field(writer, sizeof(chunk_size),
+                   reinterpret_cast<unsigned char *>(&chunk_size));
+    if (send_chunk_size_res.is_error) {
+        explicit_bzero(key, key_len);
+        delete[] key;
+        handle_errors(send_chunk_size_res.error);
+    }
+
+    auto send_confirm_res = send_field(writer, sizeof(confirm), confirm);
+    if (send_confirm_res.is_error) {
+        explicit_bzero(key, key_len);
+        delete[] key;
+        handle_errors(send_confirm_res.error);
+    }
+
+    auto end_message_res = writer_end_message(writer);
+    if (end_message_res.is_error) {
+        explicit_bzero(key, key_len);
+        delete[] key;
+        handle_errors(end_message_res.error);
+    }
+
+    char *name = new char[contents.username.size() + 1];
+    memcpy(name, contents.username.c_str(), contents.username.size() + 1);
+    return {name, key, chunk_size, contents.authenticated};
+}
@@ -1,4 +1,12 @@
+#include "../common/kex.h"
+#include "../common/reader.h"
+#include "../common/types.h"
+#include "../common/writer.h"
+#include "keypool.h"
+#include "keystore.h"
 #include <openssl/bio.h>
+#include <openssl/evp.h>
+#include <stdint.h>
 #include <tuple>
 
 using namespace std;
@@ -6,11 +14,78 @@ using namespace std;
 #ifndef authentication_h
 #define authentication_h
 /*
- * Runs the authentication protocol with the entity on the other side of the
- * passed socket.
+ * State of a run of the authentication protocol that is waiting for the
+ * client's final message.
+ */
+struct AuthState {
+    unsigned char *username;
+    flen username_len;
+
+    // Long-term public key of the client, used to verify its signature
+    EVP_PKEY *client_pubkey;
+
+    // Key exchange method chosen by the client, and how the half keys are
+    // encoded
+    kex_method method;
+    kex_encoding encoding;
+
+    // Half keys exchanged so far, both parsed and as sent on the wire
+    EVP_PKEY *client_half_key;
+    unsigned char *client_half_key_encoded;
+    flen client_half_key_len;
+    unsigned char *server_half_key_encoded;
+    size_t server_half_key_len;
+
+    // Server's ephemeral keypair
+    EVP_PKEY *keypair;
+
+    // Largest chunk size the client can handle, and the one agreed on
+    unsigned int client_chunk_size;
+    unsigned int chunk_size;
+};
+
+/*
+ * Largest chunk size agreed on with the clients, between CHUNK_SIZE and
+ * MAX_CHUNK_SIZE
+ */
+extern unsigned int max_chunk_size;
+
+/*
+ * Pool the server's ephemeral keypairs are taken from, if any: without one,
+ * they are generated during the handshake
+ */
+extern KeyPool *key_pool;
+
+/*
+ * The authentication protocol is run in two steps, so that the server does not
+ * wait for the client in between.
+ *
+ * auth_start handles the client's opening message and answers it. It returns
+ * the state of the run, to be passed to auth_finish when the client's answer
+ * arrives, and holds the chunk size agreed on with the client. auth_finish
+ * returns the username of the client and the key shared with it, of len
+ * [key_len]. The messages are read from [reader], the answer is sent with
+ * [writer].
+ *
+ * If the run fails, both abort the current action by calling handle_errors.
+ */
+AuthState *auth_start(Reader *reader, Writer *writer);
+tuple<char *, unsigned char *> auth_finish(Reader *reader, AuthState *state,
+                                           int key_len);
+void free_auth_state(AuthState *state);
+
+/*
+ * Handles a client resuming a previous session with its ticket (ResumeStart),
+ * whose message type has already been read, and answers it. Returns the
+ * username of the client, the key of the new session, of len [key_len], the
+ * chunk size agreed on with it, and when the client last authenticated in
+ * full.
  *
- * Returns the key shared with the other party of len [key_len], if the run was
- * successful. If the run failed, it aborts the program execution.
+ * A ticket that is expired, or was not issued by this server, is turned down
+ * with an Error message: the client can still run the full authentication on
+ * the same connection, and the username is null. A malformed message aborts
+ * the current action by calling handle_errors.
  */
-tuple<char *, unsigned char *> authenticate(int socket, int key_len);
+tuple<char *, unsigned char *, unsigned int, int64_t>
+auth_resume(Reader *reader, Writer *writer, int key_len);
 #endif
@@ -0,0 +1,136 @@
+#include "keypool.h"
+#include <chrono>
+#include <iostream>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+
+using namespace std;
+
+// Time to wait before trying again when a keypair could not be generated
+#define REFILL_RETRY chrono::seconds(1)
+
+/*
+ * Finds the method with the fewest keypairs ready, if any is below the depth.
+ * The pool must be locked.
+ */
+static bool next_to_refill(KeyPool *pool, kex_method &method) {
+    bool found = false;
+    for (unsigned int m = 0; m < KEX_METHODS; m++) {
+        size_t ready = pool->keypairs[m].size();
+        if (ready < pool->depth &&
+            (!found || ready < pool->keypairs[method].size())) {
+            method = (kex_method)m;
+            found = true;
+        }
+    }
+    return found;
+}
+
+/* Generates a keypair for [method], or returns nullptr if it failed */
+static EVP_PKEY *try_gen_keypair(kex_method method) {
+    try {
+        auto keypair_res = kex_gen_keypair(method);
+        if (!keypair_res.is_error) {
+            return keypair_res.result;
+        }
+    } catch (char const *ex) {
+        // Some of the generators report their failures by throwing
+    }
+    return nullptr;
+}
+
+static void generate(KeyPool *pool) {
+    // The handshakes come first: the pool is refilled with the CPU time that
+    // nothing else wants
+    struct sched_param param = {};
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+    for (;;) {
+        kex_method method;
+        {
+            unique_lock<mutex> guard(pool->lock);
+            pool->needs_refill.wait(guard, [pool, &method] {
+                return pool->stopping || next_to_refill(pool, method);
+            });
+            if (pool->stopping)
+                return;
+        }
+
+        // The pool is not locked while generating, so that the handshakes
+        // can take the keypairs that are ready in the meantime
+        EVP_PKEY *keypair = try_gen_keypair(method);
+
+        unique_lock<mutex> guard(pool->lock);
+        if (keypair == nullptr) {
+            cerr << "Could not refill the key pool" << endl;
+            pool->needs_refill.wait_for(guard, REFILL_RETRY,
+                                        [pool] { return pool->stopping; });
+            continue;
+        }
+
+        pool->keypairs[method].push_back(keypair);
+        pool->metrics->keypool_depth[method] = pool->keypairs[method].size();
+        pool->metrics->keypool_refilled[method]++;
+    }
+}
+
+KeyPool *new_key_pool(unsigned int depth, WorkerMetrics *metrics) {
+    KeyPool *pool = new KeyPool();
+    pool->depth = depth;
+    pool->stopping = false;
+    pool->metrics = metrics;
+    for (unsigned int m = 0; m < KEX_METHODS; m++) {
+        metrics->keypool_depth[m] = 0;
+    }
+
+    // The generator inherits the signal mask: block everything while
+    // spawning it
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pool->generator = thread(generate, pool);
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+
+    return pool;
+}
+
+Maybe<EVP_PKEY *> key_pool_take(KeyPool *pool, kex_method method) {
+    if (pool != nullptr) {
+        unique_lock<mutex> guard(pool->lock);
+        auto &keypairs = pool->keypairs[method];
+        if (!keypairs.empty()) {
+            EVP_PKEY *keypair = keypairs.front();
+            keypairs.pop_front();
+            pool->metrics->keypool_depth[method] = keypairs.size();
+            guard.unlock();
+            pool->needs_refill.notify_one();
+
+            Maybe<EVP_PKEY *> res;
+            res.set_result(keypair);
+            return res;
+        }
+
+        // Drained by a burst of handshakes, or not filled yet
+        pool->metrics->keypool_empty[method]++;
+    }
+
+    return kex_gen_keypair(method);
+}
+
+void stop_key_pool(KeyPool *pool) {
+    {
+        lock_guard<mutex> guard(pool->lock);
+        pool->stopping = true;
+    }
+    pool->needs_refill.notify_all();
+    pool->generator.join();
+
+    for (unsigned int m = 0; m < KEX_METHODS; m++) {
+        for (EVP_PKEY *keypair : pool->keypairs[m]) {
+            EVP_PKEY_free(keypair);
+        }
+        pool->metrics->keypool_depth[m] = 0;
+    }
+    delete pool;
+}
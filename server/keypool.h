@@ -0,0 +1,53 @@
+#include "../common/kex.h"
+#include "../common/maybe.h"
+#include "metrics.h"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <openssl/evp.h>
+#include <thread>
+
+using namespace std;
+
+#ifndef keypool_h
+#define keypool_h
+
+// Keypairs kept ready for each key exchange method, unless told otherwise
+#define DEFAULT_KEY_POOL_DEPTH 16
+
+/*
+ * Ephemeral keypairs generated ahead of the handshakes that need them. A
+ * background thread tops the pool up to [depth] keypairs for every method,
+ * running only when nothing else wants the CPU. Every keypair is handed out
+ * once, to a single handshake.
+ */
+struct KeyPool {
+    deque<EVP_PKEY *> keypairs[KEX_METHODS];
+    unsigned int depth;
+
+    mutex lock;
+    condition_variable needs_refill;
+    bool stopping;
+    thread generator;
+
+    WorkerMetrics *metrics;
+};
+
+/*
+ * Starts filling a pool of [depth] keypairs for each method, reporting into
+ * [metrics]. The generator never handles signals, those are left to the
+ * calling thread.
+ */
+KeyPool *new_key_pool(unsigned int depth, WorkerMetrics *metrics);
+
+/*
+ * Takes a keypair for [method] out of [pool], or generates one right away if
+ * none is ready (or if there is no pool at all). The caller is responsible
+ * for freeing it.
+ */
+Maybe<EVP_PKEY *> key_pool_take(KeyPool *pool, kex_method method);
+
+/* Stops the generator and frees the pool, along with the unused keypairs */
+void stop_key_pool(KeyPool *pool);
+
+#endif
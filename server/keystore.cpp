@@ -0,0 +1,150 @@
+#include "keystore.h"
+#include "../common/types.h"
+#include <openssl/bio.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <stdio.h>
+#include <string.h>
+
+using namespace std;
+
+// Keystore in use, only ever accessed atomically
+static shared_ptr<const Keystore> keystore;
+
+static void free_keystore(const Keystore *store) {
+    close_registry(store->users);
+    EVP_PKEY_free(store->private_key);
+    delete[] store->certificate;
+    delete store;
+}
+
+/*
+ * Maps the registry of the users into [store]. Their keys are read from it
+ * when they log in.
+ */
+static Maybe<bool> load_users(Keystore *store) {
+    Maybe<bool> res;
+
+    auto registry_res = open_registry(REGISTRY_PATH);
+    if (registry_res.is_error) {
+        res.set_error(registry_res.error);
+        return res;
+    }
+    store->users = registry_res.result;
+
+    res.set_result(true);
+    return res;
+}
+
+/*
+ * Reads the server's certificate into [store], encoded as PEM, along with its
+ * fingerprint
+ */
+static Maybe<bool> load_certificate(Keystore *store) {
+    Maybe<bool> res;
+
+    FILE *certificate_fp;
+    if ((certificate_fp = fopen("certificates/server.crt", "r")) == nullptr) {
+        res.set_error("Could not open server's certificate file");
+        return res;
+    }
+
+    // Parsed first, so that a malformed certificate is caught here rather
+    // than by the clients
+    X509 *certificate = PEM_read_X509(certificate_fp, nullptr, 0, nullptr);
+    fclose(certificate_fp);
+    if (certificate == nullptr) {
+        res.set_error("Could not read X509 certificate from file");
+        return res;
+    }
+
+    unsigned int fingerprint_len;
+    if (X509_digest(certificate, EVP_sha256(), store->certificate_fingerprint,
+                    &fingerprint_len) != 1 ||
+        fingerprint_len != FINGERPRINT_LEN) {
+        X509_free(certificate);
+        res.set_error("Could not compute the certificate's fingerprint");
+        return res;
+    }
+
+    BIO *bio;
+    if ((bio = BIO_new(BIO_s_mem())) == nullptr) {
+        X509_free(certificate);
+        res.set_error("Could not allocate memory bio");
+        return res;
+    }
+
+    unsigned char *pem;
+    long len;
+    if (PEM_write_bio_X509(bio, certificate) != 1 ||
+        (len = BIO_get_mem_data(bio, &pem)) <= 0) {
+        BIO_free(bio);
+        X509_free(certificate);
+        res.set_error("Could not write to memory bio");
+        return res;
+    }
+    X509_free(certificate);
+
+    // It is sent as a single field
+    if (len > FLEN_MAX) {
+        BIO_free(bio);
+        res.set_error("Server's certificate length is bigger than the maximum "
+                      "field's length");
+        return res;
+    }
+
+    store->certificate = new unsigned char[len];
+    memcpy(store->certificate, pem, len);
+    store->certificate_len = len;
+    BIO_free(bio);
+
+    res.set_result(true);
+    return res;
+}
+
+/* Reads the server's private key into [store] */
+static Maybe<bool> load_private_key(Keystore *store) {
+    Maybe<bool> res;
+
+    FILE *private_key_fp;
+    if ((private_key_fp = fopen("certificates/server.key", "r")) == nullptr) {
+        res.set_error("Could not open server's private key");
+        return res;
+    }
+
+    store->private_key =
+        PEM_read_PrivateKey(private_key_fp, nullptr, 0, nullptr);
+    fclose(private_key_fp);
+    if (store->private_key == nullptr) {
+        res.set_error("Could not read server's private key");
+        return res;
+    }
+
+    res.set_result(true);
+    return res;
+}
+
+Maybe<bool> load_keystore() {
+    Maybe<bool> res;
+
+    Keystore *store = new Keystore();
+    store->users = nullptr;
+    store->private_key = nullptr;
+    store->certificate = nullptr;
+    store->certificate_len = 0;
+
+    for (auto load : {load_users, load_certificate, load_private_key}) {
+        auto load_res = load(store);
+        if (load_res.is_error) {
+            free_keystore(store);
+            res.set_error(load_res.error);
+            return res;
+        }
+    }
+
+    atomic_store(&keystore, shared_ptr<const Keystore>(store, free_keystore));
+    res.set_result(true);
+    return res;
+}
+
+shared_ptr<const Keystore> current_keystore() { return atomic_load(&keystore); }
@@ -0,0 +1,42 @@
+#include "../common/maybe.h"
+#include "../common/types.h"
+#include "registry.h"
+#include <memory>
+#include <openssl/evp.h>
+
+using namespace std;
+
+#ifndef keystore_h
+#define keystore_h
+
+/*
+ * Every key the server needs for the authentication, read from the
+ * certificates directory once and then never modified: the sessions share it
+ * without any locking.
+ */
+struct Keystore {
+    // The registered users, with their public keys
+    Registry *users;
+
+    // The server's private key, and its certificate encoded as PEM, as sent to
+    // the clients
+    EVP_PKEY *private_key;
+    unsigned char *certificate;
+    size_t certificate_len;
+
+    // Clients that hold the certificate already tell it by its fingerprint
+    unsigned char certificate_fingerprint[FINGERPRINT_LEN];
+};
+
+/*
+ * Reads the keys from the certificates directory into a new keystore, and puts
+ * it in use. The handshakes in progress keep the keystore they started with,
+ * which is freed once the last of them drops it. If the keys cannot be read
+ * the current keystore, if any, stays in place and the error is returned.
+ */
+Maybe<bool> load_keystore();
+
+/* Keystore currently in use, kept alive for as long as it is referenced */
+shared_ptr<const Keystore> current_keystore();
+
+#endif
@@ -0,0 +1,65 @@
+#include "metrics.h"
+#include <iostream>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+using namespace std;
+
+WorkerMetrics *new_metrics(unsigned int n_workers) {
+    void *shared = mmap(nullptr, n_workers * sizeof(WorkerMetrics),
+                        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                        -1, 0);
+    if (shared == MAP_FAILED) {
+        perror("Could not allocate metrics");
+        exit(EXIT_FAILURE);
+    }
+
+    // Anonymous memory is already zeroed, which is a valid state for the
+    // atomics as well
+    return static_cast<WorkerMetrics *>(shared);
+}
+
+void sample_accept_queue(WorkerMetrics *metrics, int sock) {
+    // For a listening socket, the kernel reports the length of the accept
+    // queue as the number of unacknowledged segments
+    struct tcp_info info;
+    socklen_t info_len = sizeof(info);
+    if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &info_len) < 0) {
+        return;
+    }
+
+    unsigned int depth = info.tcpi_unacked;
+    metrics->accept_queue = depth;
+    if (depth > metrics->accept_queue_max) {
+        metrics->accept_queue_max = depth;
+    }
+}
+
+void print_metrics(WorkerMetrics *metrics, unsigned int n_workers) {
+    for (unsigned int i = 0; i < n_workers; i++) {
+        WorkerMetrics *worker = &metrics[i];
+        cout << "worker_pid{worker=\"" << i << "\"} " << worker->pid << endl;
+        cout << "worker_sessions{worker=\"" << i << "\"} " << worker->sessions
+             << endl;
+        cout << "worker_accepted_total{worker=\"" << i << "\"} "
+             << worker->accepted << endl;
+        cout << "accept_queue_depth{worker=\"" << i << "\"} "
+             << worker->accept_queue << endl;
+        cout << "accept_queue_depth_max{worker=\"" << i << "\"} "
+             << worker->accept_queue_max << endl;
+
+        for (unsigned int m = 0; m < KEX_METHODS; m++) {
+            const char *method = kex_method_name((kex_method)m);
+            cout << "keypool_depth{worker=\"" << i << "\",method=\"" << method
+                 << "\"} " << worker->keypool_depth[m] << endl;
+            cout << "keypool_refilled_total{worker=\"" << i << "\",method=\""
+                 << method << "\"} " << worker->keypool_refilled[m] << endl;
+            cout << "keypool_empty_total{worker=\"" << i << "\",method=\""
+                 << method << "\"} " << worker->keypool_empty[m] << endl;
+        }
+    }
+}
@@ -0,0 +1,52 @@
+#include "../common/kex.h"
+#include <atomic>
+#include <sys/types.h>
+
+using namespace std;
+
+#ifndef metrics_h
+#define metrics_h
+
+/*
+ * Counters of a worker process. They live in memory shared by all the
+ * workers, so that any process can report on every one of them.
+ */
+struct WorkerMetrics {
+    atomic<pid_t> pid;
+
+    // Sessions currently open
+    atomic<unsigned int> sessions;
+
+    // Connections accepted so far
+    atomic<unsigned long> accepted;
+
+    // Connections waiting in the accept queue of the listening socket, the
+    // last time it was ready, and the most ever seen
+    atomic<unsigned int> accept_queue;
+    atomic<unsigned int> accept_queue_max;
+
+    // Ephemeral keypairs ready for the handshakes, for each key exchange
+    // method; generated in the background so far, which tells the refill rate
+    // between two samples; and handshakes that found none ready, generating
+    // their own on the spot
+    atomic<unsigned int> keypool_depth[KEX_METHODS];
+    atomic<unsigned long> keypool_refilled[KEX_METHODS];
+    atomic<unsigned long> keypool_empty[KEX_METHODS];
+};
+
+/*
+ * Allocates zeroed metrics for [n_workers] workers, shared with the processes
+ * forked afterwards
+ */
+WorkerMetrics *new_metrics(unsigned int n_workers);
+
+/*
+ * Samples the accept queue of the listening socket [sock] into the metrics of
+ * a worker
+ */
+void sample_accept_queue(WorkerMetrics *metrics, int sock);
+
+/* Writes the metrics of every worker to stdout, one counter per line */
+void print_metrics(WorkerMetrics *metrics, unsigned int n_workers);
+
+#endif
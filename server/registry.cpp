@@ -0,0 +1,287 @@
+#include "registry.h"
+#include <ctype.h>
+#include <fcntl.h>
+#include <openssl/bio.h>
+#include <openssl/pem.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Smallest hash table, in slots
+#define MIN_SLOTS 16
+
+/* FNV-1a, over the username up to its terminator */
+static uint64_t hash_username(const char *username) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (const char *c = username; *c != '\0'; c++) {
+        hash ^= (unsigned char)*c;
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+/* Slot holding [username], or the free slot where it would go */
+static uint32_t find_slot(RegistrySlot *slots, uint32_t n_slots,
+                          const char *username) {
+    uint32_t mask = n_slots - 1;
+    uint32_t i = hash_username(username) & mask;
+    while (slots[i].username[0] != '\0' &&
+           strncmp(slots[i].username, username, USERNAME_MAX) != 0) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+Maybe<Registry *> open_registry(const char *path) {
+    Maybe<Registry *> res;
+
+    int fd;
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        res.set_error("Could not open the user registry");
+        return res;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(RegistryHeader)) {
+        close(fd);
+        res.set_error("The user registry is truncated");
+        return res;
+    }
+
+    void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        res.set_error("Could not map the user registry");
+        return res;
+    }
+
+    auto header = static_cast<RegistryHeader *>(map);
+    uint32_t n_slots = header->n_slots;
+    size_t table_len = sizeof(RegistryHeader) + n_slots * sizeof(RegistrySlot);
+    if (memcmp(header->magic, REGISTRY_MAGIC, sizeof(header->magic)) != 0 ||
+        n_slots == 0 || (n_slots & (n_slots - 1)) != 0 ||
+        header->n_users >= n_slots || table_len > (size_t)st.st_size) {
+        munmap(map, st.st_size);
+        res.set_error("The user registry is malformed");
+        return res;
+    }
+
+    // A lookup stops at the first free slot, which must exist
+    auto slots = reinterpret_cast<RegistrySlot *>(
+        static_cast<unsigned char *>(map) + sizeof(RegistryHeader));
+    uint32_t n_users = 0;
+    for (uint32_t i = 0; i < n_slots; i++) {
+        n_users += slots[i].username[0] != '\0';
+    }
+    if (n_users != header->n_users) {
+        munmap(map, st.st_size);
+        res.set_error("The user registry is malformed");
+        return res;
+    }
+
+    Registry *registry = new Registry();
+    registry->map = static_cast<unsigned char *>(map);
+    registry->map_len = st.st_size;
+    registry->header = header;
+    registry->slots = slots;
+
+    res.set_result(registry);
+    return res;
+}
+
+void close_registry(Registry *registry) {
+    if (registry == nullptr)
+        return;
+
+    for (auto &[username, key] : registry->cache) {
+        EVP_PKEY_free(key);
+    }
+    munmap(registry->map, registry->map_len);
+    delete registry;
+}
+
+/* Public key of [slot], as PEM, if it lies within the registry */
+static Maybe<tuple<const unsigned char *, size_t>>
+slot_key(Registry *registry, RegistrySlot *slot) {
+    Maybe<tuple<const unsigned char *, size_t>> res;
+
+    if (slot->key_offset > registry->map_len ||
+        slot->key_len > registry->map_len - slot->key_offset) {
+        res.set_error("The user registry is malformed");
+        return res;
+    }
+
+    res.set_result({registry->map + slot->key_offset, slot->key_len});
+    return res;
+}
+
+Maybe<EVP_PKEY *> registry_lookup(Registry *registry, const char *username) {
+    Maybe<EVP_PKEY *> res;
+
+    if (username[0] == '\0' || strlen(username) >= USERNAME_MAX) {
+        res.set_error("User not registered!");
+        return res;
+    }
+
+    // Most logins are of the users logged in last
+    {
+        lock_guard<mutex> guard(registry->lock);
+        auto it = registry->cached.find(username);
+        if (it != registry->cached.end()) {
+            registry->cache.splice(registry->cache.begin(), registry->cache,
+                                   it->second);
+            EVP_PKEY *key = get<1>(*it->second);
+            EVP_PKEY_up_ref(key);
+            res.set_result(key);
+            return res;
+        }
+    }
+
+    RegistrySlot *slot =
+        &registry->slots[find_slot(registry->slots, registry->header->n_slots,
+                                   username)];
+    if (slot->username[0] == '\0') {
+        res.set_error("User not registered!");
+        return res;
+    }
+
+    auto key_res = slot_key(registry, slot);
+    if (key_res.is_error) {
+        res.set_error(key_res.error);
+        return res;
+    }
+    auto [pem, pem_len] = key_res.result;
+
+    BIO *bio;
+    if ((bio = BIO_new_mem_buf(pem, pem_len)) == nullptr) {
+        res.set_error("Could not allocate memory bio");
+        return res;
+    }
+    EVP_PKEY *key = PEM_read_bio_PUBKEY(bio, nullptr, 0, nullptr);
+    BIO_free(bio);
+    if (key == nullptr) {
+        res.set_error("Could not read the user's public key");
+        return res;
+    }
+
+    // The cache holds a reference of its own. Another login of the same user
+    // may have cached the key in the meantime, in which case it is replaced.
+    lock_guard<mutex> guard(registry->lock);
+    auto it = registry->cached.find(username);
+    if (it != registry->cached.end()) {
+        EVP_PKEY_free(get<1>(*it->second));
+        registry->cache.erase(it->second);
+        registry->cached.erase(it);
+    }
+    if (registry->cache.size() >= REGISTRY_CACHE_SIZE) {
+        auto &[oldest, oldest_key] = registry->cache.back();
+        EVP_PKEY_free(oldest_key);
+        registry->cached.erase(oldest);
+        registry->cache.pop_back();
+    }
+    EVP_PKEY_up_ref(key);
+    registry->cache.emplace_front(username, key);
+    registry->cached[username] = registry->cache.begin();
+
+    res.set_result(key);
+    return res;
+}
+
+vector<RegistryEntry> registry_entries(Registry *registry) {
+    vector<RegistryEntry> entries;
+
+    for (uint32_t i = 0; i < registry->header->n_slots; i++) {
+        RegistrySlot *slot = &registry->slots[i];
+        if (slot->username[0] == '\0')
+            continue;
+
+        auto key_res = slot_key(registry, slot);
+        if (key_res.is_error)
+            continue;
+        auto [pem, pem_len] = key_res.result;
+
+        string username(slot->username, strnlen(slot->username, USERNAME_MAX));
+        entries.push_back(
+            {username, string(reinterpret_cast<const char *>(pem), pem_len)});
+    }
+
+    return entries;
+}
+
+bool is_valid_username(const string &username) {
+    if (username.empty() || username.size() >= USERNAME_MAX ||
+        username[0] == '.') {
+        return false;
+    }
+
+    for (char c : username) {
+        if (!isalnum((unsigned char)c) && c != '.' && c != '-' && c != '_') {
+            return false;
+        }
+    }
+    return true;
+}
+
+Maybe<bool> write_registry(const char *path,
+                           const vector<RegistryEntry> &entries) {
+    Maybe<bool> res;
+
+    uint32_t n_slots = MIN_SLOTS;
+    while (n_slots < 2 * entries.size()) {
+        n_slots *= 2;
+    }
+
+    RegistryHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, REGISTRY_MAGIC, sizeof(header.magic));
+    header.n_slots = n_slots;
+    header.n_users = entries.size();
+
+    // The keys follow the table, in the order of the entries
+    vector<RegistrySlot> slots(n_slots);
+    memset(slots.data(), 0, n_slots * sizeof(RegistrySlot));
+    uint64_t offset = sizeof(header) + n_slots * sizeof(RegistrySlot);
+    for (auto &entry : entries) {
+        RegistrySlot *slot =
+            &slots[find_slot(slots.data(), n_slots, entry.username.c_str())];
+        strncpy(slot->username, entry.username.c_str(), USERNAME_MAX - 1);
+        slot->key_offset = offset;
+        slot->key_len = entry.public_key.size();
+        offset += entry.public_key.size();
+    }
+
+    // Written aside first, then moved in place
+    string tmp_path = string(path) + ".tmp";
+    FILE *fp;
+    if ((fp = fopen(tmp_path.c_str(), "w")) == nullptr) {
+        res.set_error("Could not create the user registry");
+        return res;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+              fwrite(slots.data(), sizeof(RegistrySlot), n_slots, fp) ==
+                  n_slots;
+    for (auto &entry : entries) {
+        ok = ok && fwrite(entry.public_key.data(), 1, entry.public_key.size(),
+                          fp) == entry.public_key.size();
+    }
+    ok = ok && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    if (fclose(fp) != 0 || !ok) {
+        remove(tmp_path.c_str());
+        res.set_error("Could not write the user registry");
+        return res;
+    }
+
+    if (rename(tmp_path.c_str(), path) != 0) {
+        remove(tmp_path.c_str());
+        res.set_error("Could not replace the user registry");
+        return res;
+    }
+
+    res.set_result(true);
+    return res;
+}
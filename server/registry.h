@@ -0,0 +1,97 @@
+#include "../common/maybe.h"
+#include <list>
+#include <mutex>
+#include <openssl/evp.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+#ifndef registry_h
+#define registry_h
+
+// Where the server looks for the registry
+#define REGISTRY_PATH "certificates/users.idx"
+
+#define REGISTRY_MAGIC "SFTUSER1"
+
+// Longest username, terminator included
+#define USERNAME_MAX 32
+
+// Parsed public keys kept in memory, for the users who logged in last
+#define REGISTRY_CACHE_SIZE 1024
+
+/*
+ * The registry is a single file: a header, a hash table of slots indexed by
+ * the hash of the username, with linear probing, and the public keys of the
+ * users, as PEM, referenced by the slots. The table is never more than half
+ * full, so that a lookup touches one or two slots.
+ */
+struct RegistryHeader {
+    char magic[8];
+    uint32_t n_slots;
+    uint32_t n_users;
+};
+
+// A slot is free if its username is empty
+struct RegistrySlot {
+    char username[USERNAME_MAX];
+    uint64_t key_offset;
+    uint32_t key_len;
+    uint32_t reserved;
+};
+
+/* A user, as added to the registry */
+struct RegistryEntry {
+    string username;
+    string public_key;
+};
+
+/*
+ * Registry mapped in memory, read-only. The public keys are only parsed when
+ * their users log in, and the most recent ones are cached.
+ */
+struct Registry {
+    unsigned char *map;
+    size_t map_len;
+    RegistryHeader *header;
+    RegistrySlot *slots;
+
+    // Least recently used last
+    mutex lock;
+    list<tuple<string, EVP_PKEY *>> cache;
+    unordered_map<string, list<tuple<string, EVP_PKEY *>>::iterator> cached;
+};
+
+/* Maps the registry at [path], checking that it is well formed */
+Maybe<Registry *> open_registry(const char *path);
+
+void close_registry(Registry *registry);
+
+/*
+ * Finds the public key of [username]. The caller is responsible for freeing
+ * it.
+ */
+Maybe<EVP_PKEY *> registry_lookup(Registry *registry, const char *username);
+
+/* Every user in the registry */
+vector<RegistryEntry> registry_entries(Registry *registry);
+
+/*
+ * Whether [username] can be registered: it names the user's storage directory
+ * too, so only letters, digits, dots, dashes and underscores are allowed
+ */
+bool is_valid_username(const string &username);
+
+/*
+ * Writes a registry holding [entries] to [path], replacing the one there at
+ * once: a server that mapped the previous one keeps reading it untouched.
+ */
+Maybe<bool> write_registry(const char *path,
+                           const vector<RegistryEntry> &entries);
+
+#endif
@@ -1,156 +1,258 @@
 #include "../common/errors.h"
-#include "../common/seq.h"
 #include "../common/types.h"
 #include "../common/utils.h"
-#include "actions/delete.h"
-#include "actions/download.h"
-#include "actions/list.h"
-#include "actions/logout.h"
-#include "actions/rename.h"
-#include "actions/upload.h"
-#include "authentication.h"
+#include "keypool.h"
+#include "keystore.h"
+#include "metrics.h"
+#include "session.h"
+#include "threadpool.h"
+#include "tickets.h"
+#include "uring.h"
 #include <csignal>
+#include <errno.h>
+#include <fcntl.h>
 #include <iostream>
+#include <mutex>
 #include <netinet/in.h>
 #include <openssl/bio.h>
+#include <set>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
 #include <unistd.h>
-#include <wait.h>
+#include <vector>
 
 #define PORT 8080
 
 using namespace std;
 
-pid_t server = -1;
-int client_sock;
-unsigned char *shared_key;
-char *username;
+#define MAX_EVENTS 64
 
-/* Handler for SIGINT. Gracefully shuts down the server by:
- *     - waiting for every child to terminate (we assume that child processes
- *       will eventually terminate)
+// Default length of the accept queue of a listening socket
+#define DEFAULT_BACKLOG SOMAXCONN
+
+volatile sig_atomic_t running = 1;
+volatile sig_atomic_t metrics_requested = 0;
+volatile sig_atomic_t reload_requested = 0;
+
+int epoll_fd;
+
+// Metrics of every worker process, and of the one running in this process
+WorkerMetrics *metrics;
+unsigned int n_workers = 1;
+WorkerMetrics *worker_metrics;
+
+// Keypairs generated ahead of the handshakes of each worker process
+unsigned int key_pool_depth = DEFAULT_KEY_POOL_DEPTH;
+
+// Every open session, so that they can be closed on shutdown
+set<Session *> sessions;
+mutex sessions_lock;
+
+/* Handler for SIGINT. Gracefully shuts down the server by stopping the event
+ * loop, which then closes every session.
  */
 void signal_handler(int signum) {
-#ifdef NDEBUG
-    if (server == getpid()) {
-        cout << "Waiting for every child process to terminate... " << endl;
+    (void)signum;
+    running = 0;
+}
 
-        while (wait(NULL) > 0)
-            ;
-        cout << "Bye!" << endl;
+/* Handler for SIGUSR2: the metrics are printed as soon as possible */
+void metrics_handler(int signum) {
+    (void)signum;
+    metrics_requested = 1;
+}
 
-        exit(EXIT_SUCCESS);
+/* Handler for SIGHUP: the keys are read again as soon as possible */
+void reload_handler(int signum) {
+    (void)signum;
+    reload_requested = 1;
+}
+
+/*
+ * Registers [handler] for [signum]. Unlike with `signal`, blocking calls are
+ * not restarted after the handler, so the loops waiting on them notice.
+ */
+void set_signal_handler(int signum, void (*handler)(int)) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handler;
+    sigemptyset(&action.sa_mask);
+    sigaction(signum, &action, nullptr);
+}
+
+void report_metrics() {
+    if (metrics_requested) {
+        metrics_requested = 0;
+        print_metrics(metrics, n_workers);
     }
-#endif
+}
 
-    if (signum == SIGUSR1) {
-        // Check whether we are exiting from a user-requested exit, or
-        // due to a wraparound happening during some other action.
-        // In the latter case, we need to receive the header of the logout
-        if (seq_num > SEQ_MAX_THRESHOLD) {
-            auto header_res = get_mtype(client_sock);
-            if (header_res.is_error || header_res.result != LogoutReq) {
-                handle_errors();
-            }
+/*
+ * Reloads the keystore if asked to, without touching the sessions. Returns
+ * whether a reload was asked for.
+ */
+bool reload_keys() {
+    if (!reload_requested) {
+        return false;
+    }
+    reload_requested = 0;
+
+    auto load_res = load_keystore();
+    if (load_res.is_error) {
+        cerr << load_res.error << ", keeping the current keys" << endl;
+    } else {
+        cout << "Keys reloaded" << endl;
+    }
+    return true;
+}
+
+/* Accepts every pending connection, registering it in the event loop */
+void accept_clients(int sock) {
+    int new_client;
+
+    sample_accept_queue(worker_metrics, sock);
+
+    // Clients are never waited on either: what they do not take right away
+    // is kept for when their socket is writable again
+    while ((new_client = accept4(sock, nullptr, nullptr, SOCK_NONBLOCK)) >= 0) {
+        Session *session = new_session(new_client);
+        {
+            lock_guard<mutex> guard(sessions_lock);
+            sessions.insert(session);
         }
+        worker_metrics->accepted++;
+        worker_metrics->sessions++;
 
-        logout(client_sock, shared_key);
-        delete[] username;
-        explicit_bzero(shared_key, get_symmetric_key_length());
-        delete[] shared_key;
-        close(client_sock);
-        exit(EXIT_SUCCESS);
+        // One-shot: the session is not reported again until it is re-armed,
+        // so that a single worker serves it at a time
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+        event.data.ptr = session;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, new_client, &event) < 0) {
+            perror("Could not register client");
+            lock_guard<mutex> guard(sessions_lock);
+            sessions.erase(session);
+            worker_metrics->sessions--;
+            close_session(session);
+        }
+    }
+
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("Accept failed");
     }
 }
 
-/* Server loop for the client to send requests to the server */
-void serve_client() {
-    int key_len;
+/*
+ * Run by the thread pool: moves the session on by one event, then either
+ * re-arms it in the event loop or closes it.
+ */
+void run_session(Session *session, uint32_t events) {
+    uint32_t interest = serve_session(session, events);
+
+    if (session->state == Closed) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, session->sock, nullptr);
+        lock_guard<mutex> guard(sessions_lock);
+        sessions.erase(session);
+        worker_metrics->sessions--;
+        close_session(session);
+        return;
+    }
 
-    key_len = get_symmetric_key_length();
+    struct epoll_event event;
+    event.events = interest | EPOLLONESHOT;
+    event.data.ptr = session;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, session->sock, &event);
+}
 
-    tuple<char *, unsigned char *> auth_res;
-    try {
-        auth_res = authenticate(client_sock, key_len);
+/*
+ * Event loop: the main thread waits for the sockets of the clients to be
+ * ready, and hands each ready session to a pool of [n_threads] threads.
+ */
+void serve_clients(int sock, unsigned int n_threads) {
+    if ((epoll_fd = epoll_create1(0)) < 0) {
+        perror("Epoll creation failed");
+        exit(EXIT_FAILURE);
+    }
 
-        username = get<0>(auth_res);
-        shared_key = get<1>(auth_res);
+    // The listening socket is the only one registered without a session
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = nullptr;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &event) < 0) {
+        perror("Could not register listening socket");
+        exit(EXIT_FAILURE);
+    }
 
-#ifdef DEBUG
-        cout << "Shared key: ";
-        print_debug(shared_key, key_len);
-        cout << endl;
-#endif
+    ThreadPool *pool = new_thread_pool(n_threads);
 
-        // Server loop
-        for (;;) {
-            auto header_res = get_mtype(client_sock);
-            if (header_res.is_error)
+    // Threads do not survive a fork: every worker fills its own key pool
+    if (key_pool_depth > 0) {
+        key_pool = new_key_pool(key_pool_depth, worker_metrics);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (running) {
+        int n_events = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (n_events < 0) {
+            if (errno == EINTR) {
+                report_metrics();
+                reload_keys();
                 continue;
+            }
+            perror("Epoll wait failed");
+            break;
+        }
 
-            switch (header_res.result) {
-            case UploadReq:
-                upload(client_sock, shared_key, username);
-                break;
-            case DownloadReq:
-                download(client_sock, shared_key, username);
-                break;
-            case DeleteReq:
-                delete_file(client_sock, shared_key, username);
-                break;
-            case ListReq:
-                list_files(client_sock, shared_key, username);
-                break;
-            case RenameReq:
-                rename(client_sock, shared_key, username);
-                break;
-            case LogoutReq:
-                kill(getpid(), SIGUSR1);
-                break;
-            default:
-#ifdef DEBUG
-                cout << "Invalid header was received from client" << endl;
-#endif
-                break;
+        for (int i = 0; i < n_events; i++) {
+            Session *session = static_cast<Session *>(events[i].data.ptr);
+            if (session == nullptr) {
+                accept_clients(sock);
+                continue;
             }
+
+            uint32_t ready = events[i].events;
+            submit(pool, [session, ready] { run_session(session, ready); });
         }
-    } catch (char const *ex) {
-        cerr << "Something went wrong! :(" << endl;
-#ifdef DEBUG
-        cerr << "Error: " << ex << endl;
-#endif
-        cerr << "Exiting..." << endl;
-        close(client_sock);
-        exit(EXIT_FAILURE);
     }
-}
 
-int main() {
-    int sock, new_client;
-    struct sockaddr_in address;
-    socklen_t addr_len = sizeof(address);
-    pid_t res;
-
-    server = getpid();
+    // Let the workers finish what they are doing first
+    stop_thread_pool(pool);
+    if (key_pool != nullptr) {
+        stop_key_pool(key_pool);
+        key_pool = nullptr;
+    }
 
-    // Register signal handler to gracefully close on SIGINT
-    signal(SIGINT, signal_handler);
+    cout << "Closing every session... " << endl;
+    for (Session *session : sessions) {
+        close_session(session);
+    }
+    worker_metrics->sessions = 0;
+    close(epoll_fd);
+    cout << "Bye!" << endl;
+}
 
-    // Register signal handler to gracefully close on SIGUSR1 (before sequence
-    // number wraps)
-    signal(SIGUSR1, signal_handler);
+/*
+ * Creates the listening socket, with an accept queue of [backlog] connections.
+ * With [reuse_port] several processes can listen on the port at once, each
+ * with its own socket, and the kernel spreads the connections among them.
+ */
+int open_listener(int backlog, bool reuse_port) {
+    int sock;
+    struct sockaddr_in address;
+    int enable_sockopt = 1;
 
     // Create socket file descriptor
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
+    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
         perror("Socket creation failed");
         exit(EXIT_FAILURE);
     }
 
 #ifdef DEBUG
-    int enable_sockopt = 1;
     // Set SO_REUSEADDR flag, so that the same port can be re-used right away
     // without waiting the TIME_WAIT time. This is used to avoid errors during
     // debug time due to the default TCP behavior.
@@ -161,6 +263,12 @@ int main() {
     }
 #endif
 
+    if (reuse_port && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT,
+                                 &enable_sockopt, sizeof(int)) < 0) {
+        perror("Setting socket options failed");
+        exit(EXIT_FAILURE);
+    }
+
     // Set socket address and port
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = INADDR_ANY;
@@ -173,45 +281,207 @@ int main() {
     }
 
     // Start listening on it
-    if (listen(sock, 0) < 0) {
+    if (listen(sock, backlog) < 0) {
         perror("Socket listen failed");
         exit(EXIT_FAILURE);
     }
 
-#ifdef DEBUG
-    // When in debug mode, don't spawn child processes. Instead, use the main
-    // process to serve the client request. Should make debugging easier.
-    if ((new_client = accept(sock, (struct sockaddr *)&address, &addr_len)) >=
-        0) {
-        client_sock = new_client;
-        serve_client();
-        // Close the file descriptor after we are done with it
-        close(new_client);
-        exit(EXIT_SUCCESS);
-    } else {
-        perror("Accept failed");
+    // Connections are accepted by the event loop, never wait on them
+    if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) < 0) {
+        perror("Setting socket options failed");
         exit(EXIT_FAILURE);
     }
-#else
-    // Accept loop: each time a new client connects start a new process for that
-    // client. The child process will handle all interactions with the client.
-    while ((new_client =
-                accept(sock, (struct sockaddr *)&address, &addr_len)) >= 0) {
-        if ((res = fork()) == -1) {
-            perror("Fork failed");
+
+    return sock;
+}
+
+/* Threads of the pool of each worker process, so that all cores are used */
+unsigned int threads_per_worker() {
+    unsigned int n_threads = thread::hardware_concurrency() / n_workers;
+    return n_threads > 0 ? n_threads : 1;
+}
+
+/* Forks the worker process [id], which serves clients until it is stopped */
+pid_t spawn_worker(unsigned int id, int backlog) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Fork failed");
+        return pid;
+    }
+    if (pid > 0) {
+        return pid;
+    }
+
+    // The master process reports the metrics of every worker
+    signal(SIGUSR2, SIG_IGN);
+
+    // Do not outlive the master process
+    prctl(PR_SET_PDEATHSIG, SIGINT);
+
+    worker_metrics = &metrics[id];
+    worker_metrics->pid = getpid();
+    worker_metrics->sessions = 0;
+
+    int sock = open_listener(backlog, true);
+    serve_clients(sock, threads_per_worker());
+
+    close(sock);
+    exit(EXIT_SUCCESS);
+}
+
+/*
+ * Prefork mode: long-lived worker processes accept the connections on their
+ * own listening socket. The master process only restarts the workers that die
+ * and, on SIGINT, stops all of them.
+ */
+void run_workers(int backlog) {
+    vector<pid_t> pids(n_workers);
+    for (unsigned int i = 0; i < n_workers; i++) {
+        if ((pids[i] = spawn_worker(i, backlog)) < 0) {
             exit(EXIT_FAILURE);
-        } else if (res == 0) {
-            client_sock = new_client;
-            serve_client();
-            // Close the file descriptor after we are done with it
-            close(new_client);
-            exit(EXIT_SUCCESS);
-        };
-
-        // The parent closes the fd immediately
-        close(new_client);
-    }
-    perror("Accept failed");
-    exit(EXIT_FAILURE);
-#endif
+        }
+    }
+
+    while (running) {
+        pid_t pid = wait(nullptr);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                report_metrics();
+
+                // The workers started afterwards get the new keys too
+                if (reload_keys()) {
+                    for (pid_t worker : pids) {
+                        kill(worker, SIGHUP);
+                    }
+                }
+                continue;
+            }
+            perror("Wait failed");
+            break;
+        }
+
+        for (unsigned int i = 0; i < n_workers; i++) {
+            if (pids[i] == pid && running) {
+                cerr << "Worker " << i << " died, restarting it" << endl;
+                pids[i] = spawn_worker(i, backlog);
+            }
+        }
+    }
+
+    cout << "Stopping the workers... " << endl;
+    for (pid_t pid : pids) {
+        if (pid > 0) {
+            kill(pid, SIGINT);
+        }
+    }
+    while (wait(nullptr) > 0 || errno == EINTR)
+        ;
+    cout << "Bye!" << endl;
+}
+
+void print_usage(char *name) {
+    cerr << "Usage: " << name
+         << " [-u] [-w workers] [-b backlog] [-c bytes] [-k keypairs]" << endl;
+    cerr << "    -u  Transfer files through io_uring, if supported" << endl;
+    cerr << "    -w  Serve clients from this many worker processes" << endl;
+    cerr << "    -b  Length of the accept queue (default: " << DEFAULT_BACKLOG
+         << ")" << endl;
+    cerr << "    -c  Largest chunk size agreed on with the clients (default: "
+         << max_chunk_size << ", at most " << MAX_CHUNK_SIZE << ")" << endl;
+    cerr << "    -k  Ephemeral keypairs kept ready for each key exchange method"
+         << endl;
+    cerr << "        (default: " << DEFAULT_KEY_POOL_DEPTH
+         << ", 0 to generate them during the handshake)" << endl;
+    cerr << "Send SIGUSR2 to print the metrics of the workers, SIGHUP to reload"
+         << endl;
+    cerr << "the certificates and keys." << endl;
+}
+
+int main(int argc, char *argv[]) {
+    int backlog = DEFAULT_BACKLOG;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "uw:b:c:k:")) != -1) {
+        switch (opt) {
+        case 'u':
+            if (uring_available()) {
+                transfer_backend = IoUring;
+            } else {
+                cerr << "io_uring is not supported, using blocking I/O"
+                     << endl;
+            }
+            break;
+        case 'w':
+            if (atoi(optarg) <= 0) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            n_workers = atoi(optarg);
+            break;
+        case 'b':
+            if (atoi(optarg) <= 0) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            backlog = atoi(optarg);
+            break;
+        case 'c':
+            if (atoi(optarg) < CHUNK_SIZE || atoi(optarg) > MAX_CHUNK_SIZE) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            max_chunk_size = atoi(optarg);
+            break;
+        case 'k':
+            if (atoi(optarg) < 0 || (atoi(optarg) == 0 && optarg[0] != '0')) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            key_pool_depth = atoi(optarg);
+            break;
+        default:
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Register signal handler to gracefully close on SIGINT
+    set_signal_handler(SIGINT, signal_handler);
+    set_signal_handler(SIGUSR2, metrics_handler);
+    set_signal_handler(SIGHUP, reload_handler);
+
+    // A client leaving in the middle of an answer must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // The keys are read once, and then only on SIGHUP
+    auto keystore_res = load_keystore();
+    if (keystore_res.is_error) {
+        cerr << keystore_res.error << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // Shared by the workers, so that a client can resume its session with any
+    // of them
+    auto ticket_key_res = init_ticket_key();
+    if (ticket_key_res.is_error) {
+        cerr << ticket_key_res.error << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    metrics = new_metrics(n_workers);
+
+    if (n_workers > 1) {
+        run_workers(backlog);
+        exit(EXIT_SUCCESS);
+    }
+
+    // A single process serves every client
+    worker_metrics = &metrics[0];
+    worker_metrics->pid = getpid();
+
+    int sock = open_listener(backlog, false);
+    serve_clients(sock, threads_per_worker());
+
+    close(sock);
+    exit(EXIT_SUCCESS);
 }
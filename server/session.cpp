@@ -0,0 +1,454 @@
+#include "session.h"
+#include "../common/errors.h"
+#include "../common/resumption.h"
+#include "../common/seq.h"
+#include "../common/types.h"
+#include "../common/utils.h"
+#include "actions/delete.h"
+#include "actions/download.h"
+#include "actions/list.h"
+#include "actions/logout.h"
+#include "actions/rename.h"
+#include "actions/upload.h"
+#include "authentication.h"
+#include "tickets.h"
+#include <iostream>
+#include <string.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Every transfer has at most two operations in flight, on two buffers big
+// enough for a whole chunk message (see `get_session_ring`)
+#define RING_ENTRIES 8
+#define RING_BUFFERS 2
+
+// Fields of the authentication messages, exchanged before any chunk size is
+// agreed on
+#define AUTH_FLEN_MAX ((1 << 16) - 1)
+
+// Messages handled at most for each event, so that a client streaming chunks
+// does not starve the other sessions
+#define MAX_MESSAGES_PER_EVENT 16
+
+Session *new_session(int sock) {
+    Session *session = new Session();
+    session->sock = sock;
+    session->state = AwaitingAuthStart;
+    session->send_seq = 0;
+    session->recv_seq = 0;
+    session->reader = new_reader(sock);
+    session->writer = new_writer(sock);
+    session->auth = nullptr;
+    session->username = nullptr;
+    session->auth_time = 0;
+    session->aead = nullptr;
+    session->chunk_size = CHUNK_SIZE;
+    session->fp = nullptr;
+    session->offset = 0;
+    session->ranges.count = 0;
+    session->ranges.current = 0;
+    session->ring = nullptr;
+    session->buffer = 0;
+    session->pipeline = nullptr;
+    session->write_behind = nullptr;
+    session->upload_hash = nullptr;
+    session->checkpoint = 0;
+    return session;
+}
+
+Uring *get_session_ring(Session *session) {
+    if (transfer_backend != IoUring || session->ring != nullptr) {
+        return session->ring;
+    }
+
+    auto ring_res =
+        new_uring(RING_ENTRIES, RING_BUFFERS, session->chunk_size + 4096);
+    if (ring_res.is_error) {
+        // Not fatal, the transfers of this session just fall back
+        cerr << ring_res.error << ", using blocking I/O" << endl;
+        return nullptr;
+    }
+    session->ring = ring_res.result;
+    return session->ring;
+}
+
+/* Closes the file being transferred, if any */
+static void abort_transfer(Session *session) {
+    if (session->fp == nullptr)
+        return;
+
+    // What was uploaded so far is kept, for the client to resume
+    if (session->state == Uploading) {
+        suspend_upload(session);
+        return;
+    }
+
+    // The file must not be in use anymore
+    stop_download(session);
+    stop_upload(session);
+    fclose(session->fp);
+    session->fp = nullptr;
+}
+
+void close_session(Session *session) {
+    free_auth_state(session->auth);
+
+    // The writes of an upload are waited for, to keep what they wrote, but
+    // nothing else can be left in flight on a file that is about to be closed
+    if (session->state == Uploading) {
+        abort_transfer(session);
+    }
+    free_uring(session->ring);
+    session->ring = nullptr;
+    abort_transfer(session);
+    free_resume_hash(session->upload_hash);
+
+    free_aead(session->aead);
+    delete[] session->username;
+    free_reader(session->reader);
+    free_writer(session->writer);
+
+    close(session->sock);
+    delete session;
+}
+
+static bool is_authenticated(Session *session) {
+    return session->state != AwaitingAuthStart &&
+           session->state != AwaitingAuthClientAns;
+}
+
+/* Number of fields of the message the session is waiting for */
+static int expected_fields(Session *session) {
+    switch (session->state) {
+    case AwaitingAuthStart: {
+        // Username, key exchange method, half key, chunk size and the
+        // fingerprint of the certificate the client holds, or, to resume a
+        // session, username, ticket, nonce and chunk size
+        auto fill_res = reader_fill(session->reader, sizeof(mtype), false);
+        if (!fill_res.is_error && fill_res.result &&
+            *reader_peek(session->reader, 0) == ResumeStart) {
+            return 4;
+        }
+        return 5;
+    }
+    default:
+        // Client signature during authentication, ciphertext afterwards
+        return 1;
+    }
+}
+
+/* Ends the session on the client's request */
+/*
+ * Moves the messages to the client on to the next key once the current one
+ * has sealed enough of them, before the next answer is sealed. While a
+ * download is in progress, its pipeline does so instead.
+ */
+static void update_send_key(Session *session) {
+    if (aead_needs_update(session->aead, session->send_seq)) {
+        send_key_update(session->writer, session->aead, session->send_seq);
+    }
+}
+
+static void end_session(Session *session) {
+    // The messages of a download sealed already go out before the answer,
+    // then whatever was in progress is aborted
+    if (session->state == Downloading) {
+        finish_download(session);
+    }
+    abort_transfer(session);
+
+    update_send_key(session);
+    logout(session);
+    session->state = LoggedOut;
+}
+
+/* Longest field expected from the client */
+static flen max_field_len(Session *session) {
+    if (!is_authenticated(session)) {
+        return AUTH_FLEN_MAX;
+    }
+
+    // A chunk, encrypted
+    return session->chunk_size + get_block_size();
+}
+
+/*
+ * Hands the client a ticket to resume the session later on, derived from the
+ * session key, as the first message of the session
+ */
+static void send_ticket(Session *session, unsigned char *secret) {
+    auto ticket_res =
+        seal_ticket(session->username, secret, session->auth_time);
+    explicit_bzero(secret, RESUMPTION_SECRET_LEN);
+    if (ticket_res.is_error) {
+        handle_errors(ticket_res.error);
+    }
+    auto [ticket, ticket_len] = ticket_res.result;
+
+    auto send_header_res =
+        send_header(session->writer, NewTicket, session->send_seq);
+    if (send_header_res.is_error) {
+        delete[] ticket;
+        handle_errors(send_header_res.error);
+    }
+
+    // Sealed like any other message: the ticket is opaque to the client, but
+    // whoever sees it could resume the session in its place
+    unsigned char *ct = new unsigned char[ticket_len];
+    unsigned char tag[TAG_LEN];
+    auto seal_res = aead_seal(session->aead, NewTicket, session->send_seq,
+                              ticket, ticket_len, ct, tag);
+    delete[] ticket;
+    if (seal_res.is_error) {
+        delete[] ct;
+        handle_errors(seal_res.error);
+    }
+
+    auto send_ct_res = send_field(session->writer, (flen)ticket_len, ct);
+    delete[] ct;
+    if (send_ct_res.is_error) {
+        handle_errors(send_ct_res.error);
+    }
+
+    auto send_tag_res = send_tag(session->writer, tag);
+    if (send_tag_res.is_error) {
+        handle_errors(send_tag_res.error);
+    }
+
+    inc_seqnum(session->send_seq);
+}
+
+/*
+ * Sets up the encryption of the session with the [key] agreed on with the
+ * client, which is wiped and freed, and hands the client a new ticket
+ */
+static void start_session(Session *session, unsigned char *key) {
+    int key_len = get_symmetric_key_length();
+
+#ifdef DEBUG
+    cout << "Shared key: ";
+    print_debug(key, key_len);
+    cout << endl;
+#endif
+
+    unsigned char secret[RESUMPTION_SECRET_LEN];
+    auto secret_res = derive_resumption_secret(key, key_len, secret);
+    auto aead_res = new_aead(key, key_len, ServerToClient);
+    explicit_bzero(key, key_len);
+    delete[] key;
+    if (aead_res.is_error) {
+        explicit_bzero(secret, sizeof(secret));
+        handle_errors(aead_res.error);
+    }
+    session->aead = aead_res.result;
+    if (secret_res.is_error) {
+        handle_errors(secret_res.error);
+    }
+
+    session->state = Ready;
+    send_ticket(session, secret);
+}
+
+/* Handles a whole message from the client, according to the session state */
+static void handle_message(Session *session) {
+    auto header_res = get_mtype(session->reader);
+    if (header_res.is_error) {
+        handle_errors(header_res.error);
+    }
+    auto type = header_res.result;
+
+    // Whatever the answer to the message is, it is sealed under a key with
+    // room for it
+    if (is_authenticated(session) && session->state != Downloading &&
+        type != LogoutReq) {
+        update_send_key(session);
+    }
+
+    // The client can log out at any time after the authentication
+    if (type == LogoutReq && is_authenticated(session)) {
+        end_session(session);
+        return;
+    }
+
+    // ... and move on to the next key, in between any two messages
+    if (type == KeyUpdate && is_authenticated(session)) {
+        receive_key_update(session->reader, session->aead, session->recv_seq);
+        return;
+    }
+
+    switch (session->state) {
+    case AwaitingAuthStart:
+        if (type == ResumeStart) {
+            auto [username, key, chunk_size, auth_time] = auth_resume(
+                session->reader, session->writer, get_symmetric_key_length());
+            if (username == nullptr) {
+                // The client can still authenticate in full
+                break;
+            }
+            session->username = username;
+            session->chunk_size = chunk_size;
+            session->auth_time = auth_time;
+            start_session(session, key);
+            break;
+        }
+        if (type != AuthStart) {
+            handle_errors("Incorrect message type");
+        }
+        session->auth = auth_start(session->reader, session->writer);
+        session->chunk_size = session->auth->chunk_size;
+        session->state = AwaitingAuthClientAns;
+        break;
+    case AwaitingAuthClientAns: {
+        if (type != AuthClientAns) {
+            handle_errors("Incorrect message type");
+        }
+        auto auth = session->auth;
+        session->auth = nullptr;
+        auto [username, shared_key] =
+            auth_finish(session->reader, auth, get_symmetric_key_length());
+        session->username = username;
+        session->auth_time = time(nullptr);
+        start_session(session, shared_key);
+        break;
+    }
+    case Ready:
+        switch (type) {
+        case UploadReq:
+            if (upload(session)) {
+                session->state = Uploading;
+            }
+            break;
+        case DownloadReq:
+            if (download(session)) {
+                session->state = Downloading;
+            }
+            break;
+        case DeleteReq:
+            if (delete_file(session)) {
+                session->state = AwaitingDeleteRes;
+            }
+            break;
+        case ListReq:
+            list_files(session);
+            break;
+        case RenameReq:
+            rename(session);
+            break;
+        default:
+            handle_errors("Invalid header was received from client");
+        }
+        break;
+    case Uploading:
+        if (upload_chunk(session, type)) {
+            session->state = Ready;
+        }
+        break;
+    case AwaitingDeleteRes:
+        if (type != DeleteRes) {
+            handle_errors("Incorrect message type");
+        }
+        delete_confirm(session);
+        session->state = Ready;
+        break;
+    default:
+        // Nothing is expected from the client while downloading
+        handle_errors("Unexpected message from client");
+    }
+}
+
+uint32_t serve_session(Session *session, uint32_t events) {
+    bool backlogged = false;
+
+    // Nothing else is done for a client that does not take what it was sent,
+    // so that it only holds up its own session
+    if (writer_pending(session->writer)) {
+        auto flush_res = writer_flush(session->writer);
+        if (flush_res.is_error) {
+            cerr << flush_res.error << ", closing session..." << endl;
+            abort_transfer(session);
+            session->state = Closed;
+            return 0;
+        }
+        if (!flush_res.result) {
+            return EPOLLOUT;
+        }
+    }
+    if (session->state == LoggedOut) {
+        session->state = Closed;
+        return 0;
+    }
+
+    // The answers to the messages handled below are sent together at the end
+    writer_cork(session->writer);
+    try {
+        // Messages may be left in the buffer by the previous event, even if
+        // nothing new was received
+        if ((events & EPOLLIN) || reader_available(session->reader) > 0) {
+            int budget = MAX_MESSAGES_PER_EVENT;
+            while (session->state != Closed && session->state != LoggedOut &&
+                   budget > 0 && !writer_pending(session->writer)) {
+                auto ready_res = is_message_ready(
+                    session->reader, expected_fields(session),
+                    is_authenticated(session), max_field_len(session));
+                if (ready_res.is_error) {
+                    handle_errors(ready_res.error);
+                }
+
+                if (ready_res.result) {
+                    handle_message(session);
+                    budget--;
+                } else if (events & (EPOLLRDHUP | EPOLLHUP)) {
+                    // The client went away in the middle of a message
+                    handle_errors("Connection closed by peer");
+                } else {
+                    break;
+                }
+            }
+            backlogged = budget == 0;
+        }
+
+        if (session->state == Downloading && (events & EPOLLOUT) &&
+            !writer_pending(session->writer)) {
+            if (download_chunk(session)) {
+                session->state = Ready;
+            }
+        }
+    } catch (char const *ex) {
+        cerr << "Something went wrong! :(" << endl;
+#ifdef DEBUG
+        cerr << "Error: " << ex << endl;
+#endif
+        cerr << "Closing session..." << endl;
+        abort_transfer(session);
+        session->state = Closed;
+
+        // The last message may have been left halfway
+        writer_discard(session->writer);
+    }
+
+    auto flush_res = writer_uncork(session->writer);
+    if (flush_res.is_error) {
+        cerr << flush_res.error << ", closing session..." << endl;
+        abort_transfer(session);
+        session->state = Closed;
+    }
+
+    // The rest of the answers first
+    if (writer_pending(session->writer)) {
+        return EPOLLOUT;
+    }
+    if (session->state == LoggedOut) {
+        session->state = Closed;
+        return 0;
+    }
+
+    // Downloads are driven by the socket being writable, and so is a session
+    // whose budget ran out, to handle the rest of its messages next
+    if (session->state == Downloading || backlogged) {
+        return EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+    }
+    return EPOLLIN | EPOLLRDHUP;
+}
@@ -0,0 +1,154 @@
+#include "../common/aead.h"
+#include "../common/reader.h"
+#include "../common/types.h"
+#include "../common/writer.h"
+#include "authentication.h"
+#include "uring.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#if __has_include(<filesystem>)
+#include <filesystem>
+namespace fs = std::filesystem;
+#elif __has_include(<experimental/filesystem>)
+#include <experimental/filesystem>
+namespace fs = std::experimental::filesystem;
+#else
+error "Missing the <filesystem> header."
+#endif
+
+#ifndef session_h
+#define session_h
+
+/* What the server is waiting for on a client connection */
+enum session_state {
+    // Authentication
+    AwaitingAuthStart,
+    AwaitingAuthClientAns,
+
+    // Authenticated, waiting for the next request
+    Ready,
+
+    // Receiving UploadChunk messages
+    Uploading,
+
+    // Sending DownloadChunk messages, each time the socket is writable
+    Downloading,
+
+    // Waiting for the user to confirm a deletion (DeleteRes)
+    AwaitingDeleteRes,
+
+    // Logged out, the connection is closed once the answer is out
+    LoggedOut,
+
+    // The session is over and the connection can be closed
+    Closed
+};
+
+// Threads preparing the chunks of a download, see actions/download.cpp
+struct DownloadPipeline;
+
+// Thread writing the chunks of an upload, see actions/upload.cpp
+struct UploadPipeline;
+
+// Hash of the start of a file being transferred, see common/utils.h
+struct ResumeHash;
+
+/* Ranges of a file left to download, read in order */
+struct RangeCursor {
+    ByteRange ranges[MAX_RANGES];
+    int count;
+
+    // Range the next chunk is read from, the ones before it being over
+    int current;
+};
+
+/* State of a client connection served by the event loop */
+struct Session {
+    int sock;
+    session_state state;
+
+    // Sequence numbers of the next message to the client and from it, each
+    // direction counting on its own
+    seqnum send_seq;
+    seqnum recv_seq;
+
+    // Bytes received from the client and not handled yet, and messages for
+    // it not sent yet
+    Reader *reader;
+    Writer *writer;
+
+    // Pending authentication, until AuthClientAns is received
+    AuthState *auth;
+
+    char *username;
+
+    // When the user last authenticated in full, which the tickets handed to
+    // them go back to even when the session is resumed
+    int64_t auth_time;
+
+    // Contexts encrypting the messages, keyed with the shared key once the
+    // authentication is over. The key itself is not kept.
+    Aead *aead;
+
+    // Size of the chunks of the transfers, agreed on with the client
+    unsigned int chunk_size;
+
+    // File being uploaded or downloaded, how much of the upload was received
+    // and what is left to send of the download
+    FILE *fp;
+    off_t offset;
+    RangeCursor ranges;
+
+    // Ring of the io_uring backend, set up at the first transfer. When
+    // uploading, [buffer] is the registered buffer for the next chunk.
+    Uring *ring;
+    unsigned buffer;
+
+    // Stages of the download in progress on blocking I/O, which own the file
+    // until they are stopped
+    DownloadPipeline *pipeline;
+
+    // Stage writing the upload in progress on blocking I/O
+    UploadPipeline *write_behind;
+
+    // File being uploaded, or waiting for the confirmation of its deletion
+    fs::path path;
+
+    // Hash of what was received of the upload in progress, set up at the
+    // first upload
+    ResumeHash *upload_hash;
+
+    // End of the block of the upload on io_uring being synced to the disk,
+    // journaled once the sync is over. 0 when there is none.
+    uint64_t checkpoint;
+};
+
+Session *new_session(int sock);
+
+/*
+ * Returns the io_uring of the session, setting it up on first use, or nullptr
+ * if the transfers run on blocking I/O.
+ */
+Uring *get_session_ring(Session *session);
+
+/*
+ * Frees the session and closes its socket. A partially uploaded file is kept
+ * for the client to resume.
+ */
+void close_session(Session *session);
+
+/*
+ * Handles the readiness [events] (EPOLLIN/EPOLLOUT) reported for the session
+ * socket. Messages are only handled once they have been fully received, so
+ * that serving a session never blocks the others while waiting for the client.
+ * All the messages already buffered are handled in one go, up to a budget,
+ * and the answers to them are coalesced into as few writes as possible.
+ *
+ * Returns the events the session must be polled for next. When the session is
+ * over its state is Closed.
+ */
+uint32_t serve_session(Session *session, uint32_t events);
+
+#endif
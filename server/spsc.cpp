@@ -0,0 +1,72 @@
+#include "spsc.h"
+
+SpscRing *new_spsc(unsigned int capacity) {
+    SpscRing *ring = new SpscRing();
+    ring->slots = new void *[capacity];
+    ring->mask = capacity - 1;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->waiting = false;
+    ring->closed = false;
+    return ring;
+}
+
+void free_spsc(SpscRing *ring) {
+    if (ring == nullptr)
+        return;
+
+    delete[] ring->slots;
+    delete ring;
+}
+
+bool spsc_push(SpscRing *ring, void *item) {
+    unsigned int tail = ring->tail.load(memory_order_relaxed);
+    if (tail - ring->head.load(memory_order_acquire) > ring->mask) {
+        return false;
+    }
+
+    ring->slots[tail & ring->mask] = item;
+    ring->tail.store(tail + 1, memory_order_release);
+
+    // Pairs with the fence in `spsc_pop_wait`: either the consumer sees the
+    // new item before parking, or we see it parked and wake it up
+    atomic_thread_fence(memory_order_seq_cst);
+    if (ring->waiting.load(memory_order_relaxed)) {
+        lock_guard<mutex> guard(ring->lock);
+        ring->ready.notify_one();
+    }
+    return true;
+}
+
+void *spsc_pop(SpscRing *ring) {
+    unsigned int head = ring->head.load(memory_order_relaxed);
+    if (head == ring->tail.load(memory_order_acquire)) {
+        return nullptr;
+    }
+
+    void *item = ring->slots[head & ring->mask];
+    ring->head.store(head + 1, memory_order_release);
+    return item;
+}
+
+void *spsc_pop_wait(SpscRing *ring) {
+    void *item = spsc_pop(ring);
+    if (item != nullptr) {
+        return item;
+    }
+
+    unique_lock<mutex> guard(ring->lock);
+    ring->waiting.store(true, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    while ((item = spsc_pop(ring)) == nullptr && !ring->closed) {
+        ring->ready.wait(guard);
+    }
+    ring->waiting.store(false, memory_order_relaxed);
+    return item;
+}
+
+void spsc_close(SpscRing *ring) {
+    ring->closed = true;
+    lock_guard<mutex> guard(ring->lock);
+    ring->ready.notify_all();
+}
@@ -0,0 +1,58 @@
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+
+using namespace std;
+
+#ifndef spsc_h
+#define spsc_h
+
+/*
+ * Bounded queue of pointers between exactly one producer thread and one
+ * consumer thread. Pushing and popping are lock-free: the lock is only taken
+ * to park the consumer when the ring is empty, and by the producer to wake it
+ * up.
+ */
+struct SpscRing {
+    void **slots;
+    unsigned int mask;
+
+    // Next slot to pop, only written by the consumer, and next slot to push,
+    // only written by the producer. Kept apart so that the two threads do not
+    // keep stealing the same cache line from each other.
+    alignas(64) atomic<unsigned int> head;
+    alignas(64) atomic<unsigned int> tail;
+
+    // Parking of the consumer
+    atomic<bool> waiting;
+    atomic<bool> closed;
+    mutex lock;
+    condition_variable ready;
+};
+
+/*
+ * Allocates a ring with room for [capacity] items, a power of two. The caller
+ * is responsible for freeing it with `free_spsc`.
+ */
+SpscRing *new_spsc(unsigned int capacity);
+void free_spsc(SpscRing *ring);
+
+/*
+ * Called by the producer. Returns false if the ring is full, in which case
+ * [item] is not queued.
+ */
+bool spsc_push(SpscRing *ring, void *item);
+
+/* Called by the consumer. Returns nullptr if the ring is empty. */
+void *spsc_pop(SpscRing *ring);
+
+/*
+ * Called by the consumer: waits for an item to be pushed if there are none.
+ * Returns nullptr only once the ring is closed and empty.
+ */
+void *spsc_pop_wait(SpscRing *ring);
+
+/* Wakes up the consumer for good, e.g. to tear a pipeline down */
+void spsc_close(SpscRing *ring);
+
+#endif
@@ -0,0 +1,130 @@
+#include "threadpool.h"
+#include <signal.h>
+
+using namespace std;
+
+// Pool and queue index of the worker running on this thread, if any
+static thread_local ThreadPool *current_pool = nullptr;
+static thread_local unsigned int current_queue = 0;
+
+/*
+ * Takes a task for the worker owning the queue [id]: the newest of its own
+ * or, failing that, the oldest of another worker. Returns false if every queue
+ * is empty.
+ */
+static bool take_task(ThreadPool *pool, unsigned int id, task &t) {
+    WorkQueue *own = pool->queues[id];
+    {
+        lock_guard<mutex> guard(own->lock);
+        if (!own->tasks.empty()) {
+            t = move(own->tasks.back());
+            own->tasks.pop_back();
+            return true;
+        }
+    }
+
+    unsigned int n_queues = pool->queues.size();
+    for (unsigned int i = 1; i < n_queues; i++) {
+        WorkQueue *victim = pool->queues[(id + i) % n_queues];
+        lock_guard<mutex> guard(victim->lock);
+        if (!victim->tasks.empty()) {
+            t = move(victim->tasks.front());
+            victim->tasks.pop_front();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void work(ThreadPool *pool, unsigned int id) {
+    current_pool = pool;
+    current_queue = id;
+
+    for (;;) {
+        // Claim one of the queued tasks, or quit once there are no more
+        {
+            unique_lock<mutex> guard(pool->lock);
+            pool->has_work.wait(
+                guard, [pool] { return pool->pending > 0 || pool->stopping; });
+            if (pool->pending == 0)
+                return;
+            pool->pending--;
+        }
+
+        // The claimed task is queued somewhere, but another worker might take
+        // it first: in that case the one it claimed is still around
+        task t;
+        while (!take_task(pool, id, t)) {
+            this_thread::yield();
+        }
+        t();
+    }
+}
+
+ThreadPool *new_thread_pool(unsigned int n_workers) {
+    if (n_workers == 0) {
+        n_workers = thread::hardware_concurrency();
+    }
+    if (n_workers == 0) {
+        n_workers = 1;
+    }
+
+    ThreadPool *pool = new ThreadPool();
+    pool->pending = 0;
+    pool->stopping = false;
+    pool->next_queue = 0;
+    for (unsigned int i = 0; i < n_workers; i++) {
+        pool->queues.push_back(new WorkQueue());
+    }
+
+    // Workers inherit the signal mask: block everything while spawning them
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (unsigned int i = 0; i < n_workers; i++) {
+        pool->workers.emplace_back(work, pool, i);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+
+    return pool;
+}
+
+void submit(ThreadPool *pool, task t) {
+    unsigned int id;
+    if (current_pool == pool) {
+        id = current_queue;
+    } else {
+        lock_guard<mutex> guard(pool->lock);
+        id = pool->next_queue;
+        pool->next_queue = (pool->next_queue + 1) % pool->queues.size();
+    }
+
+    {
+        WorkQueue *queue = pool->queues[id];
+        lock_guard<mutex> guard(queue->lock);
+        queue->tasks.push_back(move(t));
+    }
+
+    {
+        lock_guard<mutex> guard(pool->lock);
+        pool->pending++;
+    }
+    pool->has_work.notify_one();
+}
+
+void stop_thread_pool(ThreadPool *pool) {
+    {
+        lock_guard<mutex> guard(pool->lock);
+        pool->stopping = true;
+    }
+    pool->has_work.notify_all();
+
+    for (auto &worker : pool->workers) {
+        worker.join();
+    }
+    for (WorkQueue *queue : pool->queues) {
+        delete queue;
+    }
+    delete pool;
+}
@@ -0,0 +1,56 @@
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+#ifndef threadpool_h
+#define threadpool_h
+
+typedef function<void()> task;
+
+/* Tasks waiting to be run by a worker */
+struct WorkQueue {
+    mutex lock;
+    deque<task> tasks;
+};
+
+/*
+ * Fixed set of worker threads. Every worker owns a queue: it runs its own
+ * tasks first, newest first, and when it runs out of them it steals the
+ * oldest tasks of the other workers, so that the load is balanced across all
+ * of them.
+ */
+struct ThreadPool {
+    vector<WorkQueue *> queues;
+    vector<thread> workers;
+
+    // Number of queued tasks that no worker has claimed yet
+    mutex lock;
+    condition_variable has_work;
+    size_t pending;
+    bool stopping;
+
+    // Queue to submit the next task to, when not submitting from a worker
+    unsigned int next_queue;
+};
+
+/*
+ * Starts a pool with [n_workers] threads, or one per core if zero. The
+ * workers never handle signals, those are left to the calling thread.
+ */
+ThreadPool *new_thread_pool(unsigned int n_workers);
+
+/*
+ * Queues [t] to be run by one of the workers. A task submitted by a worker
+ * goes to its own queue.
+ */
+void submit(ThreadPool *pool, task t);
+
+/* Waits for every queued task to be run, then stops and frees the pool */
+void stop_thread_pool(ThreadPool *pool);
+
+#endif
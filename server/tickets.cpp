@@ -0,0 +1,132 @@
+#include "tickets.h"
+#include <openssl/evp.h>
+#include <algorithm>
+#include <openssl/rand.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+using namespace std;
+
+#define TICKET_KEY_LEN 32
+#define TICKET_NONCE_LEN 12
+#define TICKET_TAG_LEN 16
+
+// nonce | expiry, time of the authentication, secret and username, encrypted
+// | tag
+#define TICKET_OVERHEAD (TICKET_NONCE_LEN + TICKET_TAG_LEN)
+#define TICKET_HEADER_LEN (2 * sizeof(int64_t) + RESUMPTION_SECRET_LEN)
+
+static unsigned char ticket_key[TICKET_KEY_LEN];
+
+Maybe<bool> init_ticket_key() {
+    Maybe<bool> res;
+
+    if (RAND_bytes(ticket_key, sizeof(ticket_key)) != 1) {
+        res.set_error("Could not generate the ticket key");
+        return res;
+    }
+
+    res.set_result(true);
+    return res;
+}
+
+Maybe<tuple<unsigned char *, size_t>> seal_ticket(const char *username,
+                                                  const unsigned char *secret,
+                                                  int64_t authenticated) {
+    Maybe<tuple<unsigned char *, size_t>> res;
+
+    size_t username_len = strlen(username) + 1;
+    size_t pt_len = TICKET_HEADER_LEN + username_len;
+    unsigned char *pt = new unsigned char[pt_len];
+    int64_t expiry = min((int64_t)time(nullptr) + TICKET_LIFETIME,
+                         authenticated + TICKET_MAX_AGE);
+    memcpy(pt, &expiry, sizeof(expiry));
+    memcpy(pt + sizeof(expiry), &authenticated, sizeof(authenticated));
+    memcpy(pt + 2 * sizeof(int64_t), secret, RESUMPTION_SECRET_LEN);
+    memcpy(pt + TICKET_HEADER_LEN, username, username_len);
+
+    size_t len = TICKET_OVERHEAD + pt_len;
+    unsigned char *ticket = new unsigned char[len];
+    unsigned char *nonce = ticket;
+    unsigned char *ct = ticket + TICKET_NONCE_LEN;
+    unsigned char *tag = ct + pt_len;
+
+    EVP_CIPHER_CTX *ctx;
+    int out_len;
+    bool ok = RAND_bytes(nonce, TICKET_NONCE_LEN) == 1 &&
+              (ctx = EVP_CIPHER_CTX_new()) != nullptr;
+    if (ok) {
+        ok = EVP_EncryptInit(ctx, EVP_aes_256_gcm(), ticket_key, nonce) == 1 &&
+             EVP_EncryptUpdate(ctx, ct, &out_len, pt, pt_len) == 1 &&
+             EVP_EncryptFinal(ctx, ct + out_len, &out_len) == 1 &&
+             EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, TICKET_TAG_LEN,
+                                 tag) == 1;
+        EVP_CIPHER_CTX_free(ctx);
+    }
+    explicit_bzero(pt, pt_len);
+    delete[] pt;
+    if (!ok) {
+        delete[] ticket;
+        res.set_error("Could not seal the ticket");
+        return res;
+    }
+
+    res.set_result({ticket, len});
+    return res;
+}
+
+Maybe<Ticket> open_ticket(const unsigned char *ticket, size_t len) {
+    Maybe<Ticket> res;
+
+    // At least an empty username, with its terminator
+    if (len < TICKET_OVERHEAD + TICKET_HEADER_LEN + 1) {
+        res.set_error("Invalid ticket");
+        return res;
+    }
+
+    size_t pt_len = len - TICKET_OVERHEAD;
+    const unsigned char *nonce = ticket;
+    const unsigned char *ct = ticket + TICKET_NONCE_LEN;
+    const unsigned char *tag = ct + pt_len;
+    unsigned char *pt = new unsigned char[pt_len];
+
+    EVP_CIPHER_CTX *ctx;
+    int out_len;
+    bool ok = (ctx = EVP_CIPHER_CTX_new()) != nullptr;
+    if (ok) {
+        ok = EVP_DecryptInit(ctx, EVP_aes_256_gcm(), ticket_key, nonce) == 1 &&
+             EVP_DecryptUpdate(ctx, pt, &out_len, ct, pt_len) == 1 &&
+             EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, TICKET_TAG_LEN,
+                                 const_cast<unsigned char *>(tag)) == 1 &&
+             EVP_DecryptFinal(ctx, pt + out_len, &out_len) == 1;
+        EVP_CIPHER_CTX_free(ctx);
+    }
+    if (!ok || pt[pt_len - 1] != '\0') {
+        explicit_bzero(pt, pt_len);
+        delete[] pt;
+        res.set_error("Invalid ticket");
+        return res;
+    }
+
+    int64_t expiry, authenticated;
+    memcpy(&expiry, pt, sizeof(expiry));
+    memcpy(&authenticated, pt + sizeof(expiry), sizeof(authenticated));
+    int64_t now = time(nullptr);
+    if (now >= expiry || now - authenticated >= TICKET_MAX_AGE) {
+        explicit_bzero(pt, pt_len);
+        delete[] pt;
+        res.set_error("Expired ticket");
+        return res;
+    }
+
+    Ticket contents;
+    memcpy(contents.secret, pt + 2 * sizeof(int64_t), RESUMPTION_SECRET_LEN);
+    contents.authenticated = authenticated;
+    contents.username = reinterpret_cast<char *>(pt + TICKET_HEADER_LEN);
+    explicit_bzero(pt, pt_len);
+    delete[] pt;
+
+    res.set_result(contents);
+    return res;
+}
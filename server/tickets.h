@@ -0,0 +1,48 @@
+#include "../common/maybe.h"
+#include "../common/resumption.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <tuple>
+
+using namespace std;
+
+#ifndef tickets_h
+#define tickets_h
+
+// Seconds a resumption ticket is accepted for, after it is issued, and
+// resumptions can go on for after the full authentication they started from
+#define TICKET_LIFETIME (12 * 60 * 60)
+#define TICKET_MAX_AGE (7 * 24 * 60 * 60)
+
+/* Contents of a resumption ticket */
+struct Ticket {
+    string username;
+    unsigned char secret[RESUMPTION_SECRET_LEN];
+
+    // When the user last authenticated in full, as a time_t
+    int64_t authenticated;
+};
+
+/*
+ * Generates the key the tickets are encrypted with. It never leaves the
+ * server, and changes every time the server starts: the tickets of a previous
+ * run are turned down. Must be called before forking the workers, for them to
+ * accept the tickets issued by each other.
+ */
+Maybe<bool> init_ticket_key();
+
+/*
+ * Issues a ticket for [username], holding the resumption [secret] of their
+ * session, which goes back to a full authentication at time [authenticated].
+ * Reissuing tickets never pushes them past TICKET_MAX_AGE from then. The
+ * caller is responsible for freeing it with `delete[]`.
+ */
+Maybe<tuple<unsigned char *, size_t>> seal_ticket(const char *username,
+                                                  const unsigned char *secret,
+                                                  int64_t authenticated);
+
+/* Reads a ticket issued by this server, failing if it expired */
+Maybe<Ticket> open_ticket(const unsigned char *ticket, size_t len);
+
+#endif
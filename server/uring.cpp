@@ -0,0 +1,292 @@
+#include "uring.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+io_backend transfer_backend = BlockingIO;
+
+// There is no wrapper for the io_uring syscalls in the C library
+static int io_uring_setup(unsigned entries, io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                          unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, nullptr, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg,
+                             unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+bool uring_available() {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    int fd = io_uring_setup(1, &params);
+    if (fd < 0) {
+        return false;
+    }
+    close(fd);
+    return true;
+}
+
+/* Unmaps whatever part of the ring was set up, and closes it */
+static void release_uring(Uring *ring) {
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    if (ring->sqes != nullptr) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring != nullptr) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != nullptr) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    for (unsigned i = 0; i < ring->n_buffers; i++) {
+        if (ring->buffers[i].iov_base != nullptr) {
+            munmap(ring->buffers[i].iov_base, ring->buffers[i].iov_len);
+        }
+    }
+    delete[] ring->buffers;
+    delete ring;
+}
+
+static void *map_ring(int fd, size_t size, off_t offset) {
+    void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, offset);
+    return ptr == MAP_FAILED ? nullptr : ptr;
+}
+
+Maybe<Uring *> new_uring(unsigned entries, unsigned n_buffers,
+                         size_t buffer_size) {
+    Maybe<Uring *> res;
+
+    Uring *ring = new Uring();
+    ring->buffers = new struct iovec[n_buffers]();
+    ring->n_buffers = n_buffers;
+
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    if ((ring->fd = io_uring_setup(entries, &params)) < 0) {
+        release_uring(ring);
+        res.set_error("Could not set up io_uring");
+        return res;
+    }
+
+    // Map the rings and the submission entries
+    ring->sq_ring_size =
+        params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+
+    ring->sq_ring = map_ring(ring->fd, ring->sq_ring_size, IORING_OFF_SQ_RING);
+    ring->cq_ring = map_ring(ring->fd, ring->cq_ring_size, IORING_OFF_CQ_RING);
+    ring->sqes = static_cast<io_uring_sqe *>(
+        map_ring(ring->fd, ring->sqes_size, IORING_OFF_SQES));
+    if (ring->sq_ring == nullptr || ring->cq_ring == nullptr ||
+        ring->sqes == nullptr) {
+        release_uring(ring);
+        res.set_error("Could not map io_uring");
+        return res;
+    }
+
+    char *sq = static_cast<char *>(ring->sq_ring);
+    ring->sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    ring->sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    ring->sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    ring->sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+
+    char *cq = static_cast<char *>(ring->cq_ring);
+    ring->cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    ring->cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    ring->cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    ring->cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+
+    // Allocate the buffers and pin them once, instead of at each operation
+    for (unsigned i = 0; i < n_buffers; i++) {
+        void *buffer = mmap(nullptr, buffer_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buffer == MAP_FAILED) {
+            release_uring(ring);
+            res.set_error("Could not allocate io_uring buffers");
+            return res;
+        }
+        ring->buffers[i].iov_base = buffer;
+        ring->buffers[i].iov_len = buffer_size;
+    }
+
+    if (io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, ring->buffers,
+                          n_buffers) < 0) {
+        release_uring(ring);
+        res.set_error("Could not register io_uring buffers");
+        return res;
+    }
+
+    res.set_result(ring);
+    return res;
+}
+
+void free_uring(Uring *ring) {
+    if (ring == nullptr)
+        return;
+
+    // Closing the ring cancels the operations in flight. The buffers stay
+    // pinned by the kernel until they are done with.
+    release_uring(ring);
+}
+
+/*
+ * Returns the next free submission entry, cleared and tagged with [op], or
+ * nullptr if [op] cannot be queued. It is only handed to the kernel once
+ * passed to `push_sqe`.
+ */
+static io_uring_sqe *get_sqe(Uring *ring, unsigned op, Maybe<bool> &res) {
+    if (op >= URING_MAX_OPS || ring->pending[op]) {
+        res.set_error("Operation already in flight");
+        return nullptr;
+    }
+
+    unsigned tail = *ring->sq_tail;
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head > *ring->sq_mask) {
+        res.set_error("Submission queue full");
+        return nullptr;
+    }
+
+    io_uring_sqe *sqe = &ring->sqes[tail & *ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = op;
+    return sqe;
+}
+
+/* Queues the entry returned by `get_sqe` for [op], transferring [len] bytes */
+static void push_sqe(Uring *ring, unsigned op, unsigned len) {
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    ring->pending[op] = true;
+    ring->lengths[op] = len;
+    ring->to_submit++;
+}
+
+/* Queues an operation on a registered buffer */
+static Maybe<bool> queue_fixed(Uring *ring, uint8_t opcode, unsigned op,
+                               int fd, unsigned buffer, unsigned len,
+                               off_t offset, uint8_t flags) {
+    Maybe<bool> res;
+
+    if (buffer >= ring->n_buffers || len > ring->buffers[buffer].iov_len) {
+        res.set_error("Invalid io_uring buffer");
+        return res;
+    }
+
+    io_uring_sqe *sqe = get_sqe(ring, op, res);
+    if (sqe == nullptr)
+        return res;
+
+    sqe->opcode = opcode;
+    sqe->flags = flags;
+    sqe->fd = fd;
+    sqe->off = (uint64_t)offset;
+    sqe->addr = (uint64_t)(uintptr_t)ring->buffers[buffer].iov_base;
+    sqe->len = len;
+    sqe->buf_index = buffer;
+    push_sqe(ring, op, len);
+
+    res.set_result(true);
+    return res;
+}
+
+Maybe<bool> uring_read_fixed(Uring *ring, unsigned op, int fd, unsigned buffer,
+                             unsigned len, off_t offset, uint8_t flags) {
+    return queue_fixed(ring, IORING_OP_READ_FIXED, op, fd, buffer, len, offset,
+                       flags);
+}
+
+Maybe<bool> uring_write_fixed(Uring *ring, unsigned op, int fd,
+                              unsigned buffer, unsigned len, off_t offset,
+                              uint8_t flags) {
+    return queue_fixed(ring, IORING_OP_WRITE_FIXED, op, fd, buffer, len,
+                       offset, flags);
+}
+
+Maybe<bool> uring_datasync(Uring *ring, unsigned op, int fd, uint8_t flags) {
+    Maybe<bool> res;
+
+    io_uring_sqe *sqe = get_sqe(ring, op, res);
+    if (sqe == nullptr)
+        return res;
+
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->flags = flags;
+    sqe->fd = fd;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    push_sqe(ring, op, 0);
+
+    res.set_result(true);
+    return res;
+}
+
+/* Records the result of every operation that has completed */
+static void reap_completions(Uring *ring) {
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++) {
+        io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        if (cqe->user_data < URING_MAX_OPS) {
+            ring->pending[cqe->user_data] = false;
+            ring->results[cqe->user_data] = cqe->res;
+        }
+    }
+
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+Maybe<bool> uring_submit(Uring *ring, unsigned wait_nr) {
+    Maybe<bool> res;
+
+    unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    int submitted;
+    do {
+        submitted = io_uring_enter(ring->fd, ring->to_submit, wait_nr, flags);
+    } while (submitted < 0 && errno == EINTR);
+
+    if (submitted < 0) {
+        res.set_error("Could not submit to io_uring");
+        return res;
+    }
+    ring->to_submit -= submitted;
+
+    reap_completions(ring);
+    res.set_result(true);
+    return res;
+}
+
+Maybe<int> uring_result(Uring *ring, unsigned op) {
+    Maybe<int> res;
+
+    reap_completions(ring);
+    while (ring->pending[op]) {
+        auto wait_res = uring_submit(ring, 1);
+        if (wait_res.is_error) {
+            res.set_error(wait_res.error);
+            return res;
+        }
+    }
+
+    res.set_result(ring->results[op]);
+    ring->results[op] = 0;
+    ring->lengths[op] = 0;
+    return res;
+}
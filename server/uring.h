@@ -0,0 +1,113 @@
+#include "../common/maybe.h"
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#ifndef uring_h
+#define uring_h
+
+/* I/O backends the file transfers can run on, chosen at startup */
+enum io_backend {
+    // Plain blocking read/write syscalls
+    BlockingIO,
+
+    // Batched io_uring submissions on registered buffers
+    IoUring
+};
+
+extern io_backend transfer_backend;
+
+// Operations that can be in flight at the same time on a ring. Each one is
+// identified by its index, used as the user data of its submission.
+#define URING_MAX_OPS 5
+
+/*
+ * An io_uring instance, with its submission and completion rings mapped in
+ * memory and a set of registered buffers.
+ */
+struct Uring {
+    int fd;
+
+    // Submission ring
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    io_uring_sqe *sqes;
+
+    // Completion ring
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    io_uring_cqe *cqes;
+
+    // Submissions queued but not passed to the kernel yet
+    unsigned to_submit;
+
+    // Bytes requested by each operation, and its outcome once it is not
+    // pending anymore
+    bool pending[URING_MAX_OPS];
+    unsigned lengths[URING_MAX_OPS];
+    int results[URING_MAX_OPS];
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    struct iovec *buffers;
+    unsigned n_buffers;
+};
+
+/* Whether the running kernel supports io_uring */
+bool uring_available();
+
+/*
+ * Sets up a ring with room for [entries] submissions, and registers
+ * [n_buffers] buffers of [buffer_size] bytes for the fixed operations.
+ * The caller is responsible for freeing the ring with `free_uring`.
+ */
+Maybe<Uring *> new_uring(unsigned entries, unsigned n_buffers,
+                         size_t buffer_size);
+
+/* Tears down the ring, cancelling whatever is still in flight */
+void free_uring(Uring *ring);
+
+/*
+ * Queue the operation [op] reading [len] bytes from [fd] at [offset] (-1 for
+ * sockets) into the registered buffer [buffer], or writing them from it.
+ * [flags] are the IOSQE_* flags of the submission, e.g. IOSQE_IO_LINK for the
+ * next one to start only if this one succeeds. Nothing is submitted until
+ * `uring_submit` is called.
+ */
+Maybe<bool> uring_read_fixed(Uring *ring, unsigned op, int fd, unsigned buffer,
+                             unsigned len, off_t offset, uint8_t flags);
+Maybe<bool> uring_write_fixed(Uring *ring, unsigned op, int fd,
+                              unsigned buffer, unsigned len, off_t offset,
+                              uint8_t flags);
+
+/*
+ * Queue the operation [op] flushing the data written to [fd] to the disk, like
+ * fdatasync. With IOSQE_IO_DRAIN in [flags], it only starts once everything
+ * queued before it is over.
+ */
+Maybe<bool> uring_datasync(Uring *ring, unsigned op, int fd, uint8_t flags);
+
+/*
+ * Submits every queued operation and waits for [wait_nr] completions, all
+ * within a single syscall.
+ */
+Maybe<bool> uring_submit(Uring *ring, unsigned wait_nr);
+
+/*
+ * Waits for the operation [op] to complete, if it is still in flight, and
+ * returns its result: the number of bytes transferred or a negative errno.
+ * The result is consumed: until [op] is queued again, it reads as a transfer
+ * of 0 bytes out of 0, never as the completion of an earlier operation.
+ */
+Maybe<int> uring_result(Uring *ring, unsigned op);
+
+#endif
@@ -0,0 +1,136 @@
+#include "registry.h"
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <openssl/bio.h>
+#include <openssl/pem.h>
+#include <sstream>
+#include <string.h>
+
+#if __has_include(<filesystem>)
+#include <filesystem>
+namespace fs = std::filesystem;
+#elif __has_include(<experimental/filesystem>)
+#include <experimental/filesystem>
+namespace fs = std::experimental::filesystem;
+#else
+error "Missing the <filesystem> header."
+#endif
+
+/*
+ * Manages the registry of the users of the server, from the directory the
+ * server runs in. The registry is replaced as a whole, so the server keeps
+ * serving from the previous one until it is sent SIGHUP.
+ */
+
+using namespace std;
+
+void print_usage(char *name) {
+    cerr << "Usage: " << name << " list" << endl;
+    cerr << "       " << name << " add <username> <public key file>" << endl;
+    cerr << "       " << name << " remove <username>" << endl;
+    cerr << "The registry is " << REGISTRY_PATH
+         << ", send SIGHUP to the server to apply the changes." << endl;
+}
+
+/* Users in the registry, none if there is no registry yet */
+vector<RegistryEntry> read_entries() {
+    if (!fs::exists(REGISTRY_PATH)) {
+        return {};
+    }
+
+    auto registry_res = open_registry(REGISTRY_PATH);
+    if (registry_res.is_error) {
+        cerr << registry_res.error << endl;
+        exit(EXIT_FAILURE);
+    }
+    auto entries = registry_entries(registry_res.result);
+    close_registry(registry_res.result);
+    return entries;
+}
+
+void write_entries(const vector<RegistryEntry> &entries) {
+    auto write_res = write_registry(REGISTRY_PATH, entries);
+    if (write_res.is_error) {
+        cerr << write_res.error << endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Reads the public key at [path], checking that it is one */
+string read_public_key(const char *path) {
+    ifstream file(path);
+    if (!file) {
+        cerr << "Could not open the public key" << endl;
+        exit(EXIT_FAILURE);
+    }
+    stringstream pem;
+    pem << file.rdbuf();
+    string key = pem.str();
+
+    BIO *bio = BIO_new_mem_buf(key.data(), key.size());
+    EVP_PKEY *pubkey =
+        bio != nullptr ? PEM_read_bio_PUBKEY(bio, nullptr, 0, nullptr) : nullptr;
+    BIO_free(bio);
+    if (pubkey == nullptr) {
+        cerr << "Not a PEM public key: " << path << endl;
+        exit(EXIT_FAILURE);
+    }
+    EVP_PKEY_free(pubkey);
+
+    return key;
+}
+
+void add_user(const string &username, const char *key_path) {
+    if (!is_valid_username(username)) {
+        cerr << "Invalid username: at most " << USERNAME_MAX - 1
+             << " letters, digits, dots, dashes and underscores" << endl;
+        exit(EXIT_FAILURE);
+    }
+    string key = read_public_key(key_path);
+
+    // Adding a user again replaces their key
+    auto entries = read_entries();
+    auto it = find_if(entries.begin(), entries.end(),
+                      [&](auto &entry) { return entry.username == username; });
+    if (it != entries.end()) {
+        it->public_key = key;
+    } else {
+        entries.push_back({username, key});
+    }
+
+    fs::create_directories(fs::path("server") / "storage" / username);
+    write_entries(entries);
+    cout << "Added " << username << endl;
+}
+
+void remove_user(const string &username) {
+    auto entries = read_entries();
+    auto it = find_if(entries.begin(), entries.end(),
+                      [&](auto &entry) { return entry.username == username; });
+    if (it == entries.end()) {
+        cerr << "User not registered: " << username << endl;
+        exit(EXIT_FAILURE);
+    }
+    entries.erase(it);
+
+    // Their files are left where they are
+    write_entries(entries);
+    cout << "Removed " << username << endl;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc == 2 && strcmp(argv[1], "list") == 0) {
+        for (auto &entry : read_entries()) {
+            cout << entry.username << endl;
+        }
+    } else if (argc == 4 && strcmp(argv[1], "add") == 0) {
+        add_user(argv[2], argv[3]);
+    } else if (argc == 3 && strcmp(argv[1], "remove") == 0) {
+        remove_user(argv[2]);
+    } else {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    return 0;
+}